@@ -0,0 +1,93 @@
+#ifndef CLI_H
+#define CLI_H
+
+#include <stdint.h>
+
+/*
+ * State shared between main() and process_args() beyond what global.h
+ * declares, for the options that the original interface did not have.
+ */
+
+/* Input files given with '-f', in order; osm_input_file is the first. */
+extern char **osm_input_files;
+extern int osm_num_input_files;
+
+/* Files to compare, given with '--diff' or '--diff-summary'. */
+extern char *osm_diff_old;
+extern char *osm_diff_new;
+extern int osm_diff_summary;
+
+/* Set if '-v' is given, for more detail from '-s'. */
+extern int osm_verbose;
+
+/* Time given with '--at', in seconds since the epoch, if osm_at_given. */
+extern int64_t osm_at_time;
+extern int osm_at_given;
+
+/* Fraction of the blocks to decode, if '--sample' is given. */
+extern double osm_sample_fraction;
+extern int osm_sample_given;
+
+/* Set if '--tag-stats' is given. */
+extern int osm_tag_stats;
+
+/* Set if '--check-refs' is given. */
+extern int osm_check_refs;
+
+/* OSM_GEOJSON or OSM_GEOJSON_SEQ, if '--geojson' or '--geojsonseq' is given, else -1. */
+extern int osm_geojson_format;
+
+/* Set if '--pgcopy' is given. */
+extern int osm_pgcopy;
+
+/* Output file of '--flatgeobuf'. */
+extern char *osm_flatgeobuf_path;
+
+/* Directory of '--cache', and the bound on its size from '--cache-size'. */
+extern char *osm_cache_dir;
+extern uint64_t osm_cache_size;
+
+/* Set if '--serve' is given. */
+extern int osm_serve;
+
+/* Directory of '--updates', whose change files '--serve' applies. */
+extern char *osm_updates_dir;
+
+/* Output file of '--render', and the image options of '--size' and '--bbox'. */
+extern char *osm_render_path;
+
+#include "osmrender.h"
+
+extern OSM_RenderOptions osm_render_opts;
+
+/* Set if '--index' is given; statistics of the index once it is used. */
+extern int osm_use_index;
+
+#include "osmpbf.h"
+#include "osmindex.h"
+
+extern OSM_IndexStats osm_index_stats;
+
+/* Worker processes of '--shards'; counts found by them once they have run. */
+extern int osm_shards;
+
+#include "osmshard.h"
+
+extern OSM_ShardStats osm_shard_stats;
+
+int run_diff(const OSM_Options *op);
+int (*standalone_mode(void))(const OSM_Options *op);
+int run_sample(const OSM_Options *op);
+int run_tag_stats(const OSM_Options *op);
+int run_check_refs(const OSM_Options *op);
+int run_geojson(const OSM_Options *op);
+int run_pgcopy(const OSM_Options *op);
+int run_flatgeobuf(const OSM_Options *op);
+int run_serve(const OSM_Options *op);
+int cache_lookup(int argc, char **argv, char **keyp);
+int cache_capture(void);
+void cache_release(const char *key, int store);
+OSM_Map *load_indexed_map(int argc, char **argv, const OSM_Options *op);
+OSM_Map *load_sharded_map(int argc, char **argv, const OSM_Options *op);
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef ELIASFANO_H
+#define ELIASFANO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Elias-Fano encoding of a non-decreasing sequence of 64-bit integers.
+ *
+ * Each value is split into a fixed number of low-order bits, which are
+ * stored verbatim in a packed array, and the remaining high-order bits,
+ * which are stored in unary as gaps in a bitvector.  For the monotone,
+ * densely spaced id columns found in OSM data this takes roughly
+ * 2 + log2(average gap) bits per entry instead of 64.
+ *
+ * Sampled positions of every EF_SAMPLE_RATE-th one and zero bit in the
+ * high bitvector make random access (select) and the id-to-index search
+ * (rank / successor) touch only a handful of consecutive words.
+ */
+
+#define EF_SAMPLE_RATE 256
+
+typedef struct EF_Sequence EF_Sequence;
+
+EF_Sequence *EF_encode(const int64_t *values, size_t n);
+void EF_free(EF_Sequence *ef);
+
+size_t EF_size(const EF_Sequence *ef);
+size_t EF_bytes(const EF_Sequence *ef);
+
+int64_t EF_select(const EF_Sequence *ef, size_t index);
+size_t EF_decode(const EF_Sequence *ef, size_t start, size_t count, int64_t *out);
+size_t EF_lower_bound(const EF_Sequence *ef, int64_t value);
+int EF_find(const EF_Sequence *ef, int64_t value, size_t *indexp);
+
+#endif
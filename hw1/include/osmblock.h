@@ -0,0 +1,171 @@
+#ifndef OSMBLOCK_H
+#define OSMBLOCK_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "osm.h"
+#include "osmpbf.h"
+#include "strpool.h"
+
+/*
+ * Lower-level access to the blocks of an OSM PBF file.
+ *
+ * A file is a sequence of blobs, each preceded by a BlobHeader.  Reading
+ * a blob (OSM_read_Blob) only frames it and takes ownership of its still
+ * compressed payload; decoding (OSM_decode_Block) inflates the payload
+ * and decodes it into column arrays.  Decoding touches no shared state,
+ * so separate blobs may be decoded concurrently.  An OSM_BlockReader runs
+ * that pipeline on worker threads and hands back decoded blocks in file
+ * order; both OSM_read_Map_opts() and the streaming queries use it.
+ */
+
+/*
+ * Size limits from the PBF specification.  Because an uncompressed blob
+ * is at most OSM_MAX_BLOB_SIZE bytes, every count within a single block
+ * fits in an int; only the counts of a whole map need to be 64-bit.
+ */
+
+#define OSM_MAX_BLOB_HEADER_SIZE    (64 * 1024)
+#define OSM_MAX_BLOB_SIZE           (32 * 1024 * 1024)
+
+typedef enum {
+    OSM_BLOB_HEADER = 0,        // "OSMHeader"
+    OSM_BLOB_DATA = 1,          // "OSMData"
+    OSM_BLOB_UNKNOWN = 2        // Anything else, to be skipped
+} OSM_BlobType;
+
+typedef struct OSM_Blob {
+    OSM_BlobType type;
+    uint64_t offset;            // Offset of the blob's length prefix in the file
+    size_t length;              // Total length of prefix, header and blob
+    char *data;                 // Payload, compressed if zlib is nonzero
+    size_t size;
+    size_t raw_size;
+    int zlib;
+} OSM_Blob;
+
+/*
+ * Tags of the entities of one type in a block.  The tags of entity i are
+ * at [start[i], start[i+1]) in keys and vals, which are indices into the
+ * block's string table.
+ */
+
+typedef struct OSM_BlockTags {
+    int *start;
+    uint32_t *keys;
+    uint32_t *vals;
+    int count;
+    int cap;
+} OSM_BlockTags;
+
+/*
+ * Metadata (the Info and DenseInfo messages), decoded only when requested
+ * with the metadata or history option.  Timestamps are in seconds since the
+ * epoch.  The visible flag is zero only for deleted versions in history files.
+ */
+
+/* Types of relation members, as coded in the Relation message */
+
+#define OSM_MEMBER_NODE         0
+#define OSM_MEMBER_WAY          1
+#define OSM_MEMBER_RELATION     2
+
+typedef struct OSM_BlockInfo {
+    int32_t *versions;
+    int64_t *timestamps;
+    uint8_t *visible;
+} OSM_BlockInfo;
+
+typedef struct OSM_Block {
+    OSM_BlobType type;
+    uint64_t offset;
+
+    /* HeaderBlock */
+    int has_bbox;
+    OSM_Lat min_lat, max_lat;
+    OSM_Lon min_lon, max_lon;
+    unsigned int required_features;     // OSM_FEATURE_* masks
+    unsigned int optional_features;
+
+    /* String table, each string null-terminated */
+    int num_strings;
+    char **strings;
+    uint32_t *string_lens;
+
+    int num_nodes;
+    int node_cap;
+    OSM_Id *node_ids;
+    OSM_Lat *node_lats;
+    OSM_Lon *node_lons;
+    OSM_BlockTags node_tags;
+    OSM_BlockInfo node_info;
+
+    int num_ways;
+    int way_cap;
+    OSM_Id *way_ids;
+    int *way_ref_start;
+    OSM_Id *way_refs;
+    int num_refs;
+    int ref_cap;
+    OSM_Lat *way_ref_lats;              // LocationsOnWays, parallel to way_refs,
+    OSM_Lon *way_ref_lons;              // or NULL unless every way has them
+    int no_way_locations;
+    OSM_BlockTags way_tags;
+    OSM_BlockInfo way_info;
+
+    /* Relations: counted, and decoded only with the members option */
+    int num_relations;
+    int relation_cap;
+    OSM_Id *relation_ids;
+    int *member_start;                  // Members of relation i at [start[i], start[i+1])
+    OSM_Id *member_ids;
+    uint8_t *member_types;              // OSM_MEMBER_* of each member
+    int num_members;
+    int member_cap;
+} OSM_Block;
+
+int OSM_read_Blob(FILE *in, uint64_t offset, OSM_Blob *bp);
+int OSM_skip_Blob(FILE *in, uint64_t offset, OSM_Blob *bp);
+void OSM_Blob_free(OSM_Blob *bp);
+
+OSM_Block *OSM_decode_Block(OSM_Blob *bp, const OSM_Options *op);
+OSM_Block *OSM_read_Block_at(FILE *in, uint64_t offset, const OSM_Options *op);
+void OSM_Block_free(OSM_Block *bp);
+
+typedef struct OSM_BlockReader OSM_BlockReader;
+
+OSM_BlockReader *OSM_BlockReader_open(FILE *in, const OSM_Options *op);
+OSM_BlockReader *OSM_BlockReader_open_range(FILE *in, uint64_t start, uint64_t end, const OSM_Options *op);
+int OSM_BlockReader_next(OSM_BlockReader *rp, OSM_Block **bpp);
+void OSM_BlockReader_close(OSM_BlockReader *rp);
+
+/*
+ * Construction of blocks other than by decoding.  String indices passed
+ * to OSM_Block_add_tag() refer to the table later set from a pool.
+ */
+
+int OSM_Block_add_Node(OSM_Block *bp, const OSM_Options *op, OSM_Id id, OSM_Lat lat,
+                       OSM_Lon lon, int32_t version, int64_t timestamp);
+int OSM_Block_add_Way(OSM_Block *bp, const OSM_Options *op, OSM_Id id, const OSM_Id *refs,
+                      const OSM_Lat *lats, const OSM_Lon *lons,
+                      int num_refs, int32_t version, int64_t timestamp);
+int OSM_Block_add_tag(OSM_Block *bp, unsigned int type, uint32_t key, uint32_t val);
+int OSM_Block_set_strings(OSM_Block *bp, SP_Pool *sp);
+
+/*
+ * A merge reader returns the blocks of several inputs, each sorted by type
+ * and then id, as a single stream in the same order.  An entity present in
+ * more than one input is returned once, in the version with the highest
+ * version number.  With a single input, blocks are passed through as read.
+ */
+
+#define OSM_MERGE_BLOCK_SIZE    8000    // Entities per merged block
+
+typedef struct OSM_MergeReader OSM_MergeReader;
+
+OSM_MergeReader *OSM_MergeReader_open(FILE **ins, int num_ins, const OSM_Options *op);
+int OSM_MergeReader_next(OSM_MergeReader *mr, OSM_Block **bpp);
+void OSM_MergeReader_close(OSM_MergeReader *mr);
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef OSMCACHE_H
+#define OSMCACHE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * An on-disk cache of query results, which concurrent processes may share.
+ *
+ * Results are stored under a key, which is the fingerprint of the input
+ * file followed by the query.  The fingerprint is a hash of the types,
+ * offsets and sizes of the file's blobs, read from their BlobHeaders while
+ * seeking past the blobs themselves, so it is cheap to compute and does
+ * not depend on the name or modification time of the file.  Each entry is
+ * a file in the cache directory, named by a hash of its key with
+ * OSM_CACHE_SUFFIX appended, which holds the whole key and the result.
+ * Entries are written to a temporary file and renamed into place, so that
+ * readers never see a partial entry.  A hit touches its entry, and after
+ * each write the least recently used entries are removed until the
+ * directory is within its size bound.
+ */
+
+#define OSM_CACHE_SUFFIX            ".res"
+#define OSM_CACHE_FINGERPRINT_LEN   32
+#define OSM_CACHE_DEFAULT_SIZE      (64 * 1024 * 1024)
+
+int OSM_Cache_fingerprint(FILE *in, char *fingerprint);
+int OSM_Cache_get(const char *dir, const char *key, char **datap, size_t *sizep);
+int OSM_Cache_put(const char *dir, const char *key, const char *data, size_t size, uint64_t max_bytes);
+
+#endif
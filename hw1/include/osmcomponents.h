@@ -0,0 +1,35 @@
+#ifndef OSMCOMPONENTS_H
+#define OSMCOMPONENTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "osm.h"
+#include "osmpbf.h"
+#include "osmfilter.h"
+
+/*
+ * Connected components of the ways of a map, two ways being connected if
+ * they share a node, for finding islands of a road network.
+ *
+ * The nodes referenced by the ways get dense indices from a hash table
+ * filled concurrently, and a lock-free union-find over those indices joins
+ * the nodes of each way.  Components are numbered from 0 in decreasing
+ * order of their number of ways; among equal components, the one with the
+ * first way in the map comes first.
+ */
+
+#define OSM_COMPONENT_NONE  UINT32_MAX
+
+typedef struct OSM_Components {
+    size_t num_components;
+    size_t num_ways;            // Ways of the map, the length of way_components
+    uint32_t *way_components;   // Component of each way, or OSM_COMPONENT_NONE
+    size_t *way_counts;         // Ways in each component
+    size_t *node_counts;        // Distinct nodes in each component
+} OSM_Components;
+
+int OSM_Map_way_components(OSM_Map *mp, OSM_Filter *fp, int threads, OSM_Components *cp);
+void OSM_Components_free(OSM_Components *cp);
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef OSMDELTA_H
+#define OSMDELTA_H
+
+#include <stddef.h>
+
+#include "osm.h"
+#include "osmpbf.h"
+
+/*
+ * A mutable overlay of changes on an immutable base map, kept current from
+ * OsmChange (.osc or .osc.gz) files such as minutely replication diffs.
+ *
+ * Each file applied becomes a run: a small map, sorted by id, of the last
+ * state of every node and way that the file creates, modifies or deletes,
+ * with deletions kept as invisible versions.  Lookups try the runs from
+ * the newest and then the base, at the cost of one binary search per run.
+ * Once OSM_DELTA_MAX_RUNS runs have built up, a background thread folds
+ * them into a new base, while further files keep being applied.
+ *
+ * Readers see an immutable view of a base and its runs, which each apply
+ * and compaction replaces.  As with OSM_LiveMap, readers enter and leave a
+ * view without ever waiting, and replaced views and maps are freed once no
+ * reader holds them.  The entities found are those of the run or base that
+ * holds them, so the ref locations of a way from a run must be found with
+ * OSM_DeltaView_find_Node().  Maps hold no relations, so changes to
+ * relations are skipped.
+ */
+
+#define OSM_DELTA_MAX_RUNS  16
+
+typedef struct OSM_Delta OSM_Delta;
+typedef struct OSM_DeltaView OSM_DeltaView;
+
+OSM_Delta *OSM_Delta_create(OSM_Map *base, int num_readers, const OSM_Options *op);
+int OSM_Delta_apply_file(OSM_Delta *dp, const char *path);
+int OSM_Delta_apply_dir(OSM_Delta *dp, const char *dir);
+int OSM_Delta_watch_dir(OSM_Delta *dp, const char *dir);
+int OSM_Delta_compact(OSM_Delta *dp);
+OSM_DeltaView *OSM_Delta_enter(OSM_Delta *dp, int reader);
+void OSM_Delta_leave(OSM_Delta *dp, int reader);
+void OSM_Delta_free(OSM_Delta *dp);
+
+OSM_Map *OSM_DeltaView_get_base(OSM_DeltaView *vp);
+int OSM_DeltaView_get_num_runs(OSM_DeltaView *vp);
+size_t OSM_DeltaView_get_num_nodes(OSM_DeltaView *vp);
+size_t OSM_DeltaView_get_num_ways(OSM_DeltaView *vp);
+OSM_Node *OSM_DeltaView_find_Node(OSM_DeltaView *vp, OSM_Id id);
+OSM_Way *OSM_DeltaView_find_Way(OSM_DeltaView *vp, OSM_Id id);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef OSMDIFF_H
+#define OSMDIFF_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#include "osmpbf.h"
+
+/*
+ * Differences between two OSM PBF files.
+ *
+ * Entities are compared by a 64-bit hash of their content: coordinates for
+ * nodes, the sequence of refs for ways, and the set of tags for both.
+ * Versions, timestamps and other metadata are not compared, so an entity
+ * whose version changed without any change in content is not reported.
+ */
+
+typedef struct OSM_DiffStats {
+    size_t created[2];          // Indexed by 0 for nodes, 1 for ways
+    size_t modified[2];
+    size_t deleted[2];
+} OSM_DiffStats;
+
+int OSM_diff_files(const char *old_path, const char *new_path, const OSM_Options *op,
+                   OSM_DiffStats *stats, FILE *osc);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef OSMEPOCH_H
+#define OSMEPOCH_H
+
+#include <stddef.h>
+
+/*
+ * Epoch-based reclamation, shared by the modules that publish immutable
+ * snapshots to readers that must never wait.
+ *
+ * Each reader has a slot.  OSM_Epochs_enter() records the global epoch in
+ * the reader's slot before it loads a published pointer, and
+ * OSM_Epochs_leave() clears the slot.  A writer swaps the pointer with
+ * OSM_Epochs_publish() and hands what it replaced to OSM_Epochs_retire(),
+ * which advances the epoch and frees the object once every reader in its
+ * slot has a later epoch, so no reader can still hold it.  Writers must be
+ * serialized by the caller.
+ */
+
+typedef struct OSM_Epochs OSM_Epochs;
+
+typedef void OSM_EpochFreeFunc(void *ptr);
+
+OSM_Epochs *OSM_Epochs_create(int num_readers);
+void *OSM_Epochs_enter(OSM_Epochs *ep, int reader, void **ptrp);
+void OSM_Epochs_leave(OSM_Epochs *ep, int reader);
+void *OSM_Epochs_publish(OSM_Epochs *ep, void **ptrp, void *ptr);
+void OSM_Epochs_retire(OSM_Epochs *ep, void *ptr, OSM_EpochFreeFunc *fn);
+size_t OSM_Epochs_reclaim(OSM_Epochs *ep);
+void OSM_Epochs_free(OSM_Epochs *ep);
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef OSMEXPORT_H
+#define OSMEXPORT_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "osmpbf.h"
+#include "osmblock.h"
+
+/*
+ * Streaming export of the features of an OSM PBF file, shared by the
+ * output formats.
+ *
+ * Tagged nodes become points, and ways become lines, or polygons if they
+ * are closed and have a tag that marks an area.  Threads take decoded
+ * blocks in turn, encode the features of each into their own buffer
+ * through the callbacks of an OSM_Exporter, and write the buffers in the
+ * order of the blocks, so at most one block per thread is held at a time.
+ * Way coordinates come from the way locations of files with the
+ * LocationsOnWays feature, and otherwise from a table of the node
+ * locations seen so far, which is the one part of the memory used that
+ * grows with the input.  Coordinates are in units of 1e-7 degrees.
+ * OSM_export_features_shards() splits the same export over processes, as
+ * described in osmshard.h.
+ */
+
+typedef struct OSM_ExportBuffer {
+    char *data;
+    size_t len;
+    size_t cap;
+    int error;                  // Set if the buffer could not be grown
+} OSM_ExportBuffer;
+
+/*
+ * The encoder of an output format.  The callbacks append one feature to
+ * the buffer; they are called concurrently, with arg shared.  A way is
+ * given the coordinates of the refs that could be resolved, at least two,
+ * with the first repeated last if it is a polygon.  The separator, if not
+ * NULL, is written between the buffers of two blocks that both have
+ * features.
+ */
+
+typedef struct OSM_Exporter {
+    void *arg;
+    void (*node)(void *arg, OSM_ExportBuffer *bp, OSM_Block *block, int i);
+    void (*way)(void *arg, OSM_ExportBuffer *bp, OSM_Block *block, int i,
+                const int64_t *lats, const int64_t *lons, size_t n, int polygon);
+    const char *separator;
+} OSM_Exporter;
+
+void OSM_ExportBuffer_append(OSM_ExportBuffer *bp, const void *data, size_t len);
+void OSM_ExportBuffer_append_tags(OSM_ExportBuffer *bp, OSM_Block *block, const OSM_BlockTags *tp, int i);
+int OSM_export_features(FILE *in, FILE *out, const OSM_Exporter *ep, const OSM_Options *op);
+int OSM_export_features_shards(const char *path, int num_shards, FILE *out, const OSM_Exporter *ep,
+                               const OSM_Options *op);
+
+#define OSM_EXPORT_LITERAL(bp, str) OSM_ExportBuffer_append(bp, str, sizeof(str) - 1)
+
+#endif
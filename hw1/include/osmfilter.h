@@ -0,0 +1,51 @@
+#ifndef OSMFILTER_H
+#define OSMFILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "osm.h"
+#include "osmpbf.h"
+
+/*
+ * Predicate filters over the node and way columns of a map.
+ *
+ * A filter is compiled from an expression against a particular map, so
+ * that tag keys and values are resolved once to ids in the map's string
+ * pool.  It is then evaluated a batch of at most OSM_BATCH_SIZE entities
+ * at a time, each predicate narrowing a selection vector of the offsets,
+ * within the batch, of the entities still selected.
+ *
+ * Expression syntax:
+ *
+ *   expr   := and { '|' and }
+ *   and    := unary { '&' unary }
+ *   unary  := '!' unary | '(' expr ')' | pred
+ *   pred   := node | way                   entity type
+ *           | lat:RANGE | lon:RANGE        coordinates, in degrees
+ *           | id:RANGE                     entity id
+ *           | KEY=*                        tag with key KEY is present
+ *           | KEY=VALUE                    tag KEY=VALUE is present
+ *   RANGE  := [MIN]..[MAX] | VALUE         inclusive; a missing bound is open
+ *
+ * Keys and values may be enclosed in double quotes to include spaces or
+ * the characters &|!().  Ways have no coordinates, so lat and lon
+ * predicates never select a way.  For example:
+ *
+ *   node & lat:40.9..41 & amenity=*
+ *   way & (highway=primary | highway=secondary) & !name=*
+ */
+
+typedef struct OSM_Filter OSM_Filter;
+
+typedef int OSM_MatchFunc(void *arg, unsigned int type, size_t index);
+
+OSM_Filter *OSM_Filter_compile(OSM_Map *mp, const char *expr);
+void OSM_Filter_free(OSM_Filter *fp);
+
+size_t OSM_Filter_select(OSM_Filter *fp, unsigned int type, size_t first, size_t count,
+                         uint16_t *sel);
+int OSM_Filter_foreach(OSM_Filter *fp, unsigned int types, OSM_MatchFunc *fn, void *arg);
+size_t OSM_Filter_count(OSM_Filter *fp, unsigned int type);
+
+#endif
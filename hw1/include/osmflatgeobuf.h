@@ -0,0 +1,24 @@
+#ifndef OSMFLATGEOBUF_H
+#define OSMFLATGEOBUF_H
+
+#include <stdio.h>
+
+#include "osmpbf.h"
+
+/*
+ * Export of OSM PBF files as FlatGeobuf, with a spatial index.
+ *
+ * The features are those of OSM_export_features(), encoded in parallel as
+ * FlatBuffers into a temporary file.  Their bounding boxes are then sorted
+ * by the Hilbert value of their centers, the packed Hilbert R-tree is built
+ * bottom-up over them, and the header, the tree and the features in tree
+ * order are written to the output, which need not be seekable.  Each
+ * feature has the columns osm_type (String), osm_id (Long) and tags (Json,
+ * absent for a way without tags), and the CRS is EPSG:4326.
+ */
+
+#define OSM_FGB_NODE_SIZE   16
+
+int OSM_export_flatgeobuf(FILE *in, FILE *out, const OSM_Options *op);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef OSMGEOJSON_H
+#define OSMGEOJSON_H
+
+#include <stdio.h>
+
+#include "osmpbf.h"
+
+/*
+ * Export of OSM PBF files as GeoJSON, streamed by OSM_export_features().
+ *
+ * Tagged nodes become Points, and ways become LineStrings, or Polygons if
+ * they are closed and have a tag that marks an area.  Coordinates are
+ * written with seven decimals, the precision of OSM.
+ *
+ * GeoJSON output is a single FeatureCollection; GeoJSONSeq output (RFC
+ * 8142) is one feature per line, each preceded by a record separator.
+ */
+
+#define OSM_GEOJSON             0
+#define OSM_GEOJSON_SEQ         1
+
+int OSM_export_geojson(FILE *in, FILE *out, int format, const OSM_Options *op);
+int OSM_export_geojson_shards(const char *path, int num_shards, FILE *out, int format,
+                              const OSM_Options *op);
+
+#endif
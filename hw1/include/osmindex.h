@@ -0,0 +1,54 @@
+#ifndef OSMINDEX_H
+#define OSMINDEX_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "osm.h"
+#include "osmpbf.h"
+
+/*
+ * Block indexes of OSM PBF files, for point lookups that decode only the
+ * blocks that may hold the requested ids.
+ *
+ * For each data block, the index records the offset of its blob, its
+ * numbers of nodes, ways and refs, the ranges of its node and way ids, and
+ * a bloom filter of those ids with OSM_INDEX_BITS_PER_ID bits per id.  The
+ * ranges prune the blocks of a sorted file, and the filters those of
+ * unsorted or merged files, where the ranges overlap.  The counts size the
+ * columns of a map before its blocks are decoded.  An index is kept in a
+ * sidecar file, the name of the PBF file with OSM_INDEX_SUFFIX appended,
+ * which is rebuilt whenever the size or modification time of the PBF file
+ * no longer matches.
+ */
+
+#define OSM_INDEX_SUFFIX        ".idx"
+#define OSM_INDEX_BITS_PER_ID   10
+#define OSM_INDEX_HASHES        7
+
+typedef struct OSM_Index OSM_Index;
+
+typedef struct OSM_IndexStats {
+    size_t num_blocks;          // Data blocks in the file
+    size_t num_ids;             // Node and way ids in the filters
+    size_t filter_bytes;        // Total size of the filters
+    double expected_fpr;        // Mean false-positive rate of the filters
+    size_t probes;              // Filters consulted by lookups, after the ranges
+    size_t hits;                // Of those, filters that matched
+    size_t false_positives;     // Of those, blocks without the id
+} OSM_IndexStats;
+
+OSM_Index *OSM_Index_build(FILE *in, const OSM_Options *op);
+OSM_Index *OSM_Index_open(const char *path, const OSM_Options *op);
+int OSM_Index_write(OSM_Index *ix, FILE *out);
+OSM_Index *OSM_Index_read(FILE *in);
+OSM_Index *OSM_Index_find(const char *path, FILE *in);
+void OSM_Index_free(OSM_Index *ix);
+
+OSM_Map *OSM_Index_load(OSM_Index *ix, FILE *in, const OSM_Id *node_ids, size_t num_nodes,
+                        const OSM_Id *way_ids, size_t num_ways, const OSM_Options *op);
+int OSM_Index_reserve(OSM_Index *ix, OSM_Map *mp, const OSM_Options *op);
+void OSM_Index_get_stats(OSM_Index *ix, OSM_IndexStats *sp);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef OSMLIVE_H
+#define OSMLIVE_H
+
+#include <stdint.h>
+
+#include "osm.h"
+#include "osmpbf.h"
+
+/*
+ * A map that follows its file, for a resident server that must keep
+ * answering queries while the extract on disk is replaced.
+ *
+ * The file's directory is watched with inotify, and once the file has
+ * been written or renamed into place, a new map is loaded from it in a
+ * background thread and published by swapping the current map pointer.
+ * Readers never wait: each has a slot in which OSM_LiveMap_enter() records
+ * the epoch at which it took the pointer, and OSM_LiveMap_leave() clears
+ * it.  A replaced map is retired with the epoch of its replacement, and
+ * freed once no reader holds an earlier epoch, so queries already running
+ * on it finish undisturbed.  If the new file cannot be loaded, the current
+ * map is kept.
+ */
+
+typedef struct OSM_LiveMap OSM_LiveMap;
+
+OSM_LiveMap *OSM_LiveMap_open(const char *path, int num_readers, const OSM_Options *op);
+int OSM_LiveMap_watch(OSM_LiveMap *lp);
+int OSM_LiveMap_reload(OSM_LiveMap *lp);
+OSM_Map *OSM_LiveMap_enter(OSM_LiveMap *lp, int reader);
+void OSM_LiveMap_leave(OSM_LiveMap *lp, int reader);
+uint64_t OSM_LiveMap_get_generation(OSM_LiveMap *lp);
+void OSM_LiveMap_free(OSM_LiveMap *lp);
+
+#endif
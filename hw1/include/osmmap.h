@@ -0,0 +1,131 @@
+#ifndef OSMMAP_H
+#define OSMMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "osm.h"
+#include "osmpbf.h"
+#include "osmblock.h"
+#include "strpool.h"
+#include "eliasfano.h"
+
+/*
+ * Private definition of OSM_Map, shared by the modules of the library that
+ * need direct access to its columns.  Clients see only the opaque types
+ * declared in osm.h and the accessors in osmpbf.h.
+ */
+
+typedef struct OSM_BBox {
+    OSM_Lat min_lat;
+    OSM_Lat max_lat;
+    OSM_Lon min_lon;
+    OSM_Lon max_lon;
+} OSM_BBox;
+
+/*
+ * Ids of the nodes or ways in a map, in file order.  The ids are held
+ * either as a plain array or, after OSM_Map_compress_ids(), in Elias-Fano
+ * form.  If the ids are not sorted, order is a permutation of the indices
+ * that sorts them, used for id-to-index lookup.
+ */
+
+typedef struct OSM_IdColumn {
+    OSM_Id *ids;
+    EF_Sequence *ef;
+    size_t *order;
+} OSM_IdColumn;
+
+/*
+ * Key/value pairs of the nodes or ways in a map.  Many entities have the
+ * same pairs, such as building=yes, so each distinct sequence of pairs is
+ * stored once, as a tag set, and entity i holds only the id sets[i] of its
+ * set.  The pairs of set s are at indices [set_start[s], set_start[s+1])
+ * of keys and vals, which hold ids of strings in the map's string pool.
+ * The hashes and the hash table of the sets are only kept while the map
+ * is being built.
+ */
+
+typedef struct OSM_TagColumn {
+    uint32_t *sets;             // Set of each entity, sized with the entity columns
+    size_t *set_start;          // num_sets + 1 offsets into keys and vals
+    uint32_t *set_hashes;
+    size_t num_sets;
+    size_t set_cap;
+    uint32_t *table;            // Open addressing, of set ids + 1, 0 if empty
+    size_t table_size;
+    uint32_t *keys;
+    uint32_t *vals;
+    size_t count;
+    size_t cap;
+} OSM_TagColumn;
+
+/* The range of the pairs of entity i in keys and vals */
+
+static inline size_t OSM_TagColumn_start(const OSM_TagColumn *tp, size_t i) {
+    return tp->set_start[tp->sets[i]];
+}
+
+static inline size_t OSM_TagColumn_end(const OSM_TagColumn *tp, size_t i) {
+    return tp->set_start[tp->sets[i] + 1];
+}
+
+/*
+ * Entities are stored column-wise.  The OSM_Node and OSM_Way objects
+ * handed out to clients are lightweight handles, whose position in the
+ * handle array is the index of the entity in the columns.
+ */
+
+typedef struct OSM_Map {
+    OSM_BBox bbox;
+    int has_bbox;
+    unsigned int required_features;
+    unsigned int optional_features;
+    SP_Pool *strings;
+    int has_metadata;
+    int is_history;             // Columns hold every version, sorted by version
+
+    OSM_Node *nodes;
+    size_t num_nodes;
+    size_t node_cap;
+    OSM_IdColumn node_ids;
+    OSM_Lat *node_lats;
+    OSM_Lon *node_lons;
+    OSM_TagColumn node_tags;
+    int32_t *node_versions;
+    int64_t *node_timestamps;
+    uint8_t *node_visible;
+
+    OSM_Way *ways;
+    size_t num_ways;
+    size_t way_cap;
+    OSM_IdColumn way_ids;
+    size_t *way_ref_start;
+    OSM_Id *way_refs;
+    OSM_Lat *way_ref_lats;      // Locations of refs from LocationsOnWays,
+    OSM_Lon *way_ref_lons;      // or NULL unless every way had them
+    int no_way_locations;
+    size_t num_refs;
+    size_t ref_cap;
+    OSM_TagColumn way_tags;
+    int32_t *way_versions;
+    int64_t *way_timestamps;
+    uint8_t *way_visible;
+} OSM_Map;
+
+typedef struct OSM_Node {
+    OSM_Map *map;
+} OSM_Node;
+
+typedef struct OSM_Way {
+    OSM_Map *map;
+} OSM_Way;
+
+/* Building a map from decoded blocks */
+
+OSM_Map *OSM_Map_create(const OSM_Options *op);
+int OSM_Map_reserve(OSM_Map *mp, size_t num_nodes, size_t num_ways, size_t num_refs);
+int OSM_Map_add_Block(OSM_Map *mp, OSM_Block *bp);
+int OSM_Map_finish(OSM_Map *mp, const OSM_Options *op);
+
+#endif
@@ -0,0 +1,175 @@
+#ifndef OSMPBF_H
+#define OSMPBF_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "osm.h"
+
+/*
+ * Extensions to the OSM_Map interface declared in osm.h.
+ *
+ * This library keeps no global state: any number of maps may be loaded
+ * concurrently from different threads, and once OSM_read_Map_opts() has
+ * returned, a map is never modified until OSM_Map_free(), so all accessors
+ * may be called concurrently on the same map.
+ */
+
+/* Entity types, for use in OSM_Options.types */
+
+#define OSM_TYPE_NODE       0x1
+#define OSM_TYPE_WAY        0x2
+#define OSM_TYPE_RELATION   0x4
+#define OSM_TYPE_ALL        (OSM_TYPE_NODE | OSM_TYPE_WAY | OSM_TYPE_RELATION)
+
+/*
+ * Features that the HeaderBlock of a file may declare, as required (a
+ * reader must understand them) or optional (a reader may take advantage of
+ * them).  A file with any other required feature is rejected.
+ */
+
+#define OSM_FEATURE_SCHEMA              0x01    // "OsmSchema-V0.6"
+#define OSM_FEATURE_DENSE_NODES         0x02    // "DenseNodes"
+#define OSM_FEATURE_HISTORY             0x04    // "HistoricalInformation"
+#define OSM_FEATURE_SORTED              0x08    // "Sort.Type_then_ID"
+#define OSM_FEATURE_LOCATIONS_ON_WAYS   0x10    // "LocationsOnWays"
+#define OSM_NUM_FEATURES                5
+
+const char *OSM_feature_name(unsigned int feature);
+
+/*
+ * Options controlling how a map is loaded.  Initialize with
+ * OSM_Options_init() and then override individual fields.
+ */
+
+typedef struct OSM_Options {
+    int threads;            // Decoding threads; 0 or 1 decodes in the caller
+    unsigned int types;     // Mask of entity types to load
+    int tags;               // If zero, tags are not loaded
+    int metadata;           // If nonzero, versions and timestamps are loaded
+    int compress_ids;       // If nonzero, id columns are Elias-Fano encoded
+    int cache_blocks;       // Maximum blocks read ahead or awaiting merge
+    int history;            // If nonzero, keep every version (implies metadata)
+    int64_t history_from;   // With history, versions superseded by then may be
+    int64_t history_until;  // dropped, and later versions are; 0 for no bound
+    int members;            // If nonzero, blocks decode relation ids and members
+    const char *path;       // If set, the file read, whose index sidecar sizes the map
+} OSM_Options;
+
+void OSM_Options_init(OSM_Options *op);
+
+/* Construction and destruction */
+
+OSM_Map *OSM_read_Map_opts(FILE *in, const OSM_Options *op);
+OSM_Map *OSM_read_Map_merged(FILE **ins, int num_ins, const OSM_Options *op);
+void OSM_Map_free(OSM_Map *mp);
+
+/*
+ * Counts and indices without the INT_MAX limit of the int-based accessors
+ * in osm.h, which return -1 (or NULL) for counts that do not fit in an int.
+ */
+
+size_t OSM_Map_get_num_nodes64(OSM_Map *mp);
+size_t OSM_Map_get_num_ways64(OSM_Map *mp);
+OSM_Node *OSM_Map_get_Node64(OSM_Map *mp, size_t index);
+OSM_Way *OSM_Map_get_Way64(OSM_Map *mp, size_t index);
+size_t OSM_Way_get_num_refs64(OSM_Way *wp);
+OSM_Id OSM_Way_get_ref64(OSM_Way *wp, size_t index);
+
+/*
+ * Batch access to the columns of a map, for loops over many entities that
+ * should not pay for an accessor call per field.  All spans are read-only
+ * views into the map.
+ */
+
+#define OSM_BATCH_SIZE  1024
+
+typedef struct OSM_NodeColumns {
+    size_t count;
+    const OSM_Id *ids;          // NULL if ids are compressed
+    const OSM_Lat *lats;
+    const OSM_Lon *lons;
+} OSM_NodeColumns;
+
+typedef struct OSM_WayColumns {
+    size_t count;
+    const OSM_Id *ids;          // NULL if ids are compressed
+    const size_t *ref_start;    // count + 1 offsets into refs
+    const OSM_Id *refs;
+    size_t num_refs;
+    const OSM_Lat *ref_lats;    // Locations of the refs, parallel to refs,
+    const OSM_Lon *ref_lons;    // or NULL unless the map has way locations
+} OSM_WayColumns;
+
+typedef int OSM_NodeBatchFunc(void *arg, size_t first, size_t count, const OSM_Id *ids,
+                              const OSM_Lat *lats, const OSM_Lon *lons);
+typedef int OSM_WayFunc(void *arg, size_t index, OSM_Id id, const OSM_Id *refs,
+                        size_t num_refs);
+
+int OSM_Map_node_columns(OSM_Map *mp, OSM_NodeColumns *cp);
+int OSM_Map_way_columns(OSM_Map *mp, OSM_WayColumns *cp);
+const OSM_Id *OSM_Way_refs(OSM_Way *wp, size_t *countp);
+int OSM_Map_foreach_Nodes(OSM_Map *mp, OSM_NodeBatchFunc *fn, void *arg);
+int OSM_Map_foreach_Way(OSM_Map *mp, OSM_WayFunc *fn, void *arg);
+
+/*
+ * Locations of the refs of ways.  Files with the LocationsOnWays feature
+ * store them in each way, and if every way in the input has them, they
+ * are kept beside the refs, so that way geometry needs no node lookups and
+ * the nodes need not be loaded at all.  Otherwise, OSM_Way_get_ref_location()
+ * falls back to looking up the node.
+ */
+
+int OSM_Map_has_way_locations(OSM_Map *mp);
+int OSM_Way_ref_locations(OSM_Way *wp, const OSM_Lat **latsp, const OSM_Lon **lonsp);
+int OSM_Way_get_ref_location(OSM_Way *wp, size_t index, OSM_Lat *latp, OSM_Lon *lonp);
+
+/* Features declared by the header of the input, as OSM_FEATURE_* masks */
+
+unsigned int OSM_Map_get_required_features(OSM_Map *mp);
+unsigned int OSM_Map_get_optional_features(OSM_Map *mp);
+
+/* Id-to-entity lookup */
+
+OSM_Node *OSM_Map_find_Node(OSM_Map *mp, OSM_Id id);
+OSM_Way *OSM_Map_find_Way(OSM_Map *mp, OSM_Id id);
+
+/* Metadata, available if the map was loaded with the metadata option */
+
+int OSM_Map_has_metadata(OSM_Map *mp);
+int32_t OSM_Node_get_version(OSM_Node *np);
+int64_t OSM_Node_get_timestamp(OSM_Node *np);
+int32_t OSM_Way_get_version(OSM_Way *wp);
+int64_t OSM_Way_get_timestamp(OSM_Way *wp);
+
+/*
+ * Full-history maps, loaded with the history option.  The columns of such
+ * a map hold every version of every entity, and the plain accessors count
+ * and index versions; OSM_Map_find_Node() and OSM_Map_find_Way() return the
+ * latest version, or NULL if it is deleted.  The "at" functions give the
+ * state of the map at a time in seconds since the epoch, and also work for
+ * other maps loaded with metadata.
+ */
+
+int OSM_Map_is_history(OSM_Map *mp);
+OSM_Node *OSM_Map_find_Node_at(OSM_Map *mp, OSM_Id id, int64_t time);
+OSM_Way *OSM_Map_find_Way_at(OSM_Map *mp, OSM_Id id, int64_t time);
+size_t OSM_Map_get_num_nodes_at(OSM_Map *mp, int64_t time);
+size_t OSM_Map_get_num_ways_at(OSM_Map *mp, int64_t time);
+int OSM_Node_is_visible(OSM_Node *np);
+int OSM_Way_is_visible(OSM_Way *wp);
+
+/* Elias-Fano compression of the node and way id columns */
+
+int OSM_Map_compress_ids(OSM_Map *mp);
+size_t OSM_Map_get_id_bytes(OSM_Map *mp);
+
+/*
+ * Storage of tags, which are deduplicated: entities with the same key/value
+ * pairs, in the same order, share one copy of them.
+ */
+
+size_t OSM_Map_get_tag_bytes(OSM_Map *mp);
+
+#endif
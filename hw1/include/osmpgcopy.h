@@ -0,0 +1,29 @@
+#ifndef OSMPGCOPY_H
+#define OSMPGCOPY_H
+
+#include <stdio.h>
+
+#include "osmpbf.h"
+
+/*
+ * Export of OSM PBF files in the binary format of PostgreSQL's COPY,
+ * streamed by OSM_export_features(), for bulk loading into PostGIS with
+ *
+ *     COPY table FROM STDIN (FORMAT binary)
+ *
+ * Each tagged node and each way is a row of four columns, which the table
+ * must have in this order and with these types:
+ *
+ *     osm_type text, osm_id bigint, tags text[], geom geometry
+ *
+ * osm_type is "node" or "way", tags alternates keys and values, as
+ * hstore(text[]) expects, and geom is EWKB with SRID 4326: a Point, a
+ * LineString, or a Polygon for a closed way with a tag that marks an area.
+ * Coordinates are encoded straight from their fixed-point values, without
+ * going through text.
+ */
+
+int OSM_export_pgcopy(FILE *in, FILE *out, const OSM_Options *op);
+int OSM_export_pgcopy_shards(const char *path, int num_shards, FILE *out, const OSM_Options *op);
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef OSMREFS_H
+#define OSMREFS_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#include "osm.h"
+#include "osmpbf.h"
+#include "osmblock.h"
+
+/*
+ * Referential integrity of an OSM PBF file: whether the nodes that its ways
+ * refer to, and the members of its relations, are in the file, as they are
+ * not in a badly cut extract.
+ *
+ * A first pass sets a bit for each node, way and relation id in three
+ * bitmaps, which are split into pages allocated only where ids fall, so
+ * they take about one bit per id in the ranges that the ids cover and no
+ * hash tables.  A bit already set is a duplicate id.  A second pass reads
+ * the blobs from the first one with ways or relations again, and threads
+ * check the refs of the ways against the node bitmap and each member of a
+ * relation against the bitmap of its type.
+ */
+
+#define OSM_REFS_SAMPLES    10
+
+typedef struct OSM_MissingRef {
+    OSM_Id ref;                 // A node that is not in the file
+    OSM_Id way;                 // A way that refers to it
+} OSM_MissingRef;
+
+typedef struct OSM_MissingMember {
+    int type;                   // OSM_MEMBER_* of the member
+    OSM_Id member;              // A member that is not in the file
+    OSM_Id relation;            // A relation that has it
+} OSM_MissingMember;
+
+typedef struct OSM_RefCheck {
+    size_t num_nodes;
+    size_t num_ways;
+    size_t num_relations;
+    size_t duplicate_nodes;     // Node ids seen more than once
+    size_t duplicate_ways;
+    size_t duplicate_relations;
+    size_t num_refs;            // Way refs checked
+    size_t missing_refs;        // Of those, refs to nodes not in the file
+    size_t broken_ways;         // Ways with at least one such ref
+    size_t num_members;         // Relation members checked
+    size_t missing_members;     // Of those, members not in the file
+    size_t missing_members_by_type[3];  // The same by OSM_MEMBER_*
+    size_t broken_relations;    // Relations with at least one such member
+    size_t bitmap_bytes;        // Memory used by the bitmaps
+    int num_samples;
+    OSM_MissingRef samples[OSM_REFS_SAMPLES];   // Smallest missing ids, in order
+    int num_member_samples;
+    OSM_MissingMember member_samples[OSM_REFS_SAMPLES]; // By type, then id
+} OSM_RefCheck;
+
+int OSM_check_refs(FILE *in, OSM_RefCheck *rp, const OSM_Options *op);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef OSMRENDER_H
+#define OSMRENDER_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "osm.h"
+#include "osmpbf.h"
+
+/*
+ * Raster previews of a map, written as PNG.
+ *
+ * Way refs and tagged nodes are projected to Web Mercator once, and the
+ * image is then divided into tiles of OSM_RENDER_TILE pixels square that
+ * threads claim and draw independently, each into its own buffer, before
+ * the tiles are copied into the image.  Ways are drawn one pixel wide with
+ * Bresenham's algorithm after clipping each segment to the tile, in a
+ * color chosen by their tags, with roads over water over land use, and
+ * tagged nodes as small dots on top.
+ */
+
+#define OSM_RENDER_TILE     256
+
+typedef struct OSM_RenderOptions {
+    int width;                  // Size of the image in pixels
+    int height;
+    int has_bbox;               // Otherwise the bbox of the map is drawn
+    OSM_Lat min_lat, max_lat;
+    OSM_Lon min_lon, max_lon;
+    int threads;
+} OSM_RenderOptions;
+
+int OSM_render_png(OSM_Map *mp, const OSM_RenderOptions *rp, FILE *out);
+
+#endif
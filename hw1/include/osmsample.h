@@ -0,0 +1,54 @@
+#ifndef OSMSAMPLE_H
+#define OSMSAMPLE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "osmpbf.h"
+
+/*
+ * Approximate summaries of OSM PBF files from a sample of their blocks.
+ *
+ * The blob headers of the whole file are scanned, seeking past the data,
+ * and the data blocks are divided into strata.  In a file sorted by type,
+ * the blocks where the ways and the relations start are found by binary
+ * search and decoded in full, and the blocks between them, which hold a
+ * single type, form one stratum per type; any other file is one stratum.
+ * Each stratum is divided into runs of consecutive blocks, one for each
+ * block to be sampled, from each of which one block is chosen at random
+ * and decoded.  Within a stratum of one type, totals are estimated with a
+ * ratio estimator on the size of the blobs, which the scan gives for every
+ * block; within a mixed stratum, by weighting each block with the size of
+ * its run.  Intervals are at 95% confidence, from the variance between
+ * pairs of adjacent runs, and are zero when every block is sampled.
+ */
+
+#define OSM_SAMPLE_TOP_KEYS     10
+
+typedef struct OSM_Estimate {
+    double value;
+    double half_width;          // Of the 95% interval; NAN if it cannot be estimated
+} OSM_Estimate;
+
+typedef struct OSM_SampleKey {
+    char *key;
+    OSM_Estimate count;         // Tags of nodes and ways with the key
+} OSM_SampleKey;
+
+typedef struct OSM_Sample {
+    size_t num_blocks;          // Data blocks in the file
+    size_t sampled_blocks;
+    uint64_t total_bytes;       // Size of the data blobs in the file
+    uint64_t sampled_bytes;
+    OSM_Estimate nodes;
+    OSM_Estimate ways;
+    OSM_Estimate relations;
+    size_t num_keys;            // Most frequent keys, by estimated count
+    OSM_SampleKey keys[OSM_SAMPLE_TOP_KEYS];
+} OSM_Sample;
+
+int OSM_sample_file(FILE *in, double fraction, uint64_t seed, OSM_Sample *sp);
+void OSM_Sample_free(OSM_Sample *sp);
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef OSMSHARD_H
+#define OSMSHARD_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "osm.h"
+#include "osmpbf.h"
+
+/*
+ * Sharding of a query over worker processes, for inputs too large for the
+ * threads of one process.
+ *
+ * The blob headers of the file are scanned into contiguous ranges of
+ * blobs, of about the same number of bytes each.  A worker process is
+ * forked for each range, which opens the file again, reads only its range
+ * and writes its partial result to a pipe.  The parent reads the pipes as
+ * the workers write them, and hands the results to a merge function in
+ * range order, holding those of later ranges in temporary files until the
+ * earlier ones are done.  No worker ever waits for another.
+ */
+
+#define OSM_SHARDS_MAX  256
+
+typedef struct OSM_Shard {
+    uint64_t start;             // Offset of the first blob of the range
+    uint64_t end;               // Offset past its last blob
+    size_t num_blobs;
+} OSM_Shard;
+
+/*
+ * The work of a worker process on its range of an input, opened for it,
+ * writing its result to out; returns 0 if successful.  The merge function
+ * is given the results in pieces, in range order; it returns 0 to go on.
+ */
+
+typedef int OSM_ShardWorkFunc(void *arg, FILE *in, const OSM_Shard *sp, FILE *out);
+typedef int OSM_ShardMergeFunc(void *arg, int shard, const void *data, size_t len);
+
+typedef struct OSM_ShardStats {
+    int num_shards;             // Worker processes run
+    size_t num_blobs;           // Blobs in the file
+    size_t num_blocks;          // Blocks the parent decoded for the lookups
+    size_t num_nodes;           // Nodes and ways in the file
+    size_t num_ways;
+} OSM_ShardStats;
+
+int OSM_Shards_plan(FILE *in, int num_shards, OSM_Shard **shardsp, uint64_t *header_offsetp);
+int OSM_Shards_run(const char *path, const OSM_Shard *shards, int num_shards,
+                   OSM_ShardWorkFunc *work, OSM_ShardMergeFunc *merge, void *arg);
+OSM_Map *OSM_Shards_load(const char *path, int num_shards, const OSM_Id *node_ids, size_t num_nodes,
+                         const OSM_Id *way_ids, size_t num_ways, OSM_ShardStats *sp,
+                         const OSM_Options *op);
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef OSMTAGSTATS_H
+#define OSMTAGSTATS_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "osmpbf.h"
+
+/*
+ * Tag statistics of an OSM PBF file, computed in one streaming pass over
+ * its blocks without loading a map.
+ *
+ * For each key of the tags of nodes and ways, the number of tags with the
+ * key is exact.  The number of distinct values is a HyperLogLog estimate
+ * with 2^OSM_TAGSTATS_HLL_BITS registers, about 3% standard error.  The
+ * most frequent values are kept by Space-Saving with OSM_TAGSTATS_COUNTERS
+ * counters per key: each count may overestimate by at most its error, and
+ * any value more frequent than 1/OSM_TAGSTATS_COUNTERS of the key's tags
+ * is among them.  Each thread keeps its own sketches, which are merged
+ * once the input is exhausted.  With worker processes, each worker sends
+ * the merged sketches of its range to the parent, which merges them in
+ * turn.
+ */
+
+#define OSM_TAGSTATS_HLL_BITS       10
+#define OSM_TAGSTATS_COUNTERS       32
+#define OSM_TAGSTATS_TOP_VALUES     5
+
+typedef struct OSM_ValueCount {
+    char *value;
+    uint64_t count;             // Upper bound on the number of tags
+    uint64_t error;             // Count minus error is a lower bound
+} OSM_ValueCount;
+
+typedef struct OSM_KeyStats {
+    const char *key;
+    uint64_t count;             // Tags with the key
+    double distinct_values;     // Estimated number of distinct values
+    int num_top;
+    OSM_ValueCount top[OSM_TAGSTATS_TOP_VALUES];
+} OSM_KeyStats;
+
+typedef struct OSM_TagStats OSM_TagStats;
+
+OSM_TagStats *OSM_TagStats_compute(FILE *in, const OSM_Options *op);
+OSM_TagStats *OSM_TagStats_compute_shards(const char *path, int num_shards, const OSM_Options *op);
+const OSM_KeyStats *OSM_TagStats_get_keys(OSM_TagStats *ts, size_t *num_keysp);
+void OSM_TagStats_free(OSM_TagStats *ts);
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef PB_UTIL_H
+#define PB_UTIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "protobuf.h"
+
+/*
+ * Helpers that complement the PB_Message interface in protobuf.h.
+ *
+ * PB_Message is convenient for walking the handful of fields in a blob or
+ * block header, but expanding a packed array with PB_expand_packed_fields()
+ * costs one heap-allocated PB_Field per element.  The cursor below instead
+ * decodes the values of a packed LEN_TYPE field directly from its buffer.
+ */
+
+typedef struct PB_Cursor {
+    const uint8_t *p;
+    const uint8_t *end;
+} PB_Cursor;
+
+static inline void PB_cursor_init(PB_Cursor *cp, PB_Field *fp) {
+    if (fp == NULL || fp->type != LEN_TYPE) {
+        cp->p = cp->end = NULL;
+        return;
+    }
+    cp->p = (const uint8_t *)fp->value.bytes.buf;
+    cp->end = cp->p + fp->value.bytes.size;
+}
+
+/*
+ * Decode the next varint from a cursor.
+ * Returns 1 if a value was decoded, 0 at the end of the buffer,
+ * and -1 if the buffer ends in the middle of a varint.
+ */
+
+static inline int PB_cursor_next(PB_Cursor *cp, uint64_t *valuep) {
+    if (cp->p >= cp->end) return 0;
+    uint64_t result = 0;
+    int shift = 0;
+    while (cp->p < cp->end) {
+        uint8_t byte = *cp->p++;
+        if (shift < 64)
+            result |= (uint64_t)(byte & 0x7F) << shift;
+        shift += 7;
+        if ((byte & 0x80) == 0) {
+            *valuep = result;
+            return 1;
+        }
+    }
+    return -1;
+}
+
+static inline int64_t PB_zigzag_decode(uint64_t n) {
+    return (int64_t)(n >> 1) ^ -(int64_t)(n & 1);
+}
+
+/*
+ * Number of varints packed in a LEN_TYPE field, obtained by counting
+ * the bytes that terminate a varint (those with the high bit clear).
+ */
+
+static inline size_t PB_packed_count(PB_Field *fp) {
+    if (fp == NULL || fp->type != LEN_TYPE) return 0;
+    const uint8_t *p = (const uint8_t *)fp->value.bytes.buf;
+    size_t count = 0;
+    for (size_t i = 0; i < fp->value.bytes.size; i++)
+        count += (p[i] & 0x80) == 0;
+    return count;
+}
+
+/* Compare the contents of a LEN_TYPE field against a C string. */
+int PB_field_equals(PB_Field *fp, const char *str);
+
+/* Free a message and the contents of all of its fields. */
+void PB_free_message(PB_Message msg);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef STRPOOL_H
+#define STRPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A string pool that interns byte strings and assigns each distinct string
+ * a small integer id.  Tag keys and values in a map are stored as ids into
+ * a pool, so that equal strings are stored once and can be compared by id.
+ *
+ * Strings are returned null-terminated.  A pool is not safe for concurrent
+ * modification, but lookups may proceed concurrently once it is no longer
+ * being modified.
+ */
+
+#define SP_NONE UINT32_MAX
+
+typedef struct SP_Pool SP_Pool;
+
+SP_Pool *SP_create(void);
+void SP_free(SP_Pool *sp);
+
+uint32_t SP_intern(SP_Pool *sp, const char *str, size_t len);
+uint32_t SP_lookup(SP_Pool *sp, const char *str, size_t len);
+char *SP_get(SP_Pool *sp, uint32_t id);
+
+size_t SP_count(SP_Pool *sp);
+size_t SP_bytes(SP_Pool *sp);
+
+#endif
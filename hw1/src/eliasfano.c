@@ -0,0 +1,294 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "eliasfano.h"
+#include "debug.h"
+
+struct EF_Sequence {
+    size_t n;               // Number of values
+    int64_t base;           // First (smallest) value; others stored as offsets
+    uint64_t max;           // Largest offset from base
+    int low_bits;           // Number of low-order bits stored per value
+    uint64_t *low;          // Packed low-order bits, n * low_bits bits
+    uint64_t *high;         // Unary-coded high-order bits
+    size_t high_words;
+    uint64_t *ones;         // Position of every EF_SAMPLE_RATE-th one in high
+    size_t num_ones;
+    uint64_t *zeros;        // Position of every EF_SAMPLE_RATE-th zero in high
+    size_t num_zeros;
+};
+
+/*
+ * Word-level bit tricks.  These compile to single POPCNT/TZCNT/PDEP
+ * instructions when the corresponding target features are enabled
+ * (e.g. -march=native), and to portable broadword code otherwise.
+ */
+
+static inline int ef_popcount(uint64_t x) {
+    return __builtin_popcountll(x);
+}
+
+static inline int ef_select_in_word(uint64_t x, int r) {
+#ifdef __BMI2__
+    return __builtin_ctzll(__builtin_ia32_pdep_di(1ULL << r, x));
+#else
+    while (r-- > 0)
+        x &= x - 1;
+    return __builtin_ctzll(x);
+#endif
+}
+
+static inline uint64_t ef_get_low(const EF_Sequence *ef, size_t index) {
+    if (ef->low_bits == 0) return 0;
+    uint64_t off = (uint64_t)index * ef->low_bits;
+    size_t w = off >> 6;
+    int shift = off & 63;
+    uint64_t v = ef->low[w] >> shift;
+    if (shift + ef->low_bits > 64)
+        v |= ef->low[w + 1] << (64 - shift);
+    return v & ((1ULL << ef->low_bits) - 1);
+}
+
+/*
+ * Position in the high bitvector of the one bit belonging to element index.
+ */
+
+static uint64_t ef_select1(const EF_Sequence *ef, size_t index) {
+    uint64_t pos = ef->ones[index / EF_SAMPLE_RATE];
+    size_t r = index % EF_SAMPLE_RATE;
+    size_t w = pos >> 6;
+    uint64_t cur = ef->high[w] & (~0ULL << (pos & 63));
+
+    for (;;) {
+        int c = ef_popcount(cur);
+        if (r < (size_t)c)
+            return ((uint64_t)w << 6) + ef_select_in_word(cur, r);
+        r -= c;
+        cur = ef->high[++w];
+    }
+}
+
+/*
+ * Position in the high bitvector of the zero bit terminating bucket k.
+ */
+
+static uint64_t ef_select0(const EF_Sequence *ef, size_t k) {
+    uint64_t pos = ef->zeros[k / EF_SAMPLE_RATE];
+    size_t r = k % EF_SAMPLE_RATE;
+    size_t w = pos >> 6;
+    uint64_t cur = ~ef->high[w] & (~0ULL << (pos & 63));
+
+    for (;;) {
+        int c = ef_popcount(cur);
+        if (r < (size_t)c)
+            return ((uint64_t)w << 6) + ef_select_in_word(cur, r);
+        r -= c;
+        cur = ~ef->high[++w];
+    }
+}
+
+/**
+ * @brief  Encode a sorted sequence of integers in Elias-Fano form.
+ * @param values  The values to encode, which must be in non-decreasing order.
+ * @param n  The number of values.
+ * @return  The encoded sequence, or NULL if the values were not sorted or
+ * if memory could not be allocated.
+ */
+
+EF_Sequence *EF_encode(const int64_t *values, size_t n) {
+    for (size_t i = 1; i < n; i++) {
+        if (values[i] < values[i-1]) {
+            debug("Values not sorted at index %zu", i);
+            return NULL;
+        }
+    }
+
+    EF_Sequence *ef = calloc(1, sizeof(EF_Sequence));
+    if (ef == NULL) return NULL;
+
+    ef->n = n;
+    ef->base = n ? values[0] : 0;
+    ef->max = n ? (uint64_t)values[n-1] - (uint64_t)ef->base : 0;
+
+    int l = 0;
+    if (n > 0) {
+        uint64_t ratio = ef->max / n;
+        while (l < 62 && (ratio >> (l + 1)) != 0)
+            l++;
+    }
+    ef->low_bits = l;
+
+    uint64_t buckets = (ef->max >> l) + 1;
+    uint64_t high_bits = n + buckets;
+    ef->high_words = (high_bits >> 6) + 2;
+    ef->num_ones = n / EF_SAMPLE_RATE + 1;
+    ef->num_zeros = buckets / EF_SAMPLE_RATE + 1;
+
+    ef->low = calloc(((uint64_t)n * l >> 6) + 2, sizeof(uint64_t));
+    ef->high = calloc(ef->high_words, sizeof(uint64_t));
+    ef->ones = calloc(ef->num_ones, sizeof(uint64_t));
+    ef->zeros = calloc(ef->num_zeros, sizeof(uint64_t));
+    if (!ef->low || !ef->high || !ef->ones || !ef->zeros) {
+        EF_free(ef);
+        return NULL;
+    }
+
+    uint64_t mask = l ? (1ULL << l) - 1 : 0;
+    for (size_t i = 0; i < n; i++) {
+        uint64_t d = (uint64_t)values[i] - (uint64_t)ef->base;
+        if (l) {
+            uint64_t off = (uint64_t)i * l;
+            size_t w = off >> 6;
+            int shift = off & 63;
+            ef->low[w] |= (d & mask) << shift;
+            if (shift + l > 64)
+                ef->low[w + 1] |= (d & mask) >> (64 - shift);
+        }
+        uint64_t pos = (d >> l) + i;
+        ef->high[pos >> 6] |= 1ULL << (pos & 63);
+        if (i % EF_SAMPLE_RATE == 0)
+            ef->ones[i / EF_SAMPLE_RATE] = pos;
+    }
+
+    /* Zeros are sampled in a second pass, one word at a time. */
+    uint64_t zeros_seen = 0;
+    for (size_t w = 0; w < ef->high_words && zeros_seen < buckets; w++) {
+        uint64_t z = ~ef->high[w];
+        while (z && zeros_seen < buckets) {
+            if (zeros_seen % EF_SAMPLE_RATE == 0)
+                ef->zeros[zeros_seen / EF_SAMPLE_RATE] = ((uint64_t)w << 6) + __builtin_ctzll(z);
+            zeros_seen++;
+            z &= z - 1;
+        }
+    }
+    return ef;
+}
+
+/**
+ * @brief  Free an Elias-Fano sequence and all associated storage.
+ * @param ef  The sequence to be freed, or NULL.
+ */
+
+void EF_free(EF_Sequence *ef) {
+    if (ef == NULL) return;
+    free(ef->low);
+    free(ef->high);
+    free(ef->ones);
+    free(ef->zeros);
+    free(ef);
+}
+
+/**
+ * @brief  Get the number of values in an Elias-Fano sequence.
+ */
+
+size_t EF_size(const EF_Sequence *ef) {
+    return ef ? ef->n : 0;
+}
+
+/**
+ * @brief  Get the number of bytes of heap storage used by an Elias-Fano sequence.
+ */
+
+size_t EF_bytes(const EF_Sequence *ef) {
+    if (ef == NULL) return 0;
+    return sizeof(EF_Sequence)
+        + ((((uint64_t)ef->n * ef->low_bits) >> 6) + 2) * sizeof(uint64_t)
+        + (ef->high_words + ef->num_ones + ef->num_zeros) * sizeof(uint64_t);
+}
+
+/**
+ * @brief  Get the value at a specified index of an Elias-Fano sequence.
+ * @param ef  The sequence to be queried.
+ * @param index  The index, which must be in the range [0, EF_size(ef)).
+ * @return  The value at the specified index.
+ */
+
+int64_t EF_select(const EF_Sequence *ef, size_t index) {
+    uint64_t high = ef_select1(ef, index) - index;
+    return (int64_t)((uint64_t)ef->base + ((high << ef->low_bits) | ef_get_low(ef, index)));
+}
+
+/**
+ * @brief  Decode a contiguous range of values from an Elias-Fano sequence.
+ * @details  Only one select is performed; the remaining values are produced
+ * by walking the high bitvector a word at a time, which is considerably
+ * cheaper than repeated calls to EF_select().
+ * @param ef  The sequence to be decoded.
+ * @param start  Index of the first value to decode.
+ * @param count  Maximum number of values to decode.
+ * @param out  Caller-supplied array with room for count values.
+ * @return  The number of values actually decoded.
+ */
+
+size_t EF_decode(const EF_Sequence *ef, size_t start, size_t count, int64_t *out) {
+    if (start >= ef->n) return 0;
+    if (count > ef->n - start) count = ef->n - start;
+    if (count == 0) return 0;
+
+    uint64_t pos = ef_select1(ef, start);
+    size_t w = pos >> 6;
+    uint64_t cur = ef->high[w] & (~0ULL << (pos & 63));
+    size_t i = start;
+
+    while (i < start + count) {
+        while (cur == 0)
+            cur = ef->high[++w];
+        uint64_t p = ((uint64_t)w << 6) + __builtin_ctzll(cur);
+        uint64_t high = p - i;
+        out[i - start] = (int64_t)((uint64_t)ef->base + ((high << ef->low_bits) | ef_get_low(ef, i)));
+        cur &= cur - 1;
+        i++;
+    }
+    return count;
+}
+
+/**
+ * @brief  Find the number of values in an Elias-Fano sequence that are
+ * strictly less than a given value.
+ * @details  This is both the rank of the value and the index of its
+ * successor (the first element >= value).  The bucket holding the value
+ * is located with a sampled select on the zero bits, after which only the
+ * elements sharing the same high-order bits are compared.
+ * @param ef  The sequence to be searched.
+ * @param value  The value to search for.
+ * @return  The index of the first element >= value, or EF_size(ef) if there
+ * is no such element.
+ */
+
+size_t EF_lower_bound(const EF_Sequence *ef, int64_t value) {
+    if (ef->n == 0 || value <= ef->base) return 0;
+    uint64_t d = (uint64_t)value - (uint64_t)ef->base;
+    if (d > ef->max) return ef->n;
+
+    uint64_t h = d >> ef->low_bits;
+    uint64_t pos = h ? ef_select0(ef, h - 1) + 1 : 0;
+    size_t idx = pos - h;
+    uint64_t low = d & (ef->low_bits ? (1ULL << ef->low_bits) - 1 : 0);
+
+    while (idx < ef->n && (ef->high[pos >> 6] >> (pos & 63) & 1)) {
+        if (ef_get_low(ef, idx) >= low)
+            return idx;
+        idx++;
+        pos++;
+    }
+    return idx;
+}
+
+/**
+ * @brief  Search for a value in an Elias-Fano sequence.
+ * @param ef  The sequence to be searched.
+ * @param value  The value to search for.
+ * @param indexp  If non-NULL, the index of the first occurrence of the value
+ * is stored here when it is found.
+ * @return  1 if the value was found, otherwise 0.
+ */
+
+int EF_find(const EF_Sequence *ef, int64_t value, size_t *indexp) {
+    size_t idx = EF_lower_bound(ef, value);
+    if (idx >= ef->n || EF_select(ef, idx) != value)
+        return 0;
+    if (indexp) *indexp = idx;
+    return 1;
+}
@@ -1,8 +1,11 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "global.h"
+#include "cli.h"
 #include "osm.h"
+#include "osmpbf.h"
 #include "debug.h"
 
 int main(int argc, char **argv)
@@ -15,28 +18,84 @@ int main(int argc, char **argv)
         USAGE(*argv, EXIT_SUCCESS);
     }
 
-    if (osm_input_file) {
-        FILE *in = fopen(osm_input_file, "rb");
+    OSM_Options opts;
+    OSM_Options_init(&opts);
+    opts.threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (osm_at_given) {
+        opts.history = 1;
+        opts.history_from = opts.history_until = osm_at_time;
+    }
 
-        if (in == NULL) {
-            fprintf(stderr, "Cannot read the input file %s\n", osm_input_file);
-            USAGE(*argv, EXIT_FAILURE);
-        }
+    if (osm_diff_old) {
+        if (run_diff(&opts) != 0)
+            exit(EXIT_FAILURE);
+        if (osm_num_input_files == 0)
+            return EXIT_SUCCESS;
+    }
 
+    int (*run)(const OSM_Options *) = standalone_mode();
+    if (run != NULL) {
+        int ret = run(&opts);
+        free(osm_input_files);
+        return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    char *cache_key = NULL;
+    if (osm_cache_dir != NULL) {
+        int ret = cache_lookup(argc, argv, &cache_key);
+        if (ret != 0) {
+            free(osm_input_files);
+            return ret > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
 
-        OSM_Map *map = OSM_read_Map(in);
+    OSM_Map *map;
+    if (osm_use_index) {
+        map = load_indexed_map(argc, argv, &opts);
+    } else if (osm_shards > 0) {
+        map = load_sharded_map(argc, argv, &opts);
+    } else {
+        int num_ins = osm_num_input_files ? osm_num_input_files : 1;
+        FILE *ins[num_ins];
+        ins[0] = stdin;
+        for (int i = 0; i < osm_num_input_files; i++) {
+            ins[i] = fopen(osm_input_files[i], "rb");
 
-        if (map == NULL) {
-            fprintf(stderr, "Cannot read the map!\n");
+            if (ins[i] == NULL) {
+                fprintf(stderr, "Cannot read the input file %s\n", osm_input_files[i]);
+                USAGE(*argv, EXIT_FAILURE);
+            }
         }
 
-        if (process_args(argc, argv, map) != 0) {
-            USAGE(*argv, EXIT_FAILURE);
+        if (osm_num_input_files == 1)
+            opts.path = osm_input_files[0];
+        map = OSM_read_Map_merged(ins, num_ins, &opts);
+        for (int i = 0; i < num_ins; i++) {
+            if (ins[i] != stdin)
+                fclose(ins[i]);
         }
+    }
+
+    if (map == NULL) {
+        fprintf(stderr, "Cannot read the map!\n");
+        exit(EXIT_FAILURE);
+    }
 
-        fclose(in);
+    if (cache_key != NULL && cache_capture() != 0) {
+        free(cache_key);
+        cache_key = NULL;
+    }
+    int ret = process_args(argc, argv, map);
+    if (cache_key != NULL) {
+        cache_release(cache_key, ret == 0);
+        free(cache_key);
+    }
+    OSM_Map_free(map);
+    free(osm_input_files);
+    if (ret != 0) {
+        USAGE(*argv, EXIT_FAILURE);
     }
-    USAGE(*argv, EXIT_SUCCESS);
+    return EXIT_SUCCESS;
 }
 
 /*
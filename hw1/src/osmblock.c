@@ -0,0 +1,1045 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "protobuf.h"
+#include "pb_util.h"
+#include "osmblock.h"
+#include "debug.h"
+
+/* Decoding parameters from the PrimitiveBlock, shared by all its groups. */
+
+typedef struct OSM_BlockContext {
+    OSM_Block *block;
+    const OSM_Options *opts;
+    int64_t granularity;
+    int64_t lat_offset;
+    int64_t lon_offset;
+    int64_t date_granularity;
+} OSM_BlockContext;
+
+static int grow_array(void **arrp, size_t elem_size, size_t new_cap) {
+    void *arr = realloc(*arrp, elem_size * new_cap);
+    if (arr == NULL) return -1;
+    *arrp = arr;
+    return 0;
+}
+
+static int grow_cap(int cap, int need) {
+    if (cap == 0) cap = 256;
+    while (cap < need)
+        cap *= 2;
+    return cap;
+}
+
+/* Whether metadata is decoded: history needs the versions and timestamps */
+
+static int wants_metadata(const OSM_Options *op) {
+    return op->metadata || op->history;
+}
+
+static int reserve_info(OSM_BlockInfo *ip, const OSM_Options *op, int cap) {
+    if (!wants_metadata(op)) return 0;
+    if (grow_array((void **)&ip->versions, sizeof(int32_t), cap) ||
+        grow_array((void **)&ip->timestamps, sizeof(int64_t), cap) ||
+        grow_array((void **)&ip->visible, sizeof(uint8_t), cap))
+        return -1;
+    return 0;
+}
+
+static int reserve_nodes(OSM_Block *bp, const OSM_Options *op, int extra) {
+    if (bp->num_nodes + extra <= bp->node_cap) return 0;
+    int cap = grow_cap(bp->node_cap, bp->num_nodes + extra);
+    if (grow_array((void **)&bp->node_ids, sizeof(OSM_Id), cap) ||
+        grow_array((void **)&bp->node_lats, sizeof(OSM_Lat), cap) ||
+        grow_array((void **)&bp->node_lons, sizeof(OSM_Lon), cap) ||
+        grow_array((void **)&bp->node_tags.start, sizeof(int), cap + 1) ||
+        reserve_info(&bp->node_info, op, cap))
+        return -1;
+    bp->node_cap = cap;
+    return 0;
+}
+
+static int reserve_ways(OSM_Block *bp, const OSM_Options *op, int extra) {
+    if (bp->num_ways + extra <= bp->way_cap) return 0;
+    int cap = grow_cap(bp->way_cap, bp->num_ways + extra);
+    if (grow_array((void **)&bp->way_ids, sizeof(OSM_Id), cap) ||
+        grow_array((void **)&bp->way_ref_start, sizeof(int), cap + 1) ||
+        grow_array((void **)&bp->way_tags.start, sizeof(int), cap + 1) ||
+        reserve_info(&bp->way_info, op, cap))
+        return -1;
+    bp->way_cap = cap;
+    return 0;
+}
+
+static int reserve_refs(OSM_Block *bp, int extra) {
+    if (bp->num_refs + extra <= bp->ref_cap) return 0;
+    int cap = grow_cap(bp->ref_cap, bp->num_refs + extra);
+    if (grow_array((void **)&bp->way_refs, sizeof(OSM_Id), cap))
+        return -1;
+    if (bp->way_ref_lats != NULL &&
+        (grow_array((void **)&bp->way_ref_lats, sizeof(OSM_Lat), cap) ||
+         grow_array((void **)&bp->way_ref_lons, sizeof(OSM_Lon), cap)))
+        return -1;
+    bp->ref_cap = cap;
+    return 0;
+}
+
+static int reserve_relations(OSM_Block *bp, int extra) {
+    if (bp->num_relations + extra <= bp->relation_cap) return 0;
+    int cap = grow_cap(bp->relation_cap, bp->num_relations + extra);
+    if (grow_array((void **)&bp->relation_ids, sizeof(OSM_Id), cap) ||
+        grow_array((void **)&bp->member_start, sizeof(int), cap + 1))
+        return -1;
+    bp->relation_cap = cap;
+    return 0;
+}
+
+static int reserve_members(OSM_Block *bp, int extra) {
+    if (bp->num_members + extra <= bp->member_cap) return 0;
+    int cap = grow_cap(bp->member_cap, bp->num_members + extra);
+    if (grow_array((void **)&bp->member_ids, sizeof(OSM_Id), cap) ||
+        grow_array((void **)&bp->member_types, sizeof(uint8_t), cap))
+        return -1;
+    bp->member_cap = cap;
+    return 0;
+}
+
+/*
+ * Locations of the refs of ways are kept only while every way in the block
+ * with refs has them; the first way without them discards them all.
+ */
+
+static void drop_way_locations(OSM_Block *bp) {
+    free(bp->way_ref_lats);
+    free(bp->way_ref_lons);
+    bp->way_ref_lats = NULL;
+    bp->way_ref_lons = NULL;
+    bp->no_way_locations = 1;
+}
+
+/*
+ * Prepare to store the locations of the refs of a way with at least one
+ * ref, after reserve_refs().  Returns 1 if they are to be stored, 0 if not,
+ * and -1 if memory could not be allocated.
+ */
+
+static int want_way_locations(OSM_Block *bp) {
+    if (bp->no_way_locations) return 0;
+    if (bp->way_ref_lats == NULL &&
+        (grow_array((void **)&bp->way_ref_lats, sizeof(OSM_Lat), bp->ref_cap) ||
+         grow_array((void **)&bp->way_ref_lons, sizeof(OSM_Lon), bp->ref_cap)))
+        return -1;
+    return 1;
+}
+
+static int reserve_tags(OSM_BlockTags *tp, int extra) {
+    if (tp->count + extra <= tp->cap) return 0;
+    int cap = grow_cap(tp->cap, tp->count + extra);
+    if (grow_array((void **)&tp->keys, sizeof(uint32_t), cap) ||
+        grow_array((void **)&tp->vals, sizeof(uint32_t), cap))
+        return -1;
+    tp->cap = cap;
+    return 0;
+}
+
+static int add_tag(OSM_Block *bp, OSM_BlockTags *tp, uint64_t k, uint64_t v) {
+    if (k >= (uint64_t)bp->num_strings || v >= (uint64_t)bp->num_strings) {
+        fprintf(stderr, "String index out of range\n");
+        return -1;
+    }
+    if (reserve_tags(tp, 1)) return -1;
+    tp->keys[tp->count] = k;
+    tp->vals[tp->count] = v;
+    tp->count++;
+    return 0;
+}
+
+/*
+ * Append the key/value pairs given by parallel packed keys and vals fields
+ * (as in Node and Way messages) to a tag list.
+ */
+
+static int decode_tags(OSM_BlockContext *ctx, OSM_BlockTags *tp, PB_Field *keys, PB_Field *vals) {
+    if (!ctx->opts->tags) return 0;
+    if (PB_packed_count(keys) != PB_packed_count(vals)) {
+        fprintf(stderr, "Mismatched number of keys and values\n");
+        return -1;
+    }
+    PB_Cursor kc, vc;
+    PB_cursor_init(&kc, keys);
+    PB_cursor_init(&vc, vals);
+    uint64_t k, v;
+    while (PB_cursor_next(&kc, &k) == 1 && PB_cursor_next(&vc, &v) == 1) {
+        if (add_tag(ctx->block, tp, k, v)) return -1;
+    }
+    return 0;
+}
+
+/*
+ * Decode an Info message for entity index into a metadata column.
+ */
+
+static int decode_info(OSM_BlockContext *ctx, OSM_BlockInfo *ip, int index, PB_Field *info_field) {
+    if (!wants_metadata(ctx->opts)) return 0;
+    ip->versions[index] = -1;
+    ip->timestamps[index] = 0;
+    ip->visible[index] = 1;
+    if (info_field == NULL) return 0;
+
+    PB_Message info = NULL;
+    if (PB_read_embedded_message(info_field->value.bytes.buf, info_field->value.bytes.size, &info) < 0)
+        return -1;
+    if (info == NULL) return 0;
+    PB_Field *fp;
+    if ((fp = PB_get_field(info, 1, VARINT_TYPE)) != NULL)
+        ip->versions[index] = (int32_t)fp->value.i64;
+    if ((fp = PB_get_field(info, 2, VARINT_TYPE)) != NULL)
+        ip->timestamps[index] = (int64_t)fp->value.i64 * ctx->date_granularity / 1000;
+    if ((fp = PB_get_field(info, 6, VARINT_TYPE)) != NULL)
+        ip->visible[index] = fp->value.i64 != 0;
+    PB_free_message(info);
+    return 0;
+}
+
+static int decode_dense_info(OSM_BlockContext *ctx, int first, int n, PB_Field *info_field) {
+    OSM_Block *bp = ctx->block;
+    if (!wants_metadata(ctx->opts)) return 0;
+    for (int i = first; i < first + n; i++) {
+        bp->node_info.versions[i] = -1;
+        bp->node_info.timestamps[i] = 0;
+        bp->node_info.visible[i] = 1;
+    }
+    if (info_field == NULL) return 0;
+
+    PB_Message info = NULL;
+    if (PB_read_embedded_message(info_field->value.bytes.buf, info_field->value.bytes.size, &info) < 0)
+        return -1;
+    if (info == NULL) return 0;
+
+    PB_Cursor vc, tc, visc;
+    PB_cursor_init(&vc, PB_get_field(info, 1, LEN_TYPE));
+    PB_cursor_init(&tc, PB_get_field(info, 2, LEN_TYPE));
+    PB_cursor_init(&visc, PB_get_field(info, 6, LEN_TYPE));
+    int64_t timestamp = 0;
+    uint64_t v;
+    for (int i = first; i < first + n; i++) {
+        if (PB_cursor_next(&vc, &v) == 1)
+            bp->node_info.versions[i] = (int32_t)v;
+        if (PB_cursor_next(&tc, &v) == 1) {
+            timestamp += PB_zigzag_decode(v);
+            bp->node_info.timestamps[i] = timestamp * ctx->date_granularity / 1000;
+        }
+        if (PB_cursor_next(&visc, &v) == 1)
+            bp->node_info.visible[i] = v != 0;
+    }
+    PB_free_message(info);
+    return 0;
+}
+
+static int decode_dense_nodes(OSM_BlockContext *ctx, PB_Message dense) {
+    OSM_Block *bp = ctx->block;
+    PB_Field *id_field = PB_get_field(dense, 1, LEN_TYPE);
+    PB_Field *lat_field = PB_get_field(dense, 8, LEN_TYPE);
+    PB_Field *lon_field = PB_get_field(dense, 9, LEN_TYPE);
+    PB_Field *kv_field = PB_get_field(dense, 10, LEN_TYPE);
+
+    size_t n = PB_packed_count(id_field);
+    if (PB_packed_count(lat_field) != n || PB_packed_count(lon_field) != n) {
+        fprintf(stderr, "Mismatched dense node columns\n");
+        return -1;
+    }
+    if (reserve_nodes(bp, ctx->opts, n)) return -1;
+
+    PB_Cursor ic, latc, lonc, kvc;
+    PB_cursor_init(&ic, id_field);
+    PB_cursor_init(&latc, lat_field);
+    PB_cursor_init(&lonc, lon_field);
+    PB_cursor_init(&kvc, ctx->opts->tags ? kv_field : NULL);
+
+    int first = bp->num_nodes;
+    int64_t id = 0, lat = 0, lon = 0;
+    uint64_t v;
+    for (size_t i = 0; i < n; i++) {
+        if (PB_cursor_next(&ic, &v) != 1) return -1;
+        id += PB_zigzag_decode(v);
+        if (PB_cursor_next(&latc, &v) != 1) return -1;
+        lat += PB_zigzag_decode(v);
+        if (PB_cursor_next(&lonc, &v) != 1) return -1;
+        lon += PB_zigzag_decode(v);
+
+        int index = bp->num_nodes++;
+        bp->node_ids[index] = id;
+        bp->node_lats[index] = ctx->lat_offset + ctx->granularity * lat;
+        bp->node_lons[index] = ctx->lon_offset + ctx->granularity * lon;
+        bp->node_tags.start[index] = bp->node_tags.count;
+
+        /* Keys and values are interleaved, with a 0 terminating each node. */
+        uint64_t k;
+        while (PB_cursor_next(&kvc, &k) == 1 && k != 0) {
+            if (PB_cursor_next(&kvc, &v) != 1) return -1;
+            if (add_tag(bp, &bp->node_tags, k, v)) return -1;
+        }
+    }
+    bp->node_tags.start[bp->num_nodes] = bp->node_tags.count;
+    return decode_dense_info(ctx, first, n, PB_get_field(dense, 5, LEN_TYPE));
+}
+
+static int decode_node(OSM_BlockContext *ctx, PB_Message node) {
+    OSM_Block *bp = ctx->block;
+    PB_Field *id = PB_get_field(node, 1, VARINT_TYPE);
+    PB_Field *lat = PB_get_field(node, 8, VARINT_TYPE);
+    PB_Field *lon = PB_get_field(node, 9, VARINT_TYPE);
+    if (id == NULL || lat == NULL || lon == NULL) {
+        fprintf(stderr, "Node is missing a required field\n");
+        return -1;
+    }
+    if (reserve_nodes(bp, ctx->opts, 1)) return -1;
+
+    int index = bp->num_nodes;
+    bp->node_ids[index] = PB_zigzag_decode(id->value.i64);
+    bp->node_lats[index] = ctx->lat_offset + ctx->granularity * PB_zigzag_decode(lat->value.i64);
+    bp->node_lons[index] = ctx->lon_offset + ctx->granularity * PB_zigzag_decode(lon->value.i64);
+    bp->node_tags.start[index] = bp->node_tags.count;
+    if (decode_tags(ctx, &bp->node_tags, PB_get_field(node, 2, LEN_TYPE),
+                    PB_get_field(node, 3, LEN_TYPE)) ||
+        decode_info(ctx, &bp->node_info, index, PB_get_field(node, 4, LEN_TYPE)))
+        return -1;
+    bp->num_nodes++;
+    bp->node_tags.start[bp->num_nodes] = bp->node_tags.count;
+    return 0;
+}
+
+static int decode_way(OSM_BlockContext *ctx, PB_Message way) {
+    OSM_Block *bp = ctx->block;
+    PB_Field *id = PB_get_field(way, 1, VARINT_TYPE);
+    if (id == NULL) {
+        fprintf(stderr, "Way is missing its id\n");
+        return -1;
+    }
+    PB_Field *refs = PB_get_field(way, 8, LEN_TYPE);
+    size_t num_refs = PB_packed_count(refs);
+    if (reserve_ways(bp, ctx->opts, 1) || reserve_refs(bp, num_refs)) return -1;
+
+    int index = bp->num_ways;
+    bp->way_ids[index] = (OSM_Id)id->value.i64;
+    bp->way_ref_start[index] = bp->num_refs;
+
+    PB_Cursor rc;
+    PB_cursor_init(&rc, refs);
+    int64_t ref = 0;
+    uint64_t v;
+    while (PB_cursor_next(&rc, &v) == 1) {
+        ref += PB_zigzag_decode(v);
+        bp->way_refs[bp->num_refs++] = ref;
+    }
+
+    /* LocationsOnWays: delta-coded lats and lons, one per ref */
+    PB_Field *lats = PB_get_field(way, 9, LEN_TYPE);
+    PB_Field *lons = PB_get_field(way, 10, LEN_TYPE);
+    if (num_refs > 0) {
+        int ret = 0;
+        if (PB_packed_count(lats) != num_refs || PB_packed_count(lons) != num_refs)
+            drop_way_locations(bp);
+        else if ((ret = want_way_locations(bp)) < 0)
+            return -1;
+        if (ret == 1) {
+            PB_Cursor latc, lonc;
+            PB_cursor_init(&latc, lats);
+            PB_cursor_init(&lonc, lons);
+            int64_t lat = 0, lon = 0;
+            for (int r = bp->way_ref_start[index]; r < bp->num_refs; r++) {
+                if (PB_cursor_next(&latc, &v) == 1) lat += PB_zigzag_decode(v);
+                if (PB_cursor_next(&lonc, &v) == 1) lon += PB_zigzag_decode(v);
+                bp->way_ref_lats[r] = ctx->lat_offset + ctx->granularity * lat;
+                bp->way_ref_lons[r] = ctx->lon_offset + ctx->granularity * lon;
+            }
+        }
+    }
+
+    bp->way_tags.start[index] = bp->way_tags.count;
+    if (decode_tags(ctx, &bp->way_tags, PB_get_field(way, 2, LEN_TYPE),
+                    PB_get_field(way, 3, LEN_TYPE)) ||
+        decode_info(ctx, &bp->way_info, index, PB_get_field(way, 4, LEN_TYPE)))
+        return -1;
+    bp->num_ways++;
+    bp->way_ref_start[bp->num_ways] = bp->num_refs;
+    bp->way_tags.start[bp->num_ways] = bp->way_tags.count;
+    return 0;
+}
+
+/*
+ * Decode the id and members of a relation.  Its tags, roles and metadata
+ * are not decoded.
+ */
+
+static int decode_relation(OSM_BlockContext *ctx, PB_Message relation) {
+    OSM_Block *bp = ctx->block;
+    PB_Field *id = PB_get_field(relation, 1, VARINT_TYPE);
+    if (id == NULL) {
+        fprintf(stderr, "Relation is missing its id\n");
+        return -1;
+    }
+    PB_Field *memids = PB_get_field(relation, 9, LEN_TYPE);
+    PB_Field *types = PB_get_field(relation, 10, LEN_TYPE);
+    size_t num_members = PB_packed_count(memids);
+    if (PB_packed_count(types) != num_members) {
+        fprintf(stderr, "Mismatched number of member ids and types\n");
+        return -1;
+    }
+    if (reserve_relations(bp, 1) || reserve_members(bp, num_members)) return -1;
+
+    int index = bp->num_relations;
+    bp->relation_ids[index] = (OSM_Id)id->value.i64;
+    bp->member_start[index] = bp->num_members;
+
+    PB_Cursor mc, tc;
+    PB_cursor_init(&mc, memids);
+    PB_cursor_init(&tc, types);
+    int64_t memid = 0;
+    uint64_t v, t;
+    while (PB_cursor_next(&mc, &v) == 1 && PB_cursor_next(&tc, &t) == 1) {
+        if (t > OSM_MEMBER_RELATION) {
+            fprintf(stderr, "Unknown member type %lu\n", t);
+            return -1;
+        }
+        memid += PB_zigzag_decode(v);
+        bp->member_ids[bp->num_members] = memid;
+        bp->member_types[bp->num_members++] = t;
+    }
+    bp->num_relations++;
+    bp->member_start[bp->num_relations] = bp->num_members;
+    return 0;
+}
+
+/*
+ * Decode each embedded message with number fnum in msg, passing it to
+ * the specified decoding function.
+ */
+
+static int decode_each(OSM_BlockContext *ctx, PB_Message msg, int fnum,
+                       int (*decode)(OSM_BlockContext *, PB_Message)) {
+    for (PB_Field *fp = PB_next_field(msg, fnum, LEN_TYPE, FORWARD_DIR); fp != NULL;
+         fp = PB_next_field(fp, fnum, LEN_TYPE, FORWARD_DIR)) {
+        PB_Message sub = NULL;
+        if (PB_read_embedded_message(fp->value.bytes.buf, fp->value.bytes.size, &sub) < 0)
+            return -1;
+        if (sub == NULL) continue;
+        int ret = decode(ctx, sub);
+        PB_free_message(sub);
+        if (ret) return -1;
+    }
+    return 0;
+}
+
+static int decode_group(OSM_BlockContext *ctx, PB_Message group) {
+    unsigned int types = ctx->opts->types;
+    if (((types & OSM_TYPE_NODE) && decode_each(ctx, group, 1, decode_node)) ||
+        ((types & OSM_TYPE_NODE) && decode_each(ctx, group, 2, decode_dense_nodes)) ||
+        ((types & OSM_TYPE_WAY) && decode_each(ctx, group, 3, decode_way)))
+        return -1;
+    /* Relations are only counted, unless their members are wanted */
+    if ((types & OSM_TYPE_RELATION) && ctx->opts->members)
+        return decode_each(ctx, group, 4, decode_relation);
+    if (types & OSM_TYPE_RELATION)
+        for (PB_Field *fp = PB_next_field(group, 4, LEN_TYPE, FORWARD_DIR); fp != NULL;
+             fp = PB_next_field(fp, 4, LEN_TYPE, FORWARD_DIR))
+            ctx->block->num_relations++;
+    return 0;
+}
+
+static int decode_string_table(OSM_Block *bp, PB_Field *st_field) {
+    PB_Message st = NULL;
+    if (st_field == NULL ||
+        PB_read_embedded_message(st_field->value.bytes.buf, st_field->value.bytes.size, &st) < 0) {
+        fprintf(stderr, "Block has no string table\n");
+        return -1;
+    }
+    if (st == NULL) return 0;
+
+    PB_Field *fp;
+    size_t total = 0;
+    for (fp = PB_next_field(st, 1, LEN_TYPE, FORWARD_DIR); fp != NULL;
+         fp = PB_next_field(fp, 1, LEN_TYPE, FORWARD_DIR)) {
+        bp->num_strings++;
+        total += fp->value.bytes.size + 1;
+    }
+
+    /* All strings share one allocation, which strings[0] points to. */
+    char *data = malloc(total + 1);
+    bp->strings = malloc((bp->num_strings + 1) * sizeof(char *));
+    bp->string_lens = malloc((bp->num_strings + 1) * sizeof(uint32_t));
+    if (data == NULL || bp->strings == NULL || bp->string_lens == NULL) {
+        free(data);
+        PB_free_message(st);
+        return -1;
+    }
+    int i = 0;
+    for (fp = PB_next_field(st, 1, LEN_TYPE, FORWARD_DIR); fp != NULL;
+         fp = PB_next_field(fp, 1, LEN_TYPE, FORWARD_DIR)) {
+        size_t len = fp->value.bytes.size;
+        memcpy(data, fp->value.bytes.buf, len);
+        data[len] = '\0';
+        bp->strings[i] = data;
+        bp->string_lens[i] = len;
+        data += len + 1;
+        i++;
+    }
+    if (i == 0) free(data);
+    PB_free_message(st);
+    return 0;
+}
+
+static int decode_primitive_block(OSM_Block *bp, const OSM_Options *op, PB_Message block) {
+    OSM_BlockContext ctx = { .block = bp, .opts = op, .granularity = 100, .date_granularity = 1000 };
+    PB_Field *fp;
+
+    if ((fp = PB_get_field(block, 17, VARINT_TYPE)) != NULL)
+        ctx.granularity = (int64_t)fp->value.i64;
+    if ((fp = PB_get_field(block, 18, VARINT_TYPE)) != NULL)
+        ctx.date_granularity = (int64_t)fp->value.i64;
+    if ((fp = PB_get_field(block, 19, VARINT_TYPE)) != NULL)
+        ctx.lat_offset = (int64_t)fp->value.i64;
+    if ((fp = PB_get_field(block, 20, VARINT_TYPE)) != NULL)
+        ctx.lon_offset = (int64_t)fp->value.i64;
+
+    if (decode_string_table(bp, PB_get_field(block, 1, LEN_TYPE)))
+        return -1;
+    return decode_each(&ctx, block, 2, decode_group);
+}
+
+/*
+ * Compact the tags of a block's entities, keeping entity i if keep[i] is set.
+ */
+
+static void compact_tags(OSM_BlockTags *tp, const uint8_t *keep, int n) {
+    if (tp->start == NULL) return;
+    int count = 0, j = 0;
+    for (int i = 0; i < n; i++) {
+        int start = tp->start[i], end = tp->start[i + 1];
+        if (!keep[i]) continue;
+        memmove(tp->keys + count, tp->keys + start, (end - start) * sizeof(uint32_t));
+        memmove(tp->vals + count, tp->vals + start, (end - start) * sizeof(uint32_t));
+        tp->start[j++] = count;
+        count += end - start;
+    }
+    tp->start[j] = count;
+    tp->count = count;
+}
+
+static void compact_info(OSM_BlockInfo *ip, const uint8_t *keep, int n) {
+    int j = 0;
+    for (int i = 0; i < n; i++) {
+        if (!keep[i]) continue;
+        ip->versions[j] = ip->versions[i];
+        ip->timestamps[j] = ip->timestamps[i];
+        ip->visible[j] = ip->visible[i];
+        j++;
+    }
+}
+
+/*
+ * Decide which versions in a column of a history block are outside the
+ * time window of the options: those after history_until, and those
+ * superseded, by the next version of the same entity, at or before
+ * history_from.  Returns the number of versions to be kept.
+ */
+
+static int select_versions(const OSM_Id *ids, const OSM_BlockInfo *ip, int n,
+                           const OSM_Options *op, uint8_t *keep) {
+    int kept = 0;
+    for (int i = 0; i < n; i++) {
+        int64_t ts = ip->timestamps[i];
+        keep[i] = !(op->history_until && ts > op->history_until);
+        if (keep[i] && op->history_from && i + 1 < n && ids[i + 1] == ids[i] &&
+            ip->timestamps[i + 1] <= op->history_from)
+            keep[i] = 0;
+        kept += keep[i];
+    }
+    return kept;
+}
+
+/*
+ * Drop the versions of a decoded history block that are outside the time
+ * window, so that the work is done by the decoding threads.
+ */
+
+static int apply_history_window(OSM_Block *bp, const OSM_Options *op) {
+    int n = bp->num_nodes > bp->num_ways ? bp->num_nodes : bp->num_ways;
+    if (n == 0) return 0;
+    uint8_t *keep = malloc(n);
+    if (keep == NULL) return -1;
+
+    n = bp->num_nodes;
+    if (n > 0 && select_versions(bp->node_ids, &bp->node_info, n, op, keep) < n) {
+        int j = 0;
+        for (int i = 0; i < n; i++) {
+            if (!keep[i]) continue;
+            bp->node_ids[j] = bp->node_ids[i];
+            bp->node_lats[j] = bp->node_lats[i];
+            bp->node_lons[j] = bp->node_lons[i];
+            j++;
+        }
+        compact_tags(&bp->node_tags, keep, n);
+        compact_info(&bp->node_info, keep, n);
+        bp->num_nodes = j;
+    }
+
+    n = bp->num_ways;
+    if (n > 0 && select_versions(bp->way_ids, &bp->way_info, n, op, keep) < n) {
+        int j = 0, num_refs = 0;
+        for (int i = 0; i < n; i++) {
+            int start = bp->way_ref_start[i], end = bp->way_ref_start[i + 1];
+            if (!keep[i]) continue;
+            bp->way_ids[j] = bp->way_ids[i];
+            memmove(bp->way_refs + num_refs, bp->way_refs + start, (end - start) * sizeof(OSM_Id));
+            if (bp->way_ref_lats != NULL) {
+                memmove(bp->way_ref_lats + num_refs, bp->way_ref_lats + start,
+                        (end - start) * sizeof(OSM_Lat));
+                memmove(bp->way_ref_lons + num_refs, bp->way_ref_lons + start,
+                        (end - start) * sizeof(OSM_Lon));
+            }
+            bp->way_ref_start[j++] = num_refs;
+            num_refs += end - start;
+        }
+        bp->way_ref_start[j] = num_refs;
+        bp->num_refs = num_refs;
+        compact_tags(&bp->way_tags, keep, n);
+        compact_info(&bp->way_info, keep, n);
+        bp->num_ways = j;
+    }
+    free(keep);
+    return 0;
+}
+
+static const char *feature_names[OSM_NUM_FEATURES] = {
+    "OsmSchema-V0.6", "DenseNodes", "HistoricalInformation", "Sort.Type_then_ID", "LocationsOnWays"
+};
+
+/**
+ * @brief  Get the name under which a feature appears in a HeaderBlock.
+ *
+ * @param feature  One of the OSM_FEATURE_* masks.
+ * @return  The name of the feature, or NULL if the mask is not a feature.
+ */
+
+const char *OSM_feature_name(unsigned int feature) {
+    for (int i = 0; i < OSM_NUM_FEATURES; i++) {
+        if (feature == 1u << i)
+            return feature_names[i];
+    }
+    return NULL;
+}
+
+/*
+ * Collect the features in the repeated string field of a HeaderBlock with
+ * the specified number into a mask.  Unknown features are ignored unless
+ * they are required, in which case the block is rejected.
+ */
+
+static int decode_features(PB_Message header, int field, unsigned int *featuresp) {
+    for (PB_Field *fp = PB_next_field(header, field, LEN_TYPE, FORWARD_DIR); fp != NULL;
+         fp = PB_next_field(fp, field, LEN_TYPE, FORWARD_DIR)) {
+        int i;
+        for (i = 0; i < OSM_NUM_FEATURES; i++) {
+            if (PB_field_equals(fp, feature_names[i]))
+                break;
+        }
+        if (i < OSM_NUM_FEATURES) {
+            *featuresp |= 1u << i;
+        } else if (field == 4) {
+            fprintf(stderr, "Unsupported required feature: %.*s\n",
+                    (int)fp->value.bytes.size, fp->value.bytes.buf);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int decode_header_block(OSM_Block *bp, PB_Message header) {
+    if (decode_features(header, 4, &bp->required_features) ||
+        decode_features(header, 5, &bp->optional_features))
+        return -1;
+
+    PB_Field *bbox_field = PB_get_field(header, 1, LEN_TYPE);
+    if (bbox_field == NULL) return 0;
+
+    PB_Message bbox = NULL;
+    if (PB_read_embedded_message(bbox_field->value.bytes.buf, bbox_field->value.bytes.size, &bbox) < 0)
+        return -1;
+    if (bbox == NULL) return 0;
+
+    PB_Field *left = PB_get_field(bbox, 1, VARINT_TYPE);
+    PB_Field *right = PB_get_field(bbox, 2, VARINT_TYPE);
+    PB_Field *top = PB_get_field(bbox, 3, VARINT_TYPE);
+    PB_Field *bottom = PB_get_field(bbox, 4, VARINT_TYPE);
+    if (left && right && top && bottom) {
+        bp->min_lon = PB_zigzag_decode(left->value.i64);
+        bp->max_lon = PB_zigzag_decode(right->value.i64);
+        bp->max_lat = PB_zigzag_decode(top->value.i64);
+        bp->min_lat = PB_zigzag_decode(bottom->value.i64);
+        bp->has_bbox = 1;
+    }
+    PB_free_message(bbox);
+    return 0;
+}
+
+/* Take ownership of the buffer of a LEN_TYPE field. */
+
+static char *steal_bytes(PB_Field *fp, size_t *sizep) {
+    char *buf = fp->value.bytes.buf;
+    *sizep = fp->value.bytes.size;
+    fp->value.bytes.buf = NULL;
+    fp->value.bytes.size = 0;
+    return buf;
+}
+
+/*
+ * Read the length prefix and BlobHeader of a blob, filling in the type,
+ * offset and length of *bp and storing the size of the Blob message that
+ * follows in *datasizep.  Returns 1 if successful, 0 at the end of the
+ * input, and -1 in case of an error.
+ */
+
+static int read_blob_header(FILE *in, uint64_t offset, OSM_Blob *bp, size_t *datasizep) {
+    unsigned char buffer[4];
+    size_t n = fread(buffer, 1, 4, in);
+    if (n == 0) return 0;
+    if (n != 4) return -1;
+
+    size_t len = ((size_t)buffer[0] << 24) | (buffer[1] << 16) | (buffer[2] << 8) | buffer[3];
+    if (len > OSM_MAX_BLOB_HEADER_SIZE) {
+        fprintf(stderr, "Blob header at offset %lu too large (%zu bytes)\n", offset, len);
+        return -1;
+    }
+    PB_Message header = NULL;
+    if (PB_read_message(in, len, &header) != 1)
+        return -1;
+
+    PB_Field *type = PB_get_field(header, 1, LEN_TYPE);
+    PB_Field *datasize = PB_get_field(header, 3, VARINT_TYPE);
+    if (datasize == NULL || datasize->value.i64 < 0 || datasize->value.i64 > OSM_MAX_BLOB_SIZE) {
+        if (datasize != NULL)
+            fprintf(stderr, "Blob at offset %lu too large (%ld bytes)\n", offset, datasize->value.i64);
+        PB_free_message(header);
+        return -1;
+    }
+
+    memset(bp, 0, sizeof(OSM_Blob));
+    bp->offset = offset;
+    bp->length = 4 + len + datasize->value.i64;
+    if (PB_field_equals(type, "OSMHeader"))
+        bp->type = OSM_BLOB_HEADER;
+    else if (PB_field_equals(type, "OSMData"))
+        bp->type = OSM_BLOB_DATA;
+    else
+        bp->type = OSM_BLOB_UNKNOWN;
+    *datasizep = datasize->value.i64;
+    PB_free_message(header);
+    return 1;
+}
+
+/**
+ * @brief  Read the header of the next blob from an OSM PBF input stream
+ * and skip over its contents, seeking past them if the stream allows.
+ * @details  Only the type, offset and length of the blob are filled in;
+ * it has no data, but may still be passed to OSM_Blob_free().
+ *
+ * @param in  The input stream to read.
+ * @param offset  The offset in the file at which the blob starts.
+ * @param bp  The blob to be filled in.
+ * @return 1 if a blob was read, 0 at the end of the input, and -1 in case
+ * of an error.
+ */
+
+int OSM_skip_Blob(FILE *in, uint64_t offset, OSM_Blob *bp) {
+    size_t datasize;
+    int ret = read_blob_header(in, offset, bp, &datasize);
+    if (ret != 1) return ret;
+    if (fseeko(in, datasize, SEEK_CUR) == 0) return 1;
+
+    char buffer[4096];
+    while (datasize > 0) {
+        size_t n = datasize < sizeof(buffer) ? datasize : sizeof(buffer);
+        if (fread(buffer, 1, n, in) != n) return -1;
+        datasize -= n;
+    }
+    return 1;
+}
+
+/**
+ * @brief  Read the next blob from an OSM PBF input stream, without
+ * decompressing or decoding its contents.
+ *
+ * @param in  The input stream to read.
+ * @param offset  The offset in the file at which the blob starts, which
+ * is recorded in the blob.
+ * @param bp  Caller-supplied OSM_Blob structure to be initialized.
+ * @return 1 if a blob was read, 0 at end of file, and -1 in case of an error.
+ */
+
+int OSM_read_Blob(FILE *in, uint64_t offset, OSM_Blob *bp) {
+    size_t datasize;
+    int ret = read_blob_header(in, offset, bp, &datasize);
+    if (ret != 1) return ret;
+    PB_Message blob = NULL;
+    if (PB_read_message(in, datasize, &blob) != 1)
+        return -1;
+
+    PB_Field *raw = PB_get_field(blob, 1, LEN_TYPE);
+    PB_Field *raw_size = PB_get_field(blob, 2, VARINT_TYPE);
+    PB_Field *zlib_data = PB_get_field(blob, 3, LEN_TYPE);
+    if (raw != NULL) {
+        bp->data = steal_bytes(raw, &bp->size);
+        bp->raw_size = bp->size;
+    } else if (zlib_data != NULL) {
+        bp->data = steal_bytes(zlib_data, &bp->size);
+        bp->raw_size = raw_size ? raw_size->value.i64 : 0;
+        bp->zlib = 1;
+        if (bp->raw_size > OSM_MAX_BLOB_SIZE) {
+            fprintf(stderr, "Blob at offset %lu inflates to %zu bytes\n", offset, bp->raw_size);
+            ret = -1;
+        }
+    } else if (bp->type != OSM_BLOB_UNKNOWN) {
+        fprintf(stderr, "Unsupported blob compression\n");
+        ret = -1;
+    }
+    PB_free_message(blob);
+    return ret;
+}
+
+/**
+ * @brief  Free the payload of a blob read by OSM_read_Blob().
+ */
+
+void OSM_Blob_free(OSM_Blob *bp) {
+    if (bp == NULL) return;
+    free(bp->data);
+    bp->data = NULL;
+}
+
+/**
+ * @brief  Decompress and decode a blob into a new OSM_Block.
+ * @details  Only the entity types and attributes selected by the options
+ * are decoded, and with the history option the versions outside its time
+ * window are dropped.  This function uses no state other than its arguments
+ * and may be called concurrently for different blobs.
+ *
+ * @param bp  The blob to decode.
+ * @param op  Options selecting what is to be decoded.
+ * @return  The decoded block, or NULL in case of an error.
+ */
+
+OSM_Block *OSM_decode_Block(OSM_Blob *bp, const OSM_Options *op) {
+    OSM_Block *block = calloc(1, sizeof(OSM_Block));
+    if (block == NULL) return NULL;
+    block->type = bp->type;
+    block->offset = bp->offset;
+    if (bp->type == OSM_BLOB_UNKNOWN || bp->data == NULL)
+        return block;
+
+    PB_Message msg = NULL;
+    int ret = bp->zlib ? PB_inflate_embedded_message(bp->data, bp->size, &msg)
+                       : PB_read_embedded_message(bp->data, bp->size, &msg);
+    if (ret < 0) {
+        fprintf(stderr, "Unable to decode blob at offset %lu\n", (unsigned long)bp->offset);
+        OSM_Block_free(block);
+        return NULL;
+    }
+    if (msg == NULL)
+        return block;
+
+    if (bp->type == OSM_BLOB_HEADER)
+        ret = decode_header_block(block, msg);
+    else
+        ret = decode_primitive_block(block, op, msg);
+    PB_free_message(msg);
+    if (ret == 0 && op->history && (op->history_from || op->history_until))
+        ret = apply_history_window(block, op);
+
+    if (ret) {
+        OSM_Block_free(block);
+        return NULL;
+    }
+    return block;
+}
+
+/**
+ * @brief  Read and decode the blob at a known offset of a seekable input,
+ * such as one recorded in an earlier pass over the file.
+ *
+ * @param in  The input stream, which is repositioned.
+ * @param offset  The offset of the blob in the file.
+ * @param op  Options selecting what is to be decoded.
+ * @return  The decoded block, or NULL in case of an error.
+ */
+
+OSM_Block *OSM_read_Block_at(FILE *in, uint64_t offset, const OSM_Options *op) {
+    OSM_Blob blob;
+    if (fseeko(in, offset, SEEK_SET) != 0 || OSM_read_Blob(in, offset, &blob) != 1)
+        return NULL;
+    OSM_Block *bp = OSM_decode_Block(&blob, op);
+    OSM_Blob_free(&blob);
+    return bp;
+}
+
+static void free_block_tags(OSM_BlockTags *tp) {
+    free(tp->start);
+    free(tp->keys);
+    free(tp->vals);
+}
+
+static void free_block_info(OSM_BlockInfo *ip) {
+    free(ip->versions);
+    free(ip->timestamps);
+    free(ip->visible);
+}
+
+/**
+ * @brief  Free a block returned by OSM_decode_Block().
+ */
+
+void OSM_Block_free(OSM_Block *bp) {
+    if (bp == NULL) return;
+    if (bp->num_strings > 0)
+        free(bp->strings[0]);
+    free(bp->strings);
+    free(bp->string_lens);
+    free(bp->node_ids);
+    free(bp->node_lats);
+    free(bp->node_lons);
+    free_block_tags(&bp->node_tags);
+    free_block_info(&bp->node_info);
+    free(bp->way_ids);
+    free(bp->way_ref_start);
+    free(bp->way_ref_lats);
+    free(bp->way_ref_lons);
+    free(bp->way_refs);
+    free_block_tags(&bp->way_tags);
+    free_block_info(&bp->way_info);
+    free(bp->relation_ids);
+    free(bp->member_start);
+    free(bp->member_ids);
+    free(bp->member_types);
+    free(bp);
+}
+
+/**
+ * @brief  Append a node to a block under construction, for producers of
+ * blocks other than the decoder.
+ * @details  The node initially has no tags; OSM_Block_add_tag() appends them.
+ *
+ * @param bp  The block.
+ * @param op  Options; metadata is stored only if op->metadata or op->history is set.
+ * @return 0 if successful, -1 if memory could not be allocated.
+ */
+
+int OSM_Block_add_Node(OSM_Block *bp, const OSM_Options *op, OSM_Id id, OSM_Lat lat,
+                       OSM_Lon lon, int32_t version, int64_t timestamp) {
+    if (reserve_nodes(bp, op, 1)) return -1;
+    int index = bp->num_nodes++;
+    bp->node_ids[index] = id;
+    bp->node_lats[index] = lat;
+    bp->node_lons[index] = lon;
+    if (wants_metadata(op)) {
+        bp->node_info.versions[index] = version;
+        bp->node_info.timestamps[index] = timestamp;
+        bp->node_info.visible[index] = 1;
+    }
+    bp->node_tags.start[index] = bp->node_tags.start[index + 1] = bp->node_tags.count;
+    return 0;
+}
+
+/**
+ * @brief  Append a way with the specified refs to a block under
+ * construction, as for OSM_Block_add_Node().
+ * @details  lats and lons give the locations of the refs, or are NULL if
+ * they are not known, in which case the block keeps no way locations.
+ */
+
+int OSM_Block_add_Way(OSM_Block *bp, const OSM_Options *op, OSM_Id id, const OSM_Id *refs,
+                      const OSM_Lat *lats, const OSM_Lon *lons,
+                      int num_refs, int32_t version, int64_t timestamp) {
+    if (reserve_ways(bp, op, 1) || reserve_refs(bp, num_refs)) return -1;
+    if (num_refs > 0) {
+        int ret = 0;
+        if (lats == NULL || lons == NULL)
+            drop_way_locations(bp);
+        else if ((ret = want_way_locations(bp)) < 0)
+            return -1;
+        if (ret == 1) {
+            memcpy(bp->way_ref_lats + bp->num_refs, lats, num_refs * sizeof(OSM_Lat));
+            memcpy(bp->way_ref_lons + bp->num_refs, lons, num_refs * sizeof(OSM_Lon));
+        }
+    }
+    int index = bp->num_ways++;
+    bp->way_ids[index] = id;
+    if (num_refs > 0)
+        memcpy(bp->way_refs + bp->num_refs, refs, num_refs * sizeof(OSM_Id));
+    bp->way_ref_start[index] = bp->num_refs;
+    bp->num_refs += num_refs;
+    bp->way_ref_start[index + 1] = bp->num_refs;
+    if (wants_metadata(op)) {
+        bp->way_info.versions[index] = version;
+        bp->way_info.timestamps[index] = timestamp;
+        bp->way_info.visible[index] = 1;
+    }
+    bp->way_tags.start[index] = bp->way_tags.start[index + 1] = bp->way_tags.count;
+    return 0;
+}
+
+/**
+ * @brief  Append a tag to the node or way most recently added to a block.
+ *
+ * @param bp  The block.
+ * @param type  OSM_TYPE_NODE or OSM_TYPE_WAY.
+ * @param key  Index of the key in the string table that the block will have.
+ * @param val  Index of the value in that string table.
+ * @return 0 if successful, -1 if memory could not be allocated.
+ */
+
+int OSM_Block_add_tag(OSM_Block *bp, unsigned int type, uint32_t key, uint32_t val) {
+    OSM_BlockTags *tp = type == OSM_TYPE_NODE ? &bp->node_tags : &bp->way_tags;
+    int num = type == OSM_TYPE_NODE ? bp->num_nodes : bp->num_ways;
+    if (reserve_tags(tp, 1)) return -1;
+    tp->keys[tp->count] = key;
+    tp->vals[tp->count] = val;
+    tp->count++;
+    tp->start[num] = tp->count;
+    return 0;
+}
+
+/**
+ * @brief  Set the string table of a block under construction to the
+ * strings of a pool, so that string ids in the pool index the table.
+ *
+ * @param bp  The block, which must not yet have a string table.
+ * @param sp  The pool, which is not modified.
+ * @return 0 if successful, -1 if memory could not be allocated.
+ */
+
+int OSM_Block_set_strings(OSM_Block *bp, SP_Pool *sp) {
+    size_t count = SP_count(sp);
+    if (count == 0) return 0;
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++)
+        total += strlen(SP_get(sp, i)) + 1;
+    bp->strings = malloc(count * sizeof(char *));
+    bp->string_lens = malloc(count * sizeof(uint32_t));
+    char *buf = malloc(total);
+    if (bp->strings == NULL || bp->string_lens == NULL || buf == NULL) {
+        free(buf);
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        char *str = SP_get(sp, i);
+        size_t len = strlen(str);
+        memcpy(buf, str, len + 1);
+        bp->strings[i] = buf;
+        bp->string_lens[i] = len;
+        buf += len + 1;
+    }
+    bp->num_strings = count;
+    return 0;
+}
@@ -0,0 +1,328 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "osmcache.h"
+#include "osmblock.h"
+#include "debug.h"
+
+/*
+ * An entry file holds the magic bytes, the length of the key as 4 bytes
+ * and the key, then the length of the result as 8 bytes and the result,
+ * with the lengths little-endian.  Temporary files are named after their
+ * entry with the pid of the writer and TEMP_SUFFIX appended, and those
+ * left behind by a writer that failed are removed once they are older
+ * than STALE_TEMP_SECONDS.
+ */
+
+#define ENTRY_MAGIC         "OSMCACHE"
+#define TEMP_SUFFIX         ".tmp"
+#define STALE_TEMP_SECONDS  600
+
+/*
+ * A 128-bit hash from two lanes, FNV-1a and a multiply-xorshift, which
+ * unlike two FNV-1a lanes with different seeds do not collide together.
+ */
+
+typedef struct Hash {
+    uint64_t a;
+    uint64_t b;
+} Hash;
+
+typedef struct CacheFile {
+    char *name;
+    uint64_t size;
+    struct timespec used;
+} CacheFile;
+
+static uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static void hash_init(Hash *hp) {
+    hp->a = 0xcbf29ce484222325ULL;
+    hp->b = 0x9e3779b97f4a7c15ULL;
+}
+
+static void hash_update(Hash *hp, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        hp->a = (hp->a ^ p[i]) * 0x100000001b3ULL;
+        hp->b = (hp->b ^ p[i]) * 0xbf58476d1ce4e5b9ULL;
+        hp->b ^= hp->b >> 29;
+    }
+}
+
+static void hash_u64(Hash *hp, uint64_t v) {
+    unsigned char bytes[8];
+    for (int i = 0; i < 8; i++)
+        bytes[i] = v >> (8 * i);
+    hash_update(hp, bytes, sizeof(bytes));
+}
+
+static void hash_hex(const Hash *hp, char *hex) {
+    snprintf(hex, OSM_CACHE_FINGERPRINT_LEN + 1, "%016llx%016llx",
+             (unsigned long long)mix64(hp->a), (unsigned long long)mix64(hp->b ^ hp->a));
+}
+
+/**
+ * @brief  Compute the fingerprint of an OSM PBF file from its BlobHeaders.
+ * @details  The file is read from the start, seeking past the blobs, and
+ * left positioned at the start again.  Files whose blobs all have the same
+ * types and sizes share a fingerprint, which is why a cache keyed by it
+ * must only be used for files that are replaced rather than edited in
+ * place with blobs of the same sizes.
+ *
+ * @param in  The input file, which must be seekable.
+ * @param fingerprint  A buffer of OSM_CACHE_FINGERPRINT_LEN + 1 characters
+ * to which the fingerprint is written as a hex string.
+ * @return 0 if successful, -1 in case of an error.
+ */
+
+int OSM_Cache_fingerprint(FILE *in, char *fingerprint) {
+    if (fseeko(in, 0, SEEK_SET) != 0) {
+        fprintf(stderr, "Cannot fingerprint an input that is not seekable\n");
+        return -1;
+    }
+    Hash h;
+    hash_init(&h);
+    uint64_t offset = 0;
+    OSM_Blob blob;
+    int ret;
+    while ((ret = OSM_skip_Blob(in, offset, &blob)) == 1) {
+        hash_u64(&h, blob.type);
+        hash_u64(&h, blob.offset);
+        hash_u64(&h, blob.length);
+        offset += blob.length;
+        OSM_Blob_free(&blob);
+    }
+    hash_u64(&h, offset);
+    if (ret < 0 || fseeko(in, 0, SEEK_SET) != 0) {
+        fprintf(stderr, "Cannot fingerprint the input: unable to read its blobs\n");
+        return -1;
+    }
+    hash_hex(&h, fingerprint);
+    return 0;
+}
+
+/* The path of the entry of a key, with a suffix, to be freed by the caller */
+
+static char *entry_path(const char *dir, const char *key, const char *suffix) {
+    Hash h;
+    hash_init(&h);
+    hash_update(&h, key, strlen(key));
+    char hex[OSM_CACHE_FINGERPRINT_LEN + 1];
+    hash_hex(&h, hex);
+    size_t len = strlen(dir) + 1 + OSM_CACHE_FINGERPRINT_LEN + strlen(suffix) + 1;
+    char *path = malloc(len);
+    if (path != NULL)
+        snprintf(path, len, "%s/%s%s", dir, hex, suffix);
+    return path;
+}
+
+static int read_le(FILE *f, uint64_t *vp, int size) {
+    unsigned char bytes[8];
+    if (fread(bytes, 1, size, f) != (size_t)size) return -1;
+    *vp = 0;
+    for (int i = size - 1; i >= 0; i--)
+        *vp = *vp << 8 | bytes[i];
+    return 0;
+}
+
+static int write_le(FILE *f, uint64_t v, int size) {
+    unsigned char bytes[8];
+    for (int i = 0; i < size; i++)
+        bytes[i] = v >> (8 * i);
+    return fwrite(bytes, 1, size, f) == (size_t)size ? 0 : -1;
+}
+
+/*
+ * Read the result of an entry if it holds exactly the key, returning 1 if
+ * it does, 0 if it holds another or is malformed, and -1 in case of an
+ * error.
+ */
+
+static int read_entry(FILE *f, const char *key, char **datap, size_t *sizep) {
+    char magic[sizeof(ENTRY_MAGIC) - 1];
+    uint64_t key_len, size;
+    size_t len = strlen(key);
+    if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) ||
+        memcmp(magic, ENTRY_MAGIC, sizeof(magic)) != 0 ||
+        read_le(f, &key_len, 4) != 0 || key_len != len)
+        return 0;
+    char *stored = malloc(len + 1);
+    if (stored == NULL) return -1;
+    int same = fread(stored, 1, len, f) == len && memcmp(stored, key, len) == 0;
+    free(stored);
+    if (!same || read_le(f, &size, 8) != 0 || size > SIZE_MAX - 1)
+        return 0;
+    char *data = malloc(size + 1);
+    if (data == NULL) return -1;
+    if (fread(data, 1, size, f) != size || fgetc(f) != EOF) {
+        free(data);
+        return 0;
+    }
+    *datap = data;
+    *sizep = size;
+    return 1;
+}
+
+/**
+ * @brief  Look up the result stored under a key in a cache directory.
+ * @details  A hit marks the entry as the most recently used.
+ *
+ * @param dir  The cache directory.
+ * @param key  The key.
+ * @param datap  Set to the result, to be freed by the caller, on a hit.
+ * @param sizep  Set to the size of the result on a hit.
+ * @return 1 on a hit, 0 on a miss, and -1 in case of an error.
+ */
+
+int OSM_Cache_get(const char *dir, const char *key, char **datap, size_t *sizep) {
+    char *path = entry_path(dir, key, OSM_CACHE_SUFFIX);
+    if (path == NULL) return -1;
+    FILE *f = fopen(path, "rb");
+    int ret = 0;
+    if (f != NULL) {
+        ret = read_entry(f, key, datap, sizep);
+        fclose(f);
+        if (ret == 1)
+            utime(path, NULL);
+    }
+    free(path);
+    return ret;
+}
+
+/* Least recently used first */
+
+static int compare_files(const void *a, const void *b) {
+    const struct timespec *x = &((const CacheFile *)a)->used, *y = &((const CacheFile *)b)->used;
+    if (x->tv_sec != y->tv_sec)
+        return x->tv_sec < y->tv_sec ? -1 : 1;
+    return (x->tv_nsec > y->tv_nsec) - (x->tv_nsec < y->tv_nsec);
+}
+
+static int has_suffix(const char *name, const char *suffix) {
+    size_t len = strlen(name), n = strlen(suffix);
+    return len > n && strcmp(name + len - n, suffix) == 0;
+}
+
+/*
+ * Remove stale temporary files, and the least recently used entries until
+ * the entries total at most max_bytes.  Files that another process has
+ * already removed are skipped.
+ */
+
+static int evict(const char *dir, uint64_t max_bytes) {
+    DIR *dp = opendir(dir);
+    if (dp == NULL) return -1;
+    size_t count = 0, cap = 64;
+    uint64_t total = 0;
+    CacheFile *files = malloc(cap * sizeof(CacheFile));
+    int ret = files != NULL ? 0 : -1;
+    time_t now = time(NULL);
+    struct dirent *de;
+    while (ret == 0 && (de = readdir(dp)) != NULL) {
+        int entry = has_suffix(de->d_name, OSM_CACHE_SUFFIX);
+        if (!entry && !has_suffix(de->d_name, TEMP_SUFFIX))
+            continue;
+        size_t len = strlen(dir) + 1 + strlen(de->d_name) + 1;
+        char *path = malloc(len);
+        struct stat st;
+        if (path == NULL) {
+            ret = -1;
+            break;
+        }
+        snprintf(path, len, "%s/%s", dir, de->d_name);
+        if (stat(path, &st) != 0) {
+            free(path);
+        } else if (!entry) {
+            if (now - st.st_mtime > STALE_TEMP_SECONDS)
+                unlink(path);
+            free(path);
+        } else {
+            if (count == cap) {
+                CacheFile *grown = realloc(files, 2 * cap * sizeof(CacheFile));
+                if (grown == NULL) {
+                    free(path);
+                    ret = -1;
+                    break;
+                }
+                files = grown;
+                cap *= 2;
+            }
+            files[count++] = (CacheFile){ path, st.st_size, st.st_mtim };
+            total += st.st_size;
+        }
+    }
+    closedir(dp);
+
+    if (ret == 0 && total > max_bytes) {
+        qsort(files, count, sizeof(CacheFile), compare_files);
+        for (size_t i = 0; i < count && total > max_bytes; i++) {
+            if (unlink(files[i].name) == 0 || errno == ENOENT)
+                total -= files[i].size;
+        }
+    }
+    for (size_t i = 0; i < count; i++)
+        free(files[i].name);
+    free(files);
+    return ret;
+}
+
+/**
+ * @brief  Store a result under a key in a cache directory, which is
+ * created if it does not exist, then evict entries to keep the directory
+ * within its size bound.
+ * @details  An entry for the same key written concurrently by another
+ * process is replaced whole, never mixed with this one.
+ *
+ * @param dir  The cache directory.
+ * @param key  The key.
+ * @param data  The result.
+ * @param size  The size of the result.
+ * @param max_bytes  The bound on the total size of the entries.
+ * @return 0 if successful, -1 in case of an error.
+ */
+
+int OSM_Cache_put(const char *dir, const char *key, const char *data, size_t size, uint64_t max_bytes) {
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Cannot create the cache directory %s\n", dir);
+        return -1;
+    }
+    char suffix[64];
+    snprintf(suffix, sizeof(suffix), "%s.%ld%s", OSM_CACHE_SUFFIX, (long)getpid(), TEMP_SUFFIX);
+    char *path = entry_path(dir, key, OSM_CACHE_SUFFIX);
+    char *temp = entry_path(dir, key, suffix);
+    int ret = -1;
+    FILE *f = temp != NULL ? fopen(temp, "wb") : NULL;
+    if (f != NULL) {
+        size_t len = strlen(key);
+        int ok = fwrite(ENTRY_MAGIC, 1, sizeof(ENTRY_MAGIC) - 1, f) == sizeof(ENTRY_MAGIC) - 1 &&
+                 write_le(f, len, 4) == 0 && fwrite(key, 1, len, f) == len &&
+                 write_le(f, size, 8) == 0 && fwrite(data, 1, size, f) == size;
+        if (fclose(f) == 0 && ok && rename(temp, path) == 0)
+            ret = 0;
+        else
+            remove(temp);
+    }
+    if (ret != 0)
+        fprintf(stderr, "Cannot write to the cache directory %s\n", dir);
+    else
+        ret = evict(dir, max_bytes);
+    free(path);
+    free(temp);
+    return ret;
+}
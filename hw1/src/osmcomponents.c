@@ -0,0 +1,291 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "osmcomponents.h"
+#include "osmmap.h"
+#include "debug.h"
+
+/*
+ * Node ids are inserted into an open-addressing table by compare-and-swap
+ * on the slot, and the index of a node's slot is its dense index.  The
+ * union-find parent of each slot starts as the slot itself; roots are
+ * linked only to smaller indices, so that concurrent unions cannot form a
+ * cycle, and finds halve the paths they follow with compare-and-swap.
+ */
+
+#define EMPTY_SLOT  INT64_MIN
+
+typedef struct ComponentJob {
+    OSM_Map *map;
+    OSM_Filter *filter;
+    OSM_Id *slots;
+    uint64_t *parent;
+    uint64_t mask;
+    uint64_t *way_roots;        // Slot of the root of each way, after the unions
+    size_t next;                // Next batch of ways to be claimed
+} ComponentJob;
+
+typedef struct ComponentSize {
+    size_t way_count;
+    uint32_t component;
+} ComponentSize;
+
+static uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static uint64_t insert_node(ComponentJob *jp, OSM_Id id) {
+    uint64_t h = mix64((uint64_t)id) & jp->mask;
+    for (;;) {
+        OSM_Id cur = __atomic_load_n(&jp->slots[h], __ATOMIC_ACQUIRE);
+        if (cur == id)
+            return h;
+        if (cur == EMPTY_SLOT) {
+            OSM_Id expected = EMPTY_SLOT;
+            if (__atomic_compare_exchange_n(&jp->slots[h], &expected, id, 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                return h;
+            if (expected == id)
+                return h;
+        }
+        h = (h + 1) & jp->mask;
+    }
+}
+
+static uint64_t find_root(uint64_t *parent, uint64_t x) {
+    for (;;) {
+        uint64_t p = __atomic_load_n(&parent[x], __ATOMIC_ACQUIRE);
+        if (p == x)
+            return x;
+        uint64_t gp = __atomic_load_n(&parent[p], __ATOMIC_ACQUIRE);
+        if (gp != p)
+            __atomic_compare_exchange_n(&parent[x], &p, gp, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+        x = gp;
+    }
+}
+
+static void unite(uint64_t *parent, uint64_t a, uint64_t b) {
+    for (;;) {
+        a = find_root(parent, a);
+        b = find_root(parent, b);
+        if (a == b)
+            return;
+        uint64_t hi = a > b ? a : b, lo = a > b ? b : a;
+        if (__atomic_compare_exchange_n(&parent[hi], &hi, lo, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            return;
+    }
+}
+
+/*
+ * Claim batches of ways and run one pass over each of their selected
+ * ways: pass 0 inserts their nodes and unites them, pass 1 records the
+ * root of the first node of each way.
+ */
+
+static void component_pass(ComponentJob *jp, int pass) {
+    OSM_Map *mp = jp->map;
+    uint16_t sel[OSM_BATCH_SIZE];
+    for (;;) {
+        size_t first = __atomic_fetch_add(&jp->next, OSM_BATCH_SIZE, __ATOMIC_RELAXED);
+        if (first >= mp->num_ways)
+            break;
+        size_t count = mp->num_ways - first < OSM_BATCH_SIZE ? mp->num_ways - first : OSM_BATCH_SIZE;
+        size_t n = count;
+        if (jp->filter != NULL)
+            n = OSM_Filter_select(jp->filter, OSM_TYPE_WAY, first, count, sel);
+        else
+            for (size_t i = 0; i < count; i++)
+                sel[i] = i;
+
+        for (size_t s = 0; s < n; s++) {
+            size_t w = first + sel[s];
+            size_t start = mp->way_ref_start[w], end = mp->way_ref_start[w + 1];
+            if (start == end)
+                continue;
+            uint64_t head = insert_node(jp, mp->way_refs[start]);
+            if (pass == 0) {
+                for (size_t r = start + 1; r < end; r++)
+                    unite(jp->parent, head, insert_node(jp, mp->way_refs[r]));
+            } else {
+                jp->way_roots[w] = find_root(jp->parent, head);
+            }
+        }
+    }
+}
+
+static void *pass0_worker(void *arg) {
+    component_pass(arg, 0);
+    return NULL;
+}
+
+static void *pass1_worker(void *arg) {
+    component_pass(arg, 1);
+    return NULL;
+}
+
+static void run_pass(ComponentJob *jp, int threads, void *(*worker)(void *)) {
+    pthread_t tids[threads];
+    int started = 0;
+    jp->next = 0;
+    for (int t = 1; t < threads; t++) {
+        if (pthread_create(&tids[t], NULL, worker, jp) != 0)
+            break;
+        started++;
+    }
+    worker(jp);
+    for (int t = 1; t <= started; t++)
+        pthread_join(tids[t], NULL);
+}
+
+/* Components by decreasing number of ways, then by their first way */
+
+static int compare_components(const void *a, const void *b) {
+    const ComponentSize *x = a, *y = b;
+    if (x->way_count != y->way_count)
+        return x->way_count < y->way_count ? 1 : -1;
+    return (x->component > y->component) - (x->component < y->component);
+}
+
+/*
+ * Number the roots of the ways into components in order of their first
+ * way, count the ways and nodes of each, and renumber them by size.
+ */
+
+static int label_components(ComponentJob *jp, size_t num_slots, OSM_Components *cp) {
+    size_t num_ways = jp->map->num_ways;
+    uint32_t *root_components = malloc(num_slots * sizeof(uint32_t));
+    size_t cap = 64;
+    cp->way_counts = calloc(cap, sizeof(size_t));
+    if (root_components == NULL || cp->way_counts == NULL) {
+        free(root_components);
+        return -1;
+    }
+    memset(root_components, 0xff, num_slots * sizeof(uint32_t));
+
+    for (size_t w = 0; w < num_ways; w++) {
+        if (jp->way_roots[w] == UINT64_MAX) continue;
+        uint32_t *rcp = &root_components[jp->way_roots[w]];
+        if (*rcp == OSM_COMPONENT_NONE) {
+            if (cp->num_components == cap) {
+                size_t *counts = realloc(cp->way_counts, 2 * cap * sizeof(size_t));
+                if (counts == NULL) {
+                    free(root_components);
+                    return -1;
+                }
+                memset(counts + cap, 0, cap * sizeof(size_t));
+                cp->way_counts = counts;
+                cap *= 2;
+            }
+            *rcp = cp->num_components++;
+        }
+        cp->way_components[w] = *rcp;
+        cp->way_counts[*rcp]++;
+    }
+
+    size_t nc = cp->num_components;
+    ComponentSize *order = malloc((nc + 1) * sizeof(ComponentSize));
+    uint32_t *rank = malloc((nc + 1) * sizeof(uint32_t));
+    size_t *way_counts = malloc((nc + 1) * sizeof(size_t));
+    size_t *node_counts = calloc(nc + 1, sizeof(size_t));
+    if (order == NULL || rank == NULL || way_counts == NULL || node_counts == NULL) {
+        free(order);
+        free(rank);
+        free(way_counts);
+        free(node_counts);
+        free(root_components);
+        return -1;
+    }
+    for (size_t c = 0; c < nc; c++)
+        order[c] = (ComponentSize){ cp->way_counts[c], c };
+    qsort(order, nc, sizeof(ComponentSize), compare_components);
+    for (size_t c = 0; c < nc; c++) {
+        rank[order[c].component] = c;
+        way_counts[c] = order[c].way_count;
+    }
+    for (size_t w = 0; w < num_ways; w++) {
+        if (cp->way_components[w] != OSM_COMPONENT_NONE)
+            cp->way_components[w] = rank[cp->way_components[w]];
+    }
+    for (size_t s = 0; s < num_slots; s++) {
+        if (jp->slots[s] == EMPTY_SLOT) continue;
+        uint32_t c = root_components[find_root(jp->parent, s)];
+        if (c != OSM_COMPONENT_NONE)
+            node_counts[rank[c]]++;
+    }
+    free(cp->way_counts);
+    cp->way_counts = way_counts;
+    cp->node_counts = node_counts;
+    free(order);
+    free(rank);
+    free(root_components);
+    return 0;
+}
+
+/**
+ * @brief  Find the connected components of the ways of a map.
+ * @details  Only the ways selected by the filter, if there is one, are
+ * considered, and a way without refs is in no component.  A node that no
+ * way in the map references does not count, so an extract whose ways are
+ * cut at its boundary may show more components than the full network.
+ *
+ * @param mp  The map.
+ * @param fp  A filter compiled against the map, or NULL for all ways.
+ * @param threads  The number of threads to use.
+ * @param cp  The components to be filled in, to be freed with
+ * OSM_Components_free().
+ * @return 0 if successful, -1 in case of an error.
+ */
+
+int OSM_Map_way_components(OSM_Map *mp, OSM_Filter *fp, int threads, OSM_Components *cp) {
+    memset(cp, 0, sizeof(OSM_Components));
+    if (mp == NULL) return -1;
+    if (threads < 1) threads = 1;
+
+    uint64_t num_slots = 64;
+    while (num_slots < mp->num_refs + mp->num_refs / 2)
+        num_slots *= 2;
+    ComponentJob job = { mp, fp, NULL, NULL, num_slots - 1, NULL, 0 };
+    job.slots = malloc(num_slots * sizeof(OSM_Id));
+    job.parent = malloc(num_slots * sizeof(uint64_t));
+    job.way_roots = malloc((mp->num_ways + 1) * sizeof(uint64_t));
+    cp->num_ways = mp->num_ways;
+    cp->way_components = malloc((mp->num_ways + 1) * sizeof(uint32_t));
+    int ret = -1;
+    if (job.slots != NULL && job.parent != NULL && job.way_roots != NULL && cp->way_components != NULL) {
+        for (uint64_t s = 0; s < num_slots; s++) {
+            job.slots[s] = EMPTY_SLOT;
+            job.parent[s] = s;
+        }
+        memset(job.way_roots, 0xff, (mp->num_ways + 1) * sizeof(uint64_t));
+        memset(cp->way_components, 0xff, (mp->num_ways + 1) * sizeof(uint32_t));
+        run_pass(&job, threads, pass0_worker);
+        run_pass(&job, threads, pass1_worker);
+        ret = label_components(&job, num_slots, cp);
+    }
+    free(job.slots);
+    free(job.parent);
+    free(job.way_roots);
+    if (ret != 0)
+        OSM_Components_free(cp);
+    return ret;
+}
+
+/**
+ * @brief  Free the arrays of components filled in by OSM_Map_way_components().
+ */
+
+void OSM_Components_free(OSM_Components *cp) {
+    if (cp == NULL) return;
+    free(cp->way_components);
+    free(cp->way_counts);
+    free(cp->node_counts);
+    memset(cp, 0, sizeof(OSM_Components));
+}
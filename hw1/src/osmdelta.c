@@ -0,0 +1,1142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include <zlib.h>
+
+#include "osmdelta.h"
+#include "osmepoch.h"
+#include "osmmap.h"
+#include "osmblock.h"
+#include "strpool.h"
+#include "debug.h"
+
+/*
+ * How often the compactor retries freeing retired views and maps while
+ * readers still hold them.
+ */
+
+#define RECLAIM_INTERVAL_MS     50
+
+#define MAX_ATTRS               16
+
+struct OSM_DeltaView {
+    OSM_Map *base;
+    OSM_Map **runs;             // Oldest first
+    int num_runs;
+    size_t num_nodes;           // Visible entities of the base and runs together
+    size_t num_ways;
+};
+
+struct OSM_Delta {
+    OSM_Options opts;           // For the bases built by compaction
+    void *view;                 // The OSM_DeltaView, published through epochs
+    OSM_Epochs *epochs;
+
+    pthread_mutex_t lock;       // Held to publish a view and to reclaim
+    pthread_cond_t cond;        // Signalled when a run is added, or to stop
+    int stop;
+    int failed_runs;            // Runs when compaction last failed, not retried
+    pthread_t compactor;
+    int has_compactor;
+
+    pthread_mutex_t apply_lock; // Serializes applies, for last_applied
+    pthread_mutex_t compact_lock;
+    char *last_applied;         // Name of the last file applied from the directory
+
+    char *dir;                  // Directory watched for change files
+    int inotify_fd;
+    int wake_fds[2];            // Written to stop the watcher
+    pthread_t watcher;
+};
+
+/*
+ * The changes of one file, in file order.  The refs of a way and the tags
+ * of a node or way are consecutive in refs and tags, where tags holds key
+ * and value ids in strings in pairs.
+ */
+
+typedef struct Change {
+    unsigned int type;          // OSM_TYPE_NODE or OSM_TYPE_WAY
+    int deleted;
+    OSM_Id id;
+    OSM_Lat lat;
+    OSM_Lon lon;
+    int32_t version;
+    int64_t timestamp;
+    size_t first_ref;
+    size_t num_refs;
+    size_t first_tag;
+    size_t num_tags;
+} Change;
+
+typedef struct ChangeSet {
+    Change *changes;
+    size_t count;
+    size_t cap;
+    OSM_Id *refs;
+    size_t num_refs;
+    size_t ref_cap;
+    uint32_t *tags;
+    size_t num_tags;
+    size_t tag_cap;
+    SP_Pool *strings;
+} ChangeSet;
+
+/* An overlay entity, at index in run */
+
+typedef struct OverlayEntry {
+    OSM_Id id;
+    int run;
+    size_t index;
+} OverlayEntry;
+
+/*
+ * Writes entities to a map under construction, in blocks of at most
+ * OSM_MERGE_BLOCK_SIZE entities.
+ */
+
+typedef struct Emitter {
+    OSM_Map *map;
+    OSM_Options opts;
+    OSM_Block *block;
+    SP_Pool *strings;
+    int error;
+} Emitter;
+
+static void free_view(void *ptr) {
+    OSM_DeltaView *vp = ptr;
+    free(vp->runs);
+    free(vp);
+}
+
+static void free_map(void *ptr) {
+    OSM_Map_free(ptr);
+}
+
+static int grow(void **arrp, size_t *capp, size_t count, size_t elem_size) {
+    if (count < *capp) return 0;
+    size_t cap = *capp ? 2 * *capp : 64;
+    void *arr = realloc(*arrp, cap * elem_size);
+    if (arr == NULL) return -1;
+    *arrp = arr;
+    *capp = cap;
+    return 0;
+}
+
+/* Read a change file, gzipped or not, into a null-terminated buffer */
+
+static char *read_change_file(const char *path) {
+    gzFile gz = gzopen(path, "rb");
+    if (gz == NULL) return NULL;
+    size_t len = 0, cap = 1 << 16;
+    char *text = malloc(cap);
+    int n = 0;
+    while (text != NULL && (n = gzread(gz, text + len, cap - len - 1)) > 0) {
+        len += n;
+        if (len + 1 == cap) {
+            char *grown = realloc(text, 2 * cap);
+            if (grown == NULL)
+                free(text);
+            text = grown;
+            cap *= 2;
+        }
+    }
+    gzclose(gz);
+    if (text == NULL || n < 0) {
+        free(text);
+        return NULL;
+    }
+    text[len] = '\0';
+    return text;
+}
+
+static void put_utf8(char **outp, unsigned long c) {
+    char *out = *outp;
+    if (c < 0x80) {
+        *out++ = c;
+    } else if (c < 0x800) {
+        *out++ = 0xc0 | c >> 6;
+        *out++ = 0x80 | (c & 0x3f);
+    } else if (c < 0x10000) {
+        *out++ = 0xe0 | c >> 12;
+        *out++ = 0x80 | (c >> 6 & 0x3f);
+        *out++ = 0x80 | (c & 0x3f);
+    } else {
+        *out++ = 0xf0 | c >> 18;
+        *out++ = 0x80 | (c >> 12 & 0x3f);
+        *out++ = 0x80 | (c >> 6 & 0x3f);
+        *out++ = 0x80 | (c & 0x3f);
+    }
+    *outp = out;
+}
+
+/* Replace the XML entity and character references in a string, in place */
+
+static void decode_entities(char *str) {
+    static const char *names[] = { "amp;", "lt;", "gt;", "quot;", "apos;" };
+    static const char chars[] = "&<>\"'";
+    char *out = str;
+    for (char *p = str; *p != '\0'; ) {
+        if (*p != '&') {
+            *out++ = *p++;
+            continue;
+        }
+        p++;
+        int done = 0;
+        for (int i = 0; i < 5 && !done; i++) {
+            size_t len = strlen(names[i]);
+            if (strncmp(p, names[i], len) == 0) {
+                *out++ = chars[i];
+                p += len;
+                done = 1;
+            }
+        }
+        if (!done && *p == '#') {
+            char *end;
+            unsigned long c = p[1] == 'x' ? strtoul(p + 2, &end, 16) : strtoul(p + 1, &end, 10);
+            if (*end == ';' && c > 0 && c <= 0x10ffff) {
+                put_utf8(&out, c);
+                p = end + 1;
+                done = 1;
+            }
+        }
+        if (!done)
+            *out++ = '&';
+    }
+    *out = '\0';
+}
+
+/* Parse a decimal number of degrees into nanodegrees */
+
+static int parse_degrees(const char *str, int64_t *nanop) {
+    const char *p = str;
+    int negative = *p == '-';
+    if (*p == '-' || *p == '+') p++;
+    int64_t units = 0;
+    int digits = 0, decimals = -1;
+    for (; *p != '\0'; p++) {
+        if (*p == '.' && decimals < 0) {
+            decimals = 0;
+        } else if (*p >= '0' && *p <= '9') {
+            digits++;
+            if (decimals < 0 && units > 1000) return -1;
+            if (decimals >= 9) continue;
+            units = 10 * units + (*p - '0');
+            if (decimals >= 0) decimals++;
+        } else {
+            return -1;
+        }
+    }
+    if (digits == 0) return -1;
+    for (int d = decimals < 0 ? 0 : decimals; d < 9; d++)
+        units *= 10;
+    *nanop = negative ? -units : units;
+    return 0;
+}
+
+static int64_t parse_timestamp(const char *str) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(str, "%4d-%2d-%2dT%2d:%2d:%2d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+               &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+        return 0;
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    return timegm(&tm);
+}
+
+static int name_is(const char *name, size_t len, const char *str) {
+    return strlen(str) == len && memcmp(name, str, len) == 0;
+}
+
+static const char *find_attr(char **attrs, int num_attrs, const char *name) {
+    for (int i = 0; i < num_attrs; i++) {
+        if (strcmp(attrs[2*i], name) == 0)
+            return attrs[2*i+1];
+    }
+    return NULL;
+}
+
+/*
+ * Add a node or way from its element's attributes, returning -1 in case
+ * of an error.  A deleted entity needs only its id.
+ */
+
+static int add_change(ChangeSet *cs, unsigned int type, int deleted, char **attrs, int num_attrs) {
+    const char *id = find_attr(attrs, num_attrs, "id");
+    const char *lat = find_attr(attrs, num_attrs, "lat");
+    const char *lon = find_attr(attrs, num_attrs, "lon");
+    const char *version = find_attr(attrs, num_attrs, "version");
+    const char *timestamp = find_attr(attrs, num_attrs, "timestamp");
+    if (id == NULL || grow((void **)&cs->changes, &cs->cap, cs->count, sizeof(Change)))
+        return -1;
+    Change *cp = &cs->changes[cs->count];
+    memset(cp, 0, sizeof(Change));
+    char *end;
+    cp->type = type;
+    cp->deleted = deleted;
+    cp->id = strtoll(id, &end, 10);
+    if (*id == '\0' || *end != '\0') return -1;
+    if (type == OSM_TYPE_NODE && !deleted &&
+        (lat == NULL || lon == NULL || parse_degrees(lat, &cp->lat) || parse_degrees(lon, &cp->lon)))
+        return -1;
+    cp->version = version != NULL ? atoi(version) : 0;
+    cp->timestamp = timestamp != NULL ? parse_timestamp(timestamp) : 0;
+    cp->first_ref = cs->num_refs;
+    cp->first_tag = cs->num_tags;
+    cs->count++;
+    return 0;
+}
+
+/*
+ * Parse the nodes and ways of an osmChange document, which is modified in
+ * place.  Elements other than create, modify and delete, the nodes and ways
+ * within them, and the nd and tag elements of those, are skipped.
+ */
+
+static int parse_changes(char *text, ChangeSet *cs) {
+    int action = -1;            // 0, 1 or 2 within create, modify or delete
+    int in_entity = 0;          // Set within the node or way last added
+    char *attrs[2 * MAX_ATTRS];
+    for (char *p = text; (p = strchr(p, '<')) != NULL; ) {
+        p++;
+        if (*p == '?' || *p == '!') {
+            const char *close = *p == '?' ? "?>" : strncmp(p, "!--", 3) == 0 ? "-->" : ">";
+            if ((p = strstr(p, close)) == NULL) return -1;
+            continue;
+        }
+        int closing = *p == '/';
+        if (closing) p++;
+        char *name = p;
+        size_t name_len = strcspn(p, " \t\r\n/>");
+        p += name_len;
+
+        int num_attrs = 0, self_closing = 0;
+        for (;;) {
+            p += strspn(p, " \t\r\n");
+            if (*p == '/' && p[1] == '>') {
+                self_closing = 1;
+                p += 2;
+                break;
+            }
+            if (*p == '>') {
+                p++;
+                break;
+            }
+            char *attr = p;
+            p += strcspn(p, "= \t\r\n/>");
+            char *attr_end = p;
+            p += strspn(p, " \t\r\n");
+            if (*p != '=' || attr == attr_end) return -1;
+            p++;
+            p += strspn(p, " \t\r\n");
+            char quote = *p;
+            if (quote != '"' && quote != '\'') return -1;
+            char *val = ++p;
+            if ((p = strchr(p, quote)) == NULL) return -1;
+            *p++ = '\0';
+            *attr_end = '\0';
+            decode_entities(val);
+            if (num_attrs < MAX_ATTRS) {
+                attrs[2*num_attrs] = attr;
+                attrs[2*num_attrs+1] = val;
+                num_attrs++;
+            }
+        }
+
+        if (name_is(name, name_len, "create") || name_is(name, name_len, "modify") ||
+            name_is(name, name_len, "delete")) {
+            action = closing || self_closing ? -1 : name[0] == 'c' ? 0 : name[0] == 'm' ? 1 : 2;
+        } else if (name_is(name, name_len, "node") || name_is(name, name_len, "way")) {
+            if (closing) {
+                in_entity = 0;
+            } else if (action >= 0) {
+                unsigned int type = name[0] == 'n' ? OSM_TYPE_NODE : OSM_TYPE_WAY;
+                if (add_change(cs, type, action == 2, attrs, num_attrs)) return -1;
+                in_entity = !self_closing;
+            }
+        } else if (in_entity && !closing && name_is(name, name_len, "nd")) {
+            const char *ref = find_attr(attrs, num_attrs, "ref");
+            if (ref == NULL || grow((void **)&cs->refs, &cs->ref_cap, cs->num_refs, sizeof(OSM_Id)))
+                return -1;
+            cs->refs[cs->num_refs++] = strtoll(ref, NULL, 10);
+            cs->changes[cs->count - 1].num_refs++;
+        } else if (in_entity && !closing && name_is(name, name_len, "tag")) {
+            const char *k = find_attr(attrs, num_attrs, "k");
+            const char *v = find_attr(attrs, num_attrs, "v");
+            if (k == NULL || v == NULL ||
+                grow((void **)&cs->tags, &cs->tag_cap, cs->num_tags + 1, 2 * sizeof(uint32_t)))
+                return -1;
+            uint32_t key = SP_intern(cs->strings, k, strlen(k));
+            uint32_t val = SP_intern(cs->strings, v, strlen(v));
+            if (key == SP_NONE || val == SP_NONE) return -1;
+            cs->tags[2 * cs->num_tags] = key;
+            cs->tags[2 * cs->num_tags + 1] = val;
+            cs->num_tags++;
+            cs->changes[cs->count - 1].num_tags++;
+        }
+    }
+    return 0;
+}
+
+/* By type, then id, then position in the file */
+
+static int compare_changes(const void *a, const void *b) {
+    const Change *x = *(const Change **)a, *y = *(const Change **)b;
+    if (x->type != y->type)
+        return x->type < y->type ? -1 : 1;
+    if (x->id != y->id)
+        return x->id < y->id ? -1 : 1;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Build the run of a set of changes: a map with metadata of the last
+ * change of each node and way, sorted by id, in which deletions are
+ * invisible.
+ */
+
+static OSM_Map *build_run(ChangeSet *cs) {
+    OSM_Options opts;
+    OSM_Options_init(&opts);
+    opts.metadata = 1;
+    Change **sorted = malloc((cs->count + 1) * sizeof(Change *));
+    OSM_Block *bp = calloc(1, sizeof(OSM_Block));
+    OSM_Map *run = OSM_Map_create(&opts);
+    int ret = sorted != NULL && bp != NULL && run != NULL ? 0 : -1;
+    for (size_t i = 0; i < cs->count && ret == 0; i++)
+        sorted[i] = &cs->changes[i];
+    if (ret == 0)
+        qsort(sorted, cs->count, sizeof(Change *), compare_changes);
+
+    bp->type = OSM_BLOB_DATA;
+    for (size_t i = 0; i < cs->count && ret == 0; i++) {
+        Change *cp = sorted[i];
+        if (i + 1 < cs->count && sorted[i+1]->type == cp->type && sorted[i+1]->id == cp->id)
+            continue;
+        if (cp->deleted)
+            cp->num_refs = cp->num_tags = 0;
+        if (cp->type == OSM_TYPE_NODE) {
+            ret = OSM_Block_add_Node(bp, &opts, cp->id, cp->lat, cp->lon, cp->version, cp->timestamp);
+            if (ret == 0)
+                bp->node_info.visible[bp->num_nodes - 1] = !cp->deleted;
+        } else {
+            ret = OSM_Block_add_Way(bp, &opts, cp->id, cs->refs + cp->first_ref, NULL, NULL,
+                                    cp->num_refs, cp->version, cp->timestamp);
+            if (ret == 0)
+                bp->way_info.visible[bp->num_ways - 1] = !cp->deleted;
+        }
+        for (size_t t = 0; t < cp->num_tags && ret == 0; t++) {
+            uint32_t *tag = cs->tags + 2 * (cp->first_tag + t);
+            ret = OSM_Block_add_tag(bp, cp->type, tag[0], tag[1]);
+        }
+    }
+    if (ret == 0 && (OSM_Block_set_strings(bp, cs->strings) || OSM_Map_add_Block(run, bp) ||
+                     OSM_Map_finish(run, &opts)))
+        ret = -1;
+    free(sorted);
+    OSM_Block_free(bp);
+    if (ret != 0) {
+        OSM_Map_free(run);
+        return NULL;
+    }
+    return run;
+}
+
+static OSM_Map *read_run(const char *path) {
+    char *text = read_change_file(path);
+    if (text == NULL) {
+        fprintf(stderr, "Cannot read the change file %s\n", path);
+        return NULL;
+    }
+    ChangeSet cs;
+    memset(&cs, 0, sizeof(cs));
+    OSM_Map *run = NULL;
+    if ((cs.strings = SP_create()) != NULL) {
+        if (parse_changes(text, &cs) != 0)
+            fprintf(stderr, "Cannot parse the change file %s\n", path);
+        else
+            run = build_run(&cs);
+    }
+    SP_free(cs.strings);
+    free(cs.changes);
+    free(cs.refs);
+    free(cs.tags);
+    free(text);
+    return run;
+}
+
+/**
+ * @brief  Find a node through the runs of a view and then its base.
+ *
+ * @param vp  The view.
+ * @param id  The id of the node.
+ * @return  The latest state of the node, or NULL if it does not exist or
+ * has been deleted.
+ */
+
+OSM_Node *OSM_DeltaView_find_Node(OSM_DeltaView *vp, OSM_Id id) {
+    for (int r = vp->num_runs - 1; r >= 0; r--) {
+        OSM_Node *np = OSM_Map_find_Node(vp->runs[r], id);
+        if (np != NULL)
+            return OSM_Node_is_visible(np) ? np : NULL;
+    }
+    return OSM_Map_find_Node(vp->base, id);
+}
+
+/**
+ * @brief  Find a way through the runs of a view and then its base, as for
+ * OSM_DeltaView_find_Node().
+ */
+
+OSM_Way *OSM_DeltaView_find_Way(OSM_DeltaView *vp, OSM_Id id) {
+    for (int r = vp->num_runs - 1; r >= 0; r--) {
+        OSM_Way *wp = OSM_Map_find_Way(vp->runs[r], id);
+        if (wp != NULL)
+            return OSM_Way_is_visible(wp) ? wp : NULL;
+    }
+    return OSM_Map_find_Way(vp->base, id);
+}
+
+/**
+ * @brief  Get the base map of a view, for what the runs do not change,
+ * such as the bounding box and features of the file.
+ */
+
+OSM_Map *OSM_DeltaView_get_base(OSM_DeltaView *vp) {
+    return vp->base;
+}
+
+/**
+ * @brief  Get the number of runs of a view, not yet compacted.
+ */
+
+int OSM_DeltaView_get_num_runs(OSM_DeltaView *vp) {
+    return vp->num_runs;
+}
+
+/**
+ * @brief  Get the number of nodes of a view, counting those of the base
+ * and runs that exist in their latest state.
+ */
+
+size_t OSM_DeltaView_get_num_nodes(OSM_DeltaView *vp) {
+    return vp->num_nodes;
+}
+
+/**
+ * @brief  Get the number of ways of a view, as for
+ * OSM_DeltaView_get_num_nodes().
+ */
+
+size_t OSM_DeltaView_get_num_ways(OSM_DeltaView *vp) {
+    return vp->num_ways;
+}
+
+/*
+ * Publish a view, with the lock held, and retire the one it replaces.
+ */
+
+static void publish_view(OSM_Delta *dp, OSM_DeltaView *vp) {
+    OSM_Epochs_retire(dp->epochs, OSM_Epochs_publish(dp->epochs, &dp->view, vp), free_view);
+}
+
+/* The latest entities of the runs, sorted by id */
+
+static OverlayEntry *overlay_entries(OSM_Map **runs, int num_runs, unsigned int type, size_t *countp) {
+    size_t count = 0;
+    for (int r = 0; r < num_runs; r++)
+        count += type == OSM_TYPE_NODE ? runs[r]->num_nodes : runs[r]->num_ways;
+    OverlayEntry *entries = malloc((count + 1) * sizeof(OverlayEntry));
+    if (entries == NULL) return NULL;
+    size_t n = 0;
+    for (int r = num_runs - 1; r >= 0; r--) {
+        size_t num = type == OSM_TYPE_NODE ? runs[r]->num_nodes : runs[r]->num_ways;
+        for (size_t i = 0; i < num; i++) {
+            OSM_Id id = type == OSM_TYPE_NODE ? OSM_Node_get_id(&runs[r]->nodes[i])
+                                              : OSM_Way_get_id(&runs[r]->ways[i]);
+            entries[n++] = (OverlayEntry){ id, r, i };
+        }
+    }
+    *countp = n;
+    return entries;
+}
+
+/* By id, then newest run first */
+
+static int compare_entries(const void *a, const void *b) {
+    const OverlayEntry *x = a, *y = b;
+    if (x->id != y->id)
+        return x->id < y->id ? -1 : 1;
+    return (x->run < y->run) - (x->run > y->run);
+}
+
+static void sort_entries(OverlayEntry *entries, size_t *countp) {
+    qsort(entries, *countp, sizeof(OverlayEntry), compare_entries);
+    size_t kept = 0;
+    for (size_t i = 0; i < *countp; i++) {
+        if (kept == 0 || entries[kept-1].id != entries[i].id)
+            entries[kept++] = entries[i];
+    }
+    *countp = kept;
+}
+
+static void emit_flush(Emitter *ep) {
+    if (ep->block != NULL && !ep->error &&
+        (OSM_Block_set_strings(ep->block, ep->strings) || OSM_Map_add_Block(ep->map, ep->block)))
+        ep->error = 1;
+    OSM_Block_free(ep->block);
+    SP_free(ep->strings);
+    ep->block = NULL;
+    ep->strings = NULL;
+}
+
+/* Start a new block if there is none or the current one is full */
+
+static int emit_reserve(Emitter *ep) {
+    if (ep->block != NULL && ep->block->num_nodes + ep->block->num_ways >= OSM_MERGE_BLOCK_SIZE)
+        emit_flush(ep);
+    if (ep->block == NULL && !ep->error) {
+        ep->block = calloc(1, sizeof(OSM_Block));
+        ep->strings = SP_create();
+        if (ep->block == NULL || ep->strings == NULL)
+            ep->error = 1;
+        else
+            ep->block->type = OSM_BLOB_DATA;
+    }
+    return ep->error ? -1 : 0;
+}
+
+static void emit_tag(Emitter *ep, unsigned int type, const char *key, const char *val) {
+    uint32_t k = SP_intern(ep->strings, key, strlen(key));
+    uint32_t v = SP_intern(ep->strings, val, strlen(val));
+    if (k == SP_NONE || v == SP_NONE || OSM_Block_add_tag(ep->block, type, k, v))
+        ep->error = 1;
+}
+
+static void emit_node(Emitter *ep, OSM_Node *np) {
+    if (emit_reserve(ep)) return;
+    int metadata = OSM_Map_has_metadata(np->map);
+    if (OSM_Block_add_Node(ep->block, &ep->opts, OSM_Node_get_id(np), OSM_Node_get_lat(np),
+                           OSM_Node_get_lon(np), metadata ? OSM_Node_get_version(np) : 0,
+                           metadata ? OSM_Node_get_timestamp(np) : 0)) {
+        ep->error = 1;
+        return;
+    }
+    for (int k = 0; k < OSM_Node_get_num_keys(np) && !ep->error; k++)
+        emit_tag(ep, OSM_TYPE_NODE, OSM_Node_get_key(np, k), OSM_Node_get_value(np, k));
+}
+
+static void emit_way(Emitter *ep, OSM_Way *wp) {
+    if (emit_reserve(ep)) return;
+    int metadata = OSM_Map_has_metadata(wp->map);
+    size_t num_refs;
+    const OSM_Id *refs = OSM_Way_refs(wp, &num_refs);
+    const OSM_Lat *lats = NULL;
+    const OSM_Lon *lons = NULL;
+    OSM_Way_ref_locations(wp, &lats, &lons);
+    if (OSM_Block_add_Way(ep->block, &ep->opts, OSM_Way_get_id(wp), refs, lats, lons, num_refs,
+                          metadata ? OSM_Way_get_version(wp) : 0,
+                          metadata ? OSM_Way_get_timestamp(wp) : 0)) {
+        ep->error = 1;
+        return;
+    }
+    for (int k = 0; k < OSM_Way_get_num_keys(wp) && !ep->error; k++)
+        emit_tag(ep, OSM_TYPE_WAY, OSM_Way_get_key(wp, k), OSM_Way_get_value(wp, k));
+}
+
+/* The position in sorted order of the entity at pos in a column */
+
+static size_t sorted_index(OSM_IdColumn *cp, size_t pos) {
+    return cp->order != NULL ? cp->order[pos] : pos;
+}
+
+/*
+ * Merge the entities of one type of a base and the latest ones of its
+ * runs, by id, leaving out those deleted.
+ */
+
+static void merge_entities(Emitter *ep, OSM_Map *base, OSM_Map **runs, int num_runs, unsigned int type) {
+    size_t count;
+    OverlayEntry *entries = overlay_entries(runs, num_runs, type, &count);
+    if (entries == NULL) {
+        ep->error = 1;
+        return;
+    }
+    sort_entries(entries, &count);
+    int nodes = type == OSM_TYPE_NODE;
+    OSM_IdColumn *cp = nodes ? &base->node_ids : &base->way_ids;
+    size_t num_base = nodes ? base->num_nodes : base->num_ways;
+    size_t p = 0, q = 0;
+    while ((p < num_base || q < count) && !ep->error) {
+        size_t index = p < num_base ? sorted_index(cp, p) : 0;
+        OSM_Id id = p == num_base ? 0 : nodes ? OSM_Node_get_id(&base->nodes[index])
+                                              : OSM_Way_get_id(&base->ways[index]);
+        if (q == count || (p < num_base && id < entries[q].id)) {
+            if (nodes)
+                emit_node(ep, &base->nodes[index]);
+            else
+                emit_way(ep, &base->ways[index]);
+            p++;
+            continue;
+        }
+        if (p < num_base && id == entries[q].id)
+            p++;
+        OSM_Map *run = runs[entries[q].run];
+        if (nodes && OSM_Node_is_visible(&run->nodes[entries[q].index]))
+            emit_node(ep, &run->nodes[entries[q].index]);
+        else if (!nodes && OSM_Way_is_visible(&run->ways[entries[q].index]))
+            emit_way(ep, &run->ways[entries[q].index]);
+        q++;
+    }
+    free(entries);
+    emit_flush(ep);
+}
+
+/*
+ * Fold runs into a new base with the header and metadata of the old one,
+ * sorted by type and id.
+ */
+
+static OSM_Map *compact_maps(OSM_Map *base, OSM_Map **runs, int num_runs, const OSM_Options *op) {
+    Emitter em;
+    memset(&em, 0, sizeof(em));
+    em.opts = *op;
+    em.opts.metadata = base->has_metadata;
+    em.opts.history = 0;
+    em.opts.tags = 1;
+    if ((em.map = OSM_Map_create(&em.opts)) == NULL) return NULL;
+
+    OSM_Block header;
+    memset(&header, 0, sizeof(header));
+    header.type = OSM_BLOB_HEADER;
+    header.has_bbox = base->has_bbox;
+    header.min_lat = base->bbox.min_lat;
+    header.max_lat = base->bbox.max_lat;
+    header.min_lon = base->bbox.min_lon;
+    header.max_lon = base->bbox.max_lon;
+    header.required_features = base->required_features;
+    header.optional_features = base->optional_features;
+    if (OSM_Map_add_Block(em.map, &header))
+        em.error = 1;
+
+    /* At most every entity of the base and of the runs is kept */
+    size_t num_nodes = base->num_nodes, num_ways = base->num_ways, num_refs = base->num_refs;
+    for (int r = 0; r < num_runs; r++) {
+        num_nodes += runs[r]->num_nodes;
+        num_ways += runs[r]->num_ways;
+        num_refs += runs[r]->num_refs;
+    }
+    if (OSM_Map_reserve(em.map, num_nodes, num_ways, num_refs))
+        em.error = 1;
+
+    merge_entities(&em, base, runs, num_runs, OSM_TYPE_NODE);
+    merge_entities(&em, base, runs, num_runs, OSM_TYPE_WAY);
+    if (em.error || OSM_Map_finish(em.map, &em.opts)) {
+        OSM_Map_free(em.map);
+        return NULL;
+    }
+    return em.map;
+}
+
+/**
+ * @brief  Fold the runs of the current view into a new base.
+ * @details  The base is built without holding up readers or applies, and
+ * runs added meanwhile are kept on top of it.  Compactions are serialized.
+ *
+ * @param dp  The overlay.
+ * @return 0 if successful, -1 in case of an error, in which case the
+ * runs are kept.
+ */
+
+int OSM_Delta_compact(OSM_Delta *dp) {
+    pthread_mutex_lock(&dp->compact_lock);
+    pthread_mutex_lock(&dp->lock);
+    OSM_DeltaView *vp = dp->view;
+    OSM_Map *base = vp->base;
+    int num_runs = vp->num_runs;
+    OSM_Map **runs = num_runs > 0 ? malloc(num_runs * sizeof(OSM_Map *)) : NULL;
+    if (runs != NULL)
+        memcpy(runs, vp->runs, num_runs * sizeof(OSM_Map *));
+    pthread_mutex_unlock(&dp->lock);
+    if (num_runs == 0) {
+        pthread_mutex_unlock(&dp->compact_lock);
+        return 0;
+    }
+
+    int ret = -1;
+    OSM_Map *compacted = runs != NULL ? compact_maps(base, runs, num_runs, &dp->opts) : NULL;
+    if (compacted != NULL) {
+        pthread_mutex_lock(&dp->lock);
+        vp = dp->view;
+        OSM_DeltaView *nvp = malloc(sizeof(OSM_DeltaView));
+        OSM_Map **nruns = malloc((vp->num_runs - num_runs + 1) * sizeof(OSM_Map *));
+        if (nvp != NULL && nruns != NULL) {
+            *nvp = *vp;
+            nvp->base = compacted;
+            nvp->runs = nruns;
+            nvp->num_runs = vp->num_runs - num_runs;
+            memcpy(nruns, vp->runs + num_runs, nvp->num_runs * sizeof(OSM_Map *));
+            publish_view(dp, nvp);
+            OSM_Epochs_retire(dp->epochs, base, free_map);
+            for (int r = 0; r < num_runs; r++)
+                OSM_Epochs_retire(dp->epochs, runs[r], free_map);
+            OSM_Epochs_reclaim(dp->epochs);
+            ret = 0;
+        } else {
+            free(nvp);
+            free(nruns);
+            OSM_Map_free(compacted);
+        }
+        pthread_mutex_unlock(&dp->lock);
+    }
+    if (ret != 0)
+        fprintf(stderr, "Cannot compact the overlay, keeping its runs\n");
+    free(runs);
+    pthread_mutex_unlock(&dp->compact_lock);
+    return ret;
+}
+
+/*
+ * Compact whenever OSM_DELTA_MAX_RUNS runs have built up, and free retired
+ * views and maps as readers leave them, until stopped.
+ */
+
+static void *compact_worker(void *arg) {
+    OSM_Delta *dp = arg;
+    pthread_mutex_lock(&dp->lock);
+    while (!dp->stop) {
+        OSM_DeltaView *vp = dp->view;
+        if (vp->num_runs >= OSM_DELTA_MAX_RUNS && vp->num_runs != dp->failed_runs) {
+            pthread_mutex_unlock(&dp->lock);
+            int ret = OSM_Delta_compact(dp);
+            pthread_mutex_lock(&dp->lock);
+            dp->failed_runs = ret != 0 ? ((OSM_DeltaView *)dp->view)->num_runs : 0;
+            continue;
+        }
+        if (OSM_Epochs_reclaim(dp->epochs) > 0) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += RECLAIM_INTERVAL_MS * 1000000L;
+            if (ts.tv_nsec >= 1000000000L) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&dp->cond, &dp->lock, &ts);
+        } else {
+            pthread_cond_wait(&dp->cond, &dp->lock);
+        }
+    }
+    pthread_mutex_unlock(&dp->lock);
+    return NULL;
+}
+
+/**
+ * @brief  Create an overlay on a base map, and start its compactor.
+ *
+ * @param base  The base map, which the overlay takes over, and which must
+ * not hold history.
+ * @param num_readers  The number of readers, each of which uses its own
+ * index in [0, num_readers) with OSM_Delta_enter().
+ * @param op  Options for the bases built by compaction.
+ * @return  The overlay, or NULL in case of an error, in which case the
+ * base is not taken over.
+ */
+
+OSM_Delta *OSM_Delta_create(OSM_Map *base, int num_readers, const OSM_Options *op) {
+    if (OSM_Map_is_history(base)) {
+        fprintf(stderr, "Cannot apply changes to a history map\n");
+        return NULL;
+    }
+    OSM_Delta *dp = calloc(1, sizeof(OSM_Delta));
+    OSM_DeltaView *vp = calloc(1, sizeof(OSM_DeltaView));
+    if (dp == NULL || vp == NULL || (dp->epochs = OSM_Epochs_create(num_readers)) == NULL) {
+        free(dp);
+        free(vp);
+        return NULL;
+    }
+    vp->base = base;
+    vp->num_nodes = OSM_Map_get_num_nodes64(base);
+    vp->num_ways = OSM_Map_get_num_ways64(base);
+    dp->view = vp;
+    dp->opts = *op;
+    dp->inotify_fd = dp->wake_fds[0] = dp->wake_fds[1] = -1;
+    pthread_mutex_init(&dp->lock, NULL);
+    pthread_mutex_init(&dp->apply_lock, NULL);
+    pthread_mutex_init(&dp->compact_lock, NULL);
+    pthread_cond_init(&dp->cond, NULL);
+    if (pthread_create(&dp->compactor, NULL, compact_worker, dp) != 0) {
+        vp->base = NULL;
+        OSM_Delta_free(dp);
+        return NULL;
+    }
+    dp->has_compactor = 1;
+    return dp;
+}
+
+/*
+ * Add the run of a change file on top of the current view, with
+ * apply_lock held.
+ */
+
+static int apply_file(OSM_Delta *dp, const char *path) {
+    OSM_Map *run = read_run(path);
+    if (run == NULL) return -1;
+    if (run->num_nodes == 0 && run->num_ways == 0) {
+        OSM_Map_free(run);
+        return 0;
+    }
+
+    pthread_mutex_lock(&dp->lock);
+    OSM_DeltaView *vp = dp->view;
+    OSM_DeltaView *nvp = malloc(sizeof(OSM_DeltaView));
+    OSM_Map **runs = malloc((vp->num_runs + 1) * sizeof(OSM_Map *));
+    if (nvp == NULL || runs == NULL) {
+        pthread_mutex_unlock(&dp->lock);
+        free(nvp);
+        free(runs);
+        OSM_Map_free(run);
+        return -1;
+    }
+    *nvp = *vp;
+    for (size_t i = 0; i < run->num_nodes; i++) {
+        OSM_Node *np = &run->nodes[i];
+        nvp->num_nodes += OSM_Node_is_visible(np);
+        nvp->num_nodes -= OSM_DeltaView_find_Node(vp, OSM_Node_get_id(np)) != NULL;
+    }
+    for (size_t i = 0; i < run->num_ways; i++) {
+        OSM_Way *wp = &run->ways[i];
+        nvp->num_ways += OSM_Way_is_visible(wp);
+        nvp->num_ways -= OSM_DeltaView_find_Way(vp, OSM_Way_get_id(wp)) != NULL;
+    }
+    if (vp->num_runs > 0)
+        memcpy(runs, vp->runs, vp->num_runs * sizeof(OSM_Map *));
+    runs[nvp->num_runs++] = run;
+    nvp->runs = runs;
+    publish_view(dp, nvp);
+    pthread_cond_signal(&dp->cond);
+    pthread_mutex_unlock(&dp->lock);
+    return 0;
+}
+
+/**
+ * @brief  Apply an OsmChange file, gzipped or not, on top of the overlay.
+ * @details  Readers that entered before see the overlay without it.
+ *
+ * @param dp  The overlay.
+ * @param path  The file.
+ * @return 0 if successful, -1 in case of an error, in which case nothing
+ * is applied.
+ */
+
+int OSM_Delta_apply_file(OSM_Delta *dp, const char *path) {
+    pthread_mutex_lock(&dp->apply_lock);
+    int ret = apply_file(dp, path);
+    pthread_mutex_unlock(&dp->apply_lock);
+    return ret;
+}
+
+static int is_change_file(const char *name) {
+    size_t len = strlen(name);
+    return (len > 4 && strcmp(name + len - 4, ".osc") == 0) ||
+           (len > 7 && strcmp(name + len - 7, ".osc.gz") == 0);
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * @brief  Apply the change files of a directory that sort after the last
+ * one applied from it, in order of their names.
+ * @details  Files ending in .osc or .osc.gz are applied, so their names
+ * must sort in the order of the changes, as zero-padded sequence numbers
+ * do.  Application stops at the first file that cannot be applied, which
+ * is retried by the next call.
+ *
+ * @param dp  The overlay.
+ * @param dir  The directory.
+ * @return  The number of files applied, or -1 in case of an error.
+ */
+
+int OSM_Delta_apply_dir(OSM_Delta *dp, const char *dir) {
+    DIR *dirp = opendir(dir);
+    if (dirp == NULL) {
+        fprintf(stderr, "Cannot read the directory %s\n", dir);
+        return -1;
+    }
+    pthread_mutex_lock(&dp->apply_lock);
+    char **names = NULL;
+    size_t count = 0, cap = 0;
+    int ret = 0;
+    struct dirent *de;
+    while ((de = readdir(dirp)) != NULL && ret == 0) {
+        if (!is_change_file(de->d_name) ||
+            (dp->last_applied != NULL && strcmp(de->d_name, dp->last_applied) <= 0))
+            continue;
+        if (grow((void **)&names, &cap, count, sizeof(char *)) ||
+            (names[count] = strdup(de->d_name)) == NULL)
+            ret = -1;
+        else
+            count++;
+    }
+    closedir(dirp);
+    if (ret == 0 && count > 0)
+        qsort(names, count, sizeof(char *), compare_names);
+
+    int applied = 0;
+    for (size_t i = 0; i < count && ret == 0; i++) {
+        size_t len = strlen(dir) + 1 + strlen(names[i]) + 1;
+        char *path = malloc(len);
+        if (path == NULL || (snprintf(path, len, "%s/%s", dir, names[i]), apply_file(dp, path)) != 0) {
+            ret = -1;
+        } else {
+            free(dp->last_applied);
+            dp->last_applied = names[i];
+            names[i] = NULL;
+            applied++;
+        }
+        free(path);
+    }
+    for (size_t i = 0; i < count; i++)
+        free(names[i]);
+    free(names);
+    pthread_mutex_unlock(&dp->apply_lock);
+    return ret == 0 ? applied : -1;
+}
+
+/*
+ * Apply the new change files of the directory whenever one is closed
+ * after writing or renamed into it, until woken through wake_fds.
+ */
+
+static void *watch_worker(void *arg) {
+    OSM_Delta *dp = arg;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        struct pollfd fds[2] = { { dp->inotify_fd, POLLIN, 0 }, { dp->wake_fds[0], POLLIN, 0 } };
+        if (poll(fds, 2, -1) < 0 && errno != EINTR)
+            break;
+        if (fds[1].revents != 0)
+            break;
+
+        int changed = 0;
+        ssize_t len;
+        while ((len = read(dp->inotify_fd, buf, sizeof(buf))) > 0) {
+            for (char *p = buf; p < buf + len; ) {
+                struct inotify_event *ev = (struct inotify_event *)p;
+                if ((ev->mask & IN_Q_OVERFLOW) || (ev->len > 0 && is_change_file(ev->name)))
+                    changed = 1;
+                p += sizeof(struct inotify_event) + ev->len;
+            }
+        }
+        if (changed)
+            OSM_Delta_apply_dir(dp, dp->dir);
+    }
+    return NULL;
+}
+
+/**
+ * @brief  Apply the change files of a directory, and then those that
+ * appear in it, in the background.
+ *
+ * @param dp  The overlay, which must not be watching a directory yet.
+ * @param dir  The directory.
+ * @return 0 if successful, -1 in case of an error.
+ */
+
+int OSM_Delta_watch_dir(OSM_Delta *dp, const char *dir) {
+    if (dp->dir != NULL || (dp->dir = strdup(dir)) == NULL) return -1;
+    dp->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (dp->inotify_fd < 0 ||
+        inotify_add_watch(dp->inotify_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0 ||
+        pipe(dp->wake_fds) != 0 ||
+        pthread_create(&dp->watcher, NULL, watch_worker, dp) != 0) {
+        fprintf(stderr, "Cannot watch the directory %s\n", dir);
+        for (int i = 0; i < 2; i++) {
+            if (dp->wake_fds[i] >= 0) close(dp->wake_fds[i]);
+            dp->wake_fds[i] = -1;
+        }
+        if (dp->inotify_fd >= 0) close(dp->inotify_fd);
+        dp->inotify_fd = -1;
+        free(dp->dir);
+        dp->dir = NULL;
+        return -1;
+    }
+    OSM_Delta_apply_dir(dp, dir);
+    return 0;
+}
+
+/**
+ * @brief  Take the current view for a query.
+ * @details  The view stays valid until OSM_Delta_leave() is called with
+ * the same reader, even if it is replaced meanwhile.  This never waits.
+ *
+ * @param dp  The overlay.
+ * @param reader  The index of the calling reader, which must not be in a
+ * query already, nor used by another thread at the same time.
+ * @return  The view.
+ */
+
+OSM_DeltaView *OSM_Delta_enter(OSM_Delta *dp, int reader) {
+    return OSM_Epochs_enter(dp->epochs, reader, &dp->view);
+}
+
+/**
+ * @brief  Release the view taken by OSM_Delta_enter().
+ *
+ * @param dp  The overlay.
+ * @param reader  The index of the calling reader.
+ */
+
+void OSM_Delta_leave(OSM_Delta *dp, int reader) {
+    OSM_Epochs_leave(dp->epochs, reader);
+}
+
+/**
+ * @brief  Stop the background threads and free the overlay, with its base
+ * and runs.
+ * @details  No reader may be in a query.
+ *
+ * @param dp  The overlay, or NULL.
+ */
+
+void OSM_Delta_free(OSM_Delta *dp) {
+    if (dp == NULL) return;
+    if (dp->dir != NULL) {
+        char c = 0;
+        if (write(dp->wake_fds[1], &c, 1) == 1)
+            pthread_join(dp->watcher, NULL);
+        close(dp->wake_fds[0]);
+        close(dp->wake_fds[1]);
+        close(dp->inotify_fd);
+        free(dp->dir);
+    }
+    if (dp->has_compactor) {
+        pthread_mutex_lock(&dp->lock);
+        dp->stop = 1;
+        pthread_cond_signal(&dp->cond);
+        pthread_mutex_unlock(&dp->lock);
+        pthread_join(dp->compactor, NULL);
+    }
+    OSM_Epochs_free(dp->epochs);
+    OSM_DeltaView *vp = dp->view;
+    OSM_Map_free(vp->base);
+    for (int r = 0; r < vp->num_runs; r++)
+        OSM_Map_free(vp->runs[r]);
+    free_view(vp);
+    pthread_mutex_destroy(&dp->lock);
+    pthread_mutex_destroy(&dp->apply_lock);
+    pthread_mutex_destroy(&dp->compact_lock);
+    pthread_cond_destroy(&dp->cond);
+    free(dp->last_applied);
+    free(dp);
+}
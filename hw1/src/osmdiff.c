@@ -0,0 +1,570 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <inttypes.h>
+
+#include "osmblock.h"
+#include "osmdiff.h"
+#include "debug.h"
+
+/*
+ * A diff runs in three phases:
+ *
+ *  1. Each file is scanned for the offsets of its data blobs, without
+ *     decompressing them; this is the block index.
+ *  2. Worker threads take blocks of both files from the index, decode
+ *     them and reduce every entity to a digest of (type, id, hash).
+ *  3. The digests of the two files, each in (type, id) order, are merge
+ *     joined.  The key space is split into one partition per worker at
+ *     block boundaries of the old file, and the partitions are joined
+ *     concurrently.
+ *
+ * Only the osmChange output needs entity contents.  It is written from the
+ * changes by action, re-reading only those blocks of the new file that
+ * contain a created or modified entity.
+ */
+
+#define KIND_NODE   0
+#define KIND_WAY    1
+
+typedef enum {
+    ACTION_CREATE,
+    ACTION_MODIFY,
+    ACTION_DELETE
+} Action;
+
+typedef struct Digest {
+    OSM_Id id;
+    uint64_t hash;
+    uint32_t block;
+    uint32_t pos;               // Index among the nodes or ways of the block
+    int kind;
+} Digest;
+
+typedef struct DiffFile {
+    const char *path;
+    uint64_t *offsets;          // Block index: offsets of the data blobs
+    size_t num_blocks;
+    Digest **digests;           // Digests of each block, in file order
+    size_t *counts;
+    Digest *all;                // Digests of all blocks, sorted by (kind, id)
+    size_t total;
+    size_t *block_start;        // First digest of each block in all, if sorted
+} DiffFile;
+
+typedef struct Change {
+    OSM_Id id;
+    uint32_t block;             // Entity in the new file, unless deleted
+    uint32_t pos;
+    uint8_t kind;
+    uint8_t action;
+} Change;
+
+typedef struct Partition {
+    DiffFile *old, *new;
+    size_t old_lo, old_hi;
+    size_t new_lo, new_hi;
+    Change *changes;
+    size_t num_changes;
+    size_t cap;
+    OSM_DiffStats stats;
+    int error;
+} Partition;
+
+typedef struct DigestJob {
+    DiffFile *files[2];
+    pthread_mutex_t lock;
+    size_t next;                // Next block, counting the old file's first
+    int error;
+} DigestJob;
+
+static uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static uint64_t hash_string(const char *str, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)str[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static int compare_keys(int kind1, OSM_Id id1, int kind2, OSM_Id id2) {
+    if (kind1 != kind2) return kind1 < kind2 ? -1 : 1;
+    return (id1 > id2) - (id1 < id2);
+}
+
+static int compare_digests(const void *a, const void *b) {
+    const Digest *x = a, *y = b;
+    return compare_keys(x->kind, x->id, y->kind, y->id);
+}
+
+/*
+ * Phase 1: record the offsets of the data blobs of a file.
+ */
+
+static int index_file(DiffFile *fp) {
+    FILE *in = fopen(fp->path, "rb");
+    if (in == NULL) {
+        fprintf(stderr, "Cannot read the input file %s\n", fp->path);
+        return -1;
+    }
+    size_t cap = 0;
+    uint64_t offset = 0;
+    OSM_Blob blob;
+    int ret;
+    while ((ret = OSM_read_Blob(in, offset, &blob)) == 1) {
+        if (blob.type == OSM_BLOB_DATA) {
+            if (fp->num_blocks == cap) {
+                cap = cap ? 2 * cap : 64;
+                uint64_t *offsets = realloc(fp->offsets, cap * sizeof(uint64_t));
+                if (offsets == NULL) {
+                    OSM_Blob_free(&blob);
+                    ret = -1;
+                    break;
+                }
+                fp->offsets = offsets;
+            }
+            fp->offsets[fp->num_blocks++] = offset;
+        }
+        offset += blob.length;
+        OSM_Blob_free(&blob);
+    }
+    fclose(in);
+    if (ret < 0) {
+        fprintf(stderr, "Cannot read the blocks of %s\n", fp->path);
+        return -1;
+    }
+    fp->digests = calloc(fp->num_blocks + 1, sizeof(Digest *));
+    fp->counts = calloc(fp->num_blocks + 1, sizeof(size_t));
+    return fp->digests && fp->counts ? 0 : -1;
+}
+
+/*
+ * Phase 2: reduce the entities of one block to digests.  The tags of an
+ * entity are hashed as a set, by summing a hash of each key/value pair.
+ */
+
+static uint64_t hash_tags(OSM_BlockTags *tp, int index, const uint64_t *string_hashes) {
+    uint64_t sum = 0;
+    for (int t = tp->start[index]; t < tp->start[index + 1]; t++)
+        sum += mix64(string_hashes[tp->keys[t]] ^ (string_hashes[tp->vals[t]] << 1));
+    return sum;
+}
+
+static int digest_block(DiffFile *fp, FILE *in, size_t b) {
+    OSM_Options opts;
+    OSM_Options_init(&opts);
+    opts.types = OSM_TYPE_NODE | OSM_TYPE_WAY;
+    OSM_Block *bp = OSM_read_Block_at(in, fp->offsets[b], &opts);
+    if (bp == NULL) {
+        fprintf(stderr, "Cannot decode block %zu of %s\n", b, fp->path);
+        return -1;
+    }
+
+    uint64_t *string_hashes = malloc((bp->num_strings + 1) * sizeof(uint64_t));
+    Digest *dp = malloc(((size_t)bp->num_nodes + bp->num_ways + 1) * sizeof(Digest));
+    if (string_hashes == NULL || dp == NULL) {
+        free(string_hashes);
+        free(dp);
+        OSM_Block_free(bp);
+        return -1;
+    }
+    for (int i = 0; i < bp->num_strings; i++)
+        string_hashes[i] = hash_string(bp->strings[i], bp->string_lens[i]);
+
+    size_t n = 0;
+    for (int i = 0; i < bp->num_nodes; i++, n++) {
+        uint64_t h = mix64((uint64_t)bp->node_lats[i] ^ mix64(bp->node_lons[i]));
+        dp[n] = (Digest){ bp->node_ids[i], mix64(h + hash_tags(&bp->node_tags, i, string_hashes)),
+                          b, i, KIND_NODE };
+    }
+    for (int i = 0; i < bp->num_ways; i++, n++) {
+        uint64_t h = 0;
+        for (int r = bp->way_ref_start[i]; r < bp->way_ref_start[i + 1]; r++)
+            h = mix64(h ^ (uint64_t)bp->way_refs[r]);
+        dp[n] = (Digest){ bp->way_ids[i], mix64(h + hash_tags(&bp->way_tags, i, string_hashes)),
+                          b, i, KIND_WAY };
+    }
+    fp->digests[b] = dp;
+    fp->counts[b] = n;
+    free(string_hashes);
+    OSM_Block_free(bp);
+    return 0;
+}
+
+static void *digest_worker(void *arg) {
+    DigestJob *jp = arg;
+    FILE *ins[2] = { NULL, NULL };
+    size_t total = jp->files[0]->num_blocks + jp->files[1]->num_blocks;
+    for (;;) {
+        pthread_mutex_lock(&jp->lock);
+        size_t n = jp->next++;
+        int error = jp->error;
+        pthread_mutex_unlock(&jp->lock);
+        if (error || n >= total) break;
+
+        int f = n >= jp->files[0]->num_blocks;
+        size_t b = f ? n - jp->files[0]->num_blocks : n;
+        if (ins[f] == NULL)
+            ins[f] = fopen(jp->files[f]->path, "rb");
+        if (ins[f] == NULL || digest_block(jp->files[f], ins[f], b)) {
+            pthread_mutex_lock(&jp->lock);
+            jp->error = 1;
+            pthread_mutex_unlock(&jp->lock);
+            break;
+        }
+    }
+    for (int f = 0; f < 2; f++) {
+        if (ins[f] != NULL)
+            fclose(ins[f]);
+    }
+    return NULL;
+}
+
+static int digest_files(DiffFile *files, int num_threads) {
+    DigestJob job = { { &files[0], &files[1] }, PTHREAD_MUTEX_INITIALIZER, 0, 0 };
+    pthread_t threads[num_threads];
+    int started = 0;
+    for (int t = 1; t < num_threads; t++) {
+        if (pthread_create(&threads[t], NULL, digest_worker, &job) != 0)
+            break;
+        started++;
+    }
+    digest_worker(&job);
+    for (int t = 1; t <= started; t++)
+        pthread_join(threads[t], NULL);
+    pthread_mutex_destroy(&job.lock);
+    return job.error ? -1 : 0;
+}
+
+/*
+ * Concatenate the digests of the blocks of a file, sorting them only if
+ * the file itself is not sorted by type and id.
+ */
+
+static int collect_digests(DiffFile *fp) {
+    fp->total = 0;
+    for (size_t b = 0; b < fp->num_blocks; b++)
+        fp->total += fp->counts[b];
+    fp->all = malloc((fp->total + 1) * sizeof(Digest));
+    fp->block_start = malloc((fp->num_blocks + 1) * sizeof(size_t));
+    if (fp->all == NULL || fp->block_start == NULL) return -1;
+    size_t n = 0;
+    for (size_t b = 0; b < fp->num_blocks; b++) {
+        fp->block_start[b] = n;
+        memcpy(fp->all + n, fp->digests[b], fp->counts[b] * sizeof(Digest));
+        n += fp->counts[b];
+        free(fp->digests[b]);
+        fp->digests[b] = NULL;
+    }
+    fp->block_start[fp->num_blocks] = n;
+    for (size_t i = 1; i < n; i++) {
+        if (compare_digests(&fp->all[i-1], &fp->all[i]) > 0) {
+            qsort(fp->all, n, sizeof(Digest), compare_digests);
+            free(fp->block_start);
+            fp->block_start = NULL;
+            break;
+        }
+    }
+    return 0;
+}
+
+static size_t lower_bound(DiffFile *fp, const Digest *key) {
+    size_t lo = 0, hi = fp->total;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (compare_digests(&fp->all[mid], key) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * Phase 3: merge join one partition of the key space.
+ */
+
+static int add_change(Partition *pp, const Digest *dp, Action action) {
+    if (pp->num_changes == pp->cap) {
+        size_t cap = pp->cap ? 2 * pp->cap : 1024;
+        Change *changes = realloc(pp->changes, cap * sizeof(Change));
+        if (changes == NULL) return -1;
+        pp->changes = changes;
+        pp->cap = cap;
+    }
+    pp->changes[pp->num_changes++] = (Change){ dp->id, dp->block, dp->pos, dp->kind, action };
+    if (action == ACTION_CREATE)
+        pp->stats.created[dp->kind]++;
+    else if (action == ACTION_MODIFY)
+        pp->stats.modified[dp->kind]++;
+    else
+        pp->stats.deleted[dp->kind]++;
+    return 0;
+}
+
+static void *join_partition(void *arg) {
+    Partition *pp = arg;
+    const Digest *old = pp->old->all, *new = pp->new->all;
+    size_t i = pp->old_lo, j = pp->new_lo;
+    while (i < pp->old_hi || j < pp->new_hi) {
+        int cmp = i == pp->old_hi ? 1 : j == pp->new_hi ? -1 : compare_digests(&old[i], &new[j]);
+        int ret = 0;
+        if (cmp < 0) {
+            ret = add_change(pp, &old[i++], ACTION_DELETE);
+        } else if (cmp > 0) {
+            ret = add_change(pp, &new[j++], ACTION_CREATE);
+        } else {
+            if (old[i].hash != new[j].hash)
+                ret = add_change(pp, &new[j], ACTION_MODIFY);
+            i++;
+            j++;
+        }
+        if (ret) {
+            pp->error = 1;
+            break;
+        }
+    }
+    return NULL;
+}
+
+static int join_files(DiffFile *old, DiffFile *new, Partition *parts, int num_parts) {
+    for (int p = 0; p < num_parts; p++) {
+        parts[p].old = old;
+        parts[p].new = new;
+        if (p == 0) {
+            parts[p].old_lo = parts[p].new_lo = 0;
+        } else {
+            size_t b = (size_t)p * old->num_blocks / num_parts;
+            size_t split = old->block_start ? old->block_start[b] : (size_t)p * old->total / num_parts;
+            if (split >= old->total) {
+                parts[p].old_lo = old->total;
+                parts[p].new_lo = new->total;
+            } else {
+                parts[p].old_lo = lower_bound(old, &old->all[split]);
+                parts[p].new_lo = lower_bound(new, &old->all[split]);
+            }
+            if (parts[p].old_lo < parts[p-1].old_lo) parts[p].old_lo = parts[p-1].old_lo;
+            if (parts[p].new_lo < parts[p-1].new_lo) parts[p].new_lo = parts[p-1].new_lo;
+        }
+    }
+    for (int p = 0; p < num_parts; p++) {
+        parts[p].old_hi = p + 1 < num_parts ? parts[p+1].old_lo : old->total;
+        parts[p].new_hi = p + 1 < num_parts ? parts[p+1].new_lo : new->total;
+    }
+
+    pthread_t threads[num_parts];
+    int started = 0;
+    for (int p = 1; p < num_parts; p++) {
+        if (pthread_create(&threads[p], NULL, join_partition, &parts[p]) != 0)
+            break;
+        started++;
+    }
+    join_partition(&parts[0]);
+    for (int p = 1; p <= started; p++)
+        pthread_join(threads[p], NULL);
+    for (int p = started + 1; p < num_parts; p++)
+        join_partition(&parts[p]);
+
+    for (int p = 0; p < num_parts; p++) {
+        if (parts[p].error) return -1;
+    }
+    return 0;
+}
+
+static void print_xml_string(FILE *out, const char *str) {
+    for (; *str; str++) {
+        switch (*str) {
+        case '&': fputs("&amp;", out); break;
+        case '<': fputs("&lt;", out); break;
+        case '>': fputs("&gt;", out); break;
+        case '"': fputs("&quot;", out); break;
+        case '\'': fputs("&apos;", out); break;
+        default: fputc(*str, out); break;
+        }
+    }
+}
+
+static void print_xml_degrees(FILE *out, int64_t nanodegrees) {
+    uint64_t abs = nanodegrees < 0 ? -(uint64_t)nanodegrees : (uint64_t)nanodegrees;
+    fprintf(out, "%s%" PRIu64 ".%09" PRIu64, nanodegrees < 0 ? "-" : "",
+            abs / 1000000000, abs % 1000000000);
+}
+
+static void print_xml_entity(FILE *out, OSM_Block *bp, const Change *cp) {
+    int i = cp->pos;
+    OSM_BlockInfo *ip = cp->kind == KIND_NODE ? &bp->node_info : &bp->way_info;
+    OSM_BlockTags *tp = cp->kind == KIND_NODE ? &bp->node_tags : &bp->way_tags;
+    fprintf(out, "    <%s id=\"%" PRId64 "\"", cp->kind == KIND_NODE ? "node" : "way", cp->id);
+    if (ip->versions != NULL && ip->versions[i] >= 0)
+        fprintf(out, " version=\"%" PRId32 "\"", ip->versions[i]);
+    if (ip->timestamps != NULL && ip->timestamps[i] > 0) {
+        time_t t = ip->timestamps[i];
+        struct tm tm;
+        char buf[32];
+        strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", gmtime_r(&t, &tm));
+        fprintf(out, " timestamp=\"%s\"", buf);
+    }
+    if (cp->kind == KIND_NODE) {
+        fprintf(out, " lat=\"");
+        print_xml_degrees(out, bp->node_lats[i]);
+        fprintf(out, "\" lon=\"");
+        print_xml_degrees(out, bp->node_lons[i]);
+        fprintf(out, "\"");
+    }
+    int num_refs = cp->kind == KIND_WAY ? bp->way_ref_start[i + 1] - bp->way_ref_start[i] : 0;
+    int num_tags = tp->start[i + 1] - tp->start[i];
+    if (num_refs == 0 && num_tags == 0) {
+        fprintf(out, "/>\n");
+        return;
+    }
+    fprintf(out, ">\n");
+    for (int r = 0; r < num_refs; r++)
+        fprintf(out, "      <nd ref=\"%" PRId64 "\"/>\n", bp->way_refs[bp->way_ref_start[i] + r]);
+    for (int t = tp->start[i]; t < tp->start[i + 1]; t++) {
+        fprintf(out, "      <tag k=\"");
+        print_xml_string(out, bp->strings[tp->keys[t]]);
+        fprintf(out, "\" v=\"");
+        print_xml_string(out, bp->strings[tp->vals[t]]);
+        fprintf(out, "\"/>\n");
+    }
+    fprintf(out, "    </%s>\n", cp->kind == KIND_NODE ? "node" : "way");
+}
+
+/*
+ * Write the changes as an osmChange document with one section per action,
+ * so that it can be applied in order: every creation, nodes before the
+ * ways that may refer to them, then every modification, then every
+ * deletion, ways before the nodes that they may have referred to.
+ */
+
+static int write_osc(DiffFile *new, Partition *parts, int num_parts, FILE *out) {
+    static const char *sections[] = { "create", "modify", "delete" };
+    FILE *in = fopen(new->path, "rb");
+    if (in == NULL) return -1;
+    OSM_Options opts;
+    OSM_Options_init(&opts);
+    opts.types = OSM_TYPE_NODE | OSM_TYPE_WAY;
+    opts.metadata = 1;
+
+    OSM_Block *bp = NULL;
+    size_t cached = SIZE_MAX;
+    int ret = 0;
+    fprintf(out, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+    fprintf(out, "<osmChange version=\"0.6\" generator=\"pbf\">\n");
+    for (int action = ACTION_CREATE; action <= ACTION_DELETE && ret == 0; action++) {
+        int open = 0;
+        for (int k = 0; k < 2 && ret == 0; k++) {
+            int kind = action == ACTION_DELETE ? KIND_WAY - k : KIND_NODE + k;
+            for (int p = 0; p < num_parts && ret == 0; p++) {
+                for (size_t c = 0; c < parts[p].num_changes; c++) {
+                    const Change *cp = &parts[p].changes[c];
+                    if (cp->action != action || cp->kind != kind)
+                        continue;
+                    if (!open) {
+                        fprintf(out, "  <%s>\n", sections[action]);
+                        open = 1;
+                    }
+                    if (action == ACTION_DELETE) {
+                        fprintf(out, "    <%s id=\"%" PRId64 "\"/>\n",
+                                kind == KIND_NODE ? "node" : "way", cp->id);
+                        continue;
+                    }
+                    if (cp->block != cached) {
+                        OSM_Block_free(bp);
+                        bp = OSM_read_Block_at(in, new->offsets[cp->block], &opts);
+                        cached = cp->block;
+                        if (bp == NULL) {
+                            ret = -1;
+                            break;
+                        }
+                    }
+                    print_xml_entity(out, bp, cp);
+                }
+            }
+        }
+        if (open)
+            fprintf(out, "  </%s>\n", sections[action]);
+    }
+    fprintf(out, "</osmChange>\n");
+    OSM_Block_free(bp);
+    fclose(in);
+    return ret;
+}
+
+static void free_diff_file(DiffFile *fp) {
+    for (size_t b = 0; fp->digests != NULL && b < fp->num_blocks; b++)
+        free(fp->digests[b]);
+    free(fp->digests);
+    free(fp->counts);
+    free(fp->offsets);
+    free(fp->all);
+    free(fp->block_start);
+}
+
+/**
+ * @brief  Compare two OSM PBF files and report the nodes and ways that
+ * were created, modified or deleted in going from the old to the new.
+ * @details  Blocks are digested on op->threads threads, and the digests
+ * joined in as many partitions.  Files sorted by type and id, as extracts
+ * normally are, are joined in place; otherwise the digests are sorted
+ * first.  The files are opened by path, since blocks are read out of
+ * order by several threads.
+ *
+ * @param old_path  The path of the old file.
+ * @param new_path  The path of the new file.
+ * @param op  Options, of which only threads is used, or NULL for the defaults.
+ * @param stats  Structure in which to store the number of changes of
+ * each kind, or NULL.
+ * @param osc  If not NULL, the stream to which the changes are written
+ * as an osmChange document.
+ * @return 0 if successful, -1 in case of an error.
+ */
+
+int OSM_diff_files(const char *old_path, const char *new_path, const OSM_Options *op,
+                   OSM_DiffStats *stats, FILE *osc) {
+    int num_threads = op != NULL && op->threads > 1 ? op->threads : 1;
+    DiffFile files[2];
+    memset(files, 0, sizeof(files));
+    files[0].path = old_path;
+    files[1].path = new_path;
+    Partition *parts = calloc(num_threads, sizeof(Partition));
+    int ret = -1;
+    if (parts == NULL || index_file(&files[0]) || index_file(&files[1]))
+        goto done;
+
+    if (digest_files(files, num_threads) || collect_digests(&files[0]) ||
+        collect_digests(&files[1]))
+        goto done;
+
+    if (join_files(&files[0], &files[1], parts, num_threads))
+        goto done;
+    if (stats != NULL) {
+        memset(stats, 0, sizeof(OSM_DiffStats));
+        for (int p = 0; p < num_threads; p++) {
+            for (int k = 0; k < 2; k++) {
+                stats->created[k] += parts[p].stats.created[k];
+                stats->modified[k] += parts[p].stats.modified[k];
+                stats->deleted[k] += parts[p].stats.deleted[k];
+            }
+        }
+    }
+    ret = osc != NULL ? write_osc(&files[1], parts, num_threads, osc) : 0;
+
+done:
+    for (int p = 0; parts != NULL && p < num_threads; p++)
+        free(parts[p].changes);
+    free(parts);
+    free_diff_file(&files[0]);
+    free_diff_file(&files[1]);
+    return ret;
+}
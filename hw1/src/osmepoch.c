@@ -0,0 +1,174 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <sched.h>
+
+#include "osmepoch.h"
+#include "debug.h"
+
+/* A reader's epoch, 0 outside a read, alone in its cache line */
+
+typedef struct ReaderSlot {
+    uint64_t epoch;
+    char pad[64 - sizeof(uint64_t)];
+} ReaderSlot;
+
+typedef struct Retired {
+    void *ptr;
+    OSM_EpochFreeFunc *fn;
+    uint64_t epoch;             // Epoch from which no reader can reach it
+    struct Retired *next;
+} Retired;
+
+struct OSM_Epochs {
+    uint64_t epoch;             // Advanced atomically at each retirement, from 1
+    ReaderSlot *readers;
+    int num_readers;
+    Retired *retired;           // Owned by the writers
+    size_t num_retired;
+};
+
+/* The earliest epoch of a reader in a read, or UINT64_MAX if none is */
+
+static uint64_t min_reader_epoch(OSM_Epochs *ep) {
+    uint64_t min_epoch = UINT64_MAX;
+    for (int r = 0; r < ep->num_readers; r++) {
+        uint64_t e = __atomic_load_n(&ep->readers[r].epoch, __ATOMIC_SEQ_CST);
+        if (e != 0 && e < min_epoch)
+            min_epoch = e;
+    }
+    return min_epoch;
+}
+
+/**
+ * @brief  Create the reader slots for a number of readers.
+ *
+ * @param num_readers  The number of readers, each of which uses its own
+ * index in [0, num_readers).
+ * @return  The epochs, or NULL in case of an error.
+ */
+
+OSM_Epochs *OSM_Epochs_create(int num_readers) {
+    if (num_readers < 1) return NULL;
+    OSM_Epochs *ep = calloc(1, sizeof(OSM_Epochs));
+    if (ep == NULL) return NULL;
+    ep->readers = calloc(num_readers, sizeof(ReaderSlot));
+    if (ep->readers == NULL) {
+        free(ep);
+        return NULL;
+    }
+    ep->num_readers = num_readers;
+    ep->epoch = 1;
+    return ep;
+}
+
+/**
+ * @brief  Start a read, and load a published pointer.
+ * @details  What the pointer points to stays valid until the reader
+ * leaves, even if it is replaced meanwhile.  This never waits.
+ *
+ * @param ep  The epochs.
+ * @param reader  The index of the calling reader, which must not be in a
+ * read already, nor used by another thread at the same time.
+ * @param ptrp  The published pointer.
+ * @return  Its value.
+ */
+
+void *OSM_Epochs_enter(OSM_Epochs *ep, int reader, void **ptrp) {
+    uint64_t epoch = __atomic_load_n(&ep->epoch, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&ep->readers[reader].epoch, epoch, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(ptrp, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief  End the read started by OSM_Epochs_enter().
+ *
+ * @param ep  The epochs.
+ * @param reader  The index of the calling reader.
+ */
+
+void OSM_Epochs_leave(OSM_Epochs *ep, int reader) {
+    __atomic_store_n(&ep->readers[reader].epoch, 0, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief  Replace a published pointer, for readers that enter from now on.
+ *
+ * @param ep  The epochs.
+ * @param ptrp  The published pointer.
+ * @param ptr  Its new value.
+ * @return  Its old value, to be retired by the caller.
+ */
+
+void *OSM_Epochs_publish(OSM_Epochs *ep, void **ptrp, void *ptr) {
+    (void)ep;
+    return __atomic_exchange_n(ptrp, ptr, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief  Free an object once no reader can hold it.
+ * @details  The object must no longer be reachable through a published
+ * pointer.  It is freed by a later call to OSM_Epochs_reclaim() or
+ * OSM_Epochs_free(), or, if memory cannot be allocated to keep it, by
+ * this call after waiting for the readers that may hold it.
+ *
+ * @param ep  The epochs.
+ * @param ptr  The object, or NULL.
+ * @param fn  The function that frees it.
+ */
+
+void OSM_Epochs_retire(OSM_Epochs *ep, void *ptr, OSM_EpochFreeFunc *fn) {
+    if (ptr == NULL) return;
+    uint64_t epoch = __atomic_add_fetch(&ep->epoch, 1, __ATOMIC_SEQ_CST);
+    Retired *rp = malloc(sizeof(Retired));
+    if (rp == NULL) {
+        while (min_reader_epoch(ep) < epoch)
+            sched_yield();
+        fn(ptr);
+        return;
+    }
+    *rp = (Retired){ ptr, fn, epoch, ep->retired };
+    ep->retired = rp;
+    ep->num_retired++;
+}
+
+/**
+ * @brief  Free the retired objects that no reader can still hold.
+ *
+ * @param ep  The epochs.
+ * @return  The number of retired objects that are left.
+ */
+
+size_t OSM_Epochs_reclaim(OSM_Epochs *ep) {
+    uint64_t min_epoch = min_reader_epoch(ep);
+    for (Retired **rpp = &ep->retired; *rpp != NULL; ) {
+        Retired *rp = *rpp;
+        if (rp->epoch <= min_epoch) {
+            *rpp = rp->next;
+            rp->fn(rp->ptr);
+            free(rp);
+            ep->num_retired--;
+        } else {
+            rpp = &rp->next;
+        }
+    }
+    return ep->num_retired;
+}
+
+/**
+ * @brief  Free the epochs, with every retired object.
+ * @details  No reader may be in a read.
+ *
+ * @param ep  The epochs, or NULL.
+ */
+
+void OSM_Epochs_free(OSM_Epochs *ep) {
+    if (ep == NULL) return;
+    while (ep->retired != NULL) {
+        Retired *rp = ep->retired;
+        ep->retired = rp->next;
+        rp->fn(rp->ptr);
+        free(rp);
+    }
+    free(ep->readers);
+    free(ep);
+}
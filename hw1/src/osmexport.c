@@ -0,0 +1,526 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "osmexport.h"
+#include "osmshard.h"
+#include "debug.h"
+
+/*
+ * Keys whose presence makes a closed way a polygon, unless it has area=no;
+ * area=yes makes any closed way one.
+ */
+
+static const char *area_keys[] = {
+    "building", "landuse", "leisure", "natural", "amenity", "place", "boundary"
+};
+
+#define NUM_AREA_KEYS   (sizeof(area_keys) / sizeof(area_keys[0]))
+
+/*
+ * Locations of the nodes seen so far, in units of 1e-7 degrees, which are
+ * sorted by id before ways are resolved against them.  A sharded export
+ * fills the table of each range with the nodes of the whole file first.
+ */
+
+typedef struct NodeLocation {
+    OSM_Id id;
+    int32_t lat;
+    int32_t lon;
+} NodeLocation;
+
+typedef struct LocationTable {
+    NodeLocation *nodes;
+    size_t count;
+    size_t cap;
+    int sorted;
+    int complete;               // Filled in advance, not from the blocks
+} LocationTable;
+
+typedef struct ExportJob {
+    OSM_BlockReader *reader;
+    FILE *out;
+    const OSM_Exporter *exporter;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint64_t next_claim;        // Sequence number of the next block taken
+    uint64_t next_write;        // Sequence number of the next block written
+    int num_written;            // Blocks with features written so far, capped at 1
+    int done;
+    int error;
+
+    pthread_rwlock_t table_lock;
+    LocationTable table;
+    int use_table;              // Cleared for LocationsOnWays files
+} ExportJob;
+
+/**
+ * @brief  Append bytes to an export buffer, growing it as needed.
+ * @details  If the buffer cannot be grown, its error flag is set and the
+ * bytes are dropped, as are those of any later appends.
+ */
+
+void OSM_ExportBuffer_append(OSM_ExportBuffer *bp, const void *data, size_t len) {
+    if (bp->error) return;
+    if (bp->len + len > bp->cap) {
+        size_t cap = bp->cap ? bp->cap : 4096;
+        while (cap < bp->len + len) cap *= 2;
+        char *buf = realloc(bp->data, cap);
+        if (buf == NULL) {
+            bp->error = 1;
+            return;
+        }
+        bp->data = buf;
+        bp->cap = cap;
+    }
+    memcpy(bp->data + bp->len, data, len);
+    bp->len += len;
+}
+
+/* Append a string as a quoted JSON string */
+
+static void append_json_string(OSM_ExportBuffer *bp, const char *str, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    OSM_EXPORT_LITERAL(bp, "\"");
+    size_t run = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = str[i];
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+        OSM_ExportBuffer_append(bp, str + run, i - run);
+        run = i + 1;
+        if (c == '"') OSM_EXPORT_LITERAL(bp, "\\\"");
+        else if (c == '\\') OSM_EXPORT_LITERAL(bp, "\\\\");
+        else if (c == '\n') OSM_EXPORT_LITERAL(bp, "\\n");
+        else if (c == '\t') OSM_EXPORT_LITERAL(bp, "\\t");
+        else {
+            char esc[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 15] };
+            OSM_ExportBuffer_append(bp, esc, sizeof(esc));
+        }
+    }
+    OSM_ExportBuffer_append(bp, str + run, len - run);
+    OSM_EXPORT_LITERAL(bp, "\"");
+}
+
+/**
+ * @brief  Append the tags of an entity of a block as a JSON object.
+ *
+ * @param bp  The buffer.
+ * @param block  The block.
+ * @param tp  The tags of the entities of one type in the block.
+ * @param i  The index of the entity among those of its type.
+ */
+
+void OSM_ExportBuffer_append_tags(OSM_ExportBuffer *bp, OSM_Block *block, const OSM_BlockTags *tp, int i) {
+    OSM_EXPORT_LITERAL(bp, "{");
+    int first = 1;
+    for (int t = tp->start[i]; t < tp->start[i + 1]; t++) {
+        uint32_t k = tp->keys[t], v = tp->vals[t];
+        if (k >= (uint32_t)block->num_strings || v >= (uint32_t)block->num_strings)
+            continue;
+        if (!first)
+            OSM_EXPORT_LITERAL(bp, ",");
+        first = 0;
+        append_json_string(bp, block->strings[k], block->string_lens[k]);
+        OSM_EXPORT_LITERAL(bp, ":");
+        append_json_string(bp, block->strings[v], block->string_lens[v]);
+    }
+    OSM_EXPORT_LITERAL(bp, "}");
+}
+
+static int add_locations(LocationTable *tp, OSM_Block *bp) {
+    if (tp->count + bp->num_nodes > tp->cap) {
+        size_t cap = tp->cap ? tp->cap : 1024;
+        while (cap < tp->count + bp->num_nodes) cap *= 2;
+        NodeLocation *nodes = realloc(tp->nodes, cap * sizeof(NodeLocation));
+        if (nodes == NULL) return -1;
+        tp->nodes = nodes;
+        tp->cap = cap;
+    }
+    for (int i = 0; i < bp->num_nodes; i++) {
+        if (tp->count > 0 && bp->node_ids[i] <= tp->nodes[tp->count - 1].id)
+            tp->sorted = 0;
+        tp->nodes[tp->count++] = (NodeLocation){ bp->node_ids[i], bp->node_lats[i] / 100,
+                                                 bp->node_lons[i] / 100 };
+    }
+    return 0;
+}
+
+static int compare_locations(const void *a, const void *b) {
+    OSM_Id x = ((const NodeLocation *)a)->id, y = ((const NodeLocation *)b)->id;
+    return (x > y) - (x < y);
+}
+
+static int find_location(const LocationTable *tp, OSM_Id id, int64_t *latp, int64_t *lonp) {
+    size_t lo = 0, hi = tp->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (tp->nodes[mid].id < id) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == tp->count || tp->nodes[lo].id != id) return 0;
+    *latp = tp->nodes[lo].lat;
+    *lonp = tp->nodes[lo].lon;
+    return 1;
+}
+
+static int is_area(OSM_Block *block, const OSM_BlockTags *tp, int i) {
+    int area = 0;
+    for (int t = tp->start[i]; t < tp->start[i + 1]; t++) {
+        uint32_t k = tp->keys[t], v = tp->vals[t];
+        if (k >= (uint32_t)block->num_strings || v >= (uint32_t)block->num_strings)
+            continue;
+        const char *key = block->strings[k], *val = block->strings[v];
+        if (strcmp(key, "area") == 0)
+            return strcmp(val, "no") != 0;
+        for (size_t a = 0; a < NUM_AREA_KEYS; a++)
+            area |= strcmp(key, area_keys[a]) == 0;
+    }
+    return area;
+}
+
+static void encode_nodes(ExportJob *jp, OSM_ExportBuffer *bp, OSM_Block *block) {
+    const OSM_BlockTags *tp = &block->node_tags;
+    for (int i = 0; i < block->num_nodes; i++) {
+        if (tp->start[i + 1] > tp->start[i])
+            jp->exporter->node(jp->exporter->arg, bp, block, i);
+    }
+}
+
+/*
+ * Encode the ways of a block, whose coordinates are first resolved into
+ * the caller's arrays, which are grown as needed.
+ */
+
+static void encode_ways(ExportJob *jp, OSM_ExportBuffer *bp, OSM_Block *block, int64_t **latsp,
+                        int64_t **lonsp, size_t *capp) {
+    const OSM_BlockTags *tp = &block->way_tags;
+    for (int i = 0; i < block->num_ways && !bp->error; i++) {
+        int start = block->way_ref_start[i], end = block->way_ref_start[i + 1];
+        size_t n = end - start, found = 0;
+        if (n > *capp) {
+            int64_t *lats = realloc(*latsp, n * sizeof(int64_t));
+            if (lats != NULL) *latsp = lats;
+            int64_t *lons = realloc(*lonsp, n * sizeof(int64_t));
+            if (lons != NULL) *lonsp = lons;
+            if (lats == NULL || lons == NULL) {
+                bp->error = 1;
+                return;
+            }
+            *capp = n;
+        }
+        for (int r = start; r < end; r++) {
+            if (block->way_ref_lats != NULL) {
+                (*latsp)[found] = block->way_ref_lats[r] / 100;
+                (*lonsp)[found++] = block->way_ref_lons[r] / 100;
+            } else if (jp->use_table) {
+                found += find_location(&jp->table, block->way_refs[r], &(*latsp)[found], &(*lonsp)[found]);
+            }
+        }
+        if (found < 2)
+            continue;
+
+        int polygon = found == n && n >= 4 && block->way_refs[start] == block->way_refs[end - 1] &&
+                      is_area(block, tp, i);
+        jp->exporter->way(jp->exporter->arg, bp, block, i, *latsp, *lonsp, found, polygon);
+    }
+}
+
+/*
+ * Take the next block and the sequence number in which it is to be
+ * written, adding its node locations to the table, or sorting the table
+ * before the ways of the block are resolved against it.
+ */
+
+static int claim_block(ExportJob *jp, OSM_Block **bpp, uint64_t *seqp) {
+    pthread_mutex_lock(&jp->lock);
+    int ret = jp->done || jp->error ? 0 : OSM_BlockReader_next(jp->reader, bpp);
+    if (ret == 1) {
+        OSM_Block *bp = *bpp;
+        *seqp = jp->next_claim++;
+        if (bp->type == OSM_BLOB_HEADER &&
+            ((bp->required_features | bp->optional_features) & OSM_FEATURE_LOCATIONS_ON_WAYS))
+            jp->use_table = 0;
+        if (jp->use_table && !jp->table.complete &&
+            (bp->num_nodes > 0 || (bp->num_ways > 0 && !jp->table.sorted))) {
+            pthread_rwlock_wrlock(&jp->table_lock);
+            if (bp->num_nodes > 0 && add_locations(&jp->table, bp) != 0) {
+                ret = -1;
+            } else if (bp->num_ways > 0 && !jp->table.sorted) {
+                qsort(jp->table.nodes, jp->table.count, sizeof(NodeLocation), compare_locations);
+                jp->table.sorted = 1;
+            }
+            pthread_rwlock_unlock(&jp->table_lock);
+        }
+        if (ret != 1)
+            OSM_Block_free(bp);
+    }
+    if (ret != 1) {
+        jp->done = 1;
+        if (ret < 0) jp->error = 1;
+        pthread_cond_broadcast(&jp->cond);
+    }
+    pthread_mutex_unlock(&jp->lock);
+    return ret;
+}
+
+static void *export_worker(void *arg) {
+    ExportJob *jp = arg;
+    const char *separator = jp->exporter->separator;
+    OSM_ExportBuffer buf = { NULL, 0, 0, 0 };
+    int64_t *lats = NULL, *lons = NULL;
+    size_t cap = 0;
+    OSM_Block *bp;
+    uint64_t seq;
+    while (claim_block(jp, &bp, &seq) == 1) {
+        buf.len = 0;
+        encode_nodes(jp, &buf, bp);
+        if (bp->num_ways > 0) {
+            pthread_rwlock_rdlock(&jp->table_lock);
+            encode_ways(jp, &buf, bp, &lats, &lons, &cap);
+            pthread_rwlock_unlock(&jp->table_lock);
+        }
+        OSM_Block_free(bp);
+
+        pthread_mutex_lock(&jp->lock);
+        while (jp->next_write != seq && !jp->error)
+            pthread_cond_wait(&jp->cond, &jp->lock);
+        if (buf.error) {
+            jp->error = 1;
+        } else if (!jp->error && buf.len > 0) {
+            if (separator != NULL && jp->num_written)
+                fputs(separator, jp->out);
+            if (fwrite(buf.data, 1, buf.len, jp->out) != buf.len)
+                jp->error = 1;
+            jp->num_written = 1;
+        }
+        jp->next_write++;
+        pthread_cond_broadcast(&jp->cond);
+        int error = jp->error;
+        pthread_mutex_unlock(&jp->lock);
+        if (error) break;
+    }
+    free(buf.data);
+    free(lats);
+    free(lons);
+    return NULL;
+}
+
+/*
+ * Export the features of the blobs in a range of the input, resolving the
+ * ways against a complete table if one is given.
+ */
+
+static int export_range(FILE *in, uint64_t start, uint64_t end, FILE *out, const OSM_Exporter *ep,
+                        const LocationTable *table, const OSM_Options *op) {
+    OSM_Options opts;
+    OSM_Options_init(&opts);
+    if (op != NULL) {
+        opts.threads = op->threads;
+        opts.cache_blocks = op->cache_blocks;
+    }
+    opts.types = OSM_TYPE_NODE | OSM_TYPE_WAY;
+    opts.tags = 1;
+    opts.metadata = 0;
+
+    ExportJob job;
+    memset(&job, 0, sizeof(ExportJob));
+    job.out = out;
+    job.exporter = ep;
+    job.use_table = 1;
+    job.table.sorted = 1;
+    if (table != NULL)
+        job.table = *table;
+    if ((job.reader = OSM_BlockReader_open_range(in, start, end, &opts)) == NULL)
+        return -1;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.cond, NULL);
+    pthread_rwlock_init(&job.table_lock, NULL);
+
+    int threads = opts.threads > 1 ? opts.threads : 1;
+    pthread_t tids[threads];
+    int started = 0;
+    for (int t = 1; t < threads; t++) {
+        if (pthread_create(&tids[t], NULL, export_worker, &job) != 0)
+            break;
+        started++;
+    }
+    export_worker(&job);
+    for (int t = 1; t <= started; t++)
+        pthread_join(tids[t], NULL);
+
+    OSM_BlockReader_close(job.reader);
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.cond);
+    pthread_rwlock_destroy(&job.table_lock);
+    if (!job.table.complete)
+        free(job.table.nodes);
+    return job.error ? -1 : 0;
+}
+
+/**
+ * @brief  Export the tagged nodes and the ways of an OSM PBF input stream.
+ * @details  The input is read once, as a stream.  As many threads as the
+ * threads option asks for encode the blocks, and the output is the same
+ * for any number of threads.  Ways whose nodes are not in the input lose
+ * those coordinates, and are left out if fewer than two remain; relations
+ * are never exported.  Anything that comes before or after the features,
+ * such as a header, is for the caller to write.
+ *
+ * @param in  The input stream.
+ * @param out  The output stream.
+ * @param ep  The encoder of the output format.
+ * @param op  The options, or NULL for the defaults set by OSM_Options_init().
+ * @return 0 if successful, -1 in case of an error.
+ */
+
+int OSM_export_features(FILE *in, FILE *out, const OSM_Exporter *ep, const OSM_Options *op) {
+    return export_range(in, 0, UINT64_MAX, out, ep, NULL, op);
+}
+
+/* A sharded export, as seen by the parent and, once forked, the workers */
+
+typedef struct ShardExport {
+    const OSM_Exporter *exporter;
+    OSM_Options opts;           // Options of the workers
+    LocationTable table;
+    char *bytes;                // Node locations gathered from the workers
+    size_t size;
+    size_t cap;
+    FILE *out;
+    int last_shard;             // Range whose features were written last, or -1
+} ShardExport;
+
+/* Write the node locations of a range, as an array of NodeLocation */
+
+static int write_locations(void *arg, FILE *in, const OSM_Shard *sp, FILE *out) {
+    ShardExport *xp = arg;
+    OSM_Options opts = xp->opts;
+    opts.types = OSM_TYPE_NODE;
+    opts.tags = 0;
+    OSM_BlockReader *rp = OSM_BlockReader_open_range(in, sp->start, sp->end, &opts);
+    if (rp == NULL) return -1;
+    LocationTable table;
+    memset(&table, 0, sizeof(LocationTable));
+    OSM_Block *bp;
+    int ret;
+    while ((ret = OSM_BlockReader_next(rp, &bp)) == 1) {
+        table.count = 0;
+        if (add_locations(&table, bp) != 0 || (table.count > 0 &&
+            fwrite(table.nodes, sizeof(NodeLocation), table.count, out) != table.count))
+            ret = -1;
+        OSM_Block_free(bp);
+        if (ret < 0) break;
+    }
+    OSM_BlockReader_close(rp);
+    free(table.nodes);
+    return ret;
+}
+
+static int gather_locations(void *arg, int shard, const void *data, size_t len) {
+    ShardExport *xp = arg;
+    (void)shard;
+    if (xp->size + len > xp->cap) {
+        size_t cap = xp->cap ? 2 * xp->cap : 64 * 1024;
+        while (cap < xp->size + len)
+            cap *= 2;
+        char *bytes = realloc(xp->bytes, cap);
+        if (bytes == NULL) return -1;
+        xp->bytes = bytes;
+        xp->cap = cap;
+    }
+    memcpy(xp->bytes + xp->size, data, len);
+    xp->size += len;
+    return 0;
+}
+
+static int export_shard(void *arg, FILE *in, const OSM_Shard *sp, FILE *out) {
+    ShardExport *xp = arg;
+    return export_range(in, sp->start, sp->end, out, xp->exporter,
+                        xp->table.complete ? &xp->table : NULL, &xp->opts);
+}
+
+static int write_features(void *arg, int shard, const void *data, size_t len) {
+    ShardExport *xp = arg;
+    if (shard != xp->last_shard && xp->last_shard >= 0 && xp->exporter->separator != NULL)
+        fputs(xp->exporter->separator, xp->out);
+    xp->last_shard = shard;
+    return fwrite(data, 1, len, xp->out) == len ? 0 : -1;
+}
+
+/**
+ * @brief  Export the tagged nodes and the ways of an OSM PBF file as
+ * OSM_export_features() does, with worker processes that each export a
+ * range of the file.
+ * @details  Unless the file has the LocationsOnWays feature, the workers
+ * first send the locations of the nodes of their ranges, which are merged
+ * into one table of the whole file that the workers of the export then
+ * inherit.  The output is the same as that of OSM_export_features(),
+ * except that a way also finds the nodes that come after it in the file.
+ *
+ * @param path  The input file, which must be seekable.
+ * @param num_shards  The number of worker processes, which split the
+ * threads of the options between them.
+ * @param out  The output stream.
+ * @param ep  The encoder of the output format.
+ * @param op  The options, or NULL for the defaults set by OSM_Options_init().
+ * @return 0 if successful, -1 in case of an error.
+ */
+
+int OSM_export_features_shards(const char *path, int num_shards, FILE *out, const OSM_Exporter *ep,
+                               const OSM_Options *op) {
+    FILE *in = fopen(path, "rb");
+    if (in == NULL) {
+        fprintf(stderr, "Cannot read the input file %s\n", path);
+        return -1;
+    }
+    OSM_Shard *shards = NULL;
+    uint64_t header_offset;
+    int n = OSM_Shards_plan(in, num_shards, &shards, &header_offset);
+    if (n < 0) {
+        fclose(in);
+        return -1;
+    }
+    ShardExport x;
+    memset(&x, 0, sizeof(ShardExport));
+    x.exporter = ep;
+    x.out = out;
+    x.last_shard = -1;
+    OSM_Options_init(&x.opts);
+    if (op != NULL) {
+        x.opts.threads = op->threads;
+        x.opts.cache_blocks = op->cache_blocks;
+    }
+    x.opts.threads = n > 0 && x.opts.threads / n > 1 ? x.opts.threads / n : 1;
+
+    int ret = 0, locations_on_ways = 0;
+    if (header_offset != UINT64_MAX) {
+        OSM_Block *bp = OSM_read_Block_at(in, header_offset, &x.opts);
+        if (bp == NULL)
+            ret = -1;
+        else
+            locations_on_ways = ((bp->required_features | bp->optional_features) &
+                                 OSM_FEATURE_LOCATIONS_ON_WAYS) != 0;
+        OSM_Block_free(bp);
+    }
+    fclose(in);
+    if (ret == 0 && !locations_on_ways) {
+        ret = OSM_Shards_run(path, shards, n, write_locations, gather_locations, &x);
+        x.table.nodes = (NodeLocation *)x.bytes;
+        x.table.count = x.size / sizeof(NodeLocation);
+        x.table.sorted = x.table.complete = 1;
+        for (size_t i = 1; i < x.table.count && x.table.sorted; i++)
+            x.table.sorted = x.table.nodes[i - 1].id < x.table.nodes[i].id;
+        if (!x.table.sorted)
+            qsort(x.table.nodes, x.table.count, sizeof(NodeLocation), compare_locations);
+        x.table.sorted = 1;
+    }
+    if (ret == 0)
+        ret = OSM_Shards_run(path, shards, n, export_shard, write_features, &x);
+    free(x.bytes);
+    free(shards);
+    return ret;
+}
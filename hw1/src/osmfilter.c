@@ -0,0 +1,629 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_AVX2_KERNEL
+#endif
+
+#include "osm.h"
+#include "osmpbf.h"
+#include "osmmap.h"
+#include "osmfilter.h"
+#include "strpool.h"
+#include "eliasfano.h"
+#include "debug.h"
+
+/*
+ * A compiled filter is a tree of predicates and boolean operators.
+ * Evaluation passes a selection vector down the tree: each predicate
+ * receives the sorted offsets of the entities still under consideration
+ * and writes the subset that satisfy it, so an AND evaluates its right
+ * operand only on what its left operand selected.
+ */
+
+typedef enum {
+    F_TYPE,
+    F_LAT,
+    F_LON,
+    F_ID,
+    F_TAG,
+    F_AND,
+    F_OR,
+    F_NOT
+} FilterOp;
+
+typedef struct FilterNode {
+    FilterOp op;
+    unsigned int type;          // F_TYPE
+    int64_t lo, hi;             // F_LAT, F_LON, F_ID; inclusive
+    uint32_t key, val;          // F_TAG; val is SP_NONE for any value
+    int never;                  // F_TAG whose strings are not in the map
+    struct FilterNode *left;
+    struct FilterNode *right;
+} FilterNode;
+
+struct OSM_Filter {
+    OSM_Map *map;
+    FilterNode *root;
+    int uses_ids;
+};
+
+/*
+ * The columns of one batch of entities of a single type.  Column pointers
+ * are offset to the first entity of the batch; lats and lons are NULL for
+ * ways, which have no coordinates.
+ */
+
+typedef struct Batch {
+    size_t first;
+    size_t count;
+    const OSM_Id *ids;
+    const OSM_Lat *lats;
+    const OSM_Lon *lons;
+    const OSM_TagColumn *tags;
+    unsigned int type;
+} Batch;
+
+typedef struct Parser {
+    const char *expr;
+    const char *p;
+    OSM_Map *map;
+    OSM_Filter *filter;
+} Parser;
+
+static void free_node(FilterNode *np) {
+    if (np == NULL) return;
+    free_node(np->left);
+    free_node(np->right);
+    free(np);
+}
+
+static FilterNode *new_node(FilterOp op) {
+    FilterNode *np = calloc(1, sizeof(FilterNode));
+    if (np != NULL)
+        np->op = op;
+    return np;
+}
+
+static void parse_error(Parser *pp, const char *msg) {
+    fprintf(stderr, "Filter error at offset %ld of '%s': %s\n",
+            (long)(pp->p - pp->expr), pp->expr, msg);
+}
+
+static int is_special(char c) {
+    return c == '&' || c == '|' || c == '!' || c == '(' || c == ')';
+}
+
+static void skip_space(Parser *pp) {
+    while (isspace((unsigned char)*pp->p))
+        pp->p++;
+}
+
+/*
+ * Parse a decimal number of degrees into nanodegrees, exactly.
+ */
+
+static int parse_degrees(const char *s, const char *end, int64_t *valuep) {
+    int neg = 0;
+    if (s < end && (*s == '-' || *s == '+'))
+        neg = *s++ == '-';
+    if (s == end) return -1;
+    int64_t whole = 0, frac = 0;
+    int digits = 0, frac_digits = 0;
+    for (; s < end && isdigit((unsigned char)*s); s++, digits++) {
+        whole = whole * 10 + (*s - '0');
+        if (whole > 360) return -1;
+    }
+    if (s < end && *s == '.') {
+        for (s++; s < end && isdigit((unsigned char)*s); s++, digits++) {
+            if (frac_digits == 9) return -1;
+            frac = frac * 10 + (*s - '0');
+            frac_digits++;
+        }
+    }
+    if (s != end || digits == 0) return -1;
+    for (; frac_digits < 9; frac_digits++)
+        frac *= 10;
+    int64_t value = whole * 1000000000 + frac;
+    *valuep = neg ? -value : value;
+    return 0;
+}
+
+static int parse_integer(const char *s, const char *end, int64_t *valuep) {
+    char buf[32];
+    if (end - s < 1 || end - s >= (long)sizeof(buf)) return -1;
+    memcpy(buf, s, end - s);
+    buf[end - s] = '\0';
+    char *rest;
+    errno = 0;
+    long long value = strtoll(buf, &rest, 10);
+    if (errno != 0 || *rest != '\0') return -1;
+    *valuep = value;
+    return 0;
+}
+
+/*
+ * Parse RANGE := [MIN]..[MAX] | VALUE, for a coordinate or id field.
+ */
+
+static int parse_range(const char *s, FilterNode *np) {
+    int (*parse)(const char *, const char *, int64_t *) =
+        np->op == F_ID ? parse_integer : parse_degrees;
+    const char *end = s + strlen(s);
+    const char *dots = strstr(s, "..");
+    if (dots == NULL) {
+        if (parse(s, end, &np->lo)) return -1;
+        np->hi = np->lo;
+        return 0;
+    }
+    np->lo = INT64_MIN;
+    np->hi = INT64_MAX;
+    if (dots > s && parse(s, dots, &np->lo)) return -1;
+    if (dots + 2 < end && parse(dots + 2, end, &np->hi)) return -1;
+    return 0;
+}
+
+/*
+ * Read one predicate word, removing quotes.  The offset of the first '='
+ * outside quotes is stored in *eqp (or -1), and *quotedp is set if any
+ * part of the value after it was quoted.
+ */
+
+static char *read_word(Parser *pp, long *eqp, int *quotedp) {
+    size_t len = strlen(pp->p);
+    char *word = malloc(len + 1);
+    if (word == NULL) return NULL;
+    size_t n = 0;
+    *eqp = -1;
+    *quotedp = 0;
+    while (*pp->p && !isspace((unsigned char)*pp->p) && !is_special(*pp->p)) {
+        if (*pp->p == '"') {
+            const char *close = strchr(pp->p + 1, '"');
+            if (close == NULL) {
+                parse_error(pp, "unterminated quote");
+                free(word);
+                return NULL;
+            }
+            memcpy(word + n, pp->p + 1, close - pp->p - 1);
+            n += close - pp->p - 1;
+            if (*eqp >= 0)
+                *quotedp = 1;
+            pp->p = close + 1;
+            continue;
+        }
+        if (*pp->p == '=' && *eqp < 0)
+            *eqp = n;
+        word[n++] = *pp->p++;
+    }
+    word[n] = '\0';
+    return word;
+}
+
+static FilterNode *parse_pred(Parser *pp) {
+    long eq;
+    int quoted;
+    const char *start = pp->p;
+    char *word = read_word(pp, &eq, &quoted);
+    if (word == NULL) return NULL;
+    if (pp->p == start) {
+        parse_error(pp, "predicate expected");
+        free(word);
+        return NULL;
+    }
+
+    FilterNode *np = NULL;
+    if (eq >= 0) {
+        np = new_node(F_TAG);
+        if (np == NULL) goto done;
+        const char *val = word + eq + 1;
+        np->val = SP_NONE;
+        np->key = pp->map ? SP_lookup(pp->map->strings, word, eq) : SP_NONE;
+        np->never = np->key == SP_NONE;
+        if (quoted || strcmp(val, "*") != 0) {
+            np->val = pp->map ? SP_lookup(pp->map->strings, val, strlen(val)) : SP_NONE;
+            np->never |= np->val == SP_NONE;
+        }
+    } else if (strcmp(word, "node") == 0 || strcmp(word, "way") == 0) {
+        np = new_node(F_TYPE);
+        if (np == NULL) goto done;
+        np->type = word[0] == 'n' ? OSM_TYPE_NODE : OSM_TYPE_WAY;
+    } else {
+        FilterOp op;
+        const char *range;
+        if (strncmp(word, "lat:", 4) == 0) {
+            op = F_LAT;
+            range = word + 4;
+        } else if (strncmp(word, "lon:", 4) == 0) {
+            op = F_LON;
+            range = word + 4;
+        } else if (strncmp(word, "id:", 3) == 0) {
+            op = F_ID;
+            range = word + 3;
+            pp->filter->uses_ids = 1;
+        } else {
+            pp->p = start;
+            parse_error(pp, "unknown predicate");
+            goto done;
+        }
+        np = new_node(op);
+        if (np == NULL) goto done;
+        if (parse_range(range, np)) {
+            pp->p = start;
+            parse_error(pp, "invalid range");
+            free_node(np);
+            np = NULL;
+        }
+    }
+
+done:
+    free(word);
+    return np;
+}
+
+static FilterNode *parse_or(Parser *pp);
+
+static FilterNode *parse_unary(Parser *pp) {
+    skip_space(pp);
+    if (*pp->p == '!') {
+        pp->p++;
+        FilterNode *operand = parse_unary(pp);
+        if (operand == NULL) return NULL;
+        FilterNode *np = new_node(F_NOT);
+        if (np == NULL) {
+            free_node(operand);
+            return NULL;
+        }
+        np->left = operand;
+        return np;
+    }
+    if (*pp->p == '(') {
+        pp->p++;
+        FilterNode *np = parse_or(pp);
+        if (np == NULL) return NULL;
+        skip_space(pp);
+        if (*pp->p != ')') {
+            parse_error(pp, "')' expected");
+            free_node(np);
+            return NULL;
+        }
+        pp->p++;
+        return np;
+    }
+    return parse_pred(pp);
+}
+
+static FilterNode *parse_binary(Parser *pp, FilterOp op, char sym,
+                                FilterNode *(*parse_operand)(Parser *)) {
+    FilterNode *left = parse_operand(pp);
+    for (;;) {
+        if (left == NULL) return NULL;
+        skip_space(pp);
+        if (*pp->p != sym) return left;
+        pp->p++;
+        FilterNode *right = parse_operand(pp);
+        FilterNode *np = right ? new_node(op) : NULL;
+        if (np == NULL) {
+            free_node(left);
+            free_node(right);
+            return NULL;
+        }
+        np->left = left;
+        np->right = right;
+        left = np;
+    }
+}
+
+static FilterNode *parse_and(Parser *pp) {
+    return parse_binary(pp, F_AND, '&', parse_unary);
+}
+
+static FilterNode *parse_or(Parser *pp) {
+    return parse_binary(pp, F_OR, '|', parse_and);
+}
+
+/* Select the entities [i, n) of a dense batch after the k already selected */
+
+static size_t select_range_tail(const int64_t *col, size_t i, size_t n, int64_t lo, int64_t hi,
+                                uint16_t *out, size_t k) {
+    for (; i < n; i++) {
+        out[k] = i;
+        k += (col[i] >= lo) & (col[i] <= hi);
+    }
+    return k;
+}
+
+#ifdef HAVE_AVX2_KERNEL
+/*
+ * The AVX2 kernel, compiled for AVX2 whatever the target of the build, and
+ * only called once the CPU is known to support it.
+ */
+
+__attribute__((target("avx2")))
+static size_t select_range_avx2(const int64_t *col, size_t n, int64_t lo, int64_t hi,
+                                uint16_t *out) {
+    size_t k = 0, i = 0;
+    __m256i vlo = _mm256_set1_epi64x(lo);
+    __m256i vhi = _mm256_set1_epi64x(hi);
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(col + i));
+        __m256i outside = _mm256_or_si256(_mm256_cmpgt_epi64(vlo, v), _mm256_cmpgt_epi64(v, vhi));
+        unsigned int mask = ~_mm256_movemask_pd(_mm256_castsi256_pd(outside)) & 0xF;
+        while (mask) {
+            out[k++] = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    return select_range_tail(col, i, n, lo, hi, out, k);
+}
+#endif
+
+/*
+ * Select the entities of a dense batch, [0, n), whose value in a column
+ * lies in [lo, hi].  The AVX2 kernel is chosen at run time, so that one
+ * build runs on any x86 CPU.
+ */
+
+static size_t select_range_dense(const int64_t *col, size_t n, int64_t lo, int64_t hi,
+                                 uint16_t *out) {
+#ifdef HAVE_AVX2_KERNEL
+    if (__builtin_cpu_supports("avx2"))
+        return select_range_avx2(col, n, lo, hi, out);
+#endif
+    return select_range_tail(col, 0, n, lo, hi, out, 0);
+}
+
+/*
+ * As select_range_dense(), but only for the entities in a selection vector.
+ * The output may overwrite the input.
+ */
+
+static size_t select_range(const int64_t *col, const uint16_t *in, size_t n,
+                           int64_t lo, int64_t hi, uint16_t *out) {
+    size_t k = 0;
+    for (size_t j = 0; j < n; j++) {
+        uint16_t i = in[j];
+        out[k] = i;
+        k += (col[i] >= lo) & (col[i] <= hi);
+    }
+    return k;
+}
+
+static size_t select_tag(const FilterNode *np, const Batch *bp, const uint16_t *in,
+                         size_t n, uint16_t *out) {
+    const OSM_TagColumn *tp = bp->tags;
+    size_t k = 0;
+    for (size_t j = 0; j < n; j++) {
+        size_t e = bp->first + in[j];
+        int hit = 0;
+        for (size_t t = OSM_TagColumn_start(tp, e); t < OSM_TagColumn_end(tp, e) && !hit; t++)
+            hit = tp->keys[t] == np->key && (np->val == SP_NONE || tp->vals[t] == np->val);
+        out[k] = in[j];
+        k += hit;
+    }
+    return k;
+}
+
+/* a \ b, where b is a subset of a; out may overwrite a. */
+
+static size_t sel_difference(const uint16_t *a, size_t na, const uint16_t *b, size_t nb,
+                             uint16_t *out) {
+    size_t k = 0, j = 0;
+    for (size_t i = 0; i < na; i++) {
+        if (j < nb && b[j] == a[i]) {
+            j++;
+            continue;
+        }
+        out[k++] = a[i];
+    }
+    return k;
+}
+
+/* Merge two disjoint sorted selections; out must not overlap either. */
+
+static size_t sel_union(const uint16_t *a, size_t na, const uint16_t *b, size_t nb,
+                        uint16_t *out) {
+    size_t i = 0, j = 0, k = 0;
+    while (i < na && j < nb)
+        out[k++] = a[i] < b[j] ? a[i++] : b[j++];
+    while (i < na)
+        out[k++] = a[i++];
+    while (j < nb)
+        out[k++] = b[j++];
+    return k;
+}
+
+static size_t eval(const FilterNode *np, const Batch *bp, const uint16_t *in, size_t n,
+                   uint16_t *out) {
+    if (n == 0) return 0;
+    int dense = n == bp->count;
+    const int64_t *col = NULL;
+    uint16_t buf1[OSM_BATCH_SIZE], buf2[OSM_BATCH_SIZE];
+    size_t n1, n2;
+
+    switch (np->op) {
+    case F_TYPE:
+        if (np->type != bp->type) return 0;
+        if (out != in)
+            memcpy(out, in, n * sizeof(uint16_t));
+        return n;
+    case F_LAT:
+    case F_LON:
+    case F_ID:
+        col = np->op == F_LAT ? bp->lats : np->op == F_LON ? bp->lons : bp->ids;
+        if (col == NULL) return 0;
+        if (dense)
+            return select_range_dense(col, n, np->lo, np->hi, out);
+        return select_range(col, in, n, np->lo, np->hi, out);
+    case F_TAG:
+        if (np->never) return 0;
+        return select_tag(np, bp, in, n, out);
+    case F_AND:
+        n = eval(np->left, bp, in, n, out);
+        return eval(np->right, bp, out, n, out);
+    case F_OR:
+        n1 = eval(np->left, bp, in, n, buf1);
+        if (n1 == n) {
+            memcpy(out, buf1, n * sizeof(uint16_t));
+            return n;
+        }
+        n2 = sel_difference(in, n, buf1, n1, buf2);
+        n2 = eval(np->right, bp, buf2, n2, buf2);
+        return sel_union(buf1, n1, buf2, n2, out);
+    case F_NOT:
+        n1 = eval(np->left, bp, in, n, buf1);
+        return sel_difference(in, n, buf1, n1, out);
+    }
+    return 0;
+}
+
+/**
+ * @brief  Compile a filter expression against a map.
+ * @details  Keys and values are looked up in the string pool of the map,
+ * so the filter may only be evaluated against that map.  A tag that does
+ * not occur anywhere in the map can never match.  If mp is NULL, only the
+ * syntax of the expression is checked and the result is not usable for
+ * evaluation, though it must still be freed.
+ *
+ * @param mp  The map against which the filter will be evaluated, or NULL.
+ * @param expr  The filter expression; see osmfilter.h for the syntax.
+ * @return  The compiled filter, or NULL if the expression is invalid, in
+ * which case an error message has been printed on stderr.
+ */
+
+OSM_Filter *OSM_Filter_compile(OSM_Map *mp, const char *expr) {
+    OSM_Filter *fp = calloc(1, sizeof(OSM_Filter));
+    if (fp == NULL) return NULL;
+    fp->map = mp;
+    Parser parser = { expr, expr, mp, fp };
+    fp->root = parse_or(&parser);
+    if (fp->root != NULL) {
+        skip_space(&parser);
+        if (*parser.p != '\0') {
+            parse_error(&parser, "unexpected character");
+            free_node(fp->root);
+            fp->root = NULL;
+        }
+    }
+    if (fp->root == NULL) {
+        free(fp);
+        return NULL;
+    }
+    return fp;
+}
+
+/**
+ * @brief  Free a filter returned by OSM_Filter_compile().
+ */
+
+void OSM_Filter_free(OSM_Filter *fp) {
+    if (fp == NULL) return;
+    free_node(fp->root);
+    free(fp);
+}
+
+/**
+ * @brief  Evaluate a filter over one batch of nodes or ways.
+ * @details  A filter may be evaluated concurrently from several threads.
+ *
+ * @param fp  The filter.
+ * @param type  OSM_TYPE_NODE or OSM_TYPE_WAY.
+ * @param first  Index of the first entity of the batch.
+ * @param count  Number of entities in the batch, at most OSM_BATCH_SIZE.
+ * @param sel  Caller-supplied array of count elements, in which the
+ * offsets from first of the selected entities are stored in increasing order.
+ * @return  The number of entities selected, which is 0 if the arguments
+ * do not describe a valid batch.
+ */
+
+size_t OSM_Filter_select(OSM_Filter *fp, unsigned int type, size_t first, size_t count,
+                         uint16_t *sel) {
+    OSM_Map *mp = fp ? fp->map : NULL;
+    if (mp == NULL || count == 0 || count > OSM_BATCH_SIZE) return 0;
+
+    Batch batch = { first, count, NULL, NULL, NULL, NULL, type };
+    const OSM_IdColumn *ids;
+    if (type == OSM_TYPE_NODE) {
+        if (first > mp->num_nodes || count > mp->num_nodes - first) return 0;
+        ids = &mp->node_ids;
+        batch.lats = mp->node_lats + first;
+        batch.lons = mp->node_lons + first;
+        batch.tags = &mp->node_tags;
+    } else if (type == OSM_TYPE_WAY) {
+        if (first > mp->num_ways || count > mp->num_ways - first) return 0;
+        ids = &mp->way_ids;
+        batch.tags = &mp->way_tags;
+    } else {
+        return 0;
+    }
+
+    OSM_Id idbuf[OSM_BATCH_SIZE];
+    if (ids->ef == NULL) {
+        batch.ids = ids->ids + first;
+    } else if (fp->uses_ids) {
+        EF_decode(ids->ef, first, count, idbuf);
+        batch.ids = idbuf;
+    }
+
+    for (size_t i = 0; i < count; i++)
+        sel[i] = i;
+    return eval(fp->root, &batch, sel, count, sel);
+}
+
+/**
+ * @brief  Call a function on each node and way of a map that is selected
+ * by a filter, in index order, nodes before ways.
+ *
+ * @param fp  The filter.
+ * @param types  Mask of the entity types to visit.
+ * @param fn  The function to call with the type and index of each selected
+ * entity, which returns nonzero to stop early.
+ * @param arg  Argument passed through to fn.
+ * @return  0 if all entities were visited, otherwise the nonzero value
+ * returned by fn.
+ */
+
+int OSM_Filter_foreach(OSM_Filter *fp, unsigned int types, OSM_MatchFunc *fn, void *arg) {
+    if (fp == NULL || fp->map == NULL) return -1;
+    unsigned int type_list[2] = { OSM_TYPE_NODE, OSM_TYPE_WAY };
+    size_t counts[2] = { fp->map->num_nodes, fp->map->num_ways };
+    uint16_t sel[OSM_BATCH_SIZE];
+    for (int t = 0; t < 2; t++) {
+        if (!(types & type_list[t])) continue;
+        for (size_t first = 0; first < counts[t]; first += OSM_BATCH_SIZE) {
+            size_t count = counts[t] - first;
+            if (count > OSM_BATCH_SIZE) count = OSM_BATCH_SIZE;
+            size_t n = OSM_Filter_select(fp, type_list[t], first, count, sel);
+            for (size_t j = 0; j < n; j++) {
+                int ret = fn(arg, type_list[t], first + sel[j]);
+                if (ret) return ret;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief  Count the entities of one type that are selected by a filter.
+ *
+ * @param fp  The filter.
+ * @param type  OSM_TYPE_NODE or OSM_TYPE_WAY.
+ * @return  The number of selected entities.
+ */
+
+size_t OSM_Filter_count(OSM_Filter *fp, unsigned int type) {
+    if (fp == NULL || fp->map == NULL) return 0;
+    size_t total = type == OSM_TYPE_NODE ? fp->map->num_nodes :
+                   type == OSM_TYPE_WAY ? fp->map->num_ways : 0;
+    uint16_t sel[OSM_BATCH_SIZE];
+    size_t matched = 0;
+    for (size_t first = 0; first < total; first += OSM_BATCH_SIZE) {
+        size_t count = total - first;
+        if (count > OSM_BATCH_SIZE) count = OSM_BATCH_SIZE;
+        matched += OSM_Filter_select(fp, type, first, count, sel);
+    }
+    return matched;
+}
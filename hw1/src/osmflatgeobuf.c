@@ -0,0 +1,596 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "osmflatgeobuf.h"
+#include "osmexport.h"
+#include "debug.h"
+
+/*
+ * A FlatGeobuf file is its magic bytes, a size-prefixed FlatBuffer header,
+ * the nodes of the R-tree, and then the size-prefixed FlatBuffer features.
+ * The FlatBuffers are written front to back: a table is preceded by its
+ * vtable and followed by the vectors, strings and tables it refers to,
+ * whose offsets are filled in once their positions are known.  Everything
+ * is little-endian, and scalars are aligned from the start of the buffer.
+ */
+
+static const unsigned char fgb_magic[8] = { 'f', 'g', 'b', 3, 'f', 'g', 'b', 0 };
+
+#define FGB_UNKNOWN         0       // GeometryType
+#define FGB_POINT           1
+#define FGB_LINESTRING      2
+#define FGB_POLYGON         3
+
+#define FGB_LONG            7       // ColumnType
+#define FGB_STRING          11
+#define FGB_JSON            12
+
+#define COLUMN_TYPE         0       // Columns of the features
+#define COLUMN_ID           1
+#define COLUMN_TAGS         2
+#define NUM_COLUMNS         3
+
+#define HILBERT_MAX         0xffff
+
+/*
+ * Before its size prefix, each feature in the temporary file has its
+ * bounding box, which is dropped when it is copied to the output.
+ */
+
+typedef struct FeatureItem {
+    double min_x, min_y, max_x, max_y;
+    uint64_t offset;            // Offset of the size prefix in the temporary file
+    uint32_t size;              // Size of the feature, with its prefix
+    uint32_t hilbert;
+} FeatureItem;
+
+typedef struct NodeItem {
+    double min_x, min_y, max_x, max_y;
+    uint64_t offset;            // Byte offset of a feature, or index of a first child
+} NodeItem;
+
+/*
+ * Threads first compute the Hilbert values of one run of items each and
+ * sort it, then merge pairs of adjacent sorted runs, doubling their length
+ * in each round, from one array into the other.
+ */
+
+typedef struct SortJob {
+    FeatureItem *items;
+    FeatureItem *scratch;
+    size_t *run_start;
+    int num_runs;
+    int step;                   // Runs per half of a merge, or 0 to sort the runs
+    double min_x, min_y, width, height;
+    size_t next;                // Next task to be claimed
+} SortJob;
+
+static void put_le(OSM_ExportBuffer *bp, uint64_t v, int size) {
+    unsigned char bytes[8];
+    for (int i = 0; i < size; i++)
+        bytes[i] = v >> (8 * i);
+    OSM_ExportBuffer_append(bp, bytes, size);
+}
+
+static void put_double(OSM_ExportBuffer *bp, double d) {
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    put_le(bp, bits, 8);
+}
+
+static void set_le32(OSM_ExportBuffer *bp, size_t pos, uint32_t v) {
+    if (bp->error) return;
+    for (int i = 0; i < 4; i++)
+        bp->data[pos + i] = v >> (8 * i);
+}
+
+/* Point the offset field at pos to the current end of the buffer */
+
+static void set_offset(OSM_ExportBuffer *bp, size_t pos) {
+    set_le32(bp, pos, bp->len - pos);
+}
+
+/*
+ * Pad the buffer with zeros until the position extra bytes on is aligned
+ * from the start of the FlatBuffer at base.
+ */
+
+static void align(OSM_ExportBuffer *bp, size_t base, size_t alignment, size_t extra) {
+    static const char zeros[8];
+    size_t pad = (alignment - (bp->len + extra - base) % alignment) % alignment;
+    OSM_ExportBuffer_append(bp, zeros, pad);
+}
+
+/*
+ * Write the vtable of a table whose fields are at the given offsets from
+ * its start, 0 for absent ones, then start the table, 8-byte aligned, with
+ * the offset back to its vtable.  Returns the position of the table.
+ */
+
+static size_t begin_table(OSM_ExportBuffer *bp, size_t base, const uint16_t *fields, int n,
+                          uint16_t size) {
+    align(bp, base, 2, 0);
+    size_t vtable = bp->len;
+    put_le(bp, 4 + 2 * n, 2);
+    put_le(bp, size, 2);
+    for (int i = 0; i < n; i++)
+        put_le(bp, fields[i], 2);
+    align(bp, base, 8, 0);
+    size_t table = bp->len;
+    put_le(bp, table - vtable, 4);
+    return table;
+}
+
+static void put_string(OSM_ExportBuffer *bp, size_t base, const char *str) {
+    align(bp, base, 4, 0);
+    put_le(bp, strlen(str), 4);
+    OSM_ExportBuffer_append(bp, str, strlen(str) + 1);
+}
+
+/*
+ * Append a feature to a buffer as its bounding box and its size-prefixed
+ * FlatBuffer.  A Point has one location, a LineString n, and a Polygon
+ * a single ring of n.
+ */
+
+static void encode_feature(OSM_ExportBuffer *bp, const char *type, OSM_Id id, OSM_Block *block,
+                           const OSM_BlockTags *tp, int i, int geometry_type,
+                           const int64_t *lats, const int64_t *lons, size_t n) {
+    int64_t min_lat = lats[0], max_lat = lats[0], min_lon = lons[0], max_lon = lons[0];
+    for (size_t r = 1; r < n; r++) {
+        if (lats[r] < min_lat) min_lat = lats[r];
+        if (lats[r] > max_lat) max_lat = lats[r];
+        if (lons[r] < min_lon) min_lon = lons[r];
+        if (lons[r] > max_lon) max_lon = lons[r];
+    }
+    double box[4] = { min_lon / 1e7, min_lat / 1e7, max_lon / 1e7, max_lat / 1e7 };
+    OSM_ExportBuffer_append(bp, box, sizeof(box));
+    size_t prefix = bp->len;
+    put_le(bp, 0, 4);
+    size_t base = bp->len;
+    put_le(bp, 0, 4);
+
+    static const uint16_t feature_fields[] = { 4, 8 };
+    size_t feature = begin_table(bp, base, feature_fields, 2, 12);
+    put_le(bp, 0, 4);
+    put_le(bp, 0, 4);
+    set_le32(bp, base, feature - base);
+
+    uint16_t geometry_fields[] = { geometry_type == FGB_POLYGON ? 4 : 0, 8, 0, 0, 0, 0, 12 };
+    size_t geometry = begin_table(bp, base, geometry_fields, 7, 13);
+    set_le32(bp, feature + 4, geometry - (feature + 4));
+    put_le(bp, 0, 4);
+    put_le(bp, 0, 4);
+    put_le(bp, geometry_type, 1);
+    if (geometry_type == FGB_POLYGON) {
+        align(bp, base, 4, 0);
+        set_offset(bp, geometry + 4);
+        put_le(bp, 1, 4);
+        put_le(bp, n, 4);
+    }
+    align(bp, base, 8, 4);
+    set_offset(bp, geometry + 8);
+    put_le(bp, 2 * n, 4);
+    for (size_t r = 0; r < n; r++) {
+        put_double(bp, lons[r] / 1e7);
+        put_double(bp, lats[r] / 1e7);
+    }
+
+    align(bp, base, 4, 0);
+    set_offset(bp, feature + 8);
+    size_t properties = bp->len;
+    put_le(bp, 0, 4);
+    put_le(bp, COLUMN_TYPE, 2);
+    put_le(bp, strlen(type), 4);
+    OSM_ExportBuffer_append(bp, type, strlen(type));
+    put_le(bp, COLUMN_ID, 2);
+    put_le(bp, id, 8);
+    if (tp->start[i + 1] > tp->start[i]) {
+        put_le(bp, COLUMN_TAGS, 2);
+        size_t len = bp->len;
+        put_le(bp, 0, 4);
+        OSM_ExportBuffer_append_tags(bp, block, tp, i);
+        set_le32(bp, len, bp->len - len - 4);
+    }
+    set_le32(bp, properties, bp->len - properties - 4);
+    set_le32(bp, prefix, bp->len - base);
+}
+
+static void encode_node(void *arg, OSM_ExportBuffer *bp, OSM_Block *block, int i) {
+    int64_t lat = block->node_lats[i] / 100, lon = block->node_lons[i] / 100;
+    encode_feature(bp, "node", block->node_ids[i], block, &block->node_tags, i, FGB_POINT,
+                   &lat, &lon, 1);
+}
+
+static void encode_way(void *arg, OSM_ExportBuffer *bp, OSM_Block *block, int i,
+                       const int64_t *lats, const int64_t *lons, size_t n, int polygon) {
+    encode_feature(bp, "way", block->way_ids[i], block, &block->way_tags, i,
+                   polygon ? FGB_POLYGON : FGB_LINESTRING, lats, lons, n);
+}
+
+/*
+ * Read back the bounding boxes, offsets and sizes of the features in the
+ * temporary file, and their extent.
+ */
+
+static int scan_features(FILE *tmp, FeatureItem **itemsp, size_t *countp, NodeItem *extent) {
+    size_t count = 0, cap = 1024;
+    FeatureItem *items = malloc(cap * sizeof(FeatureItem));
+    if (items == NULL) return -1;
+    *extent = (NodeItem){ 180, 90, -180, -90, 0 };
+    rewind(tmp);
+    unsigned char head[4 * sizeof(double) + 4];
+    while (fread(head, 1, sizeof(head), tmp) == sizeof(head)) {
+        if (count == cap) {
+            FeatureItem *grown = realloc(items, 2 * cap * sizeof(FeatureItem));
+            if (grown == NULL) {
+                free(items);
+                return -1;
+            }
+            items = grown;
+            cap *= 2;
+        }
+        FeatureItem *ip = &items[count++];
+        memcpy(&ip->min_x, head, 4 * sizeof(double));
+        uint32_t size = head[32] | head[33] << 8 | head[34] << 16 | (uint32_t)head[35] << 24;
+        ip->offset = ftello(tmp) - 4;
+        ip->size = size + 4;
+        if (ip->min_x < extent->min_x) extent->min_x = ip->min_x;
+        if (ip->min_y < extent->min_y) extent->min_y = ip->min_y;
+        if (ip->max_x > extent->max_x) extent->max_x = ip->max_x;
+        if (ip->max_y > extent->max_y) extent->max_y = ip->max_y;
+        if (fseeko(tmp, size, SEEK_CUR) != 0) {
+            free(items);
+            return -1;
+        }
+    }
+    *itemsp = items;
+    *countp = count;
+    return ferror(tmp) ? -1 : 0;
+}
+
+/*
+ * The position of a point along the Hilbert curve over a 2^16 by 2^16
+ * grid, computed without branches or loops, as in FlatGeobuf's own
+ * implementation.
+ */
+
+static uint32_t hilbert(uint32_t x, uint32_t y) {
+    uint32_t a = x ^ y;
+    uint32_t b = 0xffff ^ a;
+    uint32_t c = 0xffff ^ (x | y);
+    uint32_t d = x & (y ^ 0xffff);
+
+    uint32_t A = a | (b >> 1);
+    uint32_t B = (a >> 1) ^ a;
+    uint32_t C = ((c >> 1) ^ (b & (d >> 1))) ^ c;
+    uint32_t D = ((a & (c >> 1)) ^ (d >> 1)) ^ d;
+
+    a = A; b = B; c = C; d = D;
+    A = (a & (a >> 2)) ^ (b & (b >> 2));
+    B = (a & (b >> 2)) ^ (b & ((a ^ b) >> 2));
+    C ^= (a & (c >> 2)) ^ (b & (d >> 2));
+    D ^= (b & (c >> 2)) ^ ((a ^ b) & (d >> 2));
+
+    a = A; b = B; c = C; d = D;
+    A = (a & (a >> 4)) ^ (b & (b >> 4));
+    B = (a & (b >> 4)) ^ (b & ((a ^ b) >> 4));
+    C ^= (a & (c >> 4)) ^ (b & (d >> 4));
+    D ^= (b & (c >> 4)) ^ ((a ^ b) & (d >> 4));
+
+    a = A; b = B; c = C; d = D;
+    C ^= (a & (c >> 8)) ^ (b & (d >> 8));
+    D ^= (b & (c >> 8)) ^ ((a ^ b) & (d >> 8));
+
+    a = C ^ (C >> 1);
+    b = D ^ (D >> 1);
+
+    uint32_t i0 = x ^ y;
+    uint32_t i1 = b | (0xffff ^ (i0 | a));
+
+    i0 = (i0 | (i0 << 8)) & 0x00ff00ff;
+    i0 = (i0 | (i0 << 4)) & 0x0f0f0f0f;
+    i0 = (i0 | (i0 << 2)) & 0x33333333;
+    i0 = (i0 | (i0 << 1)) & 0x55555555;
+
+    i1 = (i1 | (i1 << 8)) & 0x00ff00ff;
+    i1 = (i1 | (i1 << 4)) & 0x0f0f0f0f;
+    i1 = (i1 | (i1 << 2)) & 0x33333333;
+    i1 = (i1 | (i1 << 1)) & 0x55555555;
+
+    return (i1 << 1) | i0;
+}
+
+/* Items by decreasing Hilbert value, as FlatGeobuf orders them, then by offset */
+
+static int compare_items(const void *a, const void *b) {
+    const FeatureItem *x = a, *y = b;
+    if (x->hilbert != y->hilbert)
+        return x->hilbert < y->hilbert ? 1 : -1;
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+static void sort_run(SortJob *jp, int r) {
+    for (size_t i = jp->run_start[r]; i < jp->run_start[r + 1]; i++) {
+        FeatureItem *ip = &jp->items[i];
+        uint32_t x = 0, y = 0;
+        if (jp->width > 0)
+            x = HILBERT_MAX * ((ip->min_x + ip->max_x) / 2 - jp->min_x) / jp->width;
+        if (jp->height > 0)
+            y = HILBERT_MAX * ((ip->min_y + ip->max_y) / 2 - jp->min_y) / jp->height;
+        ip->hilbert = hilbert(x, y);
+    }
+    qsort(jp->items + jp->run_start[r], jp->run_start[r + 1] - jp->run_start[r],
+          sizeof(FeatureItem), compare_items);
+}
+
+static void merge_runs(SortJob *jp, int r) {
+    int mid = r + jp->step < jp->num_runs ? r + jp->step : jp->num_runs;
+    int end = r + 2 * jp->step < jp->num_runs ? r + 2 * jp->step : jp->num_runs;
+    size_t i = jp->run_start[r], j = jp->run_start[mid], k = i;
+    size_t i_end = j, j_end = jp->run_start[end];
+    while (i < i_end && j < j_end)
+        jp->scratch[k++] = compare_items(&jp->items[j], &jp->items[i]) < 0 ? jp->items[j++] : jp->items[i++];
+    while (i < i_end)
+        jp->scratch[k++] = jp->items[i++];
+    while (j < j_end)
+        jp->scratch[k++] = jp->items[j++];
+}
+
+static void *sort_worker(void *arg) {
+    SortJob *jp = arg;
+    for (;;) {
+        size_t task = __atomic_fetch_add(&jp->next, 1, __ATOMIC_RELAXED);
+        if (jp->step == 0) {
+            if (task >= (size_t)jp->num_runs) break;
+            sort_run(jp, task);
+        } else {
+            if (task * 2 * jp->step >= (size_t)jp->num_runs) break;
+            merge_runs(jp, task * 2 * jp->step);
+        }
+    }
+    return NULL;
+}
+
+static void run_sort_pass(SortJob *jp, int threads) {
+    pthread_t tids[threads];
+    int started = 0;
+    jp->next = 0;
+    for (int t = 1; t < threads; t++) {
+        if (pthread_create(&tids[t], NULL, sort_worker, jp) != 0)
+            break;
+        started++;
+    }
+    sort_worker(jp);
+    for (int t = 1; t <= started; t++)
+        pthread_join(tids[t], NULL);
+}
+
+/*
+ * Sort the items by Hilbert value over the extent, returning the array
+ * that holds them in order, which is either items or scratch.
+ */
+
+static FeatureItem *hilbert_sort(FeatureItem *items, FeatureItem *scratch, size_t count,
+                                 const NodeItem *extent, int threads) {
+    size_t run_start[threads + 1];
+    for (int t = 0; t <= threads; t++)
+        run_start[t] = count * t / threads;
+    SortJob job = { items, scratch, run_start, threads, 0, extent->min_x, extent->min_y,
+                    extent->max_x - extent->min_x, extent->max_y - extent->min_y, 0 };
+    run_sort_pass(&job, threads);
+    for (job.step = 1; job.step < threads; job.step *= 2) {
+        run_sort_pass(&job, threads);
+        FeatureItem *sorted = job.scratch;
+        job.scratch = job.items;
+        job.items = sorted;
+    }
+    return job.items;
+}
+
+/*
+ * Build the packed R-tree over the sorted items.  The levels are stored
+ * root first, with the leaves last, and each node of a level above them
+ * covers up to OSM_FGB_NODE_SIZE consecutive nodes of the level below.
+ */
+
+static NodeItem *build_tree(const FeatureItem *items, size_t count, size_t *num_nodesp) {
+    size_t level_size[64], level_start[64];
+    int levels = 0;
+    size_t n = count, num_nodes = count;
+    level_size[levels++] = n;
+    do {
+        n = (n + OSM_FGB_NODE_SIZE - 1) / OSM_FGB_NODE_SIZE;
+        num_nodes += n;
+        level_size[levels++] = n;
+    } while (n != 1);
+    size_t start = num_nodes;
+    for (int l = 0; l < levels; l++) {
+        start -= level_size[l];
+        level_start[l] = start;
+    }
+
+    NodeItem *nodes = malloc(num_nodes * sizeof(NodeItem));
+    if (nodes == NULL) return NULL;
+    uint64_t offset = 0;
+    for (size_t i = 0; i < count; i++) {
+        nodes[level_start[0] + i] = (NodeItem){ items[i].min_x, items[i].min_y,
+                                                items[i].max_x, items[i].max_y, offset };
+        offset += items[i].size;
+    }
+    for (int l = 0; l + 1 < levels; l++) {
+        size_t pos = level_start[l], end = level_start[l] + level_size[l];
+        size_t parent = level_start[l + 1];
+        while (pos < end) {
+            NodeItem node = { nodes[pos].min_x, nodes[pos].min_y, nodes[pos].max_x, nodes[pos].max_y, pos };
+            for (int j = 0; j < OSM_FGB_NODE_SIZE && pos < end; j++, pos++) {
+                if (nodes[pos].min_x < node.min_x) node.min_x = nodes[pos].min_x;
+                if (nodes[pos].min_y < node.min_y) node.min_y = nodes[pos].min_y;
+                if (nodes[pos].max_x > node.max_x) node.max_x = nodes[pos].max_x;
+                if (nodes[pos].max_y > node.max_y) node.max_y = nodes[pos].max_y;
+            }
+            nodes[parent++] = node;
+        }
+    }
+    *num_nodesp = num_nodes;
+    return nodes;
+}
+
+/*
+ * Append the size-prefixed header, with its columns and CRS.  An empty file
+ * has no index, which a node size of 0 declares.
+ */
+
+static void encode_header(OSM_ExportBuffer *bp, size_t count, const NodeItem *extent) {
+    static const char *column_names[NUM_COLUMNS] = { "osm_type", "osm_id", "tags" };
+    static const int column_types[NUM_COLUMNS] = { FGB_STRING, FGB_LONG, FGB_JSON };
+    put_le(bp, 0, 4);
+    size_t base = bp->len;
+    put_le(bp, 0, 4);
+
+    uint16_t header_fields[] = { 0, count > 0 ? 4 : 0, 26, 0, 0, 0, 0, 8, 16, 24, 12 };
+    size_t header = begin_table(bp, base, header_fields, 11, 27);
+    put_le(bp, 0, 4);
+    put_le(bp, 0, 4);
+    put_le(bp, 0, 4);
+    put_le(bp, count, 8);
+    put_le(bp, count > 0 ? OSM_FGB_NODE_SIZE : 0, 2);
+    put_le(bp, FGB_UNKNOWN, 1);
+    set_le32(bp, base, header - base);
+
+    if (count > 0) {
+        align(bp, base, 8, 4);
+        set_offset(bp, header + 4);
+        put_le(bp, 4, 4);
+        put_double(bp, extent->min_x);
+        put_double(bp, extent->min_y);
+        put_double(bp, extent->max_x);
+        put_double(bp, extent->max_y);
+    }
+
+    align(bp, base, 4, 0);
+    set_offset(bp, header + 8);
+    put_le(bp, NUM_COLUMNS, 4);
+    size_t slots = bp->len;
+    for (int c = 0; c < NUM_COLUMNS; c++)
+        put_le(bp, 0, 4);
+    static const uint16_t column_fields[] = { 4, 8 };
+    for (int c = 0; c < NUM_COLUMNS; c++) {
+        size_t column = begin_table(bp, base, column_fields, 2, 9);
+        set_le32(bp, slots + 4 * c, column - (slots + 4 * c));
+        put_le(bp, 0, 4);
+        put_le(bp, column_types[c], 1);
+        align(bp, base, 4, 0);
+        set_offset(bp, column + 4);
+        put_string(bp, base, column_names[c]);
+    }
+
+    static const uint16_t crs_fields[] = { 4, 8 };
+    size_t crs = begin_table(bp, base, crs_fields, 2, 12);
+    set_le32(bp, header + 12, crs - (header + 12));
+    put_le(bp, 0, 4);
+    put_le(bp, 4326, 4);
+    align(bp, base, 4, 0);
+    set_offset(bp, crs + 4);
+    put_string(bp, base, "EPSG");
+    set_le32(bp, 0, bp->len - base);
+}
+
+/*
+ * Write the header, the tree and then the features, copied from the
+ * temporary file in the order of the sorted items.
+ */
+
+static int write_file(FILE *tmp, FILE *out, const FeatureItem *items, size_t count,
+                      const NodeItem *extent) {
+    OSM_ExportBuffer buf = { NULL, 0, 0, 0 };
+    fwrite(fgb_magic, 1, sizeof(fgb_magic), out);
+    encode_header(&buf, count, extent);
+    if (!buf.error)
+        fwrite(buf.data, 1, buf.len, out);
+    int ret = buf.error ? -1 : 0;
+
+    if (ret == 0 && count > 0) {
+        size_t num_nodes;
+        NodeItem *nodes = build_tree(items, count, &num_nodes);
+        if (nodes == NULL) ret = -1;
+        for (size_t i = 0; ret == 0 && i < num_nodes; i++) {
+            buf.len = 0;
+            put_double(&buf, nodes[i].min_x);
+            put_double(&buf, nodes[i].min_y);
+            put_double(&buf, nodes[i].max_x);
+            put_double(&buf, nodes[i].max_y);
+            put_le(&buf, nodes[i].offset, 8);
+            if (buf.error || fwrite(buf.data, 1, buf.len, out) != buf.len)
+                ret = -1;
+        }
+        free(nodes);
+    }
+
+    for (size_t i = 0; ret == 0 && i < count; i++) {
+        if (buf.cap < items[i].size) {
+            char *data = realloc(buf.data, items[i].size);
+            if (data == NULL) {
+                ret = -1;
+                break;
+            }
+            buf.data = data;
+            buf.cap = items[i].size;
+        }
+        if (fseeko(tmp, items[i].offset, SEEK_SET) != 0 ||
+            fread(buf.data, 1, items[i].size, tmp) != items[i].size ||
+            fwrite(buf.data, 1, items[i].size, out) != items[i].size)
+            ret = -1;
+    }
+    free(buf.data);
+    return ret;
+}
+
+/**
+ * @brief  Export the tagged nodes and the ways of an OSM PBF input stream
+ * as FlatGeobuf, with a packed Hilbert R-tree index.
+ * @details  The input is read once, as a stream, by OSM_export_features(),
+ * which encodes the features in parallel into a temporary file; the items
+ * of the index are then sorted in parallel.  Ways whose nodes are not in
+ * the input lose those coordinates, and are left out if fewer than two
+ * remain; relations are never exported.
+ *
+ * @param in  The input stream.
+ * @param out  The output stream.
+ * @param op  The options, or NULL for the defaults set by OSM_Options_init().
+ * @return 0 if successful, -1 in case of an error.
+ */
+
+int OSM_export_flatgeobuf(FILE *in, FILE *out, const OSM_Options *op) {
+    OSM_Exporter exporter = { NULL, encode_node, encode_way, NULL };
+    int threads = op != NULL && op->threads > 1 ? op->threads : 1;
+    FILE *tmp = tmpfile();
+    if (tmp == NULL) {
+        fprintf(stderr, "Unable to create a temporary file for FlatGeobuf export\n");
+        return -1;
+    }
+
+    FeatureItem *items = NULL, *scratch = NULL;
+    size_t count = 0;
+    NodeItem extent;
+    int ret = OSM_export_features(in, tmp, &exporter, op);
+    if (ret == 0 && (fflush(tmp) != 0 || scan_features(tmp, &items, &count, &extent) != 0))
+        ret = -1;
+    if (ret == 0 && (scratch = malloc((count + 1) * sizeof(FeatureItem))) == NULL)
+        ret = -1;
+    if (ret == 0) {
+        FeatureItem *sorted = hilbert_sort(items, scratch, count, &extent, threads);
+        ret = write_file(tmp, out, sorted, count, &extent);
+    }
+    free(items);
+    free(scratch);
+    fclose(tmp);
+    if (ret != 0 || ferror(out)) {
+        fprintf(stderr, "Unable to export the input as FlatGeobuf\n");
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "osmgeojson.h"
+#include "osmexport.h"
+#include "debug.h"
+
+static void append_int(OSM_ExportBuffer *bp, int64_t v) {
+    char digits[24];
+    int n = 0;
+    uint64_t u = v < 0 ? -(uint64_t)v : (uint64_t)v;
+    do {
+        digits[sizeof(digits) - 1 - n++] = '0' + u % 10;
+        u /= 10;
+    } while (u > 0);
+    if (v < 0)
+        digits[sizeof(digits) - 1 - n++] = '-';
+    OSM_ExportBuffer_append(bp, digits + sizeof(digits) - n, n);
+}
+
+/*
+ * Append a coordinate in units of 1e-7 degrees as a decimal number of
+ * degrees with seven decimals, without going through printf.
+ */
+
+static void append_coord(OSM_ExportBuffer *bp, int64_t v) {
+    uint64_t u = v < 0 ? -(uint64_t)v : (uint64_t)v;
+    char frac[8];
+    frac[0] = '.';
+    uint64_t f = u % 10000000;
+    for (int i = 7; i >= 1; i--) {
+        frac[i] = '0' + f % 10;
+        f /= 10;
+    }
+    if (v < 0)
+        OSM_EXPORT_LITERAL(bp, "-");
+    append_int(bp, u / 10000000);
+    OSM_ExportBuffer_append(bp, frac, sizeof(frac));
+}
+
+static void begin_feature(int format, OSM_ExportBuffer *bp, const char *type, OSM_Id id) {
+    if (format == OSM_GEOJSON_SEQ)
+        OSM_EXPORT_LITERAL(bp, "\x1e");
+    else if (bp->len > 0)
+        OSM_EXPORT_LITERAL(bp, ",\n");
+    OSM_EXPORT_LITERAL(bp, "{\"type\":\"Feature\",\"id\":\"");
+    OSM_ExportBuffer_append(bp, type, strlen(type));
+    OSM_EXPORT_LITERAL(bp, "/");
+    append_int(bp, id);
+    OSM_EXPORT_LITERAL(bp, "\",\"properties\":");
+}
+
+static void end_feature(int format, OSM_ExportBuffer *bp) {
+    OSM_EXPORT_LITERAL(bp, "}}");
+    if (format == OSM_GEOJSON_SEQ)
+        OSM_EXPORT_LITERAL(bp, "\n");
+}
+
+static void append_point(OSM_ExportBuffer *bp, int64_t lat, int64_t lon) {
+    OSM_EXPORT_LITERAL(bp, "[");
+    append_coord(bp, lon);
+    OSM_EXPORT_LITERAL(bp, ",");
+    append_coord(bp, lat);
+    OSM_EXPORT_LITERAL(bp, "]");
+}
+
+static void encode_node(void *arg, OSM_ExportBuffer *bp, OSM_Block *block, int i) {
+    int format = *(int *)arg;
+    begin_feature(format, bp, "node", block->node_ids[i]);
+    OSM_ExportBuffer_append_tags(bp, block, &block->node_tags, i);
+    OSM_EXPORT_LITERAL(bp, ",\"geometry\":{\"type\":");
+    OSM_EXPORT_LITERAL(bp, "\"Point\",\"coordinates\":");
+    append_point(bp, block->node_lats[i] / 100, block->node_lons[i] / 100);
+    end_feature(format, bp);
+}
+
+static void encode_way(void *arg, OSM_ExportBuffer *bp, OSM_Block *block, int i,
+                       const int64_t *lats, const int64_t *lons, size_t n, int polygon) {
+    int format = *(int *)arg;
+    begin_feature(format, bp, "way", block->way_ids[i]);
+    OSM_ExportBuffer_append_tags(bp, block, &block->way_tags, i);
+    OSM_EXPORT_LITERAL(bp, ",\"geometry\":{\"type\":");
+    if (polygon)
+        OSM_EXPORT_LITERAL(bp, "\"Polygon\",\"coordinates\":[[");
+    else
+        OSM_EXPORT_LITERAL(bp, "\"LineString\",\"coordinates\":[");
+    for (size_t r = 0; r < n; r++) {
+        if (r > 0)
+            OSM_EXPORT_LITERAL(bp, ",");
+        append_point(bp, lats[r], lons[r]);
+    }
+    OSM_ExportBuffer_append(bp, "]]", polygon ? 2 : 1);
+    end_feature(format, bp);
+}
+
+/* Export an input stream, or a file in shards if in is NULL */
+
+static int export_geojson(FILE *in, const char *path, int num_shards, FILE *out, int format,
+                          const OSM_Options *op) {
+    OSM_Exporter exporter = { &format, encode_node, encode_way,
+                              format == OSM_GEOJSON ? ",\n" : NULL };
+    if (format == OSM_GEOJSON)
+        fputs("{\"type\":\"FeatureCollection\",\"features\":[\n", out);
+    int ret = in != NULL ? OSM_export_features(in, out, &exporter, op)
+                         : OSM_export_features_shards(path, num_shards, out, &exporter, op);
+    if (format == OSM_GEOJSON)
+        fputs("\n]}\n", out);
+    if (ret != 0 || ferror(out)) {
+        fprintf(stderr, "Unable to export the input as GeoJSON\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief  Export the tagged nodes and the ways of an OSM PBF input stream
+ * as GeoJSON.
+ * @details  The input is read once, as a stream, by OSM_export_features().
+ * Ways whose nodes are not in the input lose those coordinates, and are
+ * left out if fewer than two remain; only relations are never exported.
+ *
+ * @param in  The input stream.
+ * @param out  The output stream.
+ * @param format  OSM_GEOJSON or OSM_GEOJSON_SEQ.
+ * @param op  The options, or NULL for the defaults set by OSM_Options_init().
+ * @return 0 if successful, -1 in case of an error.
+ */
+
+int OSM_export_geojson(FILE *in, FILE *out, int format, const OSM_Options *op) {
+    return export_geojson(in, NULL, 0, out, format, op);
+}
+
+/**
+ * @brief  Export an OSM PBF file as GeoJSON with worker processes, by
+ * OSM_export_features_shards().
+ *
+ * @param path  The input file, which must be seekable.
+ * @param num_shards  The number of worker processes.
+ * @param out  The output stream.
+ * @param format  OSM_GEOJSON or OSM_GEOJSON_SEQ.
+ * @param op  The options, or NULL for the defaults set by OSM_Options_init().
+ * @return 0 if successful, -1 in case of an error.
+ */
+
+int OSM_export_geojson_shards(const char *path, int num_shards, FILE *out, int format,
+                              const OSM_Options *op) {
+    return export_geojson(NULL, path, num_shards, out, format, op);
+}
@@ -0,0 +1,526 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "osmindex.h"
+#include "osmblock.h"
+#include "osmmap.h"
+#include "debug.h"
+
+/*
+ * The sidecar file holds an IndexHeader, then num_entries IndexEntry
+ * records, one per blob in file order, and then num_words 64-bit words of
+ * bloom filters, in the byte order of the machine that wrote it.  A file
+ * that does not read back as a valid index is simply rebuilt.
+ */
+
+#define INDEX_MAGIC "OSMIDX2"
+
+#define KIND_NODE   0
+#define KIND_WAY    1
+
+typedef struct IndexHeader {
+    char magic[8];
+    uint64_t file_size;         // Size and modification time of the PBF file
+    int64_t file_mtime;
+    uint64_t num_entries;
+    uint64_t num_words;
+} IndexHeader;
+
+typedef struct IndexEntry {
+    uint64_t offset;            // Offset of the blob in the PBF file
+    uint32_t type;              // OSM_BlobType
+    uint32_t num_ids;           // Ids in the filter
+    uint32_t num_nodes;         // Entities of the block, to size a map
+    uint32_t num_ways;
+    uint64_t num_refs;
+    OSM_Id min_id[2];           // Id ranges by kind, empty if min > max
+    OSM_Id max_id[2];
+    uint64_t filter_start;      // Position and length of the filter in words
+    uint64_t filter_words;
+} IndexEntry;
+
+struct OSM_Index {
+    IndexHeader header;
+    IndexEntry *entries;
+    uint64_t *words;
+    size_t entry_cap;
+    size_t word_cap;
+    size_t probes;
+    size_t hits;
+    size_t false_positives;
+};
+
+static uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static uint64_t id_hash(int kind, OSM_Id id) {
+    return mix64((uint64_t)id ^ ((uint64_t)kind << 63));
+}
+
+/*
+ * The bits of a key are chosen by double hashing, h + i * h2 for i below
+ * OSM_INDEX_HASHES, with h2 odd.
+ */
+
+static void filter_add(uint64_t *words, uint64_t num_words, uint64_t h) {
+    uint64_t num_bits = num_words * 64, h2 = mix64(h) | 1;
+    for (int i = 0; i < OSM_INDEX_HASHES; i++) {
+        uint64_t bit = (h + i * h2) % num_bits;
+        words[bit / 64] |= 1ULL << (bit % 64);
+    }
+}
+
+static int filter_test(const uint64_t *words, uint64_t num_words, uint64_t h) {
+    uint64_t num_bits = num_words * 64, h2 = mix64(h) | 1;
+    for (int i = 0; i < OSM_INDEX_HASHES; i++) {
+        uint64_t bit = (h + i * h2) % num_bits;
+        if ((words[bit / 64] & (1ULL << (bit % 64))) == 0)
+            return 0;
+    }
+    return 1;
+}
+
+static int stat_file(FILE *in, uint64_t *sizep, int64_t *mtimep) {
+    struct stat st;
+    if (fstat(fileno(in), &st) != 0) return -1;
+    *sizep = st.st_size;
+    *mtimep = st.st_mtime;
+    return 0;
+}
+
+static IndexEntry *add_entry(OSM_Index *ix, OSM_Block *bp, uint64_t num_words) {
+    if (ix->header.num_entries == ix->entry_cap) {
+        size_t cap = ix->entry_cap ? 2 * ix->entry_cap : 64;
+        IndexEntry *entries = realloc(ix->entries, cap * sizeof(IndexEntry));
+        if (entries == NULL) return NULL;
+        ix->entries = entries;
+        ix->entry_cap = cap;
+    }
+    if (ix->header.num_words + num_words > ix->word_cap) {
+        size_t cap = ix->word_cap ? ix->word_cap : 1024;
+        while (cap < ix->header.num_words + num_words)
+            cap *= 2;
+        uint64_t *words = realloc(ix->words, cap * sizeof(uint64_t));
+        if (words == NULL) return NULL;
+        ix->words = words;
+        ix->word_cap = cap;
+    }
+    IndexEntry *ep = &ix->entries[ix->header.num_entries++];
+    memset(ep, 0, sizeof(IndexEntry));
+    ep->offset = bp->offset;
+    ep->type = bp->type;
+    ep->num_nodes = bp->num_nodes;
+    ep->num_ways = bp->num_ways;
+    ep->num_refs = bp->num_ways > 0 ? bp->way_ref_start[bp->num_ways] : 0;
+    ep->min_id[KIND_NODE] = ep->min_id[KIND_WAY] = INT64_MAX;
+    ep->max_id[KIND_NODE] = ep->max_id[KIND_WAY] = INT64_MIN;
+    ep->filter_start = ix->header.num_words;
+    ep->filter_words = num_words;
+    if (num_words > 0) {
+        memset(ix->words + ix->header.num_words, 0, num_words * sizeof(uint64_t));
+        ix->header.num_words += num_words;
+    }
+    return ep;
+}
+
+static void index_ids(OSM_Index *ix, IndexEntry *ep, int kind, const OSM_Id *ids, int n) {
+    uint64_t *words = ix->words + ep->filter_start;
+    for (int i = 0; i < n; i++) {
+        if (ids[i] < ep->min_id[kind]) ep->min_id[kind] = ids[i];
+        if (ids[i] > ep->max_id[kind]) ep->max_id[kind] = ids[i];
+        filter_add(words, ep->filter_words, id_hash(kind, ids[i]));
+    }
+    ep->num_ids += n;
+}
+
+/**
+ * @brief  Build the index of an OSM PBF input stream by decoding the ids
+ * of all of its blocks.
+ * @details  Blocks are decoded on op->threads threads.  Relations are not
+ * decoded by this library, so only node and way ids are indexed.
+ *
+ * @param in  The input stream, which is read to the end.
+ * @param op  Options, of which only threads and cache_blocks are used,
+ * or NULL for the defaults.
+ * @return  The index, or NULL in case of an error.
+ */
+
+OSM_Index *OSM_Index_build(FILE *in, const OSM_Options *op) {
+    OSM_Options opts;
+    OSM_Options_init(&opts);
+    if (op != NULL) {
+        opts.threads = op->threads;
+        opts.cache_blocks = op->cache_blocks;
+    }
+    opts.types = OSM_TYPE_NODE | OSM_TYPE_WAY;
+    opts.tags = 0;
+
+    OSM_Index *ix = calloc(1, sizeof(OSM_Index));
+    if (ix == NULL) return NULL;
+    memcpy(ix->header.magic, INDEX_MAGIC, sizeof(ix->header.magic));
+    if (stat_file(in, &ix->header.file_size, &ix->header.file_mtime)) {
+        OSM_Index_free(ix);
+        return NULL;
+    }
+    OSM_BlockReader *reader = OSM_BlockReader_open(in, &opts);
+    if (reader == NULL) {
+        OSM_Index_free(ix);
+        return NULL;
+    }
+
+    OSM_Block *bp;
+    int ret;
+    while ((ret = OSM_BlockReader_next(reader, &bp)) == 1) {
+        uint64_t n = (uint64_t)bp->num_nodes + bp->num_ways;
+        uint64_t num_words = bp->type == OSM_BLOB_DATA ? (n * OSM_INDEX_BITS_PER_ID + 63) / 64 : 0;
+        if (bp->type == OSM_BLOB_DATA && num_words == 0)
+            num_words = 1;
+        IndexEntry *ep = add_entry(ix, bp, num_words);
+        if (ep != NULL) {
+            index_ids(ix, ep, KIND_NODE, bp->node_ids, bp->num_nodes);
+            index_ids(ix, ep, KIND_WAY, bp->way_ids, bp->num_ways);
+        }
+        OSM_Block_free(bp);
+        if (ep == NULL) {
+            ret = -1;
+            break;
+        }
+    }
+    OSM_BlockReader_close(reader);
+    if (ret != 0) {
+        OSM_Index_free(ix);
+        return NULL;
+    }
+    return ix;
+}
+
+/**
+ * @brief  Write an index in the format of the sidecar file.
+ *
+ * @param ix  The index.
+ * @param out  The output stream.
+ * @return 0 if successful, -1 in case of an error.
+ */
+
+int OSM_Index_write(OSM_Index *ix, FILE *out) {
+    uint64_t num_entries = ix->header.num_entries, num_words = ix->header.num_words;
+    if (fwrite(&ix->header, sizeof(IndexHeader), 1, out) != 1 ||
+        (num_entries > 0 && fwrite(ix->entries, sizeof(IndexEntry), num_entries, out) != num_entries) ||
+        (num_words > 0 && fwrite(ix->words, sizeof(uint64_t), num_words, out) != num_words))
+        return -1;
+    return 0;
+}
+
+/**
+ * @brief  Read an index written by OSM_Index_write().
+ *
+ * @param in  The input stream.
+ * @return  The index, or NULL if the input is not a valid index.
+ */
+
+OSM_Index *OSM_Index_read(FILE *in) {
+    OSM_Index *ix = calloc(1, sizeof(OSM_Index));
+    if (ix == NULL) return NULL;
+    IndexHeader *hp = &ix->header;
+    if (fread(hp, sizeof(IndexHeader), 1, in) != 1 ||
+        memcmp(hp->magic, INDEX_MAGIC, sizeof(hp->magic)) != 0 ||
+        hp->num_entries > hp->file_size || hp->num_words > SIZE_MAX / sizeof(uint64_t))
+        goto fail;
+
+    ix->entries = malloc((hp->num_entries + 1) * sizeof(IndexEntry));
+    ix->words = malloc((hp->num_words + 1) * sizeof(uint64_t));
+    if (ix->entries == NULL || ix->words == NULL ||
+        fread(ix->entries, sizeof(IndexEntry), hp->num_entries, in) != hp->num_entries ||
+        fread(ix->words, sizeof(uint64_t), hp->num_words, in) != hp->num_words)
+        goto fail;
+    ix->entry_cap = hp->num_entries;
+    ix->word_cap = hp->num_words;
+    for (uint64_t e = 0; e < hp->num_entries; e++) {
+        IndexEntry *ep = &ix->entries[e];
+        if (ep->filter_start > hp->num_words || ep->filter_words > hp->num_words - ep->filter_start ||
+            (ep->type == OSM_BLOB_DATA && ep->filter_words == 0))
+            goto fail;
+    }
+    return ix;
+
+fail:
+    OSM_Index_free(ix);
+    return NULL;
+}
+
+static char *sidecar_path(const char *path) {
+    size_t len = strlen(path);
+    char *sidecar = malloc(len + sizeof(OSM_INDEX_SUFFIX));
+    if (sidecar == NULL) return NULL;
+    memcpy(sidecar, path, len);
+    memcpy(sidecar + len, OSM_INDEX_SUFFIX, sizeof(OSM_INDEX_SUFFIX));
+    return sidecar;
+}
+
+/* Read a sidecar file, or return NULL if it is missing, invalid or out of date */
+
+static OSM_Index *read_sidecar(const char *sidecar, uint64_t size, int64_t mtime) {
+    FILE *f = fopen(sidecar, "rb");
+    if (f == NULL) return NULL;
+    OSM_Index *ix = OSM_Index_read(f);
+    fclose(f);
+    if (ix != NULL && (ix->header.file_size != size || ix->header.file_mtime != mtime)) {
+        OSM_Index_free(ix);
+        ix = NULL;
+    }
+    return ix;
+}
+
+/**
+ * @brief  Get the index of an OSM PBF file from its sidecar file, building
+ * the index and writing the sidecar if it is missing or out of date.
+ * @details  Failure to write the sidecar is reported but not an error.
+ *
+ * @param path  The path of the PBF file.
+ * @param op  Options for building, as for OSM_Index_build().
+ * @return  The index, or NULL in case of an error.
+ */
+
+OSM_Index *OSM_Index_open(const char *path, const OSM_Options *op) {
+    FILE *in = fopen(path, "rb");
+    if (in == NULL) {
+        fprintf(stderr, "Cannot read the input file %s\n", path);
+        return NULL;
+    }
+    uint64_t size;
+    int64_t mtime;
+    if (stat_file(in, &size, &mtime)) {
+        fclose(in);
+        return NULL;
+    }
+
+    char *sidecar = sidecar_path(path);
+    if (sidecar == NULL) {
+        fclose(in);
+        return NULL;
+    }
+    OSM_Index *ix = read_sidecar(sidecar, size, mtime);
+    if (ix == NULL) {
+        ix = OSM_Index_build(in, op);
+        FILE *f = ix != NULL ? fopen(sidecar, "wb") : NULL;
+        if (ix != NULL && (f == NULL || OSM_Index_write(ix, f) != 0 || fclose(f) != 0)) {
+            fprintf(stderr, "Cannot write the index file %s\n", sidecar);
+            if (f != NULL) remove(sidecar);
+        }
+    }
+    fclose(in);
+    free(sidecar);
+    return ix;
+}
+
+/**
+ * @brief  Get the index of an OSM PBF file from its sidecar file only if
+ * the sidecar is there and up to date for the stream being read, without
+ * building it otherwise.
+ *
+ * @param path  The path of the PBF file.
+ * @param in  The PBF file, as opened for reading.
+ * @return  The index, or NULL if there is no such sidecar.
+ */
+
+OSM_Index *OSM_Index_find(const char *path, FILE *in) {
+    uint64_t size;
+    int64_t mtime;
+    if (stat_file(in, &size, &mtime)) return NULL;
+    char *sidecar = sidecar_path(path);
+    OSM_Index *ix = sidecar != NULL ? read_sidecar(sidecar, size, mtime) : NULL;
+    free(sidecar);
+    return ix;
+}
+
+/**
+ * @brief  Free an index.
+ */
+
+void OSM_Index_free(OSM_Index *ix) {
+    if (ix == NULL) return;
+    free(ix->entries);
+    free(ix->words);
+    free(ix);
+}
+
+/*
+ * Test whether a block may hold an id: first against its range, then, as
+ * a probe that is counted, against its filter.
+ */
+
+static int entry_may_hold(OSM_Index *ix, IndexEntry *ep, int kind, OSM_Id id) {
+    if (ep->type != OSM_BLOB_DATA || id < ep->min_id[kind] || id > ep->max_id[kind])
+        return 0;
+    ix->probes++;
+    if (!filter_test(ix->words + ep->filter_start, ep->filter_words, id_hash(kind, id)))
+        return 0;
+    ix->hits++;
+    return 1;
+}
+
+static int block_holds(OSM_Block *bp, int kind, OSM_Id id) {
+    const OSM_Id *ids = kind == KIND_NODE ? bp->node_ids : bp->way_ids;
+    int n = kind == KIND_NODE ? bp->num_nodes : bp->num_ways;
+    for (int i = 0; i < n; i++) {
+        if (ids[i] == id)
+            return 1;
+    }
+    return 0;
+}
+
+/* Reserve the entities of the types of the options of the selected data blocks */
+
+static int reserve_entries(OSM_Index *ix, OSM_Map *mp, const size_t *matched, const OSM_Options *op) {
+    size_t counts[3] = { 0, 0, 0 };
+    for (uint64_t e = 0; e < ix->header.num_entries; e++) {
+        IndexEntry *ep = &ix->entries[e];
+        if (ep->type != OSM_BLOB_DATA || (matched != NULL && matched[e] == 0)) continue;
+        counts[0] += ep->num_nodes;
+        counts[1] += ep->num_ways;
+        counts[2] += ep->num_refs;
+    }
+    return OSM_Map_reserve(mp, op->types & OSM_TYPE_NODE ? counts[0] : 0,
+                           op->types & OSM_TYPE_WAY ? counts[1] : 0,
+                           op->types & OSM_TYPE_WAY ? counts[2] : 0);
+}
+
+/**
+ * @brief  Size the columns of a map under construction for every node and
+ * way of the indexed file, of the types that the options select.
+ *
+ * @param ix  The index of the file.
+ * @param mp  The map, from OSM_Map_create().
+ * @param op  The options the map is loaded with.
+ * @return 0 if successful, -1 if memory could not be allocated.
+ */
+
+int OSM_Index_reserve(OSM_Index *ix, OSM_Map *mp, const OSM_Options *op) {
+    return reserve_entries(ix, mp, NULL, op);
+}
+
+/**
+ * @brief  Load a map holding the header and every block of an indexed file
+ * that may hold one of the specified node or way ids.
+ * @details  Other blocks are not decoded, so the map answers lookups of
+ * those ids as the map of the whole file would, but holds only some of the
+ * other entities.  The columns of the map are sized from the counts that
+ * the index records for the blocks that match, before any is decoded.
+ * Blocks that turn out not to hold any of the ids they
+ * matched are counted as false positives in the statistics of the index,
+ * so an index must not be used by concurrent calls.
+ *
+ * @param ix  The index of the file.
+ * @param in  The file, which must be seekable.
+ * @param node_ids  The node ids to be looked up.
+ * @param num_nodes  The number of node ids.
+ * @param way_ids  The way ids to be looked up.
+ * @param num_ways  The number of way ids.
+ * @param op  The options for decoding, or NULL for the defaults.
+ * @return  The map, or NULL in case of an error.
+ */
+
+OSM_Map *OSM_Index_load(OSM_Index *ix, FILE *in, const OSM_Id *node_ids, size_t num_nodes,
+                        const OSM_Id *way_ids, size_t num_ways, const OSM_Options *op) {
+    OSM_Options defaults;
+    if (op == NULL) {
+        OSM_Options_init(&defaults);
+        op = &defaults;
+    }
+    const OSM_Id *ids[2] = { node_ids, way_ids };
+    size_t counts[2] = { num_nodes, num_ways };
+
+    size_t *matched = calloc(ix->header.num_entries + 1, sizeof(size_t));
+    if (matched == NULL) return NULL;
+    for (uint64_t e = 0; e < ix->header.num_entries; e++) {
+        IndexEntry *ep = &ix->entries[e];
+        for (int k = 0; k < 2 && ep->type == OSM_BLOB_DATA; k++) {
+            for (size_t i = 0; i < counts[k]; i++)
+                matched[e] += entry_may_hold(ix, ep, k, ids[k][i]);
+        }
+    }
+    OSM_Map *map = OSM_Map_create(op);
+    if (map != NULL && reserve_entries(ix, map, matched, op) != 0) {
+        OSM_Map_free(map);
+        map = NULL;
+    }
+    for (uint64_t e = 0; e < ix->header.num_entries && map != NULL; e++) {
+        IndexEntry *ep = &ix->entries[e];
+        size_t held = 0;
+        if (ep->type == OSM_BLOB_DATA ? matched[e] == 0 : ep->type != OSM_BLOB_HEADER)
+            continue;
+
+        OSM_Block *bp = OSM_read_Block_at(in, ep->offset, op);
+        if (bp == NULL) {
+            fprintf(stderr, "Cannot read the block at offset %lu\n", (unsigned long)ep->offset);
+            OSM_Map_free(map);
+            map = NULL;
+            break;
+        }
+        for (int k = 0; k < 2 && matched[e] > 0; k++) {
+            for (size_t i = 0; i < counts[k]; i++) {
+                OSM_Id id = ids[k][i];
+                if (id >= ep->min_id[k] && id <= ep->max_id[k] && block_holds(bp, k, id))
+                    held++;
+            }
+        }
+        ix->false_positives += matched[e] > held ? matched[e] - held : 0;
+        int ret = OSM_Map_add_Block(map, bp);
+        OSM_Block_free(bp);
+        if (ret) {
+            OSM_Map_free(map);
+            map = NULL;
+        }
+    }
+    free(matched);
+    if (map == NULL)
+        return NULL;
+    if (OSM_Map_finish(map, op)) {
+        OSM_Map_free(map);
+        return NULL;
+    }
+    return map;
+}
+
+/**
+ * @brief  Get the statistics of an index: its size, the false-positive
+ * rate its filters are expected to have, and the probes of the filters by
+ * the lookups done so far.
+ * @details  The expected rate of a filter is f^k, where f is the fraction
+ * of its bits that are set and k is OSM_INDEX_HASHES.
+ *
+ * @param ix  The index.
+ * @param sp  The statistics structure to be filled in.
+ */
+
+void OSM_Index_get_stats(OSM_Index *ix, OSM_IndexStats *sp) {
+    memset(sp, 0, sizeof(OSM_IndexStats));
+    double fpr_sum = 0;
+    for (uint64_t e = 0; e < ix->header.num_entries; e++) {
+        IndexEntry *ep = &ix->entries[e];
+        if (ep->type != OSM_BLOB_DATA) continue;
+        sp->num_blocks++;
+        sp->num_ids += ep->num_ids;
+        uint64_t set = 0;
+        for (uint64_t w = 0; w < ep->filter_words; w++)
+            set += __builtin_popcountll(ix->words[ep->filter_start + w]);
+        double fraction = (double)set / (ep->filter_words * 64), fpr = 1;
+        for (int i = 0; i < OSM_INDEX_HASHES; i++)
+            fpr *= fraction;
+        fpr_sum += fpr;
+    }
+    sp->filter_bytes = ix->header.num_words * sizeof(uint64_t);
+    sp->expected_fpr = sp->num_blocks ? fpr_sum / sp->num_blocks : 0;
+    sp->probes = ix->probes;
+    sp->hits = ix->hits;
+    sp->false_positives = ix->false_positives;
+}
@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+
+#include "osmlive.h"
+#include "osmepoch.h"
+#include "debug.h"
+
+/*
+ * How often the watcher retries freeing retired maps while readers still
+ * hold them.
+ */
+
+#define RECLAIM_INTERVAL_MS     50
+
+struct OSM_LiveMap {
+    char *path;
+    char *dir;                  // Directory watched for the file
+    const char *name;           // Name of the file in dir, within path
+    OSM_Options opts;
+
+    void *current;              // The OSM_Map, published through epochs
+    OSM_Epochs *epochs;
+    uint64_t generation;        // Maps published so far
+    pthread_mutex_t lock;       // Held by reloads and reclamation
+
+    int watching;
+    int inotify_fd;
+    int wake_fds[2];            // Written to stop the watcher
+    pthread_t watcher;
+};
+
+static OSM_Map *load_map(OSM_LiveMap *lp) {
+    FILE *in = fopen(lp->path, "rb");
+    if (in == NULL) {
+        fprintf(stderr, "Cannot read the input file %s\n", lp->path);
+        return NULL;
+    }
+    OSM_Map *mp = OSM_read_Map_opts(in, &lp->opts);
+    fclose(in);
+    return mp;
+}
+
+static void free_map(void *ptr) {
+    OSM_Map_free(ptr);
+}
+
+/**
+ * @brief  Load a map from a file, to be replaced when the file is.
+ *
+ * @param path  The file.
+ * @param num_readers  The number of readers, each of which is given its
+ * own index in [0, num_readers) to use with OSM_LiveMap_enter().
+ * @param op  Options for loading the map and its replacements.
+ * @return  The live map, which is not yet watched, or NULL in case of an
+ * error.
+ */
+
+OSM_LiveMap *OSM_LiveMap_open(const char *path, int num_readers, const OSM_Options *op) {
+    if (num_readers < 1) return NULL;
+    OSM_LiveMap *lp = calloc(1, sizeof(OSM_LiveMap));
+    if (lp == NULL) return NULL;
+    pthread_mutex_init(&lp->lock, NULL);
+    lp->inotify_fd = lp->wake_fds[0] = lp->wake_fds[1] = -1;
+    lp->path = strdup(path);
+    lp->dir = strdup(path);
+    lp->epochs = OSM_Epochs_create(num_readers);
+    if (lp->path == NULL || lp->dir == NULL || lp->epochs == NULL) {
+        OSM_LiveMap_free(lp);
+        return NULL;
+    }
+    char *slash = strrchr(lp->dir, '/');
+    if (slash == NULL) {
+        strcpy(lp->dir, ".");
+        lp->name = lp->path;
+    } else {
+        lp->name = lp->path + (slash - lp->dir) + 1;
+        if (slash == lp->dir)
+            slash++;
+        *slash = '\0';
+    }
+    lp->opts = *op;
+    if ((lp->current = load_map(lp)) == NULL) {
+        OSM_LiveMap_free(lp);
+        return NULL;
+    }
+    lp->generation = 1;
+    return lp;
+}
+
+/**
+ * @brief  Load the file again and publish the new map.
+ * @details  Readers that entered before the swap keep the map they have,
+ * which is freed once they have all left.  Reloads are serialized.
+ *
+ * @param lp  The live map.
+ * @return 0 if successful, -1 in case of an error, in which case the
+ * current map is kept.
+ */
+
+int OSM_LiveMap_reload(OSM_LiveMap *lp) {
+    pthread_mutex_lock(&lp->lock);
+    int ret = -1;
+    OSM_Map *mp = load_map(lp);
+    if (mp != NULL) {
+        OSM_Epochs_retire(lp->epochs, OSM_Epochs_publish(lp->epochs, &lp->current, mp), free_map);
+        __atomic_add_fetch(&lp->generation, 1, __ATOMIC_SEQ_CST);
+        ret = 0;
+    } else {
+        fprintf(stderr, "Cannot reload %s, keeping the current map\n", lp->path);
+    }
+    OSM_Epochs_reclaim(lp->epochs);
+    pthread_mutex_unlock(&lp->lock);
+    return ret;
+}
+
+/*
+ * Reload the map whenever the file is closed after writing or renamed into
+ * the directory, and free retired maps as readers leave them, until woken
+ * through wake_fds.
+ */
+
+static void *watch_worker(void *arg) {
+    OSM_LiveMap *lp = arg;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        pthread_mutex_lock(&lp->lock);
+        int pending = OSM_Epochs_reclaim(lp->epochs) > 0;
+        pthread_mutex_unlock(&lp->lock);
+
+        struct pollfd fds[2] = { { lp->inotify_fd, POLLIN, 0 }, { lp->wake_fds[0], POLLIN, 0 } };
+        if (poll(fds, 2, pending ? RECLAIM_INTERVAL_MS : -1) < 0 && errno != EINTR)
+            break;
+        if (fds[1].revents != 0)
+            break;
+
+        int changed = 0;
+        ssize_t len;
+        while ((len = read(lp->inotify_fd, buf, sizeof(buf))) > 0) {
+            for (char *p = buf; p < buf + len; ) {
+                struct inotify_event *ev = (struct inotify_event *)p;
+                if ((ev->mask & IN_Q_OVERFLOW) || (ev->len > 0 && strcmp(ev->name, lp->name) == 0))
+                    changed = 1;
+                p += sizeof(struct inotify_event) + ev->len;
+            }
+        }
+        if (changed)
+            OSM_LiveMap_reload(lp);
+    }
+    return NULL;
+}
+
+/**
+ * @brief  Start reloading the map in the background whenever its file is
+ * replaced, either written in place or renamed over.
+ *
+ * @param lp  The live map.
+ * @return 0 if successful, -1 in case of an error.
+ */
+
+int OSM_LiveMap_watch(OSM_LiveMap *lp) {
+    if (lp->watching) return 0;
+    lp->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (lp->inotify_fd < 0 ||
+        inotify_add_watch(lp->inotify_fd, lp->dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0 ||
+        pipe(lp->wake_fds) != 0 ||
+        pthread_create(&lp->watcher, NULL, watch_worker, lp) != 0) {
+        fprintf(stderr, "Cannot watch the directory %s\n", lp->dir);
+        for (int i = 0; i < 2; i++) {
+            if (lp->wake_fds[i] >= 0) close(lp->wake_fds[i]);
+            lp->wake_fds[i] = -1;
+        }
+        if (lp->inotify_fd >= 0) close(lp->inotify_fd);
+        lp->inotify_fd = -1;
+        return -1;
+    }
+    lp->watching = 1;
+    return 0;
+}
+
+/**
+ * @brief  Take the current map for a query.
+ * @details  The map stays valid until OSM_LiveMap_leave() is called with
+ * the same reader, even if it is replaced meanwhile.  This never waits.
+ *
+ * @param lp  The live map.
+ * @param reader  The index of the calling reader, which must not be in a
+ * query already, nor used by another thread at the same time.
+ * @return  The map.
+ */
+
+OSM_Map *OSM_LiveMap_enter(OSM_LiveMap *lp, int reader) {
+    return OSM_Epochs_enter(lp->epochs, reader, &lp->current);
+}
+
+/**
+ * @brief  Release the map taken by OSM_LiveMap_enter().
+ *
+ * @param lp  The live map.
+ * @param reader  The index of the calling reader.
+ */
+
+void OSM_LiveMap_leave(OSM_LiveMap *lp, int reader) {
+    OSM_Epochs_leave(lp->epochs, reader);
+}
+
+/**
+ * @brief  Get the number of maps published so far, 1 for the map loaded
+ * by OSM_LiveMap_open() and one more for each reload.
+ *
+ * @param lp  The live map.
+ * @return  The generation of the current map.
+ */
+
+uint64_t OSM_LiveMap_get_generation(OSM_LiveMap *lp) {
+    return __atomic_load_n(&lp->generation, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief  Stop watching the file and free the live map with its maps.
+ * @details  No reader may be in a query.
+ *
+ * @param lp  The live map, or NULL.
+ */
+
+void OSM_LiveMap_free(OSM_LiveMap *lp) {
+    if (lp == NULL) return;
+    if (lp->watching) {
+        char c = 0;
+        if (write(lp->wake_fds[1], &c, 1) == 1)
+            pthread_join(lp->watcher, NULL);
+        close(lp->wake_fds[0]);
+        close(lp->wake_fds[1]);
+        close(lp->inotify_fd);
+    }
+    OSM_Epochs_free(lp->epochs);
+    if (lp->current != NULL)
+        OSM_Map_free(lp->current);
+    pthread_mutex_destroy(&lp->lock);
+    free(lp->dir);
+    free(lp->path);
+    free(lp);
+}
@@ -0,0 +1,383 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "osmblock.h"
+#include "strpool.h"
+#include "debug.h"
+
+/*
+ * An OSM_MergeReader runs one OSM_BlockReader per input, each with its own
+ * reader and decoding threads, and merges their entities with a binary
+ * heap keyed on (type, id, input).  Entities are copied into new blocks of
+ * OSM_MERGE_BLOCK_SIZE entities, whose string tables are built from a pool
+ * that is started afresh for each output block.  Every input is decoded
+ * with metadata, since versions decide which copy of a duplicate wins.
+ * With the history option, every version is kept: the heap is keyed on
+ * (type, id, version, input), and only copies of the same version are
+ * duplicates.
+ */
+
+#define KIND_NODE   0
+#define KIND_WAY    1
+
+typedef struct Source {
+    OSM_BlockReader *reader;
+    OSM_Block *block;           // Current data block, NULL once exhausted
+    int kind;                   // Current entity: kind and index in block
+    int pos;
+    OSM_Id id;
+    int32_t version;
+    int started;
+    uint32_t *strmap;           // Block string index -> output pool id
+    int strmap_cap;
+} Source;
+
+struct OSM_MergeReader {
+    OSM_Options opts;
+    int num_sources;
+    Source *sources;
+    int *heap;
+    int heap_size;
+    int *dups;                  // Sources positioned on the same entity
+    int num_headers;            // Input headers merged so far
+
+    OSM_Block *header;          // Merged header, returned first
+    SP_Pool *strings;           // Strings of the block under construction
+};
+
+static int same_entity(OSM_MergeReader *mr, Source *a, Source *b) {
+    return a->kind == b->kind && a->id == b->id &&
+           (!mr->opts.history || a->version == b->version);
+}
+
+static int heap_less(OSM_MergeReader *mr, int i, int j) {
+    int ia = mr->heap[i], ib = mr->heap[j];
+    Source *a = &mr->sources[ia], *b = &mr->sources[ib];
+    if (a->kind != b->kind) return a->kind < b->kind;
+    if (a->id != b->id) return a->id < b->id;
+    if (mr->opts.history && a->version != b->version) return a->version < b->version;
+    return ia < ib;
+}
+
+static void heap_swap(OSM_MergeReader *mr, int i, int j) {
+    int t = mr->heap[i];
+    mr->heap[i] = mr->heap[j];
+    mr->heap[j] = t;
+}
+
+static void heap_push(OSM_MergeReader *mr, int source) {
+    int i = mr->heap_size++;
+    mr->heap[i] = source;
+    while (i > 0 && heap_less(mr, i, (i - 1) / 2)) {
+        heap_swap(mr, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static int heap_pop(OSM_MergeReader *mr) {
+    int top = mr->heap[0];
+    mr->heap[0] = mr->heap[--mr->heap_size];
+    int i = 0;
+    for (;;) {
+        int l = 2 * i + 1, r = l + 1, m = i;
+        if (l < mr->heap_size && heap_less(mr, l, m)) m = l;
+        if (r < mr->heap_size && heap_less(mr, r, m)) m = r;
+        if (m == i) break;
+        heap_swap(mr, i, m);
+        i = m;
+    }
+    return top;
+}
+
+/*
+ * Merge the header of an input into the merged header: the union of the
+ * bounding boxes and required features, and the intersection of the
+ * optional features.
+ */
+
+static void merge_header(OSM_MergeReader *mr, OSM_Block *bp) {
+    OSM_Block *hp = mr->header;
+    hp->required_features |= bp->required_features;
+    if (mr->num_headers++ == 0)
+        hp->optional_features = bp->optional_features;
+    else
+        hp->optional_features &= bp->optional_features;
+    if (!bp->has_bbox) return;
+    if (!hp->has_bbox) {
+        hp->min_lat = bp->min_lat;
+        hp->max_lat = bp->max_lat;
+        hp->min_lon = bp->min_lon;
+        hp->max_lon = bp->max_lon;
+        hp->has_bbox = 1;
+    } else {
+        if (bp->min_lat < hp->min_lat) hp->min_lat = bp->min_lat;
+        if (bp->max_lat > hp->max_lat) hp->max_lat = bp->max_lat;
+        if (bp->min_lon < hp->min_lon) hp->min_lon = bp->min_lon;
+        if (bp->max_lon > hp->max_lon) hp->max_lon = bp->max_lon;
+    }
+}
+
+/*
+ * Advance a source to its next entity.
+ * Returns 1 if there is one, 0 if the input is exhausted, and -1 in case
+ * of an error, including an input that is not sorted by type and id.
+ */
+
+static int source_next(OSM_MergeReader *mr, Source *sp) {
+    int prev_kind = sp->kind;
+    OSM_Id prev_id = sp->id;
+    if (sp->block != NULL)
+        sp->pos++;
+    for (;;) {
+        OSM_Block *bp = sp->block;
+        if (bp != NULL && sp->kind == KIND_NODE && sp->pos >= bp->num_nodes) {
+            sp->kind = KIND_WAY;
+            sp->pos = 0;
+        }
+        if (bp != NULL && sp->kind == KIND_WAY && sp->pos >= bp->num_ways) {
+            OSM_Block_free(bp);
+            sp->block = NULL;
+        }
+        if (sp->block != NULL) break;
+
+        int ret = OSM_BlockReader_next(sp->reader, &bp);
+        if (ret != 1) return ret;
+        if (bp->type != OSM_BLOB_DATA) {
+            if (bp->type == OSM_BLOB_HEADER)
+                merge_header(mr, bp);
+            OSM_Block_free(bp);
+            continue;
+        }
+        if (bp->num_strings > sp->strmap_cap) {
+            uint32_t *map = realloc(sp->strmap, bp->num_strings * sizeof(uint32_t));
+            if (map == NULL) {
+                OSM_Block_free(bp);
+                return -1;
+            }
+            sp->strmap = map;
+            sp->strmap_cap = bp->num_strings;
+        }
+        memset(sp->strmap, 0xff, bp->num_strings * sizeof(uint32_t));
+        sp->block = bp;
+        sp->kind = KIND_NODE;
+        sp->pos = 0;
+    }
+
+    OSM_Block *bp = sp->block;
+    OSM_BlockInfo *ip = sp->kind == KIND_NODE ? &bp->node_info : &bp->way_info;
+    sp->id = sp->kind == KIND_NODE ? bp->node_ids[sp->pos] : bp->way_ids[sp->pos];
+    sp->version = ip->versions ? ip->versions[sp->pos] : -1;
+    if (sp->started && (sp->kind < prev_kind || (sp->kind == prev_kind && sp->id < prev_id))) {
+        fprintf(stderr, "Input %d is not sorted by type and id, cannot merge\n",
+                (int)(sp - mr->sources));
+        return -1;
+    }
+    sp->started = 1;
+    return 1;
+}
+
+static int map_string(OSM_MergeReader *mr, Source *sp, uint32_t index, uint32_t *idp) {
+    if (sp->strmap[index] == SP_NONE) {
+        OSM_Block *bp = sp->block;
+        sp->strmap[index] = SP_intern(mr->strings, bp->strings[index], bp->string_lens[index]);
+        if (sp->strmap[index] == SP_NONE) return -1;
+    }
+    *idp = sp->strmap[index];
+    return 0;
+}
+
+/*
+ * Copy the current entity of a source into the output block.
+ */
+
+static int copy_entity(OSM_MergeReader *mr, Source *sp, OSM_Block *out) {
+    OSM_Block *bp = sp->block;
+    int i = sp->pos;
+    OSM_BlockInfo *ip = sp->kind == KIND_NODE ? &bp->node_info : &bp->way_info;
+    OSM_BlockTags *tp = sp->kind == KIND_NODE ? &bp->node_tags : &bp->way_tags;
+    int32_t version = ip->versions ? ip->versions[i] : -1;
+    int64_t timestamp = ip->timestamps ? ip->timestamps[i] : 0;
+
+    int ret;
+    unsigned int type;
+    OSM_BlockInfo *oip;
+    if (sp->kind == KIND_NODE) {
+        type = OSM_TYPE_NODE;
+        oip = &out->node_info;
+        ret = OSM_Block_add_Node(out, &mr->opts, bp->node_ids[i], bp->node_lats[i],
+                                 bp->node_lons[i], version, timestamp);
+    } else {
+        type = OSM_TYPE_WAY;
+        oip = &out->way_info;
+        int start = bp->way_ref_start[i];
+        ret = OSM_Block_add_Way(out, &mr->opts, bp->way_ids[i], bp->way_refs + start,
+                                bp->way_ref_lats ? bp->way_ref_lats + start : NULL,
+                                bp->way_ref_lons ? bp->way_ref_lons + start : NULL,
+                                bp->way_ref_start[i + 1] - start, version, timestamp);
+    }
+    if (ret) return -1;
+    if (oip->visible != NULL && ip->visible != NULL)
+        oip->visible[(type == OSM_TYPE_NODE ? out->num_nodes : out->num_ways) - 1] = ip->visible[i];
+
+    if (tp->start == NULL) return 0;
+    for (int t = tp->start[i]; t < tp->start[i + 1]; t++) {
+        uint32_t key, val;
+        if (map_string(mr, sp, tp->keys[t], &key) || map_string(mr, sp, tp->vals[t], &val) ||
+            OSM_Block_add_tag(out, type, key, val))
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Fill a new block with up to OSM_MERGE_BLOCK_SIZE merged entities.
+ */
+
+static int merge_next_block(OSM_MergeReader *mr, OSM_Block **bpp) {
+    OSM_Block *out = calloc(1, sizeof(OSM_Block));
+    if (out == NULL) return -1;
+    out->type = OSM_BLOB_DATA;
+    SP_free(mr->strings);
+    mr->strings = SP_create();
+    if (mr->strings == NULL) goto fail;
+    for (int s = 0; s < mr->num_sources; s++) {
+        Source *sp = &mr->sources[s];
+        if (sp->block != NULL)
+            memset(sp->strmap, 0xff, sp->block->num_strings * sizeof(uint32_t));
+    }
+
+    while (mr->heap_size > 0 && out->num_nodes + out->num_ways < OSM_MERGE_BLOCK_SIZE) {
+        int num_dups = 0;
+        int best = heap_pop(mr);
+        mr->dups[num_dups++] = best;
+        while (mr->heap_size > 0) {
+            if (!same_entity(mr, &mr->sources[best], &mr->sources[mr->heap[0]])) break;
+            int s = heap_pop(mr);
+            mr->dups[num_dups++] = s;
+            if (mr->sources[s].version > mr->sources[best].version)
+                best = s;
+        }
+        if (copy_entity(mr, &mr->sources[best], out)) goto fail;
+        for (int d = 0; d < num_dups; d++) {
+            int ret = source_next(mr, &mr->sources[mr->dups[d]]);
+            if (ret < 0) goto fail;
+            if (ret == 1)
+                heap_push(mr, mr->dups[d]);
+        }
+    }
+
+    if (out->num_nodes + out->num_ways == 0) {
+        OSM_Block_free(out);
+        return 0;
+    }
+    if (OSM_Block_set_strings(out, mr->strings)) goto fail;
+    *bpp = out;
+    return 1;
+
+fail:
+    OSM_Block_free(out);
+    return -1;
+}
+
+/**
+ * @brief  Create a reader that merges the blocks of several OSM PBF inputs.
+ * @details  Each input gets its own OSM_BlockReader; the decoding threads
+ * requested in op are divided among them.  With more than one input, the
+ * first block returned is a header block that combines the headers of the
+ * inputs, as by merge_header(), and declares the output sorted.
+ *
+ * @param ins  The input streams, each sorted by type and then id.
+ * @param num_ins  The number of input streams, at least one.
+ * @param op  Options, or NULL for the defaults set by OSM_Options_init().
+ * @return  The new reader, or NULL in case of an error.
+ */
+
+OSM_MergeReader *OSM_MergeReader_open(FILE **ins, int num_ins, const OSM_Options *op) {
+    if (num_ins < 1) return NULL;
+    OSM_MergeReader *mr = calloc(1, sizeof(OSM_MergeReader));
+    if (mr == NULL) return NULL;
+    if (op != NULL)
+        mr->opts = *op;
+    else
+        OSM_Options_init(&mr->opts);
+    mr->sources = calloc(num_ins, sizeof(Source));
+    mr->heap = calloc(num_ins, sizeof(int));
+    mr->dups = calloc(num_ins, sizeof(int));
+    if (mr->sources == NULL || mr->heap == NULL || mr->dups == NULL) goto fail;
+    mr->num_sources = num_ins;
+
+    OSM_Options source_opts = mr->opts;
+    if (num_ins > 1) {
+        source_opts.metadata = 1;
+        if (source_opts.threads > 1) {
+            source_opts.threads /= num_ins;
+            if (source_opts.threads < 2)
+                source_opts.threads = 2;
+        }
+    }
+    for (int i = 0; i < num_ins; i++) {
+        mr->sources[i].reader = OSM_BlockReader_open(ins[i], &source_opts);
+        if (mr->sources[i].reader == NULL) goto fail;
+    }
+    if (num_ins == 1)
+        return mr;
+
+    mr->header = calloc(1, sizeof(OSM_Block));
+    if (mr->header == NULL) goto fail;
+    mr->header->type = OSM_BLOB_HEADER;
+    for (int i = 0; i < num_ins; i++) {
+        int ret = source_next(mr, &mr->sources[i]);
+        if (ret < 0) goto fail;
+        if (ret == 1)
+            heap_push(mr, i);
+    }
+    mr->header->optional_features |= OSM_FEATURE_SORTED;
+    return mr;
+
+fail:
+    OSM_MergeReader_close(mr);
+    return NULL;
+}
+
+/**
+ * @brief  Get the next block from a merge reader.
+ *
+ * @param mr  The reader.
+ * @param bpp  Pointer to a variable in which to store the block, which is
+ * owned by the caller and must be freed with OSM_Block_free().
+ * @return 1 if a block was returned, 0 at the end of all inputs, and -1 in
+ * case of an error.
+ */
+
+int OSM_MergeReader_next(OSM_MergeReader *mr, OSM_Block **bpp) {
+    if (mr->num_sources == 1)
+        return OSM_BlockReader_next(mr->sources[0].reader, bpp);
+    if (mr->header != NULL) {
+        *bpp = mr->header;
+        mr->header = NULL;
+        return 1;
+    }
+    return merge_next_block(mr, bpp);
+}
+
+/**
+ * @brief  Close the block readers of a merge reader and free it.  The
+ * input streams are not closed.
+ */
+
+void OSM_MergeReader_close(OSM_MergeReader *mr) {
+    if (mr == NULL) return;
+    for (int i = 0; mr->sources != NULL && i < mr->num_sources; i++) {
+        OSM_BlockReader_close(mr->sources[i].reader);
+        OSM_Block_free(mr->sources[i].block);
+        free(mr->sources[i].strmap);
+    }
+    OSM_Block_free(mr->header);
+    SP_free(mr->strings);
+    free(mr->sources);
+    free(mr->heap);
+    free(mr->dups);
+    free(mr);
+}
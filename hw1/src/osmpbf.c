@@ -1,42 +1,610 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <limits.h>
+#include <sys/mman.h>
 
-#include "global.h"
-#include "protobuf.h"
 #include "osm.h"
+#include "osmpbf.h"
+#include "osmblock.h"
+#include "osmmap.h"
+#include "osmindex.h"
+#include "strpool.h"
+#include "eliasfano.h"
 #include "debug.h"
 
-typedef struct OSM_BBox {
-    OSM_Lat min_lat;
-    OSM_Lat max_lat;
-    OSM_Lon min_lon;
-    OSM_Lon max_lon;
-} OSM_BBox;
+/*
+ * The columns of a map are anonymous mappings rather than heap blocks, so
+ * that growing one with mremap() moves its pages instead of copying them:
+ * existing entries never move byte by byte, and a load never holds the old
+ * and new copies of a column at once.  Pages are only touched as entries
+ * are appended, and OSM_Map_finish() trims each column to its final size.
+ */
+
+static int resize_column(void **arrp, size_t elem_size, size_t old_cap, size_t new_cap) {
+    if (new_cap > SIZE_MAX / elem_size) return -1;
+    void *arr = *arrp;
+    size_t old_bytes = elem_size * old_cap, new_bytes = elem_size * new_cap;
+    if (new_bytes == 0) {
+        if (arr != NULL)
+            munmap(arr, old_bytes);
+        *arrp = NULL;
+        return 0;
+    }
+    if (arr == NULL)
+        arr = mmap(NULL, new_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    else
+        arr = mremap(arr, old_bytes, new_bytes, MREMAP_MAYMOVE);
+    if (arr == MAP_FAILED) return -1;
+    *arrp = arr;
+    return 0;
+}
+
+/* A column resized with the others of its kind, which has extra more entries than they do */
+
+typedef struct ColumnRef {
+    void **arrp;
+    size_t elem_size;
+    size_t extra;
+} ColumnRef;
+
+/*
+ * Resize the columns of a kind together, from old_cap to new_cap entries,
+ * leaving them all at old_cap if any of them cannot be resized.
+ */
+
+static int resize_columns(ColumnRef *cols, int n, size_t old_cap, size_t new_cap) {
+    for (int i = 0; i < n; i++) {
+        if (resize_column(cols[i].arrp, cols[i].elem_size, old_cap + cols[i].extra,
+                          new_cap + cols[i].extra)) {
+            while (i-- > 0)
+                resize_column(cols[i].arrp, cols[i].elem_size, new_cap + cols[i].extra,
+                              old_cap + cols[i].extra);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void free_columns(ColumnRef *cols, int n, size_t cap) {
+    for (int i = 0; i < n; i++) {
+        if (*cols[i].arrp != NULL)
+            munmap(*cols[i].arrp, cols[i].elem_size * (cap + cols[i].extra));
+        *cols[i].arrp = NULL;
+    }
+}
+
+/*
+ * Compute a new capacity, at least doubling the old one, for a column that
+ * is to hold count + extra elements.  Returns -1 if that is not representable.
+ */
+
+static int grow_cap(size_t *capp, size_t count, size_t extra, size_t initial) {
+    if (extra > SIZE_MAX / 2 - count) {
+        fprintf(stderr, "Map too large: column of %zu + %zu entries\n", count, extra);
+        return -1;
+    }
+    size_t cap = *capp ? *capp : initial;
+    while (cap < count + extra)
+        cap *= 2;
+    *capp = cap;
+    return 0;
+}
+
+/* The columns of each kind, and how many of them there are */
+
+static int node_columns(OSM_Map *mp, ColumnRef *cols) {
+    cols[0] = (ColumnRef){ (void **)&mp->node_ids.ids, sizeof(OSM_Id), 0 };
+    cols[1] = (ColumnRef){ (void **)&mp->node_lats, sizeof(OSM_Lat), 0 };
+    cols[2] = (ColumnRef){ (void **)&mp->node_lons, sizeof(OSM_Lon), 0 };
+    cols[3] = (ColumnRef){ (void **)&mp->node_tags.sets, sizeof(uint32_t), 0 };
+    if (!mp->has_metadata) return 4;
+    cols[4] = (ColumnRef){ (void **)&mp->node_versions, sizeof(int32_t), 0 };
+    cols[5] = (ColumnRef){ (void **)&mp->node_timestamps, sizeof(int64_t), 0 };
+    cols[6] = (ColumnRef){ (void **)&mp->node_visible, sizeof(uint8_t), 0 };
+    return 7;
+}
+
+static int way_columns(OSM_Map *mp, ColumnRef *cols) {
+    cols[0] = (ColumnRef){ (void **)&mp->way_ids.ids, sizeof(OSM_Id), 0 };
+    cols[1] = (ColumnRef){ (void **)&mp->way_ref_start, sizeof(size_t), 1 };
+    cols[2] = (ColumnRef){ (void **)&mp->way_tags.sets, sizeof(uint32_t), 0 };
+    if (!mp->has_metadata) return 3;
+    cols[3] = (ColumnRef){ (void **)&mp->way_versions, sizeof(int32_t), 0 };
+    cols[4] = (ColumnRef){ (void **)&mp->way_timestamps, sizeof(int64_t), 0 };
+    cols[5] = (ColumnRef){ (void **)&mp->way_visible, sizeof(uint8_t), 0 };
+    return 6;
+}
+
+static int ref_columns(OSM_Map *mp, ColumnRef *cols) {
+    cols[0] = (ColumnRef){ (void **)&mp->way_refs, sizeof(OSM_Id), 0 };
+    if (mp->way_ref_lats == NULL) return 1;
+    cols[1] = (ColumnRef){ (void **)&mp->way_ref_lats, sizeof(OSM_Lat), 0 };
+    cols[2] = (ColumnRef){ (void **)&mp->way_ref_lons, sizeof(OSM_Lon), 0 };
+    return 3;
+}
+
+static int tag_columns(OSM_TagColumn *tp, ColumnRef *cols) {
+    cols[0] = (ColumnRef){ (void **)&tp->keys, sizeof(uint32_t), 0 };
+    cols[1] = (ColumnRef){ (void **)&tp->vals, sizeof(uint32_t), 0 };
+    return 2;
+}
+
+static int set_columns(OSM_TagColumn *tp, ColumnRef *cols) {
+    cols[0] = (ColumnRef){ (void **)&tp->set_start, sizeof(size_t), 1 };
+    if (tp->set_hashes == NULL && tp->set_cap > 0) return 1;
+    cols[1] = (ColumnRef){ (void **)&tp->set_hashes, sizeof(uint32_t), 0 };
+    return 2;
+}
+
+static int resize_nodes(OSM_Map *mp, size_t cap) {
+    ColumnRef cols[7];
+    if (resize_columns(cols, node_columns(mp, cols), mp->node_cap, cap)) return -1;
+    mp->node_cap = cap;
+    return 0;
+}
+
+static int resize_ways(OSM_Map *mp, size_t cap) {
+    ColumnRef cols[6];
+    if (resize_columns(cols, way_columns(mp, cols), mp->way_cap, cap)) return -1;
+    mp->way_cap = cap;
+    return 0;
+}
+
+static int resize_refs(OSM_Map *mp, size_t cap) {
+    ColumnRef cols[3];
+    if (resize_columns(cols, ref_columns(mp, cols), mp->ref_cap, cap)) return -1;
+    mp->ref_cap = cap;
+    return 0;
+}
+
+static int resize_tags(OSM_TagColumn *tp, size_t cap) {
+    ColumnRef cols[2];
+    if (resize_columns(cols, tag_columns(tp, cols), tp->cap, cap)) return -1;
+    tp->cap = cap;
+    return 0;
+}
+
+static int resize_sets(OSM_TagColumn *tp, size_t cap) {
+    ColumnRef cols[2];
+    if (resize_columns(cols, set_columns(tp, cols), tp->set_cap, cap)) return -1;
+    tp->set_cap = cap;
+    return 0;
+}
+
+static int reserve_nodes(OSM_Map *mp, size_t extra) {
+    if (extra <= mp->node_cap - mp->num_nodes) return 0;
+    size_t cap = mp->node_cap;
+    return grow_cap(&cap, mp->num_nodes, extra, 1024) ? -1 : resize_nodes(mp, cap);
+}
+
+static int reserve_ways(OSM_Map *mp, size_t extra) {
+    if (extra <= mp->way_cap - mp->num_ways) return 0;
+    size_t cap = mp->way_cap;
+    return grow_cap(&cap, mp->num_ways, extra, 1024) ? -1 : resize_ways(mp, cap);
+}
+
+static int reserve_refs(OSM_Map *mp, size_t extra) {
+    if (extra <= mp->ref_cap - mp->num_refs) return 0;
+    size_t cap = mp->ref_cap;
+    return grow_cap(&cap, mp->num_refs, extra, 4096) ? -1 : resize_refs(mp, cap);
+}
+
+static int reserve_tags(OSM_TagColumn *tp, size_t extra) {
+    if (extra <= tp->cap - tp->count) return 0;
+    size_t cap = tp->cap;
+    return grow_cap(&cap, tp->count, extra, 1024) ? -1 : resize_tags(tp, cap);
+}
 
-typedef struct OSM_Map {
-    OSM_BBox bbox;
-    OSM_Node *nodes;
-    int num_nodes;
-    OSM_Way *ways;
-    int num_ways;
-} OSM_Map;
+/*
+ * Trim the columns of a map to the entries they hold, keeping at least one
+ * so that the columns of an empty map are still there to be viewed.
+ */
+
+#define TRIMMED(n)  ((n) > 0 ? (n) : 1)
+
+static int trim_columns(OSM_Map *mp) {
+    return resize_nodes(mp, TRIMMED(mp->num_nodes)) || resize_ways(mp, TRIMMED(mp->num_ways)) ||
+           resize_refs(mp, TRIMMED(mp->num_refs)) ||
+           resize_tags(&mp->node_tags, TRIMMED(mp->node_tags.count)) ||
+           resize_tags(&mp->way_tags, TRIMMED(mp->way_tags.count)) ||
+           resize_sets(&mp->node_tags, TRIMMED(mp->node_tags.num_sets)) ||
+           resize_sets(&mp->way_tags, TRIMMED(mp->way_tags.num_sets)) ? -1 : 0;
+}
 
-typedef struct OSM_Node {
-    OSM_Id id;
-    OSM_Lat lat;
-    OSM_Lon lon;
-} OSM_Node;
+/* Drop what is only needed to add tag sets, once a map is complete */
 
-typedef struct OSM_Way {
-    OSM_Id id;
-    int num_refs;
-} OSM_Way;
+static void finish_sets(OSM_TagColumn *tp) {
+    resize_column((void **)&tp->set_hashes, sizeof(uint32_t), tp->set_cap, 0);
+    free(tp->table);
+    tp->table = NULL;
+    tp->table_size = 0;
+}
+
+static void free_all_columns(OSM_Map *mp) {
+    ColumnRef cols[7];
+    free_columns(cols, node_columns(mp, cols), mp->node_cap);
+    free_columns(cols, way_columns(mp, cols), mp->way_cap);
+    free_columns(cols, ref_columns(mp, cols), mp->ref_cap);
+    free_columns(cols, tag_columns(&mp->node_tags, cols), mp->node_tags.cap);
+    free_columns(cols, tag_columns(&mp->way_tags, cols), mp->way_tags.cap);
+    free_columns(cols, set_columns(&mp->node_tags, cols), mp->node_tags.set_cap);
+    free_columns(cols, set_columns(&mp->way_tags, cols), mp->way_tags.set_cap);
+    free(mp->node_tags.table);
+    free(mp->way_tags.table);
+    EF_free(mp->node_ids.ef);
+    free(mp->node_ids.order);
+    EF_free(mp->way_ids.ef);
+    free(mp->way_ids.order);
+}
 
-static int64_t zigzag_decode(int64_t n) { // helper function for zig zag decoding
-    if (n%2 == 0) return (n/2);
+static uint32_t hash_pairs(const uint32_t *keys, const uint32_t *vals, size_t n) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ n;
+    for (size_t i = 0; i < n; i++) {
+        h = (h ^ (((uint64_t)keys[i] << 32) | vals[i])) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 29;
+    }
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+/* Double the hash table of the tag sets, or create it */
+
+static int grow_table(OSM_TagColumn *tp) {
+    size_t size = tp->table_size ? 2 * tp->table_size : 1024;
+    uint32_t *table = calloc(size, sizeof(uint32_t));
+    if (table == NULL) return -1;
+    for (size_t s = 0; s < tp->num_sets; s++) {
+        size_t slot = tp->set_hashes[s] & (size - 1);
+        while (table[slot] != 0)
+            slot = (slot + 1) & (size - 1);
+        table[slot] = s + 1;
+    }
+    free(tp->table);
+    tp->table = table;
+    tp->table_size = size;
+    return 0;
+}
+
+/*
+ * Find the tag set of n pairs, adding it to a tag column if it has none.
+ * Returns 0 and stores the id of the set in *setp if successful.
+ */
+
+static int intern_set(OSM_TagColumn *tp, const uint32_t *keys, const uint32_t *vals, size_t n,
+                      uint32_t *setp) {
+    if (2 * (tp->num_sets + 1) > tp->table_size && grow_table(tp)) return -1;
+    uint32_t h = hash_pairs(keys, vals, n);
+    size_t slot = h & (tp->table_size - 1);
+    for (; tp->table[slot] != 0; slot = (slot + 1) & (tp->table_size - 1)) {
+        uint32_t s = tp->table[slot] - 1;
+        size_t start = tp->set_start[s];
+        if (tp->set_hashes[s] == h && tp->set_start[s + 1] - start == n &&
+            (n == 0 || (memcmp(tp->keys + start, keys, n * sizeof(uint32_t)) == 0 &&
+                        memcmp(tp->vals + start, vals, n * sizeof(uint32_t)) == 0))) {
+            *setp = s;
+            return 0;
+        }
+    }
+
+    if (tp->num_sets >= UINT32_MAX - 1) {
+        fprintf(stderr, "Map too large: more than %u tag sets\n", UINT32_MAX - 1);
+        return -1;
+    }
+    if (reserve_tags(tp, n)) return -1;
+    if (tp->num_sets == tp->set_cap) {
+        size_t cap = tp->set_cap;
+        if (grow_cap(&cap, tp->num_sets, 1, 1024) || resize_sets(tp, cap)) return -1;
+    }
+    if (n > 0) {
+        memcpy(tp->keys + tp->count, keys, n * sizeof(uint32_t));
+        memcpy(tp->vals + tp->count, vals, n * sizeof(uint32_t));
+    }
+    tp->set_start[tp->num_sets] = tp->count;
+    tp->count += n;
+    tp->set_start[tp->num_sets + 1] = tp->count;
+    tp->set_hashes[tp->num_sets] = h;
+    tp->table[slot] = tp->num_sets + 1;
+    *setp = tp->num_sets++;
+    return 0;
+}
+
+/*
+ * Give each of count entities of a block the tag set of its tags, whose
+ * string indices in the block are translated into ids in the map's string
+ * pool.  The entities are stored from index base of the column on.
+ */
+
+static int merge_tags(OSM_TagColumn *tp, OSM_BlockTags *btp, uint32_t *strings,
+                      size_t base, int count) {
+    int n = btp->start[count] - btp->start[0];
+    uint32_t *pairs = malloc((2 * (size_t)n + 1) * sizeof(uint32_t));
+    if (pairs == NULL) return -1;
+    uint32_t *keys = pairs, *vals = pairs + n;
+    for (int i = 0; i < n; i++) {
+        keys[i] = strings[btp->keys[i]];
+        vals[i] = strings[btp->vals[i]];
+    }
+    int ret = 0;
+    for (int i = 0; i < count && ret == 0; i++) {
+        size_t start = btp->start[i] - btp->start[0];
+        ret = intern_set(tp, keys + start, vals + start, btp->start[i + 1] - btp->start[i],
+                         &tp->sets[base + i]);
+    }
+    free(pairs);
+    return ret;
+}
+
+/*
+ * Append the locations of the refs of a block to those of a map, or drop
+ * the map's locations if the block has none.  Called after reserve_refs().
+ */
+
+static int merge_way_locations(OSM_Map *mp, OSM_Block *bp, size_t num_refs) {
+    if (mp->no_way_locations || num_refs == 0) return 0;
+    if (bp->way_ref_lats == NULL) {
+        resize_column((void **)&mp->way_ref_lats, sizeof(OSM_Lat), mp->ref_cap, 0);
+        resize_column((void **)&mp->way_ref_lons, sizeof(OSM_Lon), mp->ref_cap, 0);
+        mp->no_way_locations = 1;
+        return 0;
+    }
+    if (mp->way_ref_lats == NULL) {
+        if (resize_column((void **)&mp->way_ref_lats, sizeof(OSM_Lat), 0, mp->ref_cap))
+            return -1;
+        if (resize_column((void **)&mp->way_ref_lons, sizeof(OSM_Lon), 0, mp->ref_cap)) {
+            resize_column((void **)&mp->way_ref_lats, sizeof(OSM_Lat), mp->ref_cap, 0);
+            return -1;
+        }
+    }
+    memcpy(mp->way_ref_lats + mp->num_refs, bp->way_ref_lats, num_refs * sizeof(OSM_Lat));
+    memcpy(mp->way_ref_lons + mp->num_refs, bp->way_ref_lons, num_refs * sizeof(OSM_Lon));
+    return 0;
+}
+
+/*
+ * Append the entities of a decoded block to the columns of a map.
+ */
+
+static int merge_block(OSM_Map *mp, OSM_Block *bp) {
+    if (bp->type == OSM_BLOB_HEADER) {
+        if (bp->has_bbox) {
+            mp->bbox.min_lat = bp->min_lat;
+            mp->bbox.max_lat = bp->max_lat;
+            mp->bbox.min_lon = bp->min_lon;
+            mp->bbox.max_lon = bp->max_lon;
+            mp->has_bbox = 1;
+        }
+        mp->required_features = bp->required_features;
+        mp->optional_features = bp->optional_features;
+        return 0;
+    }
+
+    uint32_t *strings = malloc((bp->num_strings + 1) * sizeof(uint32_t));
+    if (strings == NULL) return -1;
+    for (int i = 0; i < bp->num_strings; i++) {
+        strings[i] = SP_intern(mp->strings, bp->strings[i], bp->string_lens[i]);
+        if (strings[i] == SP_NONE) {
+            free(strings);
+            return -1;
+        }
+    }
+
+    int ret = -1;
+    int n = bp->num_nodes;
+    size_t base = mp->num_nodes;
+    if (n > 0) {
+        if (reserve_nodes(mp, n)) goto done;
+        memcpy(mp->node_ids.ids + base, bp->node_ids, n * sizeof(OSM_Id));
+        memcpy(mp->node_lats + base, bp->node_lats, n * sizeof(OSM_Lat));
+        memcpy(mp->node_lons + base, bp->node_lons, n * sizeof(OSM_Lon));
+        if (mp->has_metadata) {
+            memcpy(mp->node_versions + base, bp->node_info.versions, n * sizeof(int32_t));
+            memcpy(mp->node_timestamps + base, bp->node_info.timestamps, n * sizeof(int64_t));
+            memcpy(mp->node_visible + base, bp->node_info.visible, n * sizeof(uint8_t));
+        }
+        if (merge_tags(&mp->node_tags, &bp->node_tags, strings, base, n)) goto done;
+        mp->num_nodes += n;
+    }
+
+    n = bp->num_ways;
+    base = mp->num_ways;
+    if (n > 0) {
+        int num_refs = bp->way_ref_start[n];
+        if (reserve_ways(mp, n) || reserve_refs(mp, num_refs)) goto done;
+        memcpy(mp->way_ids.ids + base, bp->way_ids, n * sizeof(OSM_Id));
+        memcpy(mp->way_refs + mp->num_refs, bp->way_refs, num_refs * sizeof(OSM_Id));
+        if (merge_way_locations(mp, bp, num_refs)) goto done;
+        for (int i = 0; i < n; i++)
+            mp->way_ref_start[base + i] = mp->num_refs + bp->way_ref_start[i];
+        mp->num_refs += num_refs;
+        mp->way_ref_start[base + n] = mp->num_refs;
+        if (mp->has_metadata) {
+            memcpy(mp->way_versions + base, bp->way_info.versions, n * sizeof(int32_t));
+            memcpy(mp->way_timestamps + base, bp->way_info.timestamps, n * sizeof(int64_t));
+            memcpy(mp->way_visible + base, bp->way_info.visible, n * sizeof(uint8_t));
+        }
+        if (merge_tags(&mp->way_tags, &bp->way_tags, strings, base, n)) goto done;
+        mp->num_ways += n;
+    }
+    ret = 0;
+
+done:
+    free(strings);
+    return ret;
+}
+
+static int compare_id_index(const void *a, const void *b) {
+    const OSM_Id *x = a, *y = b;
+    for (int i = 0; i < 3; i++) {
+        if (x[i] != y[i])
+            return (x[i] > y[i]) - (x[i] < y[i]);
+    }
+    return 0;
+}
+
+/*
+ * If the ids in a column are not sorted, compute the permutation that
+ * sorts them, for use by lookups.  If versions is not NULL, the versions
+ * of each entity are also sorted, so that they form a chain.  Entries
+ * that are otherwise equal keep their order in the column.  The check is
+ * made even for a file whose header declares it sorted, since a wrong
+ * declaration would otherwise break every lookup; it only costs a scan.
+ */
+
+static int index_id_column(OSM_IdColumn *cp, size_t n, const int32_t *versions,
+                           int declared, const char *type) {
+    int sorted = 1;
+    for (size_t i = 1; i < n && sorted; i++)
+        sorted = cp->ids[i-1] < cp->ids[i] ||
+                 (cp->ids[i-1] == cp->ids[i] && (!versions || versions[i-1] <= versions[i]));
+    if (sorted) return 0;
+    if (declared)
+        fprintf(stderr, "The %s of the input are not sorted, although its header says they are\n", type);
+
+    if (n > SIZE_MAX / (3 * sizeof(OSM_Id))) return -1;
+    OSM_Id *keys = malloc(3 * n * sizeof(OSM_Id));
+    cp->order = malloc(n * sizeof(size_t));
+    if (keys == NULL || cp->order == NULL) {
+        free(keys);
+        return -1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        keys[3*i] = cp->ids[i];
+        keys[3*i+1] = versions ? versions[i] : 0;
+        keys[3*i+2] = i;
+    }
+    qsort(keys, n, 3 * sizeof(OSM_Id), compare_id_index);
+    for (size_t i = 0; i < n; i++)
+        cp->order[i] = keys[3*i+2];
+    free(keys);
+    return 0;
+}
 
-    return -(n+1)/2;
+static OSM_Id id_at(OSM_IdColumn *cp, size_t index) {
+    return cp->ef ? EF_select(cp->ef, index) : cp->ids[index];
+}
+
+/*
+ * Find the first position, in sorted order, whose id is not less than id.
+ */
+
+static size_t lower_bound_id(OSM_IdColumn *cp, size_t n, OSM_Id id) {
+    if (cp->ef)
+        return EF_lower_bound(cp->ef, id);
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        OSM_Id mid_id = cp->ids[cp->order ? cp->order[mid] : mid];
+        if (mid_id < id) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * Find the index of the entity with a specified id.  Returns 1 and stores
+ * the index in *indexp if there is one, otherwise returns 0.
+ */
+
+static int find_id(OSM_IdColumn *cp, size_t n, OSM_Id id, size_t *indexp) {
+    if (cp->ef)
+        return EF_find(cp->ef, id, indexp);
+    size_t lo = lower_bound_id(cp, n, id);
+    if (lo == n) return 0;
+    size_t index = cp->order ? cp->order[lo] : lo;
+    if (cp->ids[index] != id) return 0;
+    *indexp = index;
+    return 1;
+}
+
+/*
+ * Find the version of an entity current at a specified time: the last
+ * version in its chain with a timestamp no later than that time.  Returns
+ * 1 and stores its index in *indexp if that version exists and is visible,
+ * otherwise returns 0.
+ */
+
+static int find_version_at(OSM_IdColumn *cp, size_t n, const int64_t *timestamps,
+                           const uint8_t *visible, OSM_Id id, int64_t time, size_t *indexp) {
+    size_t first = lower_bound_id(cp, n, id);
+    size_t lo = first, hi = id == INT64_MAX ? n : lower_bound_id(cp, n, id + 1);
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (timestamps[cp->order ? cp->order[mid] : mid] <= time) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == first) return 0;
+    size_t index = cp->order ? cp->order[lo - 1] : lo - 1;
+    if (!visible[index]) return 0;
+    *indexp = index;
+    return 1;
+}
+
+/*
+ * Count the entities of a column that exist at a specified time.
+ */
+
+static size_t count_at(OSM_IdColumn *cp, size_t n, const int64_t *timestamps,
+                       const uint8_t *visible, int64_t time) {
+    size_t count = 0;
+    int found = 0, current = 0;
+    OSM_Id prev = 0;
+    for (size_t pos = 0; pos < n; pos++) {
+        size_t index = cp->order ? cp->order[pos] : pos;
+        OSM_Id id = id_at(cp, index);
+        if (pos == 0 || id != prev) {
+            count += found && current;
+            found = 0;
+            prev = id;
+        }
+        if (timestamps[index] <= time) {
+            found = 1;
+            current = visible[index];
+        }
+    }
+    return count + (found && current);
+}
+
+static int finish_map(OSM_Map *mp) {
+    if (mp->node_cap == 0 && reserve_nodes(mp, 1)) return -1;
+    if (mp->way_cap == 0 && reserve_ways(mp, 1)) return -1;
+    mp->way_ref_start[mp->num_ways] = mp->num_refs;
+    finish_sets(&mp->node_tags);
+    finish_sets(&mp->way_tags);
+    if (trim_columns(mp)) return -1;
+
+    mp->nodes = malloc((mp->num_nodes + 1) * sizeof(OSM_Node));
+    mp->ways = malloc((mp->num_ways + 1) * sizeof(OSM_Way));
+    if (mp->nodes == NULL || mp->ways == NULL) return -1;
+    for (size_t i = 0; i < mp->num_nodes; i++)
+        mp->nodes[i].map = mp;
+    for (size_t i = 0; i < mp->num_ways; i++)
+        mp->ways[i].map = mp;
+
+    int declared = ((mp->required_features | mp->optional_features) & OSM_FEATURE_SORTED) != 0;
+    if (index_id_column(&mp->node_ids, mp->num_nodes, mp->is_history ? mp->node_versions : NULL,
+                        declared, "nodes") ||
+        index_id_column(&mp->way_ids, mp->num_ways, mp->is_history ? mp->way_versions : NULL,
+                        declared, "ways"))
+        return -1;
+    return 0;
+}
+
+/**
+ * @brief  Initialize an OSM_Options structure with the default options:
+ * decoding in the calling thread, and loading all entities with their tags
+ * but without metadata.
+ *
+ * @param op  The options structure to be initialized.
+ */
+
+void OSM_Options_init(OSM_Options *op) {
+    memset(op, 0, sizeof(OSM_Options));
+    op->threads = 1;
+    op->types = OSM_TYPE_ALL;
+    op->tags = 1;
+    op->cache_blocks = 0;
 }
 
 /**
@@ -49,54 +617,668 @@ static int64_t zigzag_decode(int64_t n) { // helper function for zig zag decodin
  */
 
 OSM_Map *OSM_read_Map(FILE *in) {
-    OSM_Map *map = (OSM_Map *)malloc(sizeof(OSM_Map));
+    return OSM_read_Map_opts(in, NULL);
+}
+
+/**
+ * @brief  Read map data in OSM PBF format from the specified input stream,
+ * as for OSM_read_Map(), but under the control of the specified options.
+ * @details  Blocks are decoded on op->threads threads and merged into the
+ * map in file order, so the result does not depend on the number of threads.
+ * If op->path names the file and its index sidecar is up to date, the
+ * columns of the map are first sized from the counts of the index.
+ * Concurrent calls, for different input streams, are permitted.
+ * @param in  The input stream to read.
+ * @param op  The options, or NULL for the defaults set by OSM_Options_init().
+ * @return  If reading was successful, a pointer to the OSM_Map object
+ * constructed from the input, otherwise NULL in case of any error.
+ * The map is to be freed by OSM_Map_free().
+ */
+
+OSM_Map *OSM_read_Map_opts(FILE *in, const OSM_Options *op) {
+    return OSM_read_Map_merged(&in, 1, op);
+}
+
+/**
+ * @brief  Read map data from several OSM PBF input streams into a single
+ * map, as if their contents had been merged.
+ * @details  The inputs are merged by type and id while they are read, by
+ * an OSM_MergeReader; an entity present in more than one input is stored
+ * once, in the version with the highest version number.  Each input must
+ * be sorted by type and then id, as extracts normally are.  With a single
+ * input, this is the same as OSM_read_Map_opts(), and no order is required.
+ * With the history option, every version is kept rather than only the
+ * highest, and the versions of each entity are indexed as a chain.
+ * @param ins  The input streams to read.
+ * @param num_ins  The number of input streams.
+ * @param op  The options, or NULL for the defaults set by OSM_Options_init().
+ * @return  If reading was successful, a pointer to the OSM_Map object
+ * constructed from the inputs, otherwise NULL in case of any error.
+ * The map is to be freed by OSM_Map_free().
+ */
+
+OSM_Map *OSM_read_Map_merged(FILE **ins, int num_ins, const OSM_Options *op) {
+    OSM_Options defaults;
+    if (op == NULL) {
+        OSM_Options_init(&defaults);
+        op = &defaults;
+    }
+
+    OSM_Map *map = OSM_Map_create(op);
     if (!map) {
         return NULL;
     }
+    if (num_ins == 1 && op->path != NULL) {
+        OSM_Index *ix = OSM_Index_find(op->path, ins[0]);
+        int ret = ix != NULL ? OSM_Index_reserve(ix, map, op) : 0;
+        OSM_Index_free(ix);
+        if (ret) {
+            OSM_Map_free(map);
+            return NULL;
+        }
+    }
+    OSM_MergeReader *reader = OSM_MergeReader_open(ins, num_ins, op);
+    if (reader == NULL) {
+        OSM_Map_free(map);
+        return NULL;
+    }
+
+    OSM_Block *block;
+    int ret;
+    while ((ret = OSM_MergeReader_next(reader, &block)) == 1) {
+        ret = merge_block(map, block);
+        OSM_Block_free(block);
+        if (ret) break;
+    }
+    OSM_MergeReader_close(reader);
+
+    if (ret != 0 || OSM_Map_finish(map, op)) {
+        OSM_Map_free(map);
+        return NULL;
+    }
+    return map;
+}
+
+/**
+ * @brief  Create an empty map, to be filled by OSM_Map_add_Block() and
+ * completed by OSM_Map_finish(), for loaders other than OSM_read_Map_merged().
+ *
+ * @param op  The options the blocks are decoded with; history implies metadata.
+ * @return  The new map, or NULL if memory could not be allocated.
+ */
+
+OSM_Map *OSM_Map_create(const OSM_Options *op) {
+    OSM_Map *map = calloc(1, sizeof(OSM_Map));
+    if (map == NULL) return NULL;
+    map->has_metadata = op->metadata || op->history;
+    map->is_history = op->history != 0;
+    map->strings = SP_create();
+    if (map->strings == NULL) {
+        OSM_Map_free(map);
+        return NULL;
+    }
+    return map;
+}
+
+/**
+ * @brief  Size the columns of a map under construction for the entities
+ * it is known to be going to hold, so that appending them allocates no more.
+ * @details  Columns never move as they grow, so this only saves the calls
+ * that grow them; counts that turn out too large are trimmed by
+ * OSM_Map_finish().
+ *
+ * @param mp  The map, from OSM_Map_create().
+ * @param num_nodes  The number of nodes it will hold in all.
+ * @param num_ways  The number of ways.
+ * @param num_refs  The number of refs of those ways.
+ * @return 0 if successful, -1 if memory could not be allocated.
+ */
 
-    map->num_nodes = 0;
-    map->nodes = NULL;
-    map->num_ways = 0;
-    map->ways = NULL;
+int OSM_Map_reserve(OSM_Map *mp, size_t num_nodes, size_t num_ways, size_t num_refs) {
+    if ((num_nodes > mp->node_cap && resize_nodes(mp, num_nodes)) ||
+        (num_ways > mp->way_cap && resize_ways(mp, num_ways)) ||
+        (num_refs > mp->ref_cap && resize_refs(mp, num_refs)))
+        return -1;
+    return 0;
+}
 
-    unsigned char buffer[4];
-    size_t len;
+/**
+ * @brief  Append the entities of a decoded block to a map under
+ * construction, or take the bounding box and features of a header block.
+ *
+ * @param mp  The map, from OSM_Map_create().
+ * @param bp  The block, which is not modified and remains owned by the caller.
+ * @return 0 if successful, -1 if memory could not be allocated.
+ */
 
-    while (fread(buffer, 1, 4, in) == 4) {
-        len = (buffer[0] << 24) | (buffer[1] << 16) | (buffer[2] << 8) | buffer[3];
-        PB_Message msg;
+int OSM_Map_add_Block(OSM_Map *mp, OSM_Block *bp) {
+    return merge_block(mp, bp);
+}
 
-        if (PB_read_message(in, len, &msg) != 1) {
-            return NULL;
+/**
+ * @brief  Complete a map under construction, after its last block: index
+ * its ids and, if requested, compress them.
+ *
+ * @param mp  The map, from OSM_Map_create().
+ * @param op  The options the map was created with.
+ * @return 0 if successful, -1 in case of an error, after which the map
+ * may only be freed.
+ */
+
+int OSM_Map_finish(OSM_Map *mp, const OSM_Options *op) {
+    if (finish_map(mp)) return -1;
+    if (op->compress_ids)
+        OSM_Map_compress_ids(mp);
+    return 0;
+}
+
+/**
+ * @brief  Free an OSM_Map object and all storage associated with it.
+ * @details  Any OSM_BBox, OSM_Node and OSM_Way pointers obtained from the
+ * map, and strings returned by its accessors, become invalid.
+ *
+ * @param mp  The map to be freed, or NULL.
+ */
+
+void OSM_Map_free(OSM_Map *mp) {
+    if (mp == NULL) return;
+    SP_free(mp->strings);
+    free(mp->nodes);
+    free(mp->ways);
+    free_all_columns(mp);
+    free(mp);
+}
+
+/**
+ * @brief  Determine whether an OSM_Map object was loaded with metadata.
+ *
+ * @param mp  The map object to query.
+ * @return  Nonzero if versions and timestamps are available, otherwise 0.
+ */
+
+int OSM_Map_has_metadata(OSM_Map *mp) {
+    return mp != NULL && mp->has_metadata;
+}
+
+/**
+ * @brief  Get the version of an OSM_Node object.
+ *
+ * @param np  The node object to be queried.
+ * @return  The version of the node, or -1 if it is not known.
+ */
+
+int32_t OSM_Node_get_version(OSM_Node *np) {
+    if (np == NULL || !np->map->has_metadata) return -1;
+    return np->map->node_versions[np - np->map->nodes];
+}
+
+/**
+ * @brief  Get the timestamp of an OSM_Node object.
+ *
+ * @param np  The node object to be queried.
+ * @return  The time of the last modification of the node, in seconds since
+ * the epoch, or 0 if it is not known.
+ */
+
+int64_t OSM_Node_get_timestamp(OSM_Node *np) {
+    if (np == NULL || !np->map->has_metadata) return 0;
+    return np->map->node_timestamps[np - np->map->nodes];
+}
+
+/**
+ * @brief  Get the version of an OSM_Way object.
+ *
+ * @param wp  The way object to be queried.
+ * @return  The version of the way, or -1 if it is not known.
+ */
+
+int32_t OSM_Way_get_version(OSM_Way *wp) {
+    if (wp == NULL || !wp->map->has_metadata) return -1;
+    return wp->map->way_versions[wp - wp->map->ways];
+}
+
+/**
+ * @brief  Get the timestamp of an OSM_Way object.
+ *
+ * @param wp  The way object to be queried.
+ * @return  The time of the last modification of the way, in seconds since
+ * the epoch, or 0 if it is not known.
+ */
+
+int64_t OSM_Way_get_timestamp(OSM_Way *wp) {
+    if (wp == NULL || !wp->map->has_metadata) return 0;
+    return wp->map->way_timestamps[wp - wp->map->ways];
+}
+
+/**
+ * @brief  Replace the node and way id columns of a map by Elias-Fano
+ * encoded equivalents.
+ * @details  For sorted ids, this reduces the storage for ids from 64 bits
+ * to about 2 + log2(average id gap) bits per entity, at the cost of a
+ * few word operations per access.  Accessors and lookups continue to
+ * work as before.  A column whose ids are not sorted is left unchanged.
+ *
+ * @param  mp  The map whose id columns are to be compressed.
+ * @return  0 if both columns were compressed, -1 otherwise.
+ */
+
+int OSM_Map_compress_ids(OSM_Map *mp) {
+    if (mp == NULL) return -1;
+
+    int ret = 0;
+    OSM_IdColumn *cols[2] = { &mp->node_ids, &mp->way_ids };
+    size_t counts[2] = { mp->num_nodes, mp->num_ways };
+    size_t caps[2] = { mp->node_cap, mp->way_cap };
+    for (int i = 0; i < 2; i++) {
+        OSM_IdColumn *cp = cols[i];
+        if (cp->ef) continue;
+        if (cp->order) {
+            ret = -1;
+            continue;
+        }
+        cp->ef = EF_encode(cp->ids, counts[i]);
+        if (cp->ef == NULL) {
+            ret = -1;
+            continue;
         }
+        resize_column((void **)&cp->ids, sizeof(OSM_Id), caps[i], 0);
+    }
+    return ret;
+}
+
+/**
+ * @brief  Get the number of bytes of storage used to identify the nodes
+ * and ways of a map: their id columns, and their handles.
+ * @details  Each handle takes as much as an uncompressed id, and is not
+ * compressed, so compressing the ids at most halves this.
+ *
+ * @param  mp  The map object to query.
+ * @return  The number of bytes used to store ids and handles.
+ */
+
+size_t OSM_Map_get_id_bytes(OSM_Map *mp) {
+    if (mp == NULL) return 0;
+    size_t bytes = (mp->num_nodes + 1) * sizeof(OSM_Node) + (mp->num_ways + 1) * sizeof(OSM_Way);
+    OSM_IdColumn *cols[2] = { &mp->node_ids, &mp->way_ids };
+    size_t counts[2] = { mp->num_nodes, mp->num_ways };
+    for (int i = 0; i < 2; i++) {
+        if (cols[i]->ef)
+            bytes += EF_bytes(cols[i]->ef);
+        else
+            bytes += counts[i] * sizeof(OSM_Id);
+        if (cols[i]->order)
+            bytes += counts[i] * sizeof(size_t);
+    }
+    return bytes;
+}
+
+/**
+ * @brief  Get the number of bytes of storage used by the tags of the nodes
+ * and ways of a map: the tag set of each entity, and the pairs and offsets
+ * of the distinct tag sets.
+ *
+ * @param  mp  The map object to query.
+ * @return  The number of bytes used to store tags.
+ */
+
+size_t OSM_Map_get_tag_bytes(OSM_Map *mp) {
+    if (mp == NULL) return 0;
+    OSM_TagColumn *cols[2] = { &mp->node_tags, &mp->way_tags };
+    size_t counts[2] = { mp->num_nodes, mp->num_ways };
+    size_t bytes = 0;
+    for (int i = 0; i < 2; i++)
+        bytes += counts[i] * sizeof(uint32_t) + (cols[i]->num_sets + 1) * sizeof(size_t) +
+                 cols[i]->count * 2 * sizeof(uint32_t);
+    return bytes;
+}
+
+/**
+ * @brief  Get direct read-only access to the node columns of a map.
+ * @details  The arrays remain valid until the map is freed.  The id of node
+ * i is ids[i] and its coordinates are lats[i] and lons[i], in nanodegrees.
+ * If the id columns have been compressed with OSM_Map_compress_ids(), no
+ * id array exists and ids is set to NULL; OSM_Map_foreach_Nodes() still
+ * provides ids in that case.
+ *
+ * @param  mp  The map to be queried.
+ * @param  cp  Caller-supplied structure in which the spans are stored.
+ * @return  0 if successful, -1 if mp is NULL.
+ */
+
+int OSM_Map_node_columns(OSM_Map *mp, OSM_NodeColumns *cp) {
+    if (mp == NULL) return -1;
+    cp->count = mp->num_nodes;
+    cp->ids = mp->node_ids.ids;
+    cp->lats = mp->node_lats;
+    cp->lons = mp->node_lons;
+    return 0;
+}
+
+/**
+ * @brief  Get direct read-only access to the way columns of a map.
+ * @details  The refs of way i are refs[ref_start[i]] up to, but not
+ * including, refs[ref_start[i+1]].  As for OSM_Map_node_columns(), ids
+ * is NULL if the id columns have been compressed.
+ *
+ * @param  mp  The map to be queried.
+ * @param  cp  Caller-supplied structure in which the spans are stored.
+ * @return  0 if successful, -1 if mp is NULL.
+ */
+
+int OSM_Map_way_columns(OSM_Map *mp, OSM_WayColumns *cp) {
+    if (mp == NULL) return -1;
+    cp->count = mp->num_ways;
+    cp->ids = mp->way_ids.ids;
+    cp->ref_start = mp->way_ref_start;
+    cp->refs = mp->way_refs;
+    cp->num_refs = mp->num_refs;
+    cp->ref_lats = mp->way_ref_lats;
+    cp->ref_lons = mp->way_ref_lons;
+    return 0;
+}
+
+/**
+ * @brief  Get the node references of an OSM_Way object as an array.
+ *
+ * @param  wp  The way object to be queried.
+ * @param  countp  Pointer to a variable in which to store the number of refs.
+ * @return  The refs of the way, valid until the map is freed, or NULL
+ * (with a count of 0) if wp is NULL.
+ */
 
-        PB_Field *blob_type = PB_get_field(msg, 1, LEN_TYPE);
+const OSM_Id *OSM_Way_refs(OSM_Way *wp, size_t *countp) {
+    if (wp == NULL) {
+        *countp = 0;
+        return NULL;
+    }
+    OSM_Map *mp = wp->map;
+    size_t index = wp - mp->ways;
+    *countp = mp->way_ref_start[index + 1] - mp->way_ref_start[index];
+    return mp->way_refs + mp->way_ref_start[index];
+}
+
+/**
+ * @brief  Determine whether the locations of the refs of ways were loaded
+ * from the input, which requires every way in it to have them.
+ *
+ * @param  mp  The map object to query.
+ * @return  Nonzero if way locations are available, otherwise 0.
+ */
+
+int OSM_Map_has_way_locations(OSM_Map *mp) {
+    return mp != NULL && mp->way_ref_lats != NULL;
+}
+
+/**
+ * @brief  Get the locations of the refs of an OSM_Way object as arrays
+ * parallel to those returned by OSM_Way_refs().
+ *
+ * @param  wp  The way object to be queried.
+ * @param  latsp  Pointer to a variable in which to store the latitudes.
+ * @param  lonsp  Pointer to a variable in which to store the longitudes.
+ * @return 0 if successful, -1 if the map has no way locations.
+ */
 
-        if (blob_type && strcmp(blob_type->value.bytes.buf, "OSMHeader") == 0) {
+int OSM_Way_ref_locations(OSM_Way *wp, const OSM_Lat **latsp, const OSM_Lon **lonsp) {
+    if (wp == NULL || wp->map->way_ref_lats == NULL) return -1;
+    OSM_Map *mp = wp->map;
+    size_t start = mp->way_ref_start[wp - mp->ways];
+    *latsp = mp->way_ref_lats + start;
+    *lonsp = mp->way_ref_lons + start;
+    return 0;
+}
+
+/**
+ * @brief  Get the location of a node referenced by an OSM_Way object,
+ * from the way locations if the map has them, otherwise from the node.
+ *
+ * @param  wp  The way object to be queried.
+ * @param  index  The index of the ref.
+ * @param  latp  Pointer to a variable in which to store the latitude.
+ * @param  lonp  Pointer to a variable in which to store the longitude.
+ * @return 0 if successful, -1 if the index is out of range or the node is
+ * not in the map.
+ */
+
+int OSM_Way_get_ref_location(OSM_Way *wp, size_t index, OSM_Lat *latp, OSM_Lon *lonp) {
+    if (wp == NULL) return -1;
+    OSM_Map *mp = wp->map;
+    size_t i = wp - mp->ways;
+    size_t r = mp->way_ref_start[i] + index;
+    if (r >= mp->way_ref_start[i + 1]) return -1;
+    if (mp->way_ref_lats != NULL) {
+        *latp = mp->way_ref_lats[r];
+        *lonp = mp->way_ref_lons[r];
+        return 0;
+    }
+    OSM_Node *np = OSM_Map_find_Node(mp, mp->way_refs[r]);
+    if (np == NULL) return -1;
+    *latp = OSM_Node_get_lat(np);
+    *lonp = OSM_Node_get_lon(np);
+    return 0;
+}
 
-            PB_Field *bbox_min_lon = PB_get_field(msg, 1, VARINT_TYPE);
-            PB_Field *bbox_max_lon = PB_get_field(msg, 2, VARINT_TYPE);
-            PB_Field *bbox_min_lat = PB_get_field(msg, 3, VARINT_TYPE);
-            PB_Field *bbox_max_lat = PB_get_field(msg, 4, VARINT_TYPE);
+/**
+ * @brief  Call a function on the nodes of a map, in batches of at most
+ * OSM_BATCH_SIZE consecutive nodes.
+ * @details  Each call receives the index of the first node in the batch
+ * and spans of ids, latitudes and longitudes.  Compressed ids are decoded
+ * a batch at a time into a buffer that is reused between calls, so the
+ * spans passed to fn are only valid for the duration of the call.
+ *
+ * @param  mp  The map whose nodes are to be visited.
+ * @param  fn  The function to call, which returns nonzero to stop early.
+ * @param  arg  Argument passed through to fn.
+ * @return  0 if all nodes were visited, the nonzero value returned by fn
+ * if it stopped early, or -1 if mp is NULL.
+ */
 
-            if (bbox_min_lon) map->bbox.min_lon = zigzag_decode(bbox_min_lon->value.i64) / 1e9;
-            if (bbox_max_lon) map->bbox.max_lon = zigzag_decode(bbox_max_lon->value.i64) / 1e9;
-            if (bbox_min_lat) map->bbox.min_lat = zigzag_decode(bbox_min_lat->value.i64) / 1e9;
-            if (bbox_max_lat) map->bbox.max_lat = zigzag_decode(bbox_max_lat->value.i64) / 1e9;
+int OSM_Map_foreach_Nodes(OSM_Map *mp, OSM_NodeBatchFunc *fn, void *arg) {
+    if (mp == NULL) return -1;
+    OSM_Id buf[OSM_BATCH_SIZE];
+    for (size_t first = 0; first < mp->num_nodes; first += OSM_BATCH_SIZE) {
+        size_t n = mp->num_nodes - first;
+        if (n > OSM_BATCH_SIZE) n = OSM_BATCH_SIZE;
+        const OSM_Id *ids = mp->node_ids.ids + first;
+        if (mp->node_ids.ef) {
+            EF_decode(mp->node_ids.ef, first, n, buf);
+            ids = buf;
         }
+        int ret = fn(arg, first, n, ids, mp->node_lats + first, mp->node_lons + first);
+        if (ret) return ret;
     }
-    return map;
+    return 0;
+}
+
+/**
+ * @brief  Call a function on each way of a map, with its id and refs.
+ *
+ * @param  mp  The map whose ways are to be visited.
+ * @param  fn  The function to call, which returns nonzero to stop early.
+ * @param  arg  Argument passed through to fn.
+ * @return  0 if all ways were visited, the nonzero value returned by fn
+ * if it stopped early, or -1 if mp is NULL.
+ */
+
+int OSM_Map_foreach_Way(OSM_Map *mp, OSM_WayFunc *fn, void *arg) {
+    if (mp == NULL) return -1;
+    for (size_t i = 0; i < mp->num_ways; i++) {
+        size_t start = mp->way_ref_start[i];
+        int ret = fn(arg, i, id_at(&mp->way_ids, i), mp->way_refs + start,
+                     mp->way_ref_start[i + 1] - start);
+        if (ret) return ret;
+    }
+    return 0;
+}
+
+/**
+ * @brief  Find the node with a specified id in an OSM_Map object.
+ *
+ * @param  mp  The map to be queried.
+ * @param  id  The id of the node to be found.
+ * @return  The node with the specified id, if there is one, otherwise NULL.
+ */
+
+OSM_Node *OSM_Map_find_Node(OSM_Map *mp, OSM_Id id) {
+    size_t index;
+    if (mp != NULL && mp->is_history)
+        return OSM_Map_find_Node_at(mp, id, INT64_MAX);
+    if (mp == NULL || !find_id(&mp->node_ids, mp->num_nodes, id, &index)) return NULL;
+    return &mp->nodes[index];
+}
+
+/**
+ * @brief  Find the way with a specified id in an OSM_Map object.
+ *
+ * @param  mp  The map to be queried.
+ * @param  id  The id of the way to be found.
+ * @return  The way with the specified id, if there is one, otherwise NULL.
+ */
+
+OSM_Way *OSM_Map_find_Way(OSM_Map *mp, OSM_Id id) {
+    size_t index;
+    if (mp != NULL && mp->is_history)
+        return OSM_Map_find_Way_at(mp, id, INT64_MAX);
+    if (mp == NULL || !find_id(&mp->way_ids, mp->num_ways, id, &index)) return NULL;
+    return &mp->ways[index];
+}
+
+/**
+ * @brief  Get the features that the header of the input declared as
+ * required.  For merged inputs, these are the features required by any.
+ *
+ * @param mp  The map object to query.
+ * @return  A mask of OSM_FEATURE_* values.
+ */
+
+unsigned int OSM_Map_get_required_features(OSM_Map *mp) {
+    return mp != NULL ? mp->required_features : 0;
+}
+
+/**
+ * @brief  Get the features that the header of the input declared as
+ * optional.  For merged inputs, these are the features declared by all,
+ * together with OSM_FEATURE_SORTED, since the merge is sorted.
+ *
+ * @param mp  The map object to query.
+ * @return  A mask of OSM_FEATURE_* values.
+ */
+
+unsigned int OSM_Map_get_optional_features(OSM_Map *mp) {
+    return mp != NULL ? mp->optional_features : 0;
+}
+
+/**
+ * @brief  Determine whether an OSM_Map object holds full history, having
+ * been loaded with the history option.
+ *
+ * @param mp  The map object to query.
+ * @return  Nonzero if the map holds every version of each entity, otherwise 0.
+ */
+
+int OSM_Map_is_history(OSM_Map *mp) {
+    return mp != NULL && mp->is_history;
+}
+
+/**
+ * @brief  Find the version of a node that was current at a specified time.
+ * @details  The versions of the node form a chain ordered by version, which
+ * is binary searched for the last version with a timestamp no later than
+ * the specified time.  If the map has no metadata, the time is ignored.
+ *
+ * @param  mp  The map to be queried.
+ * @param  id  The id of the node to be found.
+ * @param  time  The time, in seconds since the epoch.
+ * @return  The version current at that time, or NULL if the node did not
+ * exist then or had been deleted.
+ */
+
+OSM_Node *OSM_Map_find_Node_at(OSM_Map *mp, OSM_Id id, int64_t time) {
+    size_t index;
+    if (mp == NULL) return NULL;
+    if (!mp->has_metadata) return OSM_Map_find_Node(mp, id);
+    if (!find_version_at(&mp->node_ids, mp->num_nodes, mp->node_timestamps, mp->node_visible,
+                         id, time, &index))
+        return NULL;
+    return &mp->nodes[index];
+}
+
+/**
+ * @brief  Find the version of a way that was current at a specified time,
+ * as for OSM_Map_find_Node_at().
+ */
+
+OSM_Way *OSM_Map_find_Way_at(OSM_Map *mp, OSM_Id id, int64_t time) {
+    size_t index;
+    if (mp == NULL) return NULL;
+    if (!mp->has_metadata) return OSM_Map_find_Way(mp, id);
+    if (!find_version_at(&mp->way_ids, mp->num_ways, mp->way_timestamps, mp->way_visible,
+                         id, time, &index))
+        return NULL;
+    return &mp->ways[index];
+}
+
+/**
+ * @brief  Get the number of nodes that existed at a specified time.
+ *
+ * @param  mp  The map object to query.
+ * @param  time  The time, in seconds since the epoch.
+ * @return  The number of distinct nodes whose version current at that time
+ * is visible, or the number of nodes if the map has no metadata.
+ */
+
+size_t OSM_Map_get_num_nodes_at(OSM_Map *mp, int64_t time) {
+    if (mp == NULL) return 0;
+    if (!mp->has_metadata) return mp->num_nodes;
+    return count_at(&mp->node_ids, mp->num_nodes, mp->node_timestamps, mp->node_visible, time);
+}
+
+/**
+ * @brief  Get the number of ways that existed at a specified time, as for
+ * OSM_Map_get_num_nodes_at().
+ */
+
+size_t OSM_Map_get_num_ways_at(OSM_Map *mp, int64_t time) {
+    if (mp == NULL) return 0;
+    if (!mp->has_metadata) return mp->num_ways;
+    return count_at(&mp->way_ids, mp->num_ways, mp->way_timestamps, mp->way_visible, time);
+}
+
+/**
+ * @brief  Determine whether a version of a node is visible, rather than
+ * recording the deletion of the node.
+ *
+ * @param np  The node object to be queried.
+ * @return  0 for a deleted version, otherwise 1.
+ */
+
+int OSM_Node_is_visible(OSM_Node *np) {
+    if (np == NULL) return 0;
+    if (!np->map->has_metadata) return 1;
+    return np->map->node_visible[np - np->map->nodes];
+}
+
+/**
+ * @brief  Determine whether a version of a way is visible, as for
+ * OSM_Node_is_visible().
+ */
+
+int OSM_Way_is_visible(OSM_Way *wp) {
+    if (wp == NULL) return 0;
+    if (!wp->map->has_metadata) return 1;
+    return wp->map->way_visible[wp - wp->map->ways];
 }
 
 /**
  * @brief  Get the number of nodes in an OSM_Map object.
  *
  * @param  mp  The map object to query.
- * @return  The number of nodes.
+ * @return  The number of nodes, or -1 if it does not fit in an int,
+ * in which case OSM_Map_get_num_nodes64() must be used.
  */
 
 int OSM_Map_get_num_nodes(OSM_Map *mp) {
-    if (mp == NULL) return -1;
+    if (mp == NULL || mp->num_nodes > INT_MAX) return -1;
     return mp->num_nodes;
 }
 
@@ -104,11 +1286,12 @@ int OSM_Map_get_num_nodes(OSM_Map *mp) {
  * @brief  Get the number of ways in an OSM_Map object.
  *
  * @param  mp  The map object to query.
- * @return  The number of ways.
+ * @return  The number of ways, or -1 if it does not fit in an int,
+ * in which case OSM_Map_get_num_ways64() must be used.
  */
 
 int OSM_Map_get_num_ways(OSM_Map *mp) {
-    if (mp == NULL) return -1;
+    if (mp == NULL || mp->num_ways > INT_MAX) return -1;
     return mp->num_ways;
 }
 
@@ -122,8 +1305,8 @@ int OSM_Map_get_num_ways(OSM_Map *mp) {
  */
 
 OSM_Node *OSM_Map_get_Node(OSM_Map *mp, int index) {
-    // To be implemented
-    abort();
+    if (index < 0) return NULL;
+    return OSM_Map_get_Node64(mp, index);
 }
 
 /**
@@ -136,8 +1319,60 @@ OSM_Node *OSM_Map_get_Node(OSM_Map *mp, int index) {
  */
 
 OSM_Way *OSM_Map_get_Way(OSM_Map *mp, int index) {
-    // To be implemented
-    abort();
+    if (index < 0) return NULL;
+    return OSM_Map_get_Way64(mp, index);
+}
+
+/**
+ * @brief  Get the number of nodes in an OSM_Map object, without the
+ * limit of INT_MAX imposed by OSM_Map_get_num_nodes().
+ *
+ * @param  mp  The map object to query.
+ * @return  The number of nodes, or 0 if mp is NULL.
+ */
+
+size_t OSM_Map_get_num_nodes64(OSM_Map *mp) {
+    return mp == NULL ? 0 : mp->num_nodes;
+}
+
+/**
+ * @brief  Get the number of ways in an OSM_Map object, without the
+ * limit of INT_MAX imposed by OSM_Map_get_num_ways().
+ *
+ * @param  mp  The map object to query.
+ * @return  The number of ways, or 0 if mp is NULL.
+ */
+
+size_t OSM_Map_get_num_ways64(OSM_Map *mp) {
+    return mp == NULL ? 0 : mp->num_ways;
+}
+
+/**
+ * @brief  Get the node at the specified index from an OSM_Map object.
+ *
+ * @param  mp  The map to be queried.
+ * @param  index  The index of the node to be retrieved.
+ * @return  The node at the specifed index, if the index was in
+ * the valid range [0, num_nodes), otherwise NULL.
+ */
+
+OSM_Node *OSM_Map_get_Node64(OSM_Map *mp, size_t index) {
+    if (mp == NULL || index >= mp->num_nodes) return NULL;
+    return &mp->nodes[index];
+}
+
+/**
+ * @brief  Get the way at the specified index from an OSM_Map object.
+ *
+ * @param  mp  The map to be queried.
+ * @param  index  The index of the way to be retrieved.
+ * @return  The way at the specifed index, if the index was in
+ * the valid range [0, num_ways), otherwise NULL.
+ */
+
+OSM_Way *OSM_Map_get_Way64(OSM_Map *mp, size_t index) {
+    if (mp == NULL || index >= mp->num_ways) return NULL;
+    return &mp->ways[index];
 }
 
 /**
@@ -148,7 +1383,7 @@ OSM_Way *OSM_Map_get_Way(OSM_Map *mp, int index) {
  */
 
 OSM_BBox *OSM_Map_get_BBox(OSM_Map *mp) {
-    if (mp == NULL) return NULL;
+    if (mp == NULL || !mp->has_bbox) return NULL;
     return &mp->bbox;
 }
 
@@ -161,7 +1396,7 @@ OSM_BBox *OSM_Map_get_BBox(OSM_Map *mp) {
 
 int64_t OSM_Node_get_id(OSM_Node *np) {
     if (np == NULL) return -1;
-    return np->id;
+    return id_at(&np->map->node_ids, np - np->map->nodes);
 }
 
 /**
@@ -173,7 +1408,7 @@ int64_t OSM_Node_get_id(OSM_Node *np) {
 
 int64_t OSM_Node_get_lat(OSM_Node *np) {
     if (np == NULL) return -1;
-    return np->lat;
+    return np->map->node_lats[np - np->map->nodes];
 }
 
 /**
@@ -185,7 +1420,7 @@ int64_t OSM_Node_get_lat(OSM_Node *np) {
 
 int64_t OSM_Node_get_lon(OSM_Node *np) {
     if (np == NULL) return -1;
-    return np->lon;
+    return np->map->node_lons[np - np->map->nodes];
 }
 
 /**
@@ -196,8 +1431,10 @@ int64_t OSM_Node_get_lon(OSM_Node *np) {
  */
 
 int OSM_Node_get_num_keys(OSM_Node *np) {
-    // To be implemented
-    abort();
+    if (np == NULL) return -1;
+    const OSM_TagColumn *tp = &np->map->node_tags;
+    size_t index = np - np->map->nodes;
+    return OSM_TagColumn_end(tp, index) - OSM_TagColumn_start(tp, index);
 }
 
 /**
@@ -211,8 +1448,10 @@ int OSM_Node_get_num_keys(OSM_Node *np) {
  */
 
 char *OSM_Node_get_key(OSM_Node *np, int index) {
-    // To be implemented
-    abort();
+    if (np == NULL || index < 0 || index >= OSM_Node_get_num_keys(np)) return NULL;
+    OSM_Map *mp = np->map;
+    size_t start = OSM_TagColumn_start(&mp->node_tags, np - mp->nodes);
+    return SP_get(mp->strings, mp->node_tags.keys[start + index]);
 }
 
 /**
@@ -226,8 +1465,10 @@ char *OSM_Node_get_key(OSM_Node *np, int index) {
  */
 
 char *OSM_Node_get_value(OSM_Node *np, int index) {
-    // To be implemented
-    abort();
+    if (np == NULL || index < 0 || index >= OSM_Node_get_num_keys(np)) return NULL;
+    OSM_Map *mp = np->map;
+    size_t start = OSM_TagColumn_start(&mp->node_tags, np - mp->nodes);
+    return SP_get(mp->strings, mp->node_tags.vals[start + index]);
 }
 
 /**
@@ -239,7 +1480,7 @@ char *OSM_Node_get_value(OSM_Node *np, int index) {
 
 int64_t OSM_Way_get_id(OSM_Way *wp) {
     if (wp == NULL) return -1;
-    return wp->id;
+    return id_at(&wp->map->way_ids, wp - wp->map->ways);
 }
 
 /**
@@ -251,7 +1492,23 @@ int64_t OSM_Way_get_id(OSM_Way *wp) {
 
 int OSM_Way_get_num_refs(OSM_Way *wp) {
     if (wp == NULL) return -1;
-    return wp->num_refs;
+    size_t n = OSM_Way_get_num_refs64(wp);
+    return n > INT_MAX ? -1 : (int)n;
+}
+
+/**
+ * @brief  Get the number of node references in an OSM_Way object, without
+ * the limit of INT_MAX imposed by OSM_Way_get_num_refs().
+ *
+ * @param wp  The way object to be queried.
+ * @return  The number of node references contained in the way, or 0 if
+ * wp is NULL.
+ */
+
+size_t OSM_Way_get_num_refs64(OSM_Way *wp) {
+    if (wp == NULL) return 0;
+    size_t index = wp - wp->map->ways;
+    return wp->map->way_ref_start[index + 1] - wp->map->way_ref_start[index];
 }
 
 /**
@@ -260,12 +1517,26 @@ int OSM_Way_get_num_refs(OSM_Way *wp) {
  * @param wp  The way object to be queried.
  * @param index  The index of the node reference.
  * @return  The id of the node referred to at the specified index,
- * if the index is in the valid range [0, num_refs), otherwise NULL.
+ * if the index is in the valid range [0, num_refs), otherwise -1.
  */
 
 OSM_Id OSM_Way_get_ref(OSM_Way *wp, int index) {
-    // To be implemented
-    abort();
+    if (index < 0) return -1;
+    return OSM_Way_get_ref64(wp, index);
+}
+
+/**
+ * @brief  Get the node reference at a specified index in an OSM_Way object.
+ *
+ * @param wp  The way object to be queried.
+ * @param index  The index of the node reference.
+ * @return  The id of the node referred to at the specified index,
+ * if the index is in the valid range [0, num_refs), otherwise -1.
+ */
+
+OSM_Id OSM_Way_get_ref64(OSM_Way *wp, size_t index) {
+    if (wp == NULL || index >= OSM_Way_get_num_refs64(wp)) return -1;
+    return wp->map->way_refs[wp->map->way_ref_start[wp - wp->map->ways] + index];
 }
 
 /**
@@ -276,8 +1547,10 @@ OSM_Id OSM_Way_get_ref(OSM_Way *wp, int index) {
  */
 
 int OSM_Way_get_num_keys(OSM_Way *wp) {
-    // To be implemented
-    abort();
+    if (wp == NULL) return -1;
+    const OSM_TagColumn *tp = &wp->map->way_tags;
+    size_t index = wp - wp->map->ways;
+    return OSM_TagColumn_end(tp, index) - OSM_TagColumn_start(tp, index);
 }
 
 /**
@@ -291,8 +1564,10 @@ int OSM_Way_get_num_keys(OSM_Way *wp) {
  */
 
 char *OSM_Way_get_key(OSM_Way *wp, int index) {
-    // To be implemented
-    abort();
+    if (wp == NULL || index < 0 || index >= OSM_Way_get_num_keys(wp)) return NULL;
+    OSM_Map *mp = wp->map;
+    size_t start = OSM_TagColumn_start(&mp->way_tags, wp - mp->ways);
+    return SP_get(mp->strings, mp->way_tags.keys[start + index]);
 }
 
 /**
@@ -306,8 +1581,10 @@ char *OSM_Way_get_key(OSM_Way *wp, int index) {
  */
 
 char *OSM_Way_get_value(OSM_Way *wp, int index) {
-    // To be implemented
-    abort();
+    if (wp == NULL || index < 0 || index >= OSM_Way_get_num_keys(wp)) return NULL;
+    OSM_Map *mp = wp->map;
+    size_t start = OSM_TagColumn_start(&mp->way_tags, wp - mp->ways);
+    return SP_get(mp->strings, mp->way_tags.vals[start + index]);
 }
 
 /**
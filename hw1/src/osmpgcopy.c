@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "osmpgcopy.h"
+#include "osmexport.h"
+#include "debug.h"
+
+/*
+ * The binary COPY stream is a signature, a flags word and an empty header
+ * extension, then the rows, then a field count of -1.  All of its integers
+ * are big-endian; the EWKB of the geometries is written little-endian.
+ */
+
+#define PGCOPY_SIGNATURE    "PGCOPY\n\377\r\n\0"
+#define PGCOPY_FIELDS       4
+#define TEXT_OID            25
+
+#define EWKB_POINT          1
+#define EWKB_LINESTRING     2
+#define EWKB_POLYGON        3
+#define EWKB_SRID_FLAG      0x20000000
+#define WGS84_SRID          4326
+
+static void put_be(OSM_ExportBuffer *bp, uint64_t v, int size) {
+    unsigned char bytes[8];
+    for (int i = 0; i < size; i++)
+        bytes[i] = v >> (8 * (size - 1 - i));
+    OSM_ExportBuffer_append(bp, bytes, size);
+}
+
+static void put_le(OSM_ExportBuffer *bp, uint64_t v, int size) {
+    unsigned char bytes[8];
+    for (int i = 0; i < size; i++)
+        bytes[i] = v >> (8 * i);
+    OSM_ExportBuffer_append(bp, bytes, size);
+}
+
+/* Append a coordinate in units of 1e-7 degrees as an EWKB double */
+
+static void put_coord(OSM_ExportBuffer *bp, int64_t v) {
+    double d = v / 1e7;
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    put_le(bp, bits, 8);
+}
+
+/*
+ * Start a field whose length is not yet known, returning the offset of
+ * its length word, which end_field() fills in.
+ */
+
+static size_t begin_field(OSM_ExportBuffer *bp) {
+    size_t offset = bp->len;
+    put_be(bp, 0, 4);
+    return offset;
+}
+
+static void end_field(OSM_ExportBuffer *bp, size_t offset) {
+    if (bp->error) return;
+    uint32_t len = bp->len - offset - 4;
+    for (int i = 0; i < 4; i++)
+        bp->data[offset + i] = len >> (8 * (3 - i));
+}
+
+static void put_text(OSM_ExportBuffer *bp, const char *str, size_t len) {
+    put_be(bp, len, 4);
+    OSM_ExportBuffer_append(bp, str, len);
+}
+
+/*
+ * Begin a row with its type, id and tags.  The tags are a one-dimensional
+ * text[] of keys and values, or an empty array if there are none.
+ */
+
+static void begin_row(OSM_ExportBuffer *bp, const char *type, OSM_Id id, OSM_Block *block,
+                      const OSM_BlockTags *tp, int i) {
+    put_be(bp, PGCOPY_FIELDS, 2);
+    put_text(bp, type, strlen(type));
+    put_be(bp, 8, 4);
+    put_be(bp, id, 8);
+
+    uint32_t count = 0;
+    for (int t = tp->start[i]; t < tp->start[i + 1]; t++)
+        count += tp->keys[t] < (uint32_t)block->num_strings && tp->vals[t] < (uint32_t)block->num_strings;
+    size_t field = begin_field(bp);
+    put_be(bp, count > 0, 4);
+    put_be(bp, 0, 4);
+    put_be(bp, TEXT_OID, 4);
+    if (count > 0) {
+        put_be(bp, 2 * count, 4);
+        put_be(bp, 1, 4);
+    }
+    for (int t = tp->start[i]; t < tp->start[i + 1]; t++) {
+        uint32_t k = tp->keys[t], v = tp->vals[t];
+        if (k >= (uint32_t)block->num_strings || v >= (uint32_t)block->num_strings)
+            continue;
+        put_text(bp, block->strings[k], block->string_lens[k]);
+        put_text(bp, block->strings[v], block->string_lens[v]);
+    }
+    end_field(bp, field);
+}
+
+static void begin_geometry(OSM_ExportBuffer *bp, uint32_t type) {
+    OSM_EXPORT_LITERAL(bp, "\001");
+    put_le(bp, type | EWKB_SRID_FLAG, 4);
+    put_le(bp, WGS84_SRID, 4);
+}
+
+static void encode_node(void *arg, OSM_ExportBuffer *bp, OSM_Block *block, int i) {
+    begin_row(bp, "node", block->node_ids[i], block, &block->node_tags, i);
+    put_be(bp, 1 + 4 + 4 + 16, 4);
+    begin_geometry(bp, EWKB_POINT);
+    put_coord(bp, block->node_lons[i] / 100);
+    put_coord(bp, block->node_lats[i] / 100);
+}
+
+static void encode_way(void *arg, OSM_ExportBuffer *bp, OSM_Block *block, int i,
+                       const int64_t *lats, const int64_t *lons, size_t n, int polygon) {
+    begin_row(bp, "way", block->way_ids[i], block, &block->way_tags, i);
+    put_be(bp, 1 + 4 + 4 + (polygon ? 8 : 4) + 16 * n, 4);
+    begin_geometry(bp, polygon ? EWKB_POLYGON : EWKB_LINESTRING);
+    if (polygon)
+        put_le(bp, 1, 4);
+    put_le(bp, n, 4);
+    for (size_t r = 0; r < n; r++) {
+        put_coord(bp, lons[r]);
+        put_coord(bp, lats[r]);
+    }
+}
+
+/* Export an input stream, or a file in shards if in is NULL */
+
+static int export_pgcopy(FILE *in, const char *path, int num_shards, FILE *out, const OSM_Options *op) {
+    OSM_Exporter exporter = { NULL, encode_node, encode_way, NULL };
+    static const char header[] = PGCOPY_SIGNATURE "\0\0\0\0" "\0\0\0\0";
+    static const char trailer[] = "\377\377";
+    fwrite(header, 1, sizeof(header) - 1, out);
+    int ret = in != NULL ? OSM_export_features(in, out, &exporter, op)
+                         : OSM_export_features_shards(path, num_shards, out, &exporter, op);
+    fwrite(trailer, 1, sizeof(trailer) - 1, out);
+    if (ret != 0 || ferror(out)) {
+        fprintf(stderr, "Unable to export the input in PostgreSQL COPY format\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief  Export the tagged nodes and the ways of an OSM PBF input stream
+ * in PostgreSQL's binary COPY format.
+ * @details  The input is read once, as a stream, by OSM_export_features(),
+ * and the rows are encoded in parallel.  Ways whose nodes are not in the
+ * input lose those coordinates, and are left out if fewer than two
+ * remain; relations are never exported.
+ *
+ * @param in  The input stream.
+ * @param out  The output stream.
+ * @param op  The options, or NULL for the defaults set by OSM_Options_init().
+ * @return 0 if successful, -1 in case of an error.
+ */
+
+int OSM_export_pgcopy(FILE *in, FILE *out, const OSM_Options *op) {
+    return export_pgcopy(in, NULL, 0, out, op);
+}
+
+/**
+ * @brief  Export an OSM PBF file in PostgreSQL's binary COPY format with
+ * worker processes, by OSM_export_features_shards().
+ *
+ * @param path  The input file, which must be seekable.
+ * @param num_shards  The number of worker processes.
+ * @param out  The output stream.
+ * @param op  The options, or NULL for the defaults set by OSM_Options_init().
+ * @return 0 if successful, -1 in case of an error.
+ */
+
+int OSM_export_pgcopy_shards(const char *path, int num_shards, FILE *out, const OSM_Options *op) {
+    return export_pgcopy(NULL, path, num_shards, out, op);
+}
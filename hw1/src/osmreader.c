@@ -0,0 +1,267 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "osmblock.h"
+#include "debug.h"
+
+/*
+ * An OSM_BlockReader is a three-stage pipeline.  A reader thread frames
+ * blobs from the input stream into a ring of slots; worker threads claim
+ * framed blobs in sequence and decode them; the consumer, calling
+ * OSM_BlockReader_next(), takes decoded blocks out of the ring in file
+ * order.  The ring holds at most cache_blocks blobs, so a slow consumer
+ * throttles the reader instead of letting decoded blocks pile up.
+ *
+ * With fewer than two threads, no threads are started and each call to
+ * OSM_BlockReader_next() reads and decodes one blob in the caller.
+ */
+
+typedef enum {
+    SLOT_EMPTY = 0,
+    SLOT_READ,
+    SLOT_DECODED
+} SlotState;
+
+typedef struct Slot {
+    SlotState state;
+    OSM_Blob blob;
+    OSM_Block *block;
+} Slot;
+
+struct OSM_BlockReader {
+    FILE *in;
+    OSM_Options opts;
+    uint64_t offset;
+    uint64_t end;           // Offset at which to stop reading
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t reader;
+    pthread_t *workers;
+    int num_workers;
+
+    Slot *slots;
+    int cap;
+    uint64_t read_seq;      // Next blob to be read
+    uint64_t decode_seq;    // Next blob to be claimed by a worker
+    uint64_t merge_seq;     // Next block to be returned to the consumer
+    int eof;
+    int error;
+    int closing;
+};
+
+static void *reader_thread(void *arg) {
+    OSM_BlockReader *rp = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&rp->lock);
+        while (rp->read_seq - rp->merge_seq >= (uint64_t)rp->cap && !rp->closing)
+            pthread_cond_wait(&rp->cond, &rp->lock);
+        int closing = rp->closing;
+        pthread_mutex_unlock(&rp->lock);
+        if (closing) break;
+
+        /* The slot for read_seq is free and only this thread touches it. */
+        Slot *sp = &rp->slots[rp->read_seq % rp->cap];
+        int ret = rp->offset < rp->end ? OSM_read_Blob(rp->in, rp->offset, &sp->blob) : 0;
+
+        pthread_mutex_lock(&rp->lock);
+        if (ret == 1) {
+            rp->offset += sp->blob.length;
+            sp->state = SLOT_READ;
+            rp->read_seq++;
+        } else if (ret == 0) {
+            rp->eof = 1;
+        } else {
+            rp->error = 1;
+        }
+        pthread_cond_broadcast(&rp->cond);
+        pthread_mutex_unlock(&rp->lock);
+        if (ret != 1) break;
+    }
+    return NULL;
+}
+
+static void *worker_thread(void *arg) {
+    OSM_BlockReader *rp = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&rp->lock);
+        while (rp->decode_seq == rp->read_seq && !rp->eof && !rp->error && !rp->closing)
+            pthread_cond_wait(&rp->cond, &rp->lock);
+        if (rp->decode_seq == rp->read_seq || rp->error || rp->closing) {
+            pthread_mutex_unlock(&rp->lock);
+            break;
+        }
+        Slot *sp = &rp->slots[rp->decode_seq % rp->cap];
+        rp->decode_seq++;
+        pthread_mutex_unlock(&rp->lock);
+
+        OSM_Block *block = OSM_decode_Block(&sp->blob, &rp->opts);
+        OSM_Blob_free(&sp->blob);
+
+        pthread_mutex_lock(&rp->lock);
+        if (block == NULL)
+            rp->error = 1;
+        sp->block = block;
+        sp->state = SLOT_DECODED;
+        pthread_cond_broadcast(&rp->cond);
+        pthread_mutex_unlock(&rp->lock);
+    }
+    return NULL;
+}
+
+/**
+ * @brief  Create a reader that returns the decoded blocks of an OSM PBF
+ * input stream in file order.
+ * @details  If op->threads is greater than one, a reader thread and
+ * op->threads decoding threads are started, which run until end of file
+ * or until the reader is closed.  The input stream must not be used by
+ * the caller while the reader is open.
+ *
+ * @param in  The input stream to read.
+ * @param op  Options, or NULL for the defaults set by OSM_Options_init().
+ * @return  The new reader, or NULL in case of an error.
+ */
+
+OSM_BlockReader *OSM_BlockReader_open(FILE *in, const OSM_Options *op) {
+    return OSM_BlockReader_open_range(in, 0, UINT64_MAX, op);
+}
+
+/**
+ * @brief  Create a reader that returns the decoded blocks of the blobs of
+ * a seekable OSM PBF input stream in a range of offsets, in file order.
+ * @details  The range must start at a blob, and ends with the last blob
+ * that starts before its end.  A range from 0 is read without seeking, as
+ * by OSM_BlockReader_open(), which the stream then need not allow.
+ *
+ * @param in  The input stream to read.
+ * @param start  The offset of the first blob.
+ * @param end  The offset at which to stop.
+ * @param op  Options, or NULL for the defaults set by OSM_Options_init().
+ * @return  The new reader, or NULL in case of an error.
+ */
+
+OSM_BlockReader *OSM_BlockReader_open_range(FILE *in, uint64_t start, uint64_t end, const OSM_Options *op) {
+    if (start > 0 && fseeko(in, start, SEEK_SET) != 0)
+        return NULL;
+    OSM_BlockReader *rp = calloc(1, sizeof(OSM_BlockReader));
+    if (rp == NULL) return NULL;
+    rp->in = in;
+    rp->offset = start;
+    rp->end = end;
+    if (op != NULL)
+        rp->opts = *op;
+    else
+        OSM_Options_init(&rp->opts);
+    if (rp->opts.threads < 2)
+        return rp;
+
+    rp->cap = rp->opts.cache_blocks > rp->opts.threads ? rp->opts.cache_blocks : 2 * rp->opts.threads;
+    rp->slots = calloc(rp->cap, sizeof(Slot));
+    rp->workers = calloc(rp->opts.threads, sizeof(pthread_t));
+    if (rp->slots == NULL || rp->workers == NULL) {
+        free(rp->slots);
+        free(rp->workers);
+        free(rp);
+        return NULL;
+    }
+    pthread_mutex_init(&rp->lock, NULL);
+    pthread_cond_init(&rp->cond, NULL);
+
+    if (pthread_create(&rp->reader, NULL, reader_thread, rp) != 0) {
+        pthread_mutex_destroy(&rp->lock);
+        pthread_cond_destroy(&rp->cond);
+        free(rp->slots);
+        free(rp->workers);
+        free(rp);
+        return NULL;
+    }
+    for (int i = 0; i < rp->opts.threads; i++) {
+        if (pthread_create(&rp->workers[i], NULL, worker_thread, rp) != 0)
+            break;
+        rp->num_workers++;
+    }
+    if (rp->num_workers == 0) {
+        pthread_mutex_lock(&rp->lock);
+        rp->error = 1;
+        pthread_mutex_unlock(&rp->lock);
+    }
+    return rp;
+}
+
+/**
+ * @brief  Get the next decoded block from a reader.
+ *
+ * @param rp  The reader.
+ * @param bpp  Pointer to a variable in which to store the block, which is
+ * owned by the caller and must be freed with OSM_Block_free().
+ * @return 1 if a block was returned, 0 at end of file, and -1 in case of an
+ * error reading or decoding the input.
+ */
+
+int OSM_BlockReader_next(OSM_BlockReader *rp, OSM_Block **bpp) {
+    if (rp->workers == NULL) {
+        OSM_Blob blob;
+        int ret = rp->offset < rp->end ? OSM_read_Blob(rp->in, rp->offset, &blob) : 0;
+        if (ret != 1) return ret;
+        rp->offset += blob.length;
+        *bpp = OSM_decode_Block(&blob, &rp->opts);
+        OSM_Blob_free(&blob);
+        return *bpp ? 1 : -1;
+    }
+
+    pthread_mutex_lock(&rp->lock);
+    Slot *sp = &rp->slots[rp->merge_seq % rp->cap];
+    while (!rp->error && sp->state != SLOT_DECODED && !(rp->eof && rp->merge_seq == rp->read_seq))
+        pthread_cond_wait(&rp->cond, &rp->lock);
+
+    int ret;
+    if (rp->error) {
+        ret = -1;
+    } else if (sp->state != SLOT_DECODED) {
+        ret = 0;
+    } else {
+        *bpp = sp->block;
+        sp->block = NULL;
+        sp->state = SLOT_EMPTY;
+        rp->merge_seq++;
+        pthread_cond_broadcast(&rp->cond);
+        ret = 1;
+    }
+    pthread_mutex_unlock(&rp->lock);
+    return ret;
+}
+
+/**
+ * @brief  Stop the threads of a reader and free it, together with any
+ * blocks that have not been returned to the caller.  The input stream
+ * is not closed.
+ */
+
+void OSM_BlockReader_close(OSM_BlockReader *rp) {
+    if (rp == NULL) return;
+    if (rp->workers != NULL) {
+        pthread_mutex_lock(&rp->lock);
+        rp->closing = 1;
+        pthread_cond_broadcast(&rp->cond);
+        pthread_mutex_unlock(&rp->lock);
+
+        pthread_join(rp->reader, NULL);
+        for (int i = 0; i < rp->num_workers; i++)
+            pthread_join(rp->workers[i], NULL);
+
+        for (int i = 0; i < rp->cap; i++) {
+            if (rp->slots[i].state == SLOT_READ)
+                OSM_Blob_free(&rp->slots[i].blob);
+            OSM_Block_free(rp->slots[i].block);
+        }
+        pthread_mutex_destroy(&rp->lock);
+        pthread_cond_destroy(&rp->cond);
+        free(rp->slots);
+        free(rp->workers);
+    }
+    free(rp);
+}
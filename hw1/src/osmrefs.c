@@ -0,0 +1,323 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "osmrefs.h"
+#include "osmblock.h"
+#include "debug.h"
+
+/*
+ * A bitmap of ids, in pages of 2^PAGE_BITS bits that are allocated when an
+ * id first falls in them.  Pages are found through chunks of 2^CHUNK_BITS
+ * pointers, also allocated on demand, so that the ids of a sparse extract
+ * do not need a directory as long as the largest id.  Negative ids, which
+ * some editors give to new entities, are kept apart by absolute value.
+ */
+
+#define PAGE_BITS   12
+#define CHUNK_BITS  8
+#define PAGE_WORDS  ((1 << PAGE_BITS) / 64)
+
+typedef struct IdBitmap {
+    uint64_t ***chunks[2];      // By chunk index, for ids >= 0 and < 0
+    size_t num_chunks[2];       // Length of each directory
+    size_t allocated_chunks;
+    size_t allocated_pages;
+} IdBitmap;
+
+/* The directory, chunk, page within the chunk and bit of an id */
+
+static void locate(OSM_Id id, int *dirp, uint64_t *chunkp, int *pagep, int *bitp) {
+    uint64_t u = id < 0 ? -(uint64_t)id : (uint64_t)id;
+    *dirp = id < 0;
+    *chunkp = u >> (PAGE_BITS + CHUNK_BITS);
+    *pagep = (u >> PAGE_BITS) & ((1 << CHUNK_BITS) - 1);
+    *bitp = u & ((1 << PAGE_BITS) - 1);
+}
+
+/* Set the bit of an id, returning 1 if it was already set and -1 if out of memory */
+
+static int bitmap_set(IdBitmap *bp, OSM_Id id) {
+    int d, page, bit;
+    uint64_t chunk;
+    locate(id, &d, &chunk, &page, &bit);
+    if (chunk >= bp->num_chunks[d]) {
+        size_t n = bp->num_chunks[d] ? bp->num_chunks[d] : 64;
+        while (n <= chunk)
+            n *= 2;
+        uint64_t ***chunks = realloc(bp->chunks[d], n * sizeof(uint64_t **));
+        if (chunks == NULL) return -1;
+        memset(chunks + bp->num_chunks[d], 0, (n - bp->num_chunks[d]) * sizeof(uint64_t **));
+        bp->chunks[d] = chunks;
+        bp->num_chunks[d] = n;
+    }
+    uint64_t **pages = bp->chunks[d][chunk];
+    if (pages == NULL) {
+        if ((pages = calloc(1 << CHUNK_BITS, sizeof(uint64_t *))) == NULL) return -1;
+        bp->chunks[d][chunk] = pages;
+        bp->allocated_chunks++;
+    }
+    uint64_t *words = pages[page];
+    if (words == NULL) {
+        if ((words = calloc(PAGE_WORDS, sizeof(uint64_t))) == NULL) return -1;
+        pages[page] = words;
+        bp->allocated_pages++;
+    }
+    uint64_t mask = (uint64_t)1 << (bit & 63);
+    int was_set = (words[bit >> 6] & mask) != 0;
+    words[bit >> 6] |= mask;
+    return was_set;
+}
+
+static int bitmap_test(const IdBitmap *bp, OSM_Id id) {
+    int d, page, bit;
+    uint64_t chunk;
+    locate(id, &d, &chunk, &page, &bit);
+    if (chunk >= bp->num_chunks[d] || bp->chunks[d][chunk] == NULL)
+        return 0;
+    const uint64_t *words = bp->chunks[d][chunk][page];
+    return words != NULL && ((words[bit >> 6] >> (bit & 63)) & 1);
+}
+
+static size_t bitmap_bytes(const IdBitmap *bp) {
+    return bp->allocated_pages * PAGE_WORDS * sizeof(uint64_t) +
+           bp->allocated_chunks * (1 << CHUNK_BITS) * sizeof(uint64_t *) +
+           (bp->num_chunks[0] + bp->num_chunks[1]) * sizeof(uint64_t **);
+}
+
+static void bitmap_free(IdBitmap *bp) {
+    for (int d = 0; d < 2; d++) {
+        for (size_t c = 0; c < bp->num_chunks[d]; c++) {
+            if (bp->chunks[d][c] == NULL) continue;
+            for (int p = 0; p < 1 << CHUNK_BITS; p++)
+                free(bp->chunks[d][c][p]);
+            free(bp->chunks[d][c]);
+        }
+        free(bp->chunks[d]);
+    }
+}
+
+typedef struct CheckJob {
+    OSM_BlockReader *reader;
+    pthread_mutex_t lock;
+    int done;
+    int error;
+    const IdBitmap *bitmaps;    // Nodes, ways and relations
+} CheckJob;
+
+typedef struct ThreadArg {
+    CheckJob *job;
+    OSM_RefCheck check;         // Counts and samples of the blocks this thread took
+} ThreadArg;
+
+/* Keep a missing ref among the samples if its id is among the smallest */
+
+static void add_sample(OSM_RefCheck *rp, OSM_Id ref, OSM_Id way) {
+    int i = rp->num_samples;
+    while (i > 0 && rp->samples[i - 1].ref > ref)
+        i--;
+    if ((i > 0 && rp->samples[i - 1].ref == ref) || i == OSM_REFS_SAMPLES)
+        return;
+    int n = rp->num_samples < OSM_REFS_SAMPLES ? rp->num_samples : OSM_REFS_SAMPLES - 1;
+    memmove(&rp->samples[i + 1], &rp->samples[i], (n - i) * sizeof(OSM_MissingRef));
+    rp->samples[i] = (OSM_MissingRef){ ref, way };
+    if (rp->num_samples < OSM_REFS_SAMPLES)
+        rp->num_samples++;
+}
+
+/* The same for a missing member, ordered by type and then id */
+
+static int member_before(int type, OSM_Id id, const OSM_MissingMember *mp) {
+    return type < mp->type || (type == mp->type && id < mp->member);
+}
+
+static void add_member_sample(OSM_RefCheck *rp, int type, OSM_Id member, OSM_Id relation) {
+    int i = rp->num_member_samples;
+    while (i > 0 && member_before(type, member, &rp->member_samples[i - 1]))
+        i--;
+    if (i > 0 && rp->member_samples[i - 1].type == type && rp->member_samples[i - 1].member == member)
+        return;
+    if (i == OSM_REFS_SAMPLES)
+        return;
+    int n = rp->num_member_samples < OSM_REFS_SAMPLES ? rp->num_member_samples : OSM_REFS_SAMPLES - 1;
+    memmove(&rp->member_samples[i + 1], &rp->member_samples[i], (n - i) * sizeof(OSM_MissingMember));
+    rp->member_samples[i] = (OSM_MissingMember){ type, member, relation };
+    if (rp->num_member_samples < OSM_REFS_SAMPLES)
+        rp->num_member_samples++;
+}
+
+static void check_block(const IdBitmap *bitmaps, OSM_Block *bp, OSM_RefCheck *rp) {
+    for (int w = 0; w < bp->num_ways; w++) {
+        size_t missing = 0;
+        for (int r = bp->way_ref_start[w]; r < bp->way_ref_start[w + 1]; r++) {
+            if (!bitmap_test(&bitmaps[0], bp->way_refs[r])) {
+                missing++;
+                add_sample(rp, bp->way_refs[r], bp->way_ids[w]);
+            }
+        }
+        rp->num_refs += bp->way_ref_start[w + 1] - bp->way_ref_start[w];
+        rp->missing_refs += missing;
+        rp->broken_ways += missing > 0;
+    }
+    for (int r = 0; r < bp->num_relations; r++) {
+        size_t missing = 0;
+        for (int m = bp->member_start[r]; m < bp->member_start[r + 1]; m++) {
+            int type = bp->member_types[m];
+            if (!bitmap_test(&bitmaps[type], bp->member_ids[m])) {
+                missing++;
+                rp->missing_members_by_type[type]++;
+                add_member_sample(rp, type, bp->member_ids[m], bp->relation_ids[r]);
+            }
+        }
+        rp->num_members += bp->member_start[r + 1] - bp->member_start[r];
+        rp->missing_members += missing;
+        rp->broken_relations += missing > 0;
+    }
+}
+
+static void *check_worker(void *arg) {
+    ThreadArg *ap = arg;
+    CheckJob *jp = ap->job;
+    for (;;) {
+        OSM_Block *bp = NULL;
+        pthread_mutex_lock(&jp->lock);
+        int ret = jp->done ? 0 : OSM_BlockReader_next(jp->reader, &bp);
+        if (ret != 1) jp->done = 1;
+        if (ret < 0) jp->error = 1;
+        pthread_mutex_unlock(&jp->lock);
+        if (ret != 1) break;
+        check_block(jp->bitmaps, bp, &ap->check);
+        OSM_Block_free(bp);
+    }
+    return NULL;
+}
+
+/* Set the bits of a column of ids, counting those already set */
+
+static int set_ids(IdBitmap *bitmap, const OSM_Id *ids, int n, size_t *duplicatesp) {
+    for (int i = 0; i < n; i++) {
+        int dup = bitmap_set(bitmap, ids[i]);
+        if (dup < 0) return -1;
+        *duplicatesp += dup;
+    }
+    return 0;
+}
+
+/*
+ * Set the bits of the nodes, ways and relations of the input, and count
+ * its entities, finding the offset of the first blob with ways or
+ * relations.
+ */
+
+static int index_ids(FILE *in, IdBitmap *bitmaps, OSM_RefCheck *rp, uint64_t *firstp,
+                     const OSM_Options *op) {
+    OSM_BlockReader *reader = OSM_BlockReader_open(in, op);
+    if (reader == NULL) return -1;
+    *firstp = UINT64_MAX;
+    OSM_Block *bp;
+    int ret;
+    while ((ret = OSM_BlockReader_next(reader, &bp)) == 1) {
+        if (set_ids(&bitmaps[0], bp->node_ids, bp->num_nodes, &rp->duplicate_nodes) ||
+            set_ids(&bitmaps[1], bp->way_ids, bp->num_ways, &rp->duplicate_ways) ||
+            set_ids(&bitmaps[2], bp->relation_ids, bp->num_relations, &rp->duplicate_relations))
+            ret = -1;
+        rp->num_nodes += bp->num_nodes;
+        rp->num_ways += bp->num_ways;
+        rp->num_relations += bp->num_relations;
+        if (bp->num_ways + bp->num_relations > 0 && *firstp == UINT64_MAX)
+            *firstp = bp->offset;
+        OSM_Block_free(bp);
+        if (ret < 0) break;
+    }
+    OSM_BlockReader_close(reader);
+    if (ret < 0)
+        fprintf(stderr, "Cannot index the ids of the input\n");
+    return ret;
+}
+
+/**
+ * @brief  Check that the nodes the ways of an OSM PBF file refer to, and
+ * the members of its relations, are in the file.
+ * @details  The file is read twice, and must be seekable.  The blocks are
+ * decoded as by OSM_BlockReader, and in the second pass, as many threads
+ * as the threads option asks for check the blocks, each with its own
+ * counts and samples, which are merged once the input is exhausted.
+ *
+ * @param in  The input stream.
+ * @param rp  The results to be filled in.
+ * @param op  The options, or NULL for the defaults set by OSM_Options_init().
+ * @return 0 if successful, -1 in case of an error.
+ */
+
+int OSM_check_refs(FILE *in, OSM_RefCheck *rp, const OSM_Options *op) {
+    OSM_Options opts;
+    OSM_Options_init(&opts);
+    if (op != NULL) {
+        opts.threads = op->threads;
+        opts.cache_blocks = op->cache_blocks;
+    }
+    opts.types = OSM_TYPE_ALL;
+    opts.members = 1;
+    opts.tags = 0;
+    opts.metadata = 0;
+    memset(rp, 0, sizeof(OSM_RefCheck));
+    if (fseeko(in, 0, SEEK_SET) != 0) {
+        fprintf(stderr, "Cannot check the refs of an input that is not seekable\n");
+        return -1;
+    }
+
+    IdBitmap bitmaps[3];
+    memset(bitmaps, 0, sizeof(bitmaps));
+    uint64_t first;
+    int error = index_ids(in, bitmaps, rp, &first, &opts) != 0;
+    for (int i = 0; i < 3; i++)
+        rp->bitmap_bytes += bitmap_bytes(&bitmaps[i]);
+
+    int num_threads = opts.threads > 1 ? opts.threads : 1;
+    ThreadArg *args = calloc(num_threads, sizeof(ThreadArg));
+    CheckJob job = { NULL, PTHREAD_MUTEX_INITIALIZER, 0, 0, bitmaps };
+    opts.types = OSM_TYPE_WAY | OSM_TYPE_RELATION;
+    if (!error && first != UINT64_MAX &&
+        (args == NULL || (job.reader = OSM_BlockReader_open_range(in, first, UINT64_MAX, &opts)) == NULL))
+        error = 1;
+
+    if (job.reader != NULL) {
+        pthread_t threads[num_threads];
+        int started = 0;
+        for (int t = 0; t < num_threads; t++)
+            args[t].job = &job;
+        for (int t = 1; t < num_threads; t++) {
+            if (pthread_create(&threads[t], NULL, check_worker, &args[t]) != 0)
+                break;
+            started++;
+        }
+        check_worker(&args[0]);
+        for (int t = 1; t <= started; t++)
+            pthread_join(threads[t], NULL);
+        OSM_BlockReader_close(job.reader);
+        error |= job.error;
+        for (int t = 0; t <= started; t++) {
+            OSM_RefCheck *cp = &args[t].check;
+            rp->num_refs += cp->num_refs;
+            rp->missing_refs += cp->missing_refs;
+            rp->broken_ways += cp->broken_ways;
+            rp->num_members += cp->num_members;
+            rp->missing_members += cp->missing_members;
+            rp->broken_relations += cp->broken_relations;
+            for (int i = 0; i < 3; i++)
+                rp->missing_members_by_type[i] += cp->missing_members_by_type[i];
+            for (int s = 0; s < cp->num_samples; s++)
+                add_sample(rp, cp->samples[s].ref, cp->samples[s].way);
+            for (int s = 0; s < cp->num_member_samples; s++)
+                add_member_sample(rp, cp->member_samples[s].type, cp->member_samples[s].member,
+                                  cp->member_samples[s].relation);
+        }
+    }
+    pthread_mutex_destroy(&job.lock);
+    free(args);
+    for (int i = 0; i < 3; i++)
+        bitmap_free(&bitmaps[i]);
+    return error ? -1 : 0;
+}
@@ -0,0 +1,447 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "osmrender.h"
+#include "osmmap.h"
+#include "debug.h"
+
+#define MAX_MERCATOR_LAT    85.0511287798
+
+/*
+ * Ways are styled by the first entry of this table that one of their tags
+ * matches, a NULL value matching any value of the key, and drawn in
+ * increasing order of layer.  Ways that match no entry get the default.
+ */
+
+typedef struct Style {
+    const char *key;
+    const char *value;
+    int layer;
+    uint8_t rgb[3];
+} Style;
+
+static const Style styles[] = {
+    { "highway",  "motorway",  5, { 226,  90,  70 } },
+    { "highway",  "trunk",     5, { 235, 130,  80 } },
+    { "highway",  "primary",   5, { 240, 165,  90 } },
+    { "highway",  "secondary", 4, { 225, 190, 100 } },
+    { "highway",  NULL,        3, { 110, 110, 110 } },
+    { "railway",  NULL,        3, {  70,  70,  90 } },
+    { "waterway", NULL,        2, {  80, 140, 210 } },
+    { "natural",  "water",     2, {  80, 140, 210 } },
+    { "building", NULL,        1, { 185, 150, 130 } },
+    { "landuse",  NULL,        0, { 160, 195, 140 } },
+    { "leisure",  NULL,        0, { 140, 205, 140 } },
+    { "natural",  NULL,        0, { 150, 190, 130 } },
+};
+
+#define NUM_STYLES      (sizeof(styles) / sizeof(styles[0]))
+#define NUM_LAYERS      6
+
+static const uint8_t default_rgb[3] = { 195, 195, 195 };
+static const uint8_t node_rgb[3] = { 60, 60, 60 };
+static const uint8_t background_rgb[3] = { 245, 243, 238 };
+
+typedef struct RenderJob {
+    OSM_Map *map;
+    int width, height;
+    double scale;               // Pixels per unit of the Mercator square
+    double center_x, center_y;
+    uint32_t style_keys[NUM_STYLES];
+    uint32_t style_vals[NUM_STYLES];
+
+    float *ref_x, *ref_y;       // Pixel position of each way ref, NAN if unknown
+    float *way_box;             // Pixel bbox of each way: min x, min y, max x, max y
+    const uint8_t **way_rgb;
+    size_t *draw_order;         // Ways in increasing order of layer
+    float *node_x, *node_y;     // Pixel positions of the tagged nodes
+    size_t num_tagged;
+
+    uint8_t *image;
+    int tiles_x, tiles_y;
+    size_t next;                // Next batch of ways, or next tile, to be claimed
+} RenderJob;
+
+static double mercator_x(OSM_Lon lon) {
+    return (lon / 1e9 + 180) / 360;
+}
+
+static double mercator_y(OSM_Lat lat) {
+    double deg = lat / 1e9;
+    if (deg > MAX_MERCATOR_LAT) deg = MAX_MERCATOR_LAT;
+    if (deg < -MAX_MERCATOR_LAT) deg = -MAX_MERCATOR_LAT;
+    return (1 - asinh(tan(deg * M_PI / 180)) / M_PI) / 2;
+}
+
+static void project(const RenderJob *jp, OSM_Lat lat, OSM_Lon lon, float *xp, float *yp) {
+    *xp = (mercator_x(lon) - jp->center_x) * jp->scale + jp->width / 2.0;
+    *yp = (mercator_y(lat) - jp->center_y) * jp->scale + jp->height / 2.0;
+}
+
+/*
+ * Choose the style of a way, returning its layer and color.
+ */
+
+static int way_style(const RenderJob *jp, size_t w, const uint8_t **rgbp) {
+    const OSM_TagColumn *tp = &jp->map->way_tags;
+    for (size_t s = 0; s < NUM_STYLES; s++) {
+        if (jp->style_keys[s] == SP_NONE) continue;
+        for (size_t t = OSM_TagColumn_start(tp, w); t < OSM_TagColumn_end(tp, w); t++) {
+            if (tp->keys[t] == jp->style_keys[s] &&
+                (styles[s].value == NULL || tp->vals[t] == jp->style_vals[s])) {
+                *rgbp = styles[s].rgb;
+                return styles[s].layer;
+            }
+        }
+    }
+    *rgbp = default_rgb;
+    return 0;
+}
+
+/*
+ * Project the refs of batches of ways and compute their pixel bboxes.
+ */
+
+static void *project_worker(void *arg) {
+    RenderJob *jp = arg;
+    OSM_Map *mp = jp->map;
+    for (;;) {
+        size_t first = __atomic_fetch_add(&jp->next, OSM_BATCH_SIZE, __ATOMIC_RELAXED);
+        if (first >= mp->num_ways)
+            break;
+        size_t last = mp->num_ways - first < OSM_BATCH_SIZE ? mp->num_ways : first + OSM_BATCH_SIZE;
+        for (size_t w = first; w < last; w++) {
+            float *box = &jp->way_box[4 * w];
+            box[0] = box[1] = INFINITY;
+            box[2] = box[3] = -INFINITY;
+            OSM_Way *wp = &mp->ways[w];
+            size_t start = mp->way_ref_start[w];
+            for (size_t r = start; r < mp->way_ref_start[w + 1]; r++) {
+                OSM_Lat lat;
+                OSM_Lon lon;
+                float x = NAN, y = NAN;
+                if (OSM_Way_get_ref_location(wp, r - start, &lat, &lon) == 0) {
+                    project(jp, lat, lon, &x, &y);
+                    box[0] = fminf(box[0], x);
+                    box[1] = fminf(box[1], y);
+                    box[2] = fmaxf(box[2], x);
+                    box[3] = fmaxf(box[3], y);
+                }
+                jp->ref_x[r] = x;
+                jp->ref_y[r] = y;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void plot(uint8_t *tile, int tw, int th, int x, int y, const uint8_t *rgb) {
+    if (x < 0 || y < 0 || x >= tw || y >= th) return;
+    memcpy(&tile[3 * ((size_t)y * tw + x)], rgb, 3);
+}
+
+/*
+ * Clip the segment from (x0, y0) to (x1, y1) to the rectangle [0, w] x
+ * [0, h] by the Liang-Barsky method.  Returns zero if nothing is left.
+ */
+
+static int clip_segment(double *x0, double *y0, double *x1, double *y1, double w, double h) {
+    double dx = *x1 - *x0, dy = *y1 - *y0, t0 = 0, t1 = 1;
+    double p[4] = { -dx, dx, -dy, dy };
+    double q[4] = { *x0, w - *x0, *y0, h - *y0 };
+    for (int i = 0; i < 4; i++) {
+        if (p[i] == 0) {
+            if (q[i] < 0) return 0;
+            continue;
+        }
+        double t = q[i] / p[i];
+        if (p[i] < 0) {
+            if (t > t1) return 0;
+            if (t > t0) t0 = t;
+        } else {
+            if (t < t0) return 0;
+            if (t < t1) t1 = t;
+        }
+    }
+    double sx = *x0, sy = *y0;
+    *x0 = sx + t0 * dx;
+    *y0 = sy + t0 * dy;
+    *x1 = sx + t1 * dx;
+    *y1 = sy + t1 * dy;
+    return 1;
+}
+
+/*
+ * Draw a segment given in tile coordinates with Bresenham's algorithm.
+ */
+
+static void draw_segment(uint8_t *tile, int tw, int th, double fx0, double fy0, double fx1,
+                         double fy1, const uint8_t *rgb) {
+    if (!clip_segment(&fx0, &fy0, &fx1, &fy1, tw, th))
+        return;
+    int x0 = (int)floor(fx0), y0 = (int)floor(fy0), x1 = (int)floor(fx1), y1 = (int)floor(fy1);
+    int dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
+    int dy = -abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
+    int err = dx + dy;
+    for (;;) {
+        plot(tile, tw, th, x0, y0, rgb);
+        if (x0 == x1 && y0 == y1) break;
+        int e2 = 2 * err;
+        if (e2 >= dy) {
+            err += dy;
+            x0 += sx;
+        }
+        if (e2 <= dx) {
+            err += dx;
+            y0 += sy;
+        }
+    }
+}
+
+static void render_tile(RenderJob *jp, uint8_t *tile, int tx, int ty, int tw, int th) {
+    OSM_Map *mp = jp->map;
+    for (int i = 0; i < tw * th; i++)
+        memcpy(&tile[3 * i], background_rgb, 3);
+
+    for (size_t k = 0; k < mp->num_ways; k++) {
+        size_t w = jp->draw_order[k];
+        const float *box = &jp->way_box[4 * w];
+        if (box[2] < tx || box[0] > tx + tw || box[3] < ty || box[1] > ty + th)
+            continue;
+        for (size_t r = mp->way_ref_start[w] + 1; r < mp->way_ref_start[w + 1]; r++) {
+            if (isnan(jp->ref_x[r - 1]) || isnan(jp->ref_x[r])) continue;
+            draw_segment(tile, tw, th, jp->ref_x[r - 1] - tx, jp->ref_y[r - 1] - ty,
+                         jp->ref_x[r] - tx, jp->ref_y[r] - ty, jp->way_rgb[w]);
+        }
+    }
+    for (size_t n = 0; n < jp->num_tagged; n++) {
+        int x = (int)floor(jp->node_x[n]) - tx, y = (int)floor(jp->node_y[n]) - ty;
+        if (x < -1 || y < -1 || x > tw || y > th) continue;
+        for (int d = 0; d < 4; d++)
+            plot(tile, tw, th, x + (d & 1), y + (d >> 1), node_rgb);
+    }
+}
+
+static void *tile_worker(void *arg) {
+    RenderJob *jp = arg;
+    uint8_t *tile = malloc(3 * OSM_RENDER_TILE * OSM_RENDER_TILE);
+    if (tile == NULL) return NULL;
+    size_t num_tiles = (size_t)jp->tiles_x * jp->tiles_y;
+    for (;;) {
+        size_t t = __atomic_fetch_add(&jp->next, 1, __ATOMIC_RELAXED);
+        if (t >= num_tiles)
+            break;
+        int tx = (t % jp->tiles_x) * OSM_RENDER_TILE, ty = (t / jp->tiles_x) * OSM_RENDER_TILE;
+        int tw = jp->width - tx < OSM_RENDER_TILE ? jp->width - tx : OSM_RENDER_TILE;
+        int th = jp->height - ty < OSM_RENDER_TILE ? jp->height - ty : OSM_RENDER_TILE;
+        render_tile(jp, tile, tx, ty, tw, th);
+        for (int y = 0; y < th; y++)
+            memcpy(&jp->image[3 * ((size_t)(ty + y) * jp->width + tx)], &tile[3 * (size_t)y * tw],
+                   3 * (size_t)tw);
+    }
+    free(tile);
+    return NULL;
+}
+
+static void run_workers(RenderJob *jp, int threads, void *(*worker)(void *)) {
+    pthread_t tids[threads];
+    int started = 0;
+    jp->next = 0;
+    for (int t = 1; t < threads; t++) {
+        if (pthread_create(&tids[t], NULL, worker, jp) != 0)
+            break;
+        started++;
+    }
+    worker(jp);
+    for (int t = 1; t <= started; t++)
+        pthread_join(tids[t], NULL);
+}
+
+/*
+ * Set up the projection of a bbox onto the image, fitting it in the image
+ * with its aspect ratio kept and centering it.
+ */
+
+static void set_view(RenderJob *jp, OSM_Lat min_lat, OSM_Lat max_lat, OSM_Lon min_lon,
+                     OSM_Lon max_lon) {
+    double x0 = mercator_x(min_lon), x1 = mercator_x(max_lon);
+    double y0 = mercator_y(max_lat), y1 = mercator_y(min_lat);
+    jp->center_x = (x0 + x1) / 2;
+    jp->center_y = (y0 + y1) / 2;
+    double sx = x1 > x0 ? jp->width / (x1 - x0) : INFINITY;
+    double sy = y1 > y0 ? jp->height / (y1 - y0) : INFINITY;
+    jp->scale = sx < sy ? sx : sy;
+    if (isinf(jp->scale))
+        jp->scale = jp->width;
+}
+
+static int map_bbox(OSM_Map *mp, OSM_Lat *min_lat, OSM_Lat *max_lat, OSM_Lon *min_lon,
+                    OSM_Lon *max_lon) {
+    if (mp->has_bbox) {
+        *min_lat = mp->bbox.min_lat;
+        *max_lat = mp->bbox.max_lat;
+        *min_lon = mp->bbox.min_lon;
+        *max_lon = mp->bbox.max_lon;
+        return 0;
+    }
+    if (mp->num_nodes == 0) return -1;
+    *min_lat = *max_lat = mp->node_lats[0];
+    *min_lon = *max_lon = mp->node_lons[0];
+    for (size_t i = 1; i < mp->num_nodes; i++) {
+        if (mp->node_lats[i] < *min_lat) *min_lat = mp->node_lats[i];
+        if (mp->node_lats[i] > *max_lat) *max_lat = mp->node_lats[i];
+        if (mp->node_lons[i] < *min_lon) *min_lon = mp->node_lons[i];
+        if (mp->node_lons[i] > *max_lon) *max_lon = mp->node_lons[i];
+    }
+    return 0;
+}
+
+static int write_chunk(FILE *out, const char *type, const unsigned char *data, size_t len) {
+    unsigned char header[8] = { len >> 24, len >> 16, len >> 8, len, type[0], type[1], type[2], type[3] };
+    uLong crc = crc32(0, header + 4, 4);
+    if (len > 0)
+        crc = crc32(crc, data, len);
+    unsigned char trailer[4] = { crc >> 24, crc >> 16, crc >> 8, crc };
+    if (fwrite(header, 1, 8, out) != 8 || (len > 0 && fwrite(data, 1, len, out) != len) ||
+        fwrite(trailer, 1, 4, out) != 4)
+        return -1;
+    return 0;
+}
+
+/*
+ * Write an RGB image as a PNG file, with no filtering of the rows.
+ */
+
+static int write_png(FILE *out, const uint8_t *image, int width, int height) {
+    size_t row = 1 + 3 * (size_t)width;
+    size_t raw_size = row * height;
+    unsigned char *raw = malloc(raw_size);
+    uLongf packed_size = compressBound(raw_size);
+    unsigned char *packed = malloc(packed_size);
+    int ret = -1;
+    if (raw != NULL && packed != NULL) {
+        for (int y = 0; y < height; y++) {
+            raw[y * row] = 0;
+            memcpy(&raw[y * row + 1], &image[3 * (size_t)y * width], row - 1);
+        }
+        unsigned char ihdr[13] = { width >> 24, width >> 16, width >> 8, width,
+                                   height >> 24, height >> 16, height >> 8, height,
+                                   8, 2, 0, 0, 0 };
+        if (compress2(packed, &packed_size, raw, raw_size, Z_BEST_SPEED) == Z_OK &&
+            fwrite("\x89PNG\r\n\x1a\n", 1, 8, out) == 8 &&
+            write_chunk(out, "IHDR", ihdr, sizeof(ihdr)) == 0 &&
+            write_chunk(out, "IDAT", packed, packed_size) == 0 &&
+            write_chunk(out, "IEND", NULL, 0) == 0)
+            ret = 0;
+        else
+            fprintf(stderr, "Unable to write the PNG image\n");
+    }
+    free(raw);
+    free(packed);
+    return ret;
+}
+
+static int prepare(RenderJob *jp, const OSM_RenderOptions *rp) {
+    OSM_Map *mp = jp->map;
+    for (size_t s = 0; s < NUM_STYLES; s++) {
+        jp->style_keys[s] = SP_lookup(mp->strings, styles[s].key, strlen(styles[s].key));
+        jp->style_vals[s] = styles[s].value == NULL ? SP_NONE :
+                            SP_lookup(mp->strings, styles[s].value, strlen(styles[s].value));
+        if (styles[s].value != NULL && jp->style_vals[s] == SP_NONE)
+            jp->style_keys[s] = SP_NONE;
+    }
+
+    jp->ref_x = malloc((mp->num_refs + 1) * sizeof(float));
+    jp->ref_y = malloc((mp->num_refs + 1) * sizeof(float));
+    jp->way_box = malloc((4 * mp->num_ways + 1) * sizeof(float));
+    jp->way_rgb = malloc((mp->num_ways + 1) * sizeof(uint8_t *));
+    jp->draw_order = malloc((mp->num_ways + 1) * sizeof(size_t));
+    int *layers = malloc((mp->num_ways + 1) * sizeof(int));
+    const OSM_TagColumn *tp = &mp->node_tags;
+    size_t num_tagged = 0;
+    for (size_t i = 0; i < mp->num_nodes; i++)
+        num_tagged += OSM_TagColumn_end(tp, i) > OSM_TagColumn_start(tp, i);
+    jp->node_x = malloc((num_tagged + 1) * sizeof(float));
+    jp->node_y = malloc((num_tagged + 1) * sizeof(float));
+    if (jp->ref_x == NULL || jp->ref_y == NULL || jp->way_box == NULL || jp->way_rgb == NULL ||
+        jp->draw_order == NULL || layers == NULL || jp->node_x == NULL || jp->node_y == NULL) {
+        free(layers);
+        return -1;
+    }
+
+    run_workers(jp, rp->threads > 1 ? rp->threads : 1, project_worker);
+
+    size_t counts[NUM_LAYERS + 1] = { 0 };
+    for (size_t w = 0; w < mp->num_ways; w++) {
+        layers[w] = way_style(jp, w, &jp->way_rgb[w]);
+        counts[layers[w] + 1]++;
+    }
+    for (int l = 1; l <= NUM_LAYERS; l++)
+        counts[l] += counts[l - 1];
+    for (size_t w = 0; w < mp->num_ways; w++)
+        jp->draw_order[counts[layers[w]]++] = w;
+    free(layers);
+
+    for (size_t i = 0; i < mp->num_nodes; i++) {
+        if (OSM_TagColumn_end(tp, i) > OSM_TagColumn_start(tp, i)) {
+            project(jp, mp->node_lats[i], mp->node_lons[i], &jp->node_x[jp->num_tagged],
+                    &jp->node_y[jp->num_tagged]);
+            jp->num_tagged++;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief  Render a map as a PNG image.
+ * @details  The image shows the bbox given in the options, or else that of
+ * the map's header or, failing that, of its nodes, fitted to the image in
+ * Web Mercator.  Refs whose nodes are not in the map break their ways.
+ *
+ * @param mp  The map.
+ * @param rp  The size and bbox of the image and the number of threads.
+ * @param out  The output stream, to which the PNG file is written.
+ * @return 0 if successful, -1 in case of an error.
+ */
+
+int OSM_render_png(OSM_Map *mp, const OSM_RenderOptions *rp, FILE *out) {
+    if (mp == NULL || rp->width <= 0 || rp->height <= 0 || rp->width > 1 << 15 || rp->height > 1 << 15) {
+        fprintf(stderr, "Cannot render an image of %d x %d pixels\n", rp->width, rp->height);
+        return -1;
+    }
+    RenderJob job;
+    memset(&job, 0, sizeof(RenderJob));
+    job.map = mp;
+    job.width = rp->width;
+    job.height = rp->height;
+    OSM_Lat min_lat = rp->min_lat, max_lat = rp->max_lat;
+    OSM_Lon min_lon = rp->min_lon, max_lon = rp->max_lon;
+    if (!rp->has_bbox && map_bbox(mp, &min_lat, &max_lat, &min_lon, &max_lon) != 0) {
+        fprintf(stderr, "The map has no bbox and no nodes to render\n");
+        return -1;
+    }
+    set_view(&job, min_lat, max_lat, min_lon, max_lon);
+
+    int ret = -1;
+    job.image = calloc(3 * (size_t)job.width * job.height, 1);
+    if (job.image != NULL && prepare(&job, rp) == 0) {
+        job.tiles_x = (job.width + OSM_RENDER_TILE - 1) / OSM_RENDER_TILE;
+        job.tiles_y = (job.height + OSM_RENDER_TILE - 1) / OSM_RENDER_TILE;
+        run_workers(&job, rp->threads > 1 ? rp->threads : 1, tile_worker);
+        ret = write_png(out, job.image, job.width, job.height);
+    }
+    free(job.ref_x);
+    free(job.ref_y);
+    free(job.way_box);
+    free(job.way_rgb);
+    free(job.draw_order);
+    free(job.node_x);
+    free(job.node_y);
+    free(job.image);
+    return ret;
+}
@@ -0,0 +1,506 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "osmsample.h"
+#include "osmblock.h"
+#include "debug.h"
+
+/*
+ * Quantiles for a two-sided 95% interval: of Student's t distribution by
+ * degrees of freedom up to 30, and of the normal distribution beyond.
+ */
+
+#define Z_95    1.959963984540054
+
+static const double t_95[] = {
+    0, 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+    2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+    2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+};
+
+static double quantile_95(double df) {
+    size_t n = df < 1 ? 1 : (size_t)df;
+    return n < sizeof(t_95) / sizeof(t_95[0]) ? t_95[n] : Z_95;
+}
+
+/*
+ * A stratum of consecutive data blocks, of which num_sampled are decoded,
+ * one from each of as many runs.  Types holds the entity types that may be
+ * in its blocks: all of them unless the file is sorted by type.
+ */
+
+typedef struct Stratum {
+    size_t first;               // Index of its first data blob
+    size_t count;
+    size_t first_unit;          // Index of its first sampled block
+    size_t num_sampled;
+    double bytes;               // Size of its data blobs
+    unsigned int types;         // OSM_TYPE_* masks
+} Stratum;
+
+/* A sampled block, and the size of the run it was chosen from */
+
+typedef struct Unit {
+    double weight;
+    double x;                   // Size of its blob
+    double nodes, ways, relations;
+} Unit;
+
+/* The count of a key in a sampled block */
+
+typedef struct KeyCount {
+    size_t unit;
+    int count;
+} KeyCount;
+
+typedef struct KeyTally {
+    char *key;
+    KeyCount *counts;           // By sampled block, for those that have the key
+    size_t num_counts;
+    size_t count_cap;
+} KeyTally;
+
+typedef struct SampleState {
+    uint64_t *offsets;          // Of the data blobs, in file order
+    uint64_t *lengths;
+    size_t num_blobs;
+    size_t blob_cap;
+    int sorted;                 // If the header declares Sort.Type_then_ID
+    Stratum strata[5];
+    int num_strata;
+    Unit *units;
+    size_t num_units;
+    KeyTally *keys;             // Open addressing on the key string
+    size_t key_cap;
+    size_t num_keys;
+} SampleState;
+
+static uint64_t splitmix64(uint64_t *statep) {
+    uint64_t z = (*statep += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static uint64_t hash_key(const char *key) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (; *key != '\0'; key++)
+        h = (h ^ (unsigned char)*key) * 0x100000001b3ULL;
+    return h;
+}
+
+static int add_key_count(KeyTally *kp, size_t unit, int count) {
+    if (kp->num_counts == kp->count_cap) {
+        size_t cap = kp->count_cap ? 2 * kp->count_cap : 8;
+        KeyCount *counts = realloc(kp->counts, cap * sizeof(KeyCount));
+        if (counts == NULL) return -1;
+        kp->counts = counts;
+        kp->count_cap = cap;
+    }
+    kp->counts[kp->num_counts++] = (KeyCount){ unit, count };
+    return 0;
+}
+
+/*
+ * Find the tally of a key, adding it if it is not there yet.
+ */
+
+static KeyTally *find_key(SampleState *sp, const char *key) {
+    if (2 * (sp->num_keys + 1) > sp->key_cap) {
+        size_t cap = sp->key_cap ? 2 * sp->key_cap : 256;
+        KeyTally *keys = calloc(cap, sizeof(KeyTally));
+        if (keys == NULL) return NULL;
+        for (size_t i = 0; i < sp->key_cap; i++) {
+            if (sp->keys[i].key == NULL) continue;
+            size_t j = hash_key(sp->keys[i].key) & (cap - 1);
+            while (keys[j].key != NULL)
+                j = (j + 1) & (cap - 1);
+            keys[j] = sp->keys[i];
+        }
+        free(sp->keys);
+        sp->keys = keys;
+        sp->key_cap = cap;
+    }
+    size_t j = hash_key(key) & (sp->key_cap - 1);
+    while (sp->keys[j].key != NULL) {
+        if (strcmp(sp->keys[j].key, key) == 0)
+            return &sp->keys[j];
+        j = (j + 1) & (sp->key_cap - 1);
+    }
+    if ((sp->keys[j].key = strdup(key)) == NULL)
+        return NULL;
+    sp->num_keys++;
+    return &sp->keys[j];
+}
+
+/*
+ * Scan the blob headers of the input, recording the offset and length of
+ * each data blob, and check the header block.
+ */
+
+static int scan_blobs(FILE *in, SampleState *sp) {
+    uint64_t offset = 0;
+    OSM_Blob blob;
+    int ret;
+    while ((ret = OSM_skip_Blob(in, offset, &blob)) == 1) {
+        if (blob.type == OSM_BLOB_HEADER) {
+            OSM_Options opts;
+            OSM_Options_init(&opts);
+            OSM_Block *bp = OSM_read_Block_at(in, offset, &opts);
+            if (bp == NULL || fseeko(in, offset + blob.length, SEEK_SET) != 0) {
+                OSM_Block_free(bp);
+                return -1;
+            }
+            sp->sorted = ((bp->required_features | bp->optional_features) & OSM_FEATURE_SORTED) != 0;
+            OSM_Block_free(bp);
+        } else if (blob.type == OSM_BLOB_DATA) {
+            if (sp->num_blobs == sp->blob_cap) {
+                size_t cap = sp->blob_cap ? 2 * sp->blob_cap : 64;
+                uint64_t *offsets = realloc(sp->offsets, cap * sizeof(uint64_t));
+                if (offsets == NULL) return -1;
+                sp->offsets = offsets;
+                uint64_t *lengths = realloc(sp->lengths, cap * sizeof(uint64_t));
+                if (lengths == NULL) return -1;
+                sp->lengths = lengths;
+                sp->blob_cap = cap;
+            }
+            sp->offsets[sp->num_blobs] = offset;
+            sp->lengths[sp->num_blobs++] = blob.length;
+        }
+        offset += blob.length;
+    }
+    return ret;
+}
+
+/*
+ * The type of the last entity of a data block: in a file sorted by type,
+ * this never decreases from one block to the next.  Returns 0 for a block
+ * with no entities and -1 in case of an error.
+ */
+
+static int last_type(FILE *in, SampleState *sp, size_t index) {
+    OSM_Options opts;
+    OSM_Options_init(&opts);
+    opts.tags = 0;
+    OSM_Block *bp = OSM_read_Block_at(in, sp->offsets[index], &opts);
+    if (bp == NULL) return -1;
+    int type = bp->num_relations ? OSM_TYPE_RELATION : bp->num_ways ? OSM_TYPE_WAY :
+               bp->num_nodes ? OSM_TYPE_NODE : 0;
+    OSM_Block_free(bp);
+    return type;
+}
+
+/*
+ * Find the first of the data blocks from lo whose last entity is of the
+ * specified type or a later one, or num_blobs if there is none.
+ */
+
+static int find_type(FILE *in, SampleState *sp, size_t lo, int type, size_t *indexp) {
+    size_t hi = sp->num_blobs;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int t = last_type(in, sp, mid);
+        if (t < 0) return -1;
+        if (t < type) lo = mid + 1;
+        else hi = mid;
+    }
+    *indexp = lo;
+    return 0;
+}
+
+static void add_stratum(SampleState *sp, size_t first, size_t end, unsigned int types) {
+    if (first >= end) return;
+    Stratum *hp = &sp->strata[sp->num_strata++];
+    memset(hp, 0, sizeof(Stratum));
+    hp->first = first;
+    hp->count = end - first;
+    hp->types = types;
+    for (size_t i = first; i < end; i++)
+        hp->bytes += sp->lengths[i];
+}
+
+/*
+ * Divide the data blocks into strata.  In a file sorted by type, the
+ * blocks where the ways and the relations start are found by binary
+ * search and are strata of their own, since they may hold two types; the
+ * blocks between them hold only one type.  Any other file is a single
+ * stratum.
+ */
+
+static int make_strata(FILE *in, SampleState *sp) {
+    size_t N = sp->num_blobs, ways = N, relations = N;
+    if (sp->sorted &&
+        (find_type(in, sp, 0, OSM_TYPE_WAY, &ways) || find_type(in, sp, ways, OSM_TYPE_RELATION, &relations)))
+        return -1;
+    if (!sp->sorted) {
+        add_stratum(sp, 0, N, OSM_TYPE_ALL);
+        return 0;
+    }
+    size_t after_ways = ways < N ? ways + 1 : N;
+    add_stratum(sp, 0, ways, OSM_TYPE_NODE);
+    add_stratum(sp, ways, after_ways, OSM_TYPE_ALL);
+    if (relations > ways) {
+        size_t after_relations = relations < N ? relations + 1 : N;
+        add_stratum(sp, after_ways, relations, OSM_TYPE_WAY);
+        add_stratum(sp, relations, after_relations, OSM_TYPE_ALL);
+        add_stratum(sp, after_relations, N, OSM_TYPE_RELATION);
+    } else {
+        add_stratum(sp, after_ways, N, OSM_TYPE_RELATION);
+    }
+    return 0;
+}
+
+/*
+ * Count the tags of one type of entity in a block by key, in counts
+ * indexed by the block's string table.
+ */
+
+static void count_keys(const OSM_BlockTags *tp, int *counts) {
+    for (int i = 0; i < tp->count; i++)
+        counts[tp->keys[i]]++;
+}
+
+/*
+ * Decode the data blob with the given index as the next sampled block of
+ * a stratum, chosen from a run of weight blocks, and add its counts.  A
+ * type found where the file's order says it cannot be is added to the
+ * types of the stratum, so that a wrong header costs precision but does
+ * not make the estimates wrong.
+ */
+
+static int sample_block(FILE *in, SampleState *sp, Stratum *hp, size_t index, size_t weight) {
+    OSM_Options opts;
+    OSM_Options_init(&opts);
+    OSM_Block *bp = OSM_read_Block_at(in, sp->offsets[index], &opts);
+    if (bp == NULL) return -1;
+
+    size_t unit = sp->num_units++;
+    Unit *up = &sp->units[unit];
+    up->weight = weight;
+    up->x = sp->lengths[index];
+    up->nodes = bp->num_nodes;
+    up->ways = bp->num_ways;
+    up->relations = bp->num_relations;
+    hp->types |= (bp->num_nodes ? OSM_TYPE_NODE : 0) | (bp->num_ways ? OSM_TYPE_WAY : 0) |
+                 (bp->num_relations ? OSM_TYPE_RELATION : 0);
+
+    int ret = 0;
+    int *counts = calloc(bp->num_strings + 1, sizeof(int));
+    if (counts == NULL) ret = -1;
+    else {
+        count_keys(&bp->node_tags, counts);
+        count_keys(&bp->way_tags, counts);
+        for (int i = 0; i < bp->num_strings && ret == 0; i++) {
+            if (counts[i] == 0) continue;
+            KeyTally *kp = find_key(sp, bp->strings[i]);
+            if (kp == NULL || add_key_count(kp, unit, counts[i])) ret = -1;
+        }
+        free(counts);
+    }
+    OSM_Block_free(bp);
+    return ret;
+}
+
+/*
+ * Estimate a total from its values y over the sampled blocks, for a count
+ * of entities of the types in a mask, summing the estimates of the strata
+ * that may have such entities.  In a stratum of a single type, the total
+ * is the ratio of the weighted sums of y and of the blob sizes over the
+ * sampled blocks, times the size of the stratum, since its blocks differ
+ * mostly in size; in a stratum of mixed types, whose blocks differ in kind,
+ * it is the weighted sum of y.  With one block chosen per run there is no
+ * variance within a run to go by, so runs are collapsed in pairs (the last
+ * three together if their number is odd) and the variance is estimated
+ * from the differences within each group.  The interval uses Student's t
+ * with the degrees of freedom of the groups, as combined over the strata
+ * by Satterthwaite's approximation.  An interval that cannot be estimated,
+ * or that would be zero only because no sampled block had anything to
+ * count, is NAN.
+ */
+
+static OSM_Estimate estimate(const SampleState *sp, const double *y, unsigned int types) {
+    OSM_Estimate e = { 0, 0 };
+    double var = 0, sum_vv_df = 0, uncertain_y = 0;
+    int uncertain = 0, unknown = 0;
+    for (int h = 0; h < sp->num_strata; h++) {
+        const Stratum *hp = &sp->strata[h];
+        if (!(hp->types & types)) continue;
+        const Unit *up = &sp->units[hp->first_unit];
+        const double *yp = &y[hp->first_unit];
+        size_t k = hp->num_sampled;
+        double sum_wy = 0, sum_wx = 0;
+        for (size_t j = 0; j < k; j++) {
+            sum_wy += up[j].weight * yp[j];
+            sum_wx += up[j].weight * up[j].x;
+        }
+        int ratio = (hp->types & (hp->types - 1)) == 0;
+        double r = ratio && sum_wx > 0 ? sum_wy / sum_wx : 0;
+        e.value += ratio ? r * hp->bytes : sum_wy;
+        if (k == hp->count) continue;
+        uncertain = 1;
+        if (k < 2) {
+            unknown = 1;
+            continue;
+        }
+        double v = 0;
+        for (size_t j = 0; j < k; ) {
+            size_t m = k - j == 3 ? 3 : 2, g;
+            double mean = 0;
+            for (g = j; g < j + m; g++)
+                mean += up[g].weight * (yp[g] - r * up[g].x) / m;
+            for (g = j; g < j + m; g++) {
+                double d = up[g].weight * (yp[g] - r * up[g].x) - mean;
+                v += d * d * m / (m - 1);
+            }
+            j += m;
+        }
+        v *= 1 - (double)k / hp->count;
+        var += v;
+        sum_vv_df += v * v / (k / 2);
+        for (size_t j = 0; j < k; j++)
+            uncertain_y += yp[j];
+    }
+    if (unknown || (uncertain && uncertain_y == 0))
+        e.half_width = NAN;
+    else if (var == 0)
+        e.half_width = 0;
+    else
+        e.half_width = quantile_95(var * var / sum_vv_df) * sqrt(var);
+    return e;
+}
+
+static int compare_keys(const void *a, const void *b) {
+    const OSM_SampleKey *ka = a, *kb = b;
+    if (ka->count.value != kb->count.value)
+        return ka->count.value < kb->count.value ? 1 : -1;
+    return strcmp(ka->key, kb->key);
+}
+
+/**
+ * @brief  Estimate the numbers of entities in an OSM PBF file, and of the
+ * most frequent tag keys, from a stratified sample of its data blocks.
+ * @details  The input must be seekable.  The data blocks are divided into
+ * strata, by type if the file is sorted by type, and of the N blocks of a
+ * stratum, ceil(fraction * N) but at least two are decoded, one chosen at
+ * random from each of as many runs of consecutive blocks, so that the
+ * estimates do not depend on how the blocks are ordered within a stratum.
+ * The same seed chooses the same blocks.
+ *
+ * @param in  The input stream, positioned at its start.
+ * @param fraction  The fraction of the data blocks to sample, in (0, 1].
+ * @param seed  Seed for choosing the blocks.
+ * @param sp  The summary to be filled in, to be freed with OSM_Sample_free().
+ * @return 0 if successful, -1 in case of an error.
+ */
+
+int OSM_sample_file(FILE *in, double fraction, uint64_t seed, OSM_Sample *sp) {
+    memset(sp, 0, sizeof(OSM_Sample));
+    if (!(fraction > 0 && fraction <= 1)) {
+        fprintf(stderr, "Sample fraction %g is not in (0, 1]\n", fraction);
+        return -1;
+    }
+    if (fseeko(in, 0, SEEK_CUR) != 0) {
+        fprintf(stderr, "Sampling needs a seekable input\n");
+        return -1;
+    }
+
+    SampleState state;
+    memset(&state, 0, sizeof(SampleState));
+    int ret = scan_blobs(in, &state);
+    size_t N = state.num_blobs;
+    if (ret == 0)
+        ret = make_strata(in, &state);
+    if (ret == 0 && (state.units = calloc(N + 1, sizeof(Unit))) == NULL)
+        ret = -1;
+
+    uint64_t rng = seed;
+    for (int h = 0; h < state.num_strata && ret == 0; h++) {
+        Stratum *hp = &state.strata[h];
+        size_t n = (size_t)ceil(fraction * hp->count);
+        if (n < 2) n = 2;
+        if (n > hp->count) n = hp->count;
+        hp->first_unit = state.num_units;
+        hp->num_sampled = n;
+        for (size_t j = 0; j < n && ret == 0; j++) {
+            size_t lo = j * hp->count / n, hi = (j + 1) * hp->count / n;
+            size_t index = hp->first + lo + splitmix64(&rng) % (hi - lo);
+            ret = sample_block(in, &state, hp, index, hi - lo);
+            sp->sampled_bytes += state.lengths[index];
+        }
+        sp->sampled_blocks += n;
+    }
+
+    double *y = ret == 0 ? calloc(state.num_units + 1, sizeof(double)) : NULL;
+    if (ret == 0 && y == NULL)
+        ret = -1;
+    if (ret == 0) {
+        sp->num_blocks = N;
+        for (size_t i = 0; i < N; i++)
+            sp->total_bytes += state.lengths[i];
+        for (size_t u = 0; u < state.num_units; u++)
+            y[u] = state.units[u].nodes;
+        sp->nodes = estimate(&state, y, OSM_TYPE_NODE);
+        for (size_t u = 0; u < state.num_units; u++)
+            y[u] = state.units[u].ways;
+        sp->ways = estimate(&state, y, OSM_TYPE_WAY);
+        for (size_t u = 0; u < state.num_units; u++)
+            y[u] = state.units[u].relations;
+        sp->relations = estimate(&state, y, OSM_TYPE_RELATION);
+        memset(y, 0, state.num_units * sizeof(double));
+
+        /* Only the tags of nodes and ways are counted */
+        OSM_SampleKey *keys = calloc(state.num_keys + 1, sizeof(OSM_SampleKey));
+        if (keys == NULL) ret = -1;
+        else {
+            size_t k = 0;
+            for (size_t i = 0; i < state.key_cap; i++) {
+                KeyTally *kp = &state.keys[i];
+                if (kp->key == NULL) continue;
+                for (size_t c = 0; c < kp->num_counts; c++)
+                    y[kp->counts[c].unit] = kp->counts[c].count;
+                keys[k].key = kp->key;
+                keys[k++].count = estimate(&state, y, OSM_TYPE_NODE | OSM_TYPE_WAY);
+                for (size_t c = 0; c < kp->num_counts; c++)
+                    y[kp->counts[c].unit] = 0;
+            }
+            qsort(keys, k, sizeof(OSM_SampleKey), compare_keys);
+            for (size_t i = 0; i < k && i < OSM_SAMPLE_TOP_KEYS; i++) {
+                sp->keys[i].key = strdup(keys[i].key);
+                sp->keys[i].count = keys[i].count;
+                if (sp->keys[i].key == NULL) {
+                    ret = -1;
+                    break;
+                }
+                sp->num_keys++;
+            }
+            free(keys);
+        }
+    }
+
+    free(y);
+    for (size_t i = 0; i < state.key_cap; i++) {
+        free(state.keys[i].key);
+        free(state.keys[i].counts);
+    }
+    free(state.keys);
+    free(state.units);
+    free(state.offsets);
+    free(state.lengths);
+    if (ret != 0)
+        OSM_Sample_free(sp);
+    return ret;
+}
+
+/**
+ * @brief  Free the keys of a summary filled in by OSM_sample_file().
+ */
+
+void OSM_Sample_free(OSM_Sample *sp) {
+    if (sp == NULL) return;
+    for (size_t i = 0; i < sp->num_keys; i++)
+        free(sp->keys[i].key);
+    sp->num_keys = 0;
+}
@@ -0,0 +1,455 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "osmshard.h"
+#include "osmblock.h"
+#include "osmmap.h"
+#include "debug.h"
+
+#define PIPE_BUFFER_SIZE    (64 * 1024)
+
+/* A worker process, seen from the parent */
+
+typedef struct Worker {
+    pid_t pid;
+    int fd;                     // Read end of its pipe, or -1 once at its end
+    FILE *spill;                // What it wrote before its turn to be merged
+} Worker;
+
+/**
+ * @brief  Split the blobs of a seekable input into contiguous ranges of
+ * about the same size.
+ * @details  Only the blob headers are read.  The ranges cover every blob,
+ * including the header blob, which is also returned separately; there are
+ * fewer ranges than asked for if there are fewer blobs.
+ *
+ * @param in  The input stream, which is left at its start.
+ * @param num_shards  The number of ranges wanted.
+ * @param shardsp  Pointer to a variable in which to store the ranges, to
+ * be freed by the caller.
+ * @param header_offsetp  Pointer to a variable in which to store the offset
+ * of the header blob, or UINT64_MAX if there is none.
+ * @return  The number of ranges, or -1 in case of an error.
+ */
+
+int OSM_Shards_plan(FILE *in, int num_shards, OSM_Shard **shardsp, uint64_t *header_offsetp) {
+    if (num_shards < 1 || fseeko(in, 0, SEEK_SET) != 0) {
+        fprintf(stderr, "Cannot shard an input that is not seekable\n");
+        return -1;
+    }
+    *header_offsetp = UINT64_MAX;
+    uint64_t *offsets = NULL, offset = 0;
+    size_t count = 0, cap = 0;
+    OSM_Blob blob;
+    int ret;
+    while ((ret = OSM_skip_Blob(in, offset, &blob)) == 1) {
+        if (count == cap) {
+            size_t new_cap = cap ? 2 * cap : 1024;
+            uint64_t *p = realloc(offsets, new_cap * sizeof(uint64_t));
+            if (p == NULL) {
+                ret = -1;
+                break;
+            }
+            offsets = p;
+            cap = new_cap;
+        }
+        offsets[count++] = offset;
+        if (blob.type == OSM_BLOB_HEADER && *header_offsetp == UINT64_MAX)
+            *header_offsetp = offset;
+        offset += blob.length;
+        OSM_Blob_free(&blob);
+    }
+    int n = (size_t)num_shards < count ? num_shards : (int)count;
+    OSM_Shard *shards = ret == 0 ? calloc(n > 0 ? n : 1, sizeof(OSM_Shard)) : NULL;
+    if (shards == NULL || fseeko(in, 0, SEEK_SET) != 0) {
+        fprintf(stderr, "Cannot shard the input: unable to read its blobs\n");
+        free(shards);
+        free(offsets);
+        return -1;
+    }
+
+    /* Each range ends at the first blob past its share of the bytes, leaving a blob for each later range */
+    size_t b = 0;
+    for (int k = 0; k < n; k++) {
+        size_t first = b++;
+        uint64_t target = offset * (k + 1) / n;
+        while (b < count - (n - 1 - k) && offsets[b] < target)
+            b++;
+        shards[k].start = offsets[first];
+        shards[k].end = b < count ? offsets[b] : offset;
+        shards[k].num_blobs = b - first;
+    }
+    free(offsets);
+    *shardsp = shards;
+    return n;
+}
+
+/* Run the work of a range in a forked process, returning its exit status */
+
+static int run_worker(const char *path, const OSM_Shard *sp, OSM_ShardWorkFunc *work, void *arg, int fd) {
+    FILE *in = fopen(path, "rb");
+    FILE *out = fdopen(fd, "wb");
+    if (in == NULL || out == NULL) {
+        fprintf(stderr, "Cannot read the input file %s\n", path);
+        return 1;
+    }
+    int ret = work(arg, in, sp, out);
+    if (fclose(out) != 0)
+        ret = -1;
+    fclose(in);
+    return ret == 0 ? 0 : 1;
+}
+
+/* Hand what a worker held back to the merge function, once it is its turn */
+
+static int replay(Worker *wp, int shard, OSM_ShardMergeFunc *merge, void *arg, char *buf) {
+    if (wp->spill == NULL) return 0;
+    int ret = fseeko(wp->spill, 0, SEEK_SET) == 0 ? 0 : -1;
+    size_t len;
+    while (ret == 0 && (len = fread(buf, 1, PIPE_BUFFER_SIZE, wp->spill)) > 0)
+        ret = merge(arg, shard, buf, len) ? -1 : 0;
+    if (ferror(wp->spill))
+        ret = -1;
+    fclose(wp->spill);
+    wp->spill = NULL;
+    return ret;
+}
+
+/*
+ * Read the pipes of the workers until they all end, merging what the
+ * earliest unfinished range writes as it comes and spilling the rest.
+ * After a failure, the pipes are still drained, so no worker is blocked.
+ * If this cannot start, the caller closes the pipes, which ends the workers.
+ */
+
+static int collect(Worker *workers, int num_workers, OSM_ShardMergeFunc *merge, void *arg) {
+    struct pollfd *fds = malloc(num_workers * sizeof(struct pollfd));
+    char *buf = malloc(PIPE_BUFFER_SIZE);
+    if (fds == NULL || buf == NULL) {
+        free(fds);
+        free(buf);
+        return -1;
+    }
+    int ret = 0, head = 0, num_open = num_workers;
+    while (num_open > 0) {
+        for (int s = 0; s < num_workers; s++) {
+            fds[s].fd = workers[s].fd;
+            fds[s].events = POLLIN;
+            fds[s].revents = 0;
+        }
+        if (poll(fds, num_workers, -1) < 0) {
+            if (errno == EINTR) continue;
+            ret = -1;
+            break;
+        }
+        for (int s = 0; s < num_workers; s++) {
+            if (fds[s].revents == 0) continue;
+            ssize_t len = read(workers[s].fd, buf, PIPE_BUFFER_SIZE);
+            if (len < 0 && errno == EINTR) continue;
+            if (len <= 0) {
+                close(workers[s].fd);
+                workers[s].fd = -1;
+                num_open--;
+                if (len < 0) ret = -1;
+            } else if (ret != 0) {
+                continue;
+            } else if (s == head) {
+                ret = merge(arg, s, buf, len) ? -1 : 0;
+            } else if (workers[s].spill == NULL && (workers[s].spill = tmpfile()) == NULL) {
+                ret = -1;
+            } else if (fwrite(buf, 1, len, workers[s].spill) != (size_t)len) {
+                ret = -1;
+            }
+        }
+        while (ret == 0 && head < num_workers && workers[head].fd < 0) {
+            if (++head < num_workers)
+                ret = replay(&workers[head], head, merge, arg, buf);
+        }
+    }
+    free(fds);
+    free(buf);
+    return ret;
+}
+
+/**
+ * @brief  Run a function on ranges of an input in worker processes, and
+ * merge their results in range order.
+ * @details  Each worker is forked from the caller, so the work function
+ * sees what the caller had set up, and opens the input file again.  The
+ * caller must not have threads running, since only the forking thread is
+ * carried over into the workers.
+ *
+ * @param path  The input file.
+ * @param shards  The ranges, from OSM_Shards_plan().
+ * @param num_shards  The number of ranges, and of workers.
+ * @param work  The function run by each worker on its range.
+ * @param merge  The function given the results of the workers.
+ * @param arg  Argument passed to both.
+ * @return 0 if every worker and merge succeeded, -1 otherwise.
+ */
+
+int OSM_Shards_run(const char *path, const OSM_Shard *shards, int num_shards,
+                   OSM_ShardWorkFunc *work, OSM_ShardMergeFunc *merge, void *arg) {
+    if (num_shards < 1) return 0;
+    Worker *workers = calloc(num_shards, sizeof(Worker));
+    if (workers == NULL) return -1;
+    fflush(NULL);
+    int ret = 0, started = 0;
+    for (int s = 0; s < num_shards; s++) {
+        int fds[2];
+        if (pipe(fds) != 0) {
+            ret = -1;
+            break;
+        }
+        pid_t pid = fork();
+        if (pid < 0) {
+            close(fds[0]);
+            close(fds[1]);
+            ret = -1;
+            break;
+        }
+        if (pid == 0) {
+            close(fds[0]);
+            for (int t = 0; t < s; t++)
+                close(workers[t].fd);
+            _exit(run_worker(path, &shards[s], work, arg, fds[1]));
+        }
+        close(fds[1]);
+        workers[s].pid = pid;
+        workers[s].fd = fds[0];
+        started++;
+    }
+    if (ret == 0)
+        ret = collect(workers, num_shards, merge, arg);
+    for (int s = 0; s < started; s++) {
+        if (workers[s].fd >= 0)
+            close(workers[s].fd);
+        if (workers[s].spill != NULL)
+            fclose(workers[s].spill);
+        int status;
+        while (waitpid(workers[s].pid, &status, 0) < 0 && errno == EINTR)
+            ;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            ret = -1;
+    }
+    if (started < num_shards)
+        fprintf(stderr, "Cannot start the worker processes\n");
+    free(workers);
+    return ret;
+}
+
+/* The lookups of OSM_Shards_load(), and the results of the workers */
+
+typedef struct LoadJob {
+    OSM_Id *ids[2];             // Sorted node and way ids
+    size_t counts[2];
+    OSM_Options opts;           // Options of the workers
+    uint64_t *results;          // Merged results, as written by the workers
+    size_t size;                // Bytes in results
+    size_t cap;
+} LoadJob;
+
+static int compare_ids(const void *a, const void *b) {
+    OSM_Id x = *(const OSM_Id *)a, y = *(const OSM_Id *)b;
+    return (x > y) - (x < y);
+}
+
+static int holds_any(const OSM_Id *sorted, size_t num_sorted, const OSM_Id *ids, int n) {
+    for (int i = 0; i < n && num_sorted > 0; i++) {
+        if (bsearch(&ids[i], sorted, num_sorted, sizeof(OSM_Id), compare_ids) != NULL)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Count the nodes and ways of a range and find its blocks that hold any of
+ * the ids, writing the counts, the number of those blocks, and the offset
+ * and the numbers of nodes, ways and refs of each.
+ */
+
+#define BLOCK_WORDS 4
+
+static int scan_shard(void *arg, FILE *in, const OSM_Shard *sp, FILE *out) {
+    LoadJob *jp = arg;
+    OSM_BlockReader *rp = OSM_BlockReader_open_range(in, sp->start, sp->end, &jp->opts);
+    if (rp == NULL) return -1;
+    uint64_t header[3] = { 0, 0, 0 };
+    uint64_t *found = malloc((sp->num_blobs + 1) * BLOCK_WORDS * sizeof(uint64_t));
+    OSM_Block *bp;
+    int ret = found != NULL ? 1 : -1;
+    while (ret == 1 && (ret = OSM_BlockReader_next(rp, &bp)) == 1) {
+        header[0] += bp->num_nodes;
+        header[1] += bp->num_ways;
+        if (header[2] < sp->num_blobs &&
+            (holds_any(jp->ids[0], jp->counts[0], bp->node_ids, bp->num_nodes) ||
+             holds_any(jp->ids[1], jp->counts[1], bp->way_ids, bp->num_ways))) {
+            uint64_t *fp = &found[BLOCK_WORDS * header[2]++];
+            fp[0] = bp->offset;
+            fp[1] = bp->num_nodes;
+            fp[2] = bp->num_ways;
+            fp[3] = bp->num_ways > 0 ? bp->way_ref_start[bp->num_ways] : 0;
+        }
+        OSM_Block_free(bp);
+    }
+    OSM_BlockReader_close(rp);
+    size_t words = BLOCK_WORDS * header[2];
+    if (ret == 0 && (fwrite(header, sizeof(uint64_t), 3, out) != 3 ||
+                     fwrite(found, sizeof(uint64_t), words, out) != words))
+        ret = -1;
+    free(found);
+    return ret;
+}
+
+static int gather_results(void *arg, int shard, const void *data, size_t len) {
+    LoadJob *jp = arg;
+    (void)shard;
+    if (jp->size + len > jp->cap) {
+        size_t new_cap = jp->cap ? 2 * jp->cap : 4096;
+        while (new_cap < jp->size + len)
+            new_cap *= 2;
+        uint64_t *p = realloc(jp->results, new_cap);
+        if (p == NULL) return -1;
+        jp->results = p;
+        jp->cap = new_cap;
+    }
+    memcpy((char *)jp->results + jp->size, data, len);
+    jp->size += len;
+    return 0;
+}
+
+/* Add the block at an offset of the input to a map */
+
+static int add_block_at(OSM_Map *mp, FILE *in, uint64_t offset, const OSM_Options *op) {
+    OSM_Block *bp = OSM_read_Block_at(in, offset, op);
+    if (bp == NULL) {
+        fprintf(stderr, "Cannot read the block at offset %lu\n", (unsigned long)offset);
+        return -1;
+    }
+    int ret = OSM_Map_add_Block(mp, bp);
+    OSM_Block_free(bp);
+    return ret;
+}
+
+/**
+ * @brief  Load the blocks of a file that hold specified ids, and its
+ * header, with worker processes that each scan a range of the file.
+ * @details  The workers also count the nodes and ways of the whole file,
+ * as they are stored, and split the threads of the options between them.
+ * The blocks they find are then decoded by the caller.
+ *
+ * @param path  The input file, which must be seekable.
+ * @param num_shards  The number of worker processes.
+ * @param node_ids  The ids of the nodes to be found.
+ * @param num_nodes  The number of node ids.
+ * @param way_ids  The ids of the ways to be found.
+ * @param num_ways  The number of way ids.
+ * @param sp  The statistics structure to be filled in, with the counts.
+ * @param op  The options, or NULL for the defaults set by OSM_Options_init().
+ * @return  The map, or NULL in case of an error.
+ */
+
+OSM_Map *OSM_Shards_load(const char *path, int num_shards, const OSM_Id *node_ids, size_t num_nodes,
+                         const OSM_Id *way_ids, size_t num_ways, OSM_ShardStats *sp,
+                         const OSM_Options *op) {
+    OSM_Options defaults;
+    if (op == NULL) {
+        OSM_Options_init(&defaults);
+        op = &defaults;
+    }
+    memset(sp, 0, sizeof(OSM_ShardStats));
+    FILE *in = fopen(path, "rb");
+    if (in == NULL) {
+        fprintf(stderr, "Cannot read the input file %s\n", path);
+        return NULL;
+    }
+    OSM_Shard *shards = NULL;
+    uint64_t header_offset;
+    int n = OSM_Shards_plan(in, num_shards, &shards, &header_offset);
+    if (n < 0) {
+        fclose(in);
+        return NULL;
+    }
+
+    LoadJob job;
+    memset(&job, 0, sizeof(LoadJob));
+    const OSM_Id *ids[2] = { node_ids, way_ids };
+    size_t counts[2] = { num_nodes, num_ways };
+    int ret = 0;
+    for (int k = 0; k < 2 && ret == 0; k++) {
+        job.counts[k] = counts[k];
+        if ((job.ids[k] = malloc((counts[k] + 1) * sizeof(OSM_Id))) == NULL) {
+            ret = -1;
+            break;
+        }
+        if (counts[k] > 0) {
+            memcpy(job.ids[k], ids[k], counts[k] * sizeof(OSM_Id));
+            qsort(job.ids[k], counts[k], sizeof(OSM_Id), compare_ids);
+        }
+    }
+    job.opts = *op;
+    job.opts.types = OSM_TYPE_NODE | OSM_TYPE_WAY;
+    job.opts.tags = 0;
+    job.opts.metadata = 0;
+    job.opts.history = 0;
+    job.opts.threads = n > 0 && op->threads / n > 1 ? op->threads / n : 1;
+    if (ret == 0)
+        ret = OSM_Shards_run(path, shards, n, scan_shard, gather_results, &job);
+
+    /*
+     * The results are, for each range in order, the two counts and the number
+     * of blocks found, then those blocks.  The counts of the blocks size the
+     * map before any of them is decoded.
+     */
+    size_t pos = 0, words = job.size / sizeof(uint64_t), totals[3] = { 0, 0, 0 };
+    for (int s = 0; s < n && ret == 0; s++) {
+        if (pos + 3 > words || job.results[pos + 2] > (words - pos - 3) / BLOCK_WORDS) {
+            ret = -1;
+            break;
+        }
+        sp->num_nodes += job.results[pos];
+        sp->num_ways += job.results[pos + 1];
+        size_t num_blocks = job.results[pos + 2];
+        pos += 3;
+        for (size_t b = 0; b < num_blocks; b++, pos += BLOCK_WORDS) {
+            for (int k = 0; k < 3; k++)
+                totals[k] += job.results[pos + 1 + k];
+        }
+        sp->num_blocks += num_blocks;
+    }
+    OSM_Map *map = ret == 0 ? OSM_Map_create(op) : NULL;
+    if (map != NULL &&
+        OSM_Map_reserve(map, op->types & OSM_TYPE_NODE ? totals[0] : 0,
+                        op->types & OSM_TYPE_WAY ? totals[1] : 0,
+                        op->types & OSM_TYPE_WAY ? totals[2] : 0) != 0)
+        ret = -1;
+    if (map != NULL && header_offset != UINT64_MAX && add_block_at(map, in, header_offset, op) != 0)
+        ret = -1;
+    pos = 0;
+    for (int s = 0; s < n && map != NULL && ret == 0; s++) {
+        size_t num_blocks = job.results[pos + 2];
+        pos += 3;
+        for (size_t b = 0; b < num_blocks && ret == 0; b++, pos += BLOCK_WORDS)
+            ret = add_block_at(map, in, job.results[pos], op);
+    }
+    if (map != NULL && (ret != 0 || OSM_Map_finish(map, op) != 0)) {
+        OSM_Map_free(map);
+        map = NULL;
+    }
+    sp->num_shards = n;
+    for (int s = 0; s < n; s++)
+        sp->num_blobs += shards[s].num_blobs;
+    free(job.ids[0]);
+    free(job.ids[1]);
+    free(job.results);
+    free(shards);
+    fclose(in);
+    return map;
+}
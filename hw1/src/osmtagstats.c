@@ -0,0 +1,650 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "osmtagstats.h"
+#include "osmblock.h"
+#include "osmshard.h"
+#include "strpool.h"
+#include "debug.h"
+
+#define HLL_REGISTERS   (1 << OSM_TAGSTATS_HLL_BITS)
+
+/*
+ * A Space-Saving counter.  The value is owned by the counter and the hash
+ * is compared before it.
+ */
+
+typedef struct Counter {
+    char *value;
+    uint64_t hash;
+    uint64_t count;
+    uint64_t error;
+} Counter;
+
+typedef struct KeySketch {
+    uint64_t count;
+    uint8_t *registers;         // HyperLogLog, HLL_REGISTERS of them
+    Counter counters[OSM_TAGSTATS_COUNTERS];
+    int num_counters;
+} KeySketch;
+
+/*
+ * The sketches of one thread, indexed by the id of the key in its own
+ * string pool.
+ */
+
+typedef struct Sketch {
+    SP_Pool *keys;
+    KeySketch *sketches;
+    size_t cap;
+    int error;
+} Sketch;
+
+typedef struct StatsJob {
+    OSM_BlockReader *reader;
+    pthread_mutex_t lock;
+    int done;
+} StatsJob;
+
+typedef struct ThreadArg {
+    StatsJob *job;
+    Sketch sketch;
+} ThreadArg;
+
+struct OSM_TagStats {
+    Sketch merged;
+    OSM_KeyStats *keys;
+    size_t num_keys;
+};
+
+static uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static uint64_t hash_string(const char *str, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)str[i];
+        h *= 0x100000001b3ULL;
+    }
+    return mix64(h);
+}
+
+static void free_sketch(Sketch *sp) {
+    for (size_t i = 0; i < sp->cap; i++) {
+        free(sp->sketches[i].registers);
+        for (int c = 0; c < sp->sketches[i].num_counters; c++)
+            free(sp->sketches[i].counters[c].value);
+    }
+    free(sp->sketches);
+    SP_free(sp->keys);
+}
+
+/*
+ * Find the id of the sketch of a key, adding the sketch if it is not there
+ * yet.  Returns SP_NONE in case of an error.
+ */
+
+static uint32_t key_sketch(Sketch *sp, const char *key, size_t len) {
+    uint32_t id = SP_intern(sp->keys, key, len);
+    if (id == SP_NONE) return SP_NONE;
+    if (id >= sp->cap) {
+        size_t cap = sp->cap ? 2 * sp->cap : 256;
+        while (cap <= id) cap *= 2;
+        KeySketch *sketches = realloc(sp->sketches, cap * sizeof(KeySketch));
+        if (sketches == NULL) return SP_NONE;
+        memset(sketches + sp->cap, 0, (cap - sp->cap) * sizeof(KeySketch));
+        sp->sketches = sketches;
+        sp->cap = cap;
+    }
+    KeySketch *kp = &sp->sketches[id];
+    if (kp->registers == NULL && (kp->registers = calloc(HLL_REGISTERS, 1)) == NULL)
+        return SP_NONE;
+    return id;
+}
+
+static void hll_add(uint8_t *registers, uint64_t hash) {
+    uint64_t rest = hash << OSM_TAGSTATS_HLL_BITS;
+    uint8_t rank = rest ? __builtin_clzll(rest) + 1 : 64 - OSM_TAGSTATS_HLL_BITS + 1;
+    uint8_t *rp = &registers[hash >> (64 - OSM_TAGSTATS_HLL_BITS)];
+    if (rank > *rp) *rp = rank;
+}
+
+static double hll_estimate(const uint8_t *registers) {
+    double m = HLL_REGISTERS, sum = 0;
+    int zeros = 0;
+    for (int j = 0; j < HLL_REGISTERS; j++) {
+        sum += ldexp(1, -registers[j]);
+        zeros += registers[j] == 0;
+    }
+    double e = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+    if (e <= 2.5 * m && zeros > 0)
+        e = m * log(m / zeros);
+    return e;
+}
+
+/*
+ * Count one occurrence of a value in the Space-Saving counters of a key,
+ * taking over the smallest counter if the value has none and all are used.
+ */
+
+static int count_value(KeySketch *kp, const char *value, size_t len, uint64_t hash) {
+    int min = 0;
+    for (int c = 0; c < kp->num_counters; c++) {
+        Counter *cp = &kp->counters[c];
+        if (cp->hash == hash && strlen(cp->value) == len && memcmp(cp->value, value, len) == 0) {
+            cp->count++;
+            return 0;
+        }
+        if (cp->count < kp->counters[min].count)
+            min = c;
+    }
+    char *copy = strndup(value, len);
+    if (copy == NULL) return -1;
+    if (kp->num_counters < OSM_TAGSTATS_COUNTERS) {
+        kp->counters[kp->num_counters++] = (Counter){ copy, hash, 1, 0 };
+    } else {
+        Counter *cp = &kp->counters[min];
+        free(cp->value);
+        *cp = (Counter){ copy, hash, cp->count + 1, cp->count };
+    }
+    return 0;
+}
+
+/*
+ * Add the tags of one type of entity in a block to a sketch.  The sketch
+ * id of each key (plus one, so that zero is unset) and the hash of each
+ * value are looked up once per string of the block's string table.
+ */
+
+static int sketch_tags(Sketch *sp, OSM_Block *bp, const OSM_BlockTags *tp,
+                       uint32_t *key_ids, uint64_t *value_hashes) {
+    for (int i = 0; i < tp->count; i++) {
+        uint32_t k = tp->keys[i], v = tp->vals[i];
+        if (k >= (uint32_t)bp->num_strings || v >= (uint32_t)bp->num_strings)
+            continue;
+        if (key_ids[k] == 0) {
+            uint32_t id = key_sketch(sp, bp->strings[k], bp->string_lens[k]);
+            if (id == SP_NONE) return -1;
+            key_ids[k] = id + 1;
+        }
+        if (value_hashes[v] == 0)
+            value_hashes[v] = hash_string(bp->strings[v], bp->string_lens[v]) | 1;
+        KeySketch *kp = &sp->sketches[key_ids[k] - 1];
+        kp->count++;
+        hll_add(kp->registers, value_hashes[v]);
+        if (count_value(kp, bp->strings[v], bp->string_lens[v], value_hashes[v]))
+            return -1;
+    }
+    return 0;
+}
+
+static int sketch_block(Sketch *sp, OSM_Block *bp) {
+    uint32_t *key_ids = calloc(bp->num_strings + 1, sizeof(uint32_t));
+    uint64_t *value_hashes = calloc(bp->num_strings + 1, sizeof(uint64_t));
+    int ret = -1;
+    if (key_ids != NULL && value_hashes != NULL &&
+        sketch_tags(sp, bp, &bp->node_tags, key_ids, value_hashes) == 0 &&
+        sketch_tags(sp, bp, &bp->way_tags, key_ids, value_hashes) == 0)
+        ret = 0;
+    free(key_ids);
+    free(value_hashes);
+    return ret;
+}
+
+static void *stats_worker(void *arg) {
+    ThreadArg *ap = arg;
+    StatsJob *jp = ap->job;
+    for (;;) {
+        OSM_Block *bp = NULL;
+        pthread_mutex_lock(&jp->lock);
+        int ret = jp->done ? 0 : OSM_BlockReader_next(jp->reader, &bp);
+        if (ret != 1) jp->done = 1;
+        pthread_mutex_unlock(&jp->lock);
+        if (ret < 0) ap->sketch.error = 1;
+        if (ret != 1) break;
+
+        int error = sketch_block(&ap->sketch, bp);
+        OSM_Block_free(bp);
+        if (error) {
+            ap->sketch.error = 1;
+            pthread_mutex_lock(&jp->lock);
+            jp->done = 1;
+            pthread_mutex_unlock(&jp->lock);
+            break;
+        }
+    }
+    return NULL;
+}
+
+static int compare_counters(const void *a, const void *b) {
+    const Counter *x = a, *y = b;
+    if (x->count != y->count) return x->count < y->count ? 1 : -1;
+    return strcmp(x->value, y->value);
+}
+
+static uint64_t min_count(const KeySketch *kp) {
+    if (kp->num_counters < OSM_TAGSTATS_COUNTERS) return 0;
+    uint64_t min = UINT64_MAX;
+    for (int c = 0; c < kp->num_counters; c++) {
+        if (kp->counters[c].count < min)
+            min = kp->counters[c].count;
+    }
+    return min;
+}
+
+/*
+ * Merge the Space-Saving counters of src into dst.  A value missing from
+ * a full summary may have occurred as often as its smallest counter, which
+ * is added to both its count and its error; of the union, the largest
+ * counts are kept.  The values of src are taken over or freed.
+ */
+
+static void merge_counters(KeySketch *dst, KeySketch *src) {
+    Counter all[2 * OSM_TAGSTATS_COUNTERS];
+    uint64_t min_dst = min_count(dst), min_src = min_count(src);
+    int n = 0;
+    for (int c = 0; c < dst->num_counters; c++) {
+        all[n] = dst->counters[c];
+        all[n].count += min_src;
+        all[n++].error += min_src;
+    }
+    for (int s = 0; s < src->num_counters; s++) {
+        Counter *sp = &src->counters[s];
+        int c;
+        for (c = 0; c < dst->num_counters; c++) {
+            if (all[c].hash == sp->hash && strcmp(all[c].value, sp->value) == 0)
+                break;
+        }
+        if (c < dst->num_counters) {
+            all[c].count += sp->count - min_src;
+            all[c].error += sp->error - min_src;
+            free(sp->value);
+        } else {
+            all[n] = *sp;
+            all[n].count += min_dst;
+            all[n++].error += min_dst;
+        }
+    }
+    src->num_counters = 0;
+    qsort(all, n, sizeof(Counter), compare_counters);
+    dst->num_counters = n < OSM_TAGSTATS_COUNTERS ? n : OSM_TAGSTATS_COUNTERS;
+    memcpy(dst->counters, all, dst->num_counters * sizeof(Counter));
+    for (int c = dst->num_counters; c < n; c++)
+        free(all[c].value);
+}
+
+static int merge_sketch(Sketch *dst, Sketch *src) {
+    size_t num_keys = SP_count(src->keys);
+    for (uint32_t id = 0; id < num_keys && id < src->cap; id++) {
+        KeySketch *sp = &src->sketches[id];
+        if (sp->registers == NULL) continue;
+        char *key = SP_get(src->keys, id);
+        uint32_t dst_id = key_sketch(dst, key, strlen(key));
+        if (dst_id == SP_NONE) return -1;
+        KeySketch *dp = &dst->sketches[dst_id];
+        dp->count += sp->count;
+        for (int j = 0; j < HLL_REGISTERS; j++) {
+            if (sp->registers[j] > dp->registers[j])
+                dp->registers[j] = sp->registers[j];
+        }
+        merge_counters(dp, sp);
+    }
+    return 0;
+}
+
+static int compare_key_stats(const void *a, const void *b) {
+    const OSM_KeyStats *x = a, *y = b;
+    if (x->count != y->count) return x->count < y->count ? 1 : -1;
+    return strcmp(x->key, y->key);
+}
+
+/*
+ * Fill in the key statistics of a merged sketch, most frequent key first.
+ */
+
+static int summarize(OSM_TagStats *ts) {
+    Sketch *sp = &ts->merged;
+    size_t num_keys = SP_count(sp->keys);
+    ts->keys = calloc(num_keys + 1, sizeof(OSM_KeyStats));
+    if (ts->keys == NULL) return -1;
+    for (uint32_t id = 0; id < num_keys && id < sp->cap; id++) {
+        KeySketch *kp = &sp->sketches[id];
+        if (kp->registers == NULL) continue;
+        OSM_KeyStats *ks = &ts->keys[ts->num_keys++];
+        ks->key = SP_get(sp->keys, id);
+        ks->count = kp->count;
+        ks->distinct_values = hll_estimate(kp->registers);
+        qsort(kp->counters, kp->num_counters, sizeof(Counter), compare_counters);
+        for (int c = 0; c < kp->num_counters && c < OSM_TAGSTATS_TOP_VALUES; c++) {
+            ks->top[c] = (OSM_ValueCount){ kp->counters[c].value, kp->counters[c].count,
+                                           kp->counters[c].error };
+            ks->num_top++;
+        }
+    }
+    qsort(ts->keys, ts->num_keys, sizeof(OSM_KeyStats), compare_key_stats);
+    return 0;
+}
+
+/* The options of the reader of the blocks of a computation */
+
+static void stats_options(OSM_Options *opts, const OSM_Options *op) {
+    OSM_Options_init(opts);
+    if (op != NULL) {
+        opts->threads = op->threads;
+        opts->cache_blocks = op->cache_blocks;
+        opts->types = op->types;
+    }
+    opts->types &= OSM_TYPE_NODE | OSM_TYPE_WAY;
+    opts->tags = 1;
+    opts->metadata = 0;
+}
+
+/*
+ * Sketch the tags of the blocks of a reader into an empty sketch, with as
+ * many threads as the options ask for.  Returns 0 if successful.
+ */
+
+static int sketch_reader(OSM_BlockReader *rp, int num_threads, Sketch *sp) {
+    ThreadArg *args = calloc(num_threads, sizeof(ThreadArg));
+    StatsJob job = { rp, PTHREAD_MUTEX_INITIALIZER, 0 };
+    int error = args == NULL;
+    for (int t = 0; t < num_threads && !error; t++) {
+        args[t].job = &job;
+        if ((args[t].sketch.keys = SP_create()) == NULL)
+            error = 1;
+    }
+
+    if (!error) {
+        pthread_t threads[num_threads];
+        int started = 0;
+        for (int t = 1; t < num_threads; t++) {
+            if (pthread_create(&threads[t], NULL, stats_worker, &args[t]) != 0)
+                break;
+            started++;
+        }
+        stats_worker(&args[0]);
+        for (int t = 1; t <= started; t++)
+            pthread_join(threads[t], NULL);
+        for (int t = 0; t <= started; t++)
+            error |= args[t].sketch.error;
+        for (int t = 1; t <= started && !error; t++)
+            error = merge_sketch(&args[0].sketch, &args[t].sketch) != 0;
+    }
+    pthread_mutex_destroy(&job.lock);
+
+    if (!error) {
+        *sp = args[0].sketch;
+        args[0].sketch = (Sketch){ 0 };
+    }
+    for (int t = 0; args != NULL && t < num_threads; t++) {
+        if (args[t].sketch.keys != NULL)
+            free_sketch(&args[t].sketch);
+    }
+    free(args);
+    return error ? -1 : 0;
+}
+
+/* Summarize a sketch taken over by new statistics, or free it on error */
+
+static OSM_TagStats *finish_stats(Sketch *sp, int error) {
+    OSM_TagStats *ts = error ? NULL : calloc(1, sizeof(OSM_TagStats));
+    if (ts == NULL) {
+        if (sp->keys != NULL)
+            free_sketch(sp);
+        return NULL;
+    }
+    ts->merged = *sp;
+    if (summarize(ts) != 0) {
+        OSM_TagStats_free(ts);
+        return NULL;
+    }
+    return ts;
+}
+
+/**
+ * @brief  Compute the tag statistics of an OSM PBF input stream.
+ * @details  The blocks are decoded as by OSM_BlockReader, and as many
+ * threads as the threads option asks for each sketch the tags of the
+ * blocks they take, so the input may be a pipe.  Only nodes and ways are
+ * read, and only those of the types that the options select.
+ *
+ * @param in  The input stream.
+ * @param op  The options, or NULL for the defaults set by OSM_Options_init().
+ * @return  The statistics, to be freed with OSM_TagStats_free(), or NULL in
+ * case of an error.
+ */
+
+OSM_TagStats *OSM_TagStats_compute(FILE *in, const OSM_Options *op) {
+    OSM_Options opts;
+    stats_options(&opts, op);
+    Sketch sketch = { 0 };
+    OSM_BlockReader *rp = OSM_BlockReader_open(in, &opts);
+    int error = rp == NULL || sketch_reader(rp, opts.threads > 1 ? opts.threads : 1, &sketch) != 0;
+    if (rp != NULL)
+        OSM_BlockReader_close(rp);
+    return finish_stats(&sketch, error);
+}
+
+/*
+ * A sharded computation.  Each worker writes the sketch of its range, key
+ * by key: the length and bytes of the key, its count, its registers, and
+ * its number of counters, each with the length and bytes of its value, its
+ * hash, count and error.  The parent holds the bytes of one worker until
+ * the next begins, and merges its sketch as the threads' are merged.
+ */
+
+typedef struct ShardStats {
+    OSM_Options opts;           // Options of the workers
+    Sketch merged;
+    char *bytes;                // Sketch of the current worker so far
+    size_t size;
+    size_t cap;
+    int shard;                  // Range of those bytes, or -1
+} ShardStats;
+
+static int write_string(FILE *out, const char *str) {
+    uint32_t len = strlen(str);
+    return fwrite(&len, sizeof(len), 1, out) == 1 && fwrite(str, 1, len, out) == len ? 0 : -1;
+}
+
+static int write_sketch(const Sketch *sp, FILE *out) {
+    size_t num_keys = SP_count(sp->keys);
+    for (uint32_t id = 0; id < num_keys && id < sp->cap; id++) {
+        const KeySketch *kp = &sp->sketches[id];
+        if (kp->registers == NULL) continue;
+        uint32_t num_counters = kp->num_counters;
+        if (write_string(out, SP_get(sp->keys, id)) != 0 ||
+            fwrite(&kp->count, sizeof(uint64_t), 1, out) != 1 ||
+            fwrite(kp->registers, 1, HLL_REGISTERS, out) != HLL_REGISTERS ||
+            fwrite(&num_counters, sizeof(num_counters), 1, out) != 1)
+            return -1;
+        for (int c = 0; c < kp->num_counters; c++) {
+            const Counter *cp = &kp->counters[c];
+            if (write_string(out, cp->value) != 0 ||
+                fwrite(&cp->hash, sizeof(uint64_t), 1, out) != 1 ||
+                fwrite(&cp->count, sizeof(uint64_t), 1, out) != 1 ||
+                fwrite(&cp->error, sizeof(uint64_t), 1, out) != 1)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+static int sketch_shard(void *arg, FILE *in, const OSM_Shard *shp, FILE *out) {
+    ShardStats *xp = arg;
+    Sketch sketch = { 0 };
+    OSM_BlockReader *rp = OSM_BlockReader_open_range(in, shp->start, shp->end, &xp->opts);
+    int ret = rp == NULL || sketch_reader(rp, xp->opts.threads, &sketch) != 0 ||
+              write_sketch(&sketch, out) != 0 ? -1 : 0;
+    if (rp != NULL)
+        OSM_BlockReader_close(rp);
+    if (sketch.keys != NULL)
+        free_sketch(&sketch);
+    return ret;
+}
+
+/* Take len bytes at *pos of the bytes of a worker, or fail if they are not all there */
+
+static const char *take(const ShardStats *xp, size_t *pos, size_t len) {
+    if (len > xp->size - *pos) return NULL;
+    const char *p = xp->bytes + *pos;
+    *pos += len;
+    return p;
+}
+
+static int take_u64(const ShardStats *xp, size_t *pos, uint64_t *vp) {
+    const char *p = take(xp, pos, sizeof(uint64_t));
+    if (p == NULL) return -1;
+    memcpy(vp, p, sizeof(uint64_t));
+    return 0;
+}
+
+static const char *take_string(const ShardStats *xp, size_t *pos, uint32_t *lenp) {
+    const char *p = take(xp, pos, sizeof(uint32_t));
+    if (p == NULL) return NULL;
+    memcpy(lenp, p, sizeof(uint32_t));
+    return take(xp, pos, *lenp);
+}
+
+/* Merge the sketch of the worker whose bytes are held */
+
+static int merge_bytes(ShardStats *xp) {
+    size_t pos = 0;
+    while (pos < xp->size) {
+        uint32_t len, num_counters;
+        const char *key = take_string(xp, &pos, &len);
+        if (key == NULL) return -1;
+        uint32_t id = key_sketch(&xp->merged, key, len);
+        if (id == SP_NONE) return -1;
+        KeySketch src = { 0 };
+        const char *registers, *np;
+        if (take_u64(xp, &pos, &src.count) != 0 ||
+            (registers = take(xp, &pos, HLL_REGISTERS)) == NULL ||
+            (np = take(xp, &pos, sizeof(num_counters))) == NULL)
+            return -1;
+        memcpy(&num_counters, np, sizeof(num_counters));
+        if (num_counters > OSM_TAGSTATS_COUNTERS) return -1;
+        int error = 0;
+        for (uint32_t c = 0; c < num_counters && !error; c++) {
+            Counter *cp = &src.counters[c];
+            const char *value = take_string(xp, &pos, &len);
+            error = value == NULL || take_u64(xp, &pos, &cp->hash) != 0 ||
+                    take_u64(xp, &pos, &cp->count) != 0 || take_u64(xp, &pos, &cp->error) != 0 ||
+                    (cp->value = strndup(value, len)) == NULL;
+            src.num_counters += cp->value != NULL;
+        }
+        if (error) {
+            for (int c = 0; c < src.num_counters; c++)
+                free(src.counters[c].value);
+            return -1;
+        }
+        KeySketch *dp = &xp->merged.sketches[id];
+        dp->count += src.count;
+        for (int j = 0; j < HLL_REGISTERS; j++) {
+            if ((uint8_t)registers[j] > dp->registers[j])
+                dp->registers[j] = registers[j];
+        }
+        merge_counters(dp, &src);
+    }
+    xp->size = 0;
+    return 0;
+}
+
+static int gather_sketch(void *arg, int shard, const void *data, size_t len) {
+    ShardStats *xp = arg;
+    if (shard != xp->shard && xp->shard >= 0 && merge_bytes(xp) != 0)
+        return -1;
+    xp->shard = shard;
+    if (xp->size + len > xp->cap) {
+        size_t cap = xp->cap ? 2 * xp->cap : 64 * 1024;
+        while (cap < xp->size + len)
+            cap *= 2;
+        char *bytes = realloc(xp->bytes, cap);
+        if (bytes == NULL) return -1;
+        xp->bytes = bytes;
+        xp->cap = cap;
+    }
+    memcpy(xp->bytes + xp->size, data, len);
+    xp->size += len;
+    return 0;
+}
+
+/**
+ * @brief  Compute the tag statistics of an OSM PBF file as
+ * OSM_TagStats_compute() does, with worker processes that each sketch a
+ * range of the file.
+ * @details  The workers send their sketches to the parent, which merges
+ * them as the sketches of the threads are merged, so the counts of the
+ * keys are the same as without workers, and the estimates within the
+ * same bounds.
+ *
+ * @param path  The input file, which must be seekable.
+ * @param num_shards  The number of worker processes, which split the
+ * threads of the options between them.
+ * @param op  The options, or NULL for the defaults set by OSM_Options_init().
+ * @return  The statistics, to be freed with OSM_TagStats_free(), or NULL in
+ * case of an error.
+ */
+
+OSM_TagStats *OSM_TagStats_compute_shards(const char *path, int num_shards, const OSM_Options *op) {
+    FILE *in = fopen(path, "rb");
+    if (in == NULL) {
+        fprintf(stderr, "Cannot read the input file %s\n", path);
+        return NULL;
+    }
+    OSM_Shard *shards = NULL;
+    uint64_t header_offset;
+    int n = OSM_Shards_plan(in, num_shards, &shards, &header_offset);
+    fclose(in);
+    if (n < 0)
+        return NULL;
+    ShardStats x;
+    memset(&x, 0, sizeof(ShardStats));
+    x.shard = -1;
+    stats_options(&x.opts, op);
+    x.opts.threads = n > 0 && x.opts.threads / n > 1 ? x.opts.threads / n : 1;
+
+    int error = (x.merged.keys = SP_create()) == NULL ||
+                OSM_Shards_run(path, shards, n, sketch_shard, gather_sketch, &x) != 0 ||
+                merge_bytes(&x) != 0;
+    free(x.bytes);
+    free(shards);
+    return finish_stats(&x.merged, error);
+}
+
+/**
+ * @brief  Get the statistics of each key, in decreasing order of the
+ * number of tags with the key.
+ *
+ * @param ts  The tag statistics.
+ * @param num_keysp  Set to the number of keys.
+ * @return  The statistics of the keys, which remain valid until
+ * OSM_TagStats_free().
+ */
+
+const OSM_KeyStats *OSM_TagStats_get_keys(OSM_TagStats *ts, size_t *num_keysp) {
+    *num_keysp = ts->num_keys;
+    return ts->keys;
+}
+
+/**
+ * @brief  Free tag statistics returned by OSM_TagStats_compute().
+ */
+
+void OSM_TagStats_free(OSM_TagStats *ts) {
+    if (ts == NULL) return;
+    if (ts->merged.keys != NULL)
+        free_sketch(&ts->merged);
+    free(ts->keys);
+    free(ts);
+}
@@ -1,10 +1,32 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <inttypes.h>
+#include <time.h>
+#include <math.h>
+#include <unistd.h>
+#include <errno.h>
 
 #include "global.h"
+#include "cli.h"
 #include "osm.h"
+#include "osmpbf.h"
+#include "osmfilter.h"
+#include "osmdiff.h"
+#include "osmindex.h"
+#include "osmsample.h"
+#include "osmtagstats.h"
+#include "osmcomponents.h"
+#include "osmrender.h"
+#include "osmgeojson.h"
+#include "osmpgcopy.h"
+#include "osmflatgeobuf.h"
+#include "osmcache.h"
+#include "osmlive.h"
+#include "osmdelta.h"
+#include "osmshard.h"
+#include "osmrefs.h"
 #include "debug.h"
 
 /* Variable to be set by process_args if the '-h' flag is seen. */
@@ -13,6 +35,1013 @@ int help_requested = 0;
 /* Variable to be set by process_args to any filename specified with '-f'. */
 char *osm_input_file = NULL;
 
+/* Every file specified with '-f', to be merged into one map. */
+char **osm_input_files = NULL;
+int osm_num_input_files = 0;
+
+/* Files to compare, which main() does before any other query. */
+char *osm_diff_old = NULL;
+char *osm_diff_new = NULL;
+int osm_diff_summary = 0;
+
+/* Variable to be set by process_args if the '-v' flag is seen. */
+int osm_verbose = 0;
+
+/* Whether to answer '-n' and '-w' from the blocks found by the index. */
+int osm_use_index = 0;
+OSM_IndexStats osm_index_stats;
+
+/* Worker processes of '--shards', and the counts they found. */
+int osm_shards = 0;
+OSM_ShardStats osm_shard_stats;
+
+/* Fraction of the blocks that '--sample' decodes for its estimates. */
+double osm_sample_fraction = 0;
+int osm_sample_given = 0;
+
+/* Whether to print the tag statistics of the input instead of loading it. */
+int osm_tag_stats = 0;
+
+/* Whether to check that the nodes the ways refer to are in the input. */
+int osm_check_refs = 0;
+
+/* Where '--render' writes its image, and the size and bbox of the image. */
+char *osm_render_path = NULL;
+OSM_RenderOptions osm_render_opts = { 1024, 1024, 0, 0, 0, 0, 0, 1 };
+
+/* Whether and how to export the input as GeoJSON instead of loading it. */
+int osm_geojson_format = -1;
+int osm_pgcopy;
+char *osm_flatgeobuf_path = NULL;
+char *osm_cache_dir = NULL;
+uint64_t osm_cache_size = OSM_CACHE_DEFAULT_SIZE;
+
+/* Whether to answer queries from stdin, reloading the input when it is replaced. */
+int osm_serve = 0;
+/* Directory of OsmChange files that '--serve' applies on top of the input. */
+char *osm_updates_dir = NULL;
+/* The view of the input and its applied changes that '--updates' queries are answered from. */
+static OSM_DeltaView *overlay;
+
+/* Files that stdout and stderr go to while output is captured for the cache, and their saved descriptors. */
+static FILE *captured[2];
+static int saved_fds[2] = { -1, -1 };
+
+/* Time at which queries are answered, for a history file. */
+int64_t osm_at_time = 0;
+int osm_at_given = 0;
+
+/*
+ * Print a coordinate given in nanodegrees as a decimal number of degrees.
+ */
+
+static void print_degrees(FILE *out, int64_t nanodegrees) {
+    uint64_t abs = nanodegrees < 0 ? -(uint64_t)nanodegrees : (uint64_t)nanodegrees;
+    fprintf(out, "%s%" PRIu64 ".%09" PRIu64, nanodegrees < 0 ? "-" : "",
+            abs / 1000000000, abs % 1000000000);
+}
+
+static int parse_id(char *arg, OSM_Id *idp) {
+    char *end;
+    long long id = strtoll(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0') return -1;
+    *idp = id;
+    return 0;
+}
+
+/*
+ * Parse a UTC time in ISO 8601 format, either YYYY-MM-DDTHH:MM:SSZ or
+ * YYYY-MM-DD, into seconds since the epoch.
+ */
+
+static int parse_time(char *arg, int64_t *timep) {
+    struct tm tm;
+    int len = 0;
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(arg, "%4d-%2d-%2dT%2d:%2d:%2dZ%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+               &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &len) != 6 || arg[len] != '\0') {
+        memset(&tm, 0, sizeof(tm));
+        len = 0;
+        if (sscanf(arg, "%4d-%2d-%2d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &len) != 3 ||
+            arg[len] != '\0')
+            return -1;
+    }
+    if (tm.tm_mon < 1 || tm.tm_mon > 12 || tm.tm_mday < 1 || tm.tm_mday > 31 ||
+        tm.tm_hour > 23 || tm.tm_min > 59 || tm.tm_sec > 60)
+        return -1;
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    *timep = timegm(&tm);
+    return 0;
+}
+
+static OSM_Node *find_node(OSM_Map *mp, OSM_Id id) {
+    if (overlay != NULL)
+        return OSM_DeltaView_find_Node(overlay, id);
+    return osm_at_given ? OSM_Map_find_Node_at(mp, id, osm_at_time) : OSM_Map_find_Node(mp, id);
+}
+
+static OSM_Way *find_way(OSM_Map *mp, OSM_Id id) {
+    if (overlay != NULL)
+        return OSM_DeltaView_find_Way(overlay, id);
+    return osm_at_given ? OSM_Map_find_Way_at(mp, id, osm_at_time) : OSM_Map_find_Way(mp, id);
+}
+
+static int query_node(OSM_Map *mp, OSM_Id id) {
+    OSM_Node *np = find_node(mp, id);
+    if (np == NULL) {
+        fprintf(stderr, "Node %" PRId64 " not found\n", id);
+        return -1;
+    }
+    printf("id: %" PRId64 ", lat: ", OSM_Node_get_id(np));
+    print_degrees(stdout, OSM_Node_get_lat(np));
+    printf(", lon: ");
+    print_degrees(stdout, OSM_Node_get_lon(np));
+    printf("\n");
+    for (int k = 0; k < OSM_Node_get_num_keys(np); k++)
+        printf("%s: %s\n", OSM_Node_get_key(np, k), OSM_Node_get_value(np, k));
+    return 0;
+}
+
+static int query_way(OSM_Map *mp, OSM_Id id, char **keys, int num_keys) {
+    OSM_Way *wp = find_way(mp, id);
+    if (wp == NULL) {
+        fprintf(stderr, "Way %" PRId64 " not found\n", id);
+        return -1;
+    }
+    if (num_keys == 0) {
+        size_t num_refs;
+        const OSM_Id *refs = OSM_Way_refs(wp, &num_refs);
+        for (size_t r = 0; r < num_refs; r++)
+            printf("%s%" PRId64, r ? " " : "", refs[r]);
+        printf("\n");
+        return 0;
+    }
+    for (int i = 0; i < num_keys; i++) {
+        int k;
+        for (k = 0; k < OSM_Way_get_num_keys(wp); k++) {
+            if (strcmp(OSM_Way_get_key(wp, k), keys[i]) == 0) {
+                printf("%s: %s\n", keys[i], OSM_Way_get_value(wp, k));
+                break;
+            }
+        }
+        if (k == OSM_Way_get_num_keys(wp))
+            fprintf(stderr, "Way %" PRId64 " has no key %s\n", id, keys[i]);
+    }
+    return 0;
+}
+
+static void print_features(const char *label, unsigned int features) {
+    printf("%s features:", label);
+    for (int i = 0; i < OSM_NUM_FEATURES; i++) {
+        if (features & (1u << i))
+            printf(" %s", OSM_feature_name(1u << i));
+    }
+    printf("\n");
+}
+
+/*
+ * Print the answer to '-s': the numbers of nodes and ways, or the
+ * statistics of the index, and with '-v' the features of the file.
+ */
+
+static void print_summary(OSM_Map *mp) {
+    if (osm_use_index) {
+        OSM_IndexStats *sp = &osm_index_stats;
+        printf("index blocks: %zu, ids: %zu, filter bytes: %zu, expected false positives: %.4f%%\n",
+               sp->num_blocks, sp->num_ids, sp->filter_bytes, 100 * sp->expected_fpr);
+        printf("lookup probes: %zu, hits: %zu, false positives: %zu\n",
+               sp->probes, sp->hits, sp->false_positives);
+    } else if (overlay != NULL)
+        printf("nodes: %zu, ways: %zu\n", OSM_DeltaView_get_num_nodes(overlay),
+               OSM_DeltaView_get_num_ways(overlay));
+    else if (osm_shards > 0)
+        printf("nodes: %zu, ways: %zu\n", osm_shard_stats.num_nodes, osm_shard_stats.num_ways);
+    else if (osm_at_given)
+        printf("nodes: %zu, ways: %zu\n", OSM_Map_get_num_nodes_at(mp, osm_at_time),
+               OSM_Map_get_num_ways_at(mp, osm_at_time));
+    else
+        printf("nodes: %zu, ways: %zu\n", OSM_Map_get_num_nodes64(mp), OSM_Map_get_num_ways64(mp));
+    if (osm_verbose) {
+        print_features("required", OSM_Map_get_required_features(mp));
+        print_features("optional", OSM_Map_get_optional_features(mp));
+    }
+}
+
+/* Print the answer to '-b', which is empty if the map has no bbox */
+
+static void print_bbox(OSM_Map *mp) {
+    OSM_BBox *bbox = OSM_Map_get_BBox(mp);
+    if (bbox == NULL)
+        return;
+
+    printf("min lon: ");
+    print_degrees(stdout, OSM_BBox_get_min_lon(bbox));
+    printf(", max_lon: ");
+    print_degrees(stdout, OSM_BBox_get_max_lon(bbox));
+    printf(", max_lat: ");
+    print_degrees(stdout, OSM_BBox_get_max_lat(bbox));
+    printf(", min_lat: ");
+    print_degrees(stdout, OSM_BBox_get_min_lat(bbox));
+    printf("\n");
+}
+
+static int print_match(void *arg, unsigned int type, size_t index) {
+    OSM_Map *mp = arg;
+    if (type == OSM_TYPE_NODE)
+        printf("node %" PRId64 "\n", OSM_Node_get_id(OSM_Map_get_Node64(mp, index)));
+    else
+        printf("way %" PRId64 "\n", OSM_Way_get_id(OSM_Map_get_Way64(mp, index)));
+    return 0;
+}
+
+/*
+ * Print the type and id of each node and way selected by a filter
+ * expression.  With mp NULL, only the syntax of the expression is checked.
+ */
+
+static int query_where(OSM_Map *mp, char *expr) {
+    OSM_Filter *fp = OSM_Filter_compile(mp, expr);
+    if (fp == NULL) return -1;
+    if (mp != NULL)
+        OSM_Filter_foreach(fp, OSM_TYPE_NODE | OSM_TYPE_WAY, print_match, mp);
+    OSM_Filter_free(fp);
+    return 0;
+}
+
+/*
+ * Find the connected components of the ways selected by a filter
+ * expression, or of all ways if expr is NULL, and print their sizes or,
+ * if export_ids is set, the component of each way.  With mp NULL, only
+ * the syntax of the expression is checked.
+ */
+
+static int query_components(OSM_Map *mp, char *expr, int export_ids) {
+    OSM_Filter *fp = NULL;
+    if (expr != NULL && (fp = OSM_Filter_compile(mp, expr)) == NULL)
+        return -1;
+    OSM_Components comps;
+    if (mp == NULL || OSM_Map_way_components(mp, fp, sysconf(_SC_NPROCESSORS_ONLN), &comps) != 0) {
+        OSM_Filter_free(fp);
+        return mp == NULL ? 0 : -1;
+    }
+    OSM_Filter_free(fp);
+
+    if (export_ids) {
+        for (size_t w = 0; w < comps.num_ways; w++) {
+            if (comps.way_components[w] != OSM_COMPONENT_NONE)
+                printf("way %" PRId64 ": component %" PRIu32 "\n",
+                       OSM_Way_get_id(OSM_Map_get_Way64(mp, w)), comps.way_components[w]);
+        }
+    } else {
+        printf("components: %zu\n", comps.num_components);
+        for (size_t c = 0; c < comps.num_components; c++)
+            printf("component %zu: %zu ways, %zu nodes\n", c, comps.way_counts[c], comps.node_counts[c]);
+    }
+    OSM_Components_free(&comps);
+    return 0;
+}
+
+/*
+ * Parse a bbox given in degrees as MIN_LON,MIN_LAT,MAX_LON,MAX_LAT.
+ */
+
+static int parse_bbox(char *arg, OSM_RenderOptions *rp) {
+    double v[4];
+    char c;
+    if (sscanf(arg, "%lf,%lf,%lf,%lf%c", &v[0], &v[1], &v[2], &v[3], &c) != 4 ||
+        v[0] >= v[2] || v[1] >= v[3] || v[0] < -180 || v[2] > 180 || v[1] < -90 || v[3] > 90)
+        return -1;
+    rp->min_lon = llround(v[0] * 1e9);
+    rp->min_lat = llround(v[1] * 1e9);
+    rp->max_lon = llround(v[2] * 1e9);
+    rp->max_lat = llround(v[3] * 1e9);
+    rp->has_bbox = 1;
+    return 0;
+}
+
+/*
+ * Render the map to the file given with '--render'.
+ */
+
+static int render_map(OSM_Map *mp) {
+    FILE *out = fopen(osm_render_path, "wb");
+    if (out == NULL) {
+        fprintf(stderr, "Cannot write the image file %s\n", osm_render_path);
+        return -1;
+    }
+    osm_render_opts.threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int ret = OSM_render_png(mp, &osm_render_opts, out);
+    if (fclose(out) != 0)
+        ret = -1;
+    return ret;
+}
+
+/*
+ * Open the input file, or return stdin if there is none, reporting the
+ * failure to open it.
+ */
+
+static FILE *open_input(void) {
+    FILE *in = osm_input_file ? fopen(osm_input_file, "rb") : stdin;
+    if (in == NULL)
+        fprintf(stderr, "Cannot read the input file %s\n", osm_input_file);
+    return in;
+}
+
+static void close_input(FILE *in) {
+    if (in != stdin)
+        fclose(in);
+}
+
+/**
+ * @brief  Compare the files given with '--diff' or '--diff-summary',
+ * writing either an osmChange document or counts of changes to stdout.
+ *
+ * @param op  Options for the comparison.
+ * @return 0 if successful, -1 in case of an error.
+ */
+
+int run_diff(const OSM_Options *op) {
+    OSM_DiffStats stats;
+    if (OSM_diff_files(osm_diff_old, osm_diff_new, op, &stats,
+                       osm_diff_summary ? NULL : stdout) != 0)
+        return -1;
+    if (osm_diff_summary) {
+        const char *names[2] = { "nodes", "ways" };
+        for (int k = 0; k < 2; k++)
+            printf("%s: %zu created, %zu modified, %zu deleted\n", names[k],
+                   stats.created[k], stats.modified[k], stats.deleted[k]);
+    }
+    return 0;
+}
+
+/*
+ * Print an estimate with its 95% interval, or without one if it has none.
+ */
+
+static void print_estimate(const char *name, OSM_Estimate e) {
+    if (isnan(e.half_width))
+        printf("%s: ~%.0f\n", name, e.value);
+    else
+        printf("%s: ~%.0f (95%% CI %.0f - %.0f)\n", name, e.value,
+               e.value - e.half_width > 0 ? e.value - e.half_width : 0, e.value + e.half_width);
+}
+
+/**
+ * @brief  Estimate the counts of the input file for '--sample', from a
+ * sample of its data blocks, and print them.
+ *
+ * @param op  Options for decoding the input, which sampling does not use.
+ * @return 0 if successful, -1 in case of an error.
+ */
+
+int run_sample(const OSM_Options *op) {
+    FILE *in = open_input();
+    if (in == NULL)
+        return -1;
+    OSM_Sample sample;
+    int ret = OSM_sample_file(in, osm_sample_fraction, 1, &sample);
+    close_input(in);
+    if (ret != 0)
+        return -1;
+
+    printf("sampled blocks: %zu of %zu (%" PRIu64 " of %" PRIu64 " bytes)\n",
+           sample.sampled_blocks, sample.num_blocks, sample.sampled_bytes, sample.total_bytes);
+    print_estimate("nodes", sample.nodes);
+    print_estimate("ways", sample.ways);
+    print_estimate("relations", sample.relations);
+    for (size_t i = 0; i < sample.num_keys; i++) {
+        printf("key ");
+        print_estimate(sample.keys[i].key, sample.keys[i].count);
+    }
+    OSM_Sample_free(&sample);
+    return 0;
+}
+
+/**
+ * @brief  Compute the tag statistics of the input file, or of stdin if
+ * there is none, for '--tag-stats', and print them, with worker processes
+ * for '--shards'.
+ *
+ * @param op  Options for decoding the input.
+ * @return 0 if successful, -1 in case of an error.
+ */
+
+int run_tag_stats(const OSM_Options *op) {
+    OSM_TagStats *ts;
+    if (osm_shards > 0) {
+        ts = OSM_TagStats_compute_shards(osm_input_file, osm_shards, op);
+    } else {
+        FILE *in = open_input();
+        if (in == NULL)
+            return -1;
+        ts = OSM_TagStats_compute(in, op);
+        close_input(in);
+    }
+    if (ts == NULL)
+        return -1;
+
+    size_t num_keys;
+    const OSM_KeyStats *keys = OSM_TagStats_get_keys(ts, &num_keys);
+    for (size_t i = 0; i < num_keys; i++) {
+        const OSM_KeyStats *ks = &keys[i];
+        printf("key %s: %" PRIu64 " tags, ~%.0f distinct values\n", ks->key, ks->count,
+               ks->distinct_values);
+        for (int j = 0; j < ks->num_top; j++) {
+            const OSM_ValueCount *vc = &ks->top[j];
+            if (vc->error == 0)
+                printf("    %s: %" PRIu64 "\n", vc->value, vc->count);
+            else
+                printf("    %s: %" PRIu64 " to %" PRIu64 "\n", vc->value,
+                       vc->count - vc->error, vc->count);
+        }
+    }
+    OSM_TagStats_free(ts);
+    return 0;
+}
+
+/**
+ * @brief  Check the refs of the ways of the input file for '--check-refs',
+ * and print the counts and the first missing nodes.
+ *
+ * @param op  Options for decoding the input.
+ * @return 0 if every ref was found and no id was duplicated, 1 if not, and
+ * -1 in case of an error.
+ */
+
+int run_check_refs(const OSM_Options *op) {
+    FILE *in = open_input();
+    if (in == NULL)
+        return -1;
+    OSM_RefCheck check;
+    int ret = OSM_check_refs(in, &check, op);
+    close_input(in);
+    if (ret != 0)
+        return -1;
+
+    printf("nodes: %zu (%zu duplicate ids)\n", check.num_nodes, check.duplicate_nodes);
+    printf("ways: %zu (%zu duplicate ids)\n", check.num_ways, check.duplicate_ways);
+    printf("relations: %zu (%zu duplicate ids)\n", check.num_relations, check.duplicate_relations);
+    printf("refs: %zu, %zu missing in %zu ways\n", check.num_refs, check.missing_refs,
+           check.broken_ways);
+    printf("members: %zu, %zu missing in %zu relations (%zu nodes, %zu ways, %zu relations)\n",
+           check.num_members, check.missing_members, check.broken_relations,
+           check.missing_members_by_type[OSM_MEMBER_NODE], check.missing_members_by_type[OSM_MEMBER_WAY],
+           check.missing_members_by_type[OSM_MEMBER_RELATION]);
+    if (osm_verbose)
+        printf("bitmaps: %zu bytes\n", check.bitmap_bytes);
+    for (int i = 0; i < check.num_samples; i++)
+        printf("missing node %" PRId64 " (way %" PRId64 ")\n", check.samples[i].ref,
+               check.samples[i].way);
+    static const char *member_types[] = { "node", "way", "relation" };
+    for (int i = 0; i < check.num_member_samples; i++)
+        printf("missing member %s %" PRId64 " (relation %" PRId64 ")\n",
+               member_types[check.member_samples[i].type], check.member_samples[i].member,
+               check.member_samples[i].relation);
+    return check.missing_refs > 0 || check.missing_members > 0 || check.duplicate_nodes > 0 ||
+           check.duplicate_ways > 0 || check.duplicate_relations > 0;
+}
+
+/**
+ * @brief  Export the input file, or stdin if there is none, to stdout for
+ * '--geojson' or '--geojsonseq', with worker processes for '--shards'.
+ *
+ * @param op  Options for decoding the input.
+ * @return 0 if successful, -1 in case of an error.
+ */
+
+int run_geojson(const OSM_Options *op) {
+    FILE *in = open_input();
+    if (in == NULL)
+        return -1;
+    int ret = osm_shards > 0 ? OSM_export_geojson_shards(osm_input_file, osm_shards, stdout,
+                                                         osm_geojson_format, op)
+                             : OSM_export_geojson(in, stdout, osm_geojson_format, op);
+    close_input(in);
+    return ret;
+}
+
+/**
+ * @brief  Export the input file, or stdin if there is none, to stdout in
+ * PostgreSQL's binary COPY format for '--pgcopy', with worker processes
+ * for '--shards'.
+ *
+ * @param op  Options for decoding the input.
+ * @return 0 if successful, -1 in case of an error.
+ */
+
+int run_pgcopy(const OSM_Options *op) {
+    FILE *in = open_input();
+    if (in == NULL)
+        return -1;
+    int ret = osm_shards > 0 ? OSM_export_pgcopy_shards(osm_input_file, osm_shards, stdout, op)
+                             : OSM_export_pgcopy(in, stdout, op);
+    close_input(in);
+    return ret;
+}
+
+/**
+ * @brief  Export the input file, or stdin if there is none, to the file
+ * given with '--flatgeobuf'.
+ *
+ * @param op  Options for decoding the input.
+ * @return 0 if successful, -1 in case of an error.
+ */
+
+int run_flatgeobuf(const OSM_Options *op) {
+    FILE *in = open_input();
+    if (in == NULL)
+        return -1;
+    FILE *out = fopen(osm_flatgeobuf_path, "wb");
+    if (out == NULL) {
+        fprintf(stderr, "Cannot write the FlatGeobuf file %s\n", osm_flatgeobuf_path);
+        close_input(in);
+        return -1;
+    }
+    int ret = OSM_export_flatgeobuf(in, out, op);
+    if (fclose(out) != 0)
+        ret = -1;
+    close_input(in);
+    return ret;
+}
+
+/*
+ * Answer a line of queries for '--serve', which are -n, -w, -s and -b as
+ * on the command line, separated by whitespace, and --where, which takes
+ * the rest of the line as its expression.  Stops at the first query that
+ * fails.
+ */
+
+static int serve_queries(OSM_Map *mp, char *line) {
+    size_t len = strlen(line);
+    while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
+        line[--len] = '\0';
+    char **words = malloc((len / 2 + 2) * sizeof(char *));
+    if (words == NULL) return -1;
+    int num_words = 0;
+    for (char *p = line; *(p += strspn(p, " \t")) != '\0'; ) {
+        words[num_words++] = p;
+        p += strcspn(p, " \t");
+        if (*p != '\0')
+            *p++ = '\0';
+        if (strcmp(words[num_words-1], "--where") == 0) {
+            words[num_words++] = p + strspn(p, " \t");
+            break;
+        }
+    }
+
+    int ret = 0;
+    for (int i = 0; i < num_words && ret == 0; i++) {
+        OSM_Id id;
+        if (strcmp(words[i], "-n") == 0 && i+1 < num_words && parse_id(words[i+1], &id) == 0) {
+            ret = query_node(mp, id);
+            i++;
+        } else if (strcmp(words[i], "-w") == 0 && i+1 < num_words && parse_id(words[i+1], &id) == 0) {
+            int num_keys = 0;
+            while (i+2+num_keys < num_words && words[i+2+num_keys][0] != '-')
+                num_keys++;
+            ret = query_way(mp, id, &words[i+2], num_keys);
+            i += 1 + num_keys;
+        } else if (strcmp(words[i], "-s") == 0) {
+            print_summary(mp);
+        } else if (strcmp(words[i], "-b") == 0) {
+            print_bbox(mp);
+        } else if (strcmp(words[i], "--where") == 0 && i+1 < num_words && words[i+1][0] != '\0' &&
+                   overlay == NULL) {
+            ret = query_where(mp, words[++i]);
+        } else {
+            fprintf(stderr, "Cannot serve the query %s\n", words[i]);
+            ret = -1;
+        }
+    }
+    free(words);
+    return ret;
+}
+
+/*
+ * Answer '--serve' queries against the input and the changes applied from
+ * the directory of '--updates', which is watched for new change files.
+ */
+
+static int serve_updates(const OSM_Options *op) {
+    FILE *in = open_input();
+    if (in == NULL)
+        return -1;
+    OSM_Map *base = OSM_read_Map_opts(in, op);
+    close_input(in);
+    if (base == NULL) {
+        fprintf(stderr, "Cannot read the map!\n");
+        return -1;
+    }
+    OSM_Delta *dp = OSM_Delta_create(base, 1, op);
+    if (dp == NULL) {
+        OSM_Map_free(base);
+        return -1;
+    }
+    if (OSM_Delta_watch_dir(dp, osm_updates_dir) != 0) {
+        OSM_Delta_free(dp);
+        return -1;
+    }
+    char *line = NULL;
+    size_t cap = 0;
+    while (getline(&line, &cap, stdin) >= 0) {
+        overlay = OSM_Delta_enter(dp, 0);
+        serve_queries(OSM_DeltaView_get_base(overlay), line);
+        overlay = NULL;
+        OSM_Delta_leave(dp, 0);
+        printf("\n");
+        fflush(stdout);
+    }
+    free(line);
+    OSM_Delta_free(dp);
+    return 0;
+}
+
+/**
+ * @brief  Answer lines of queries read from stdin until its end, for
+ * '--serve', against the map of the input file, which is reloaded in the
+ * background whenever the file is replaced, or with '--updates', kept
+ * current from the change files of a directory.
+ * @details  Each line is answered against a single map, even if a reload
+ * or a change completes meanwhile, and its answer is followed by an empty
+ * line and flushed.  Queries that fail are reported on stderr without
+ * ending the server.
+ *
+ * @param op  Options for loading the map.
+ * @return 0 if successful, -1 in case of an error.
+ */
+
+int run_serve(const OSM_Options *op) {
+    if (osm_updates_dir != NULL)
+        return serve_updates(op);
+    OSM_LiveMap *lp = OSM_LiveMap_open(osm_input_file, 1, op);
+    if (lp == NULL) {
+        fprintf(stderr, "Cannot read the map!\n");
+        return -1;
+    }
+    if (OSM_LiveMap_watch(lp) != 0) {
+        OSM_LiveMap_free(lp);
+        return -1;
+    }
+    char *line = NULL;
+    size_t cap = 0;
+    while (getline(&line, &cap, stdin) >= 0) {
+        OSM_Map *mp = OSM_LiveMap_enter(lp, 0);
+        serve_queries(mp, line);
+        OSM_LiveMap_leave(lp, 0);
+        printf("\n");
+        fflush(stdout);
+    }
+    free(line);
+    OSM_LiveMap_free(lp);
+    return 0;
+}
+
+/**
+ * @brief  Answer the queries from the cache given with '--cache', if it
+ * holds them.
+ * @details  The key is the fingerprint of the input file, then '-v' and the
+ * time of '--at' if they are given, then the queries in order, with their
+ * ids normalized and their keys prefixed with their lengths.  On a miss,
+ * the key is stored in *keyp for cache_release(), to be freed by the
+ * caller.
+ *
+ * @param argc  Argument count, as passed to main.
+ * @param argv  Argument vector, as passed to main.
+ * @param keyp  Set to the key on a miss.
+ * @return 1 if the answer was printed from the cache, 0 on a miss, and -1
+ * in case of an error.
+ */
+
+int cache_lookup(int argc, char **argv, char **keyp) {
+    FILE *in = open_input();
+    if (in == NULL)
+        return -1;
+    char fingerprint[OSM_CACHE_FINGERPRINT_LEN + 1];
+    int ret = OSM_Cache_fingerprint(in, fingerprint);
+    close_input(in);
+    if (ret != 0) return -1;
+
+    char *key = NULL;
+    size_t len;
+    FILE *kf = open_memstream(&key, &len);
+    if (kf == NULL) return -1;
+    fprintf(kf, "%s\n", fingerprint);
+    if (osm_verbose)
+        fprintf(kf, "v\n");
+    if (osm_at_given)
+        fprintf(kf, "at %" PRId64 "\n", osm_at_time);
+    for (int i = 1; i < argc; i++) {
+        OSM_Id id;
+        if (strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "--at") == 0 ||
+            strcmp(argv[i], "--cache") == 0 || strcmp(argv[i], "--cache-size") == 0) {
+            i++;
+        } else if (strcmp(argv[i], "-n") == 0 && parse_id(argv[++i], &id) == 0) {
+            fprintf(kf, "n %" PRId64 "\n", id);
+        } else if (strcmp(argv[i], "-w") == 0 && parse_id(argv[++i], &id) == 0) {
+            fprintf(kf, "w %" PRId64, id);
+            while (i+1 < argc && argv[i+1][0] != '-') {
+                i++;
+                fprintf(kf, " %zu:%s", strlen(argv[i]), argv[i]);
+            }
+            fprintf(kf, "\n");
+        } else if (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "-b") == 0) {
+            fprintf(kf, "%c\n", argv[i][1]);
+        }
+    }
+    if (fclose(kf) != 0) {
+        free(key);
+        return -1;
+    }
+
+    char *data;
+    size_t size;
+    ret = OSM_Cache_get(osm_cache_dir, key, &data, &size);
+    if (ret != 1) {
+        if (ret == 0)
+            *keyp = key;
+        else
+            free(key);
+        return ret;
+    }
+    free(key);
+    uint64_t out_len = 0;
+    for (int b = 7; b >= 0 && size >= 8; b--)
+        out_len = out_len << 8 | (unsigned char)data[b];
+    if (size < 8 || out_len > size - 8) {
+        free(data);
+        return -1;
+    }
+    fwrite(data + 8, 1, out_len, stdout);
+    fwrite(data + 8 + out_len, 1, size - 8 - out_len, stderr);
+    free(data);
+    return 1;
+}
+
+/**
+ * @brief  Start capturing what is written to stdout and stderr, for the
+ * cache given with '--cache'.
+ *
+ * @return 0 if successful, -1 in case of an error, in which case nothing
+ * is captured.
+ */
+
+int cache_capture(void) {
+    fflush(stdout);
+    fflush(stderr);
+    for (int f = 0; f < 2; f++) {
+        int fd = f == 0 ? STDOUT_FILENO : STDERR_FILENO;
+        if ((captured[f] = tmpfile()) == NULL || (saved_fds[f] = dup(fd)) < 0 ||
+            dup2(fileno(captured[f]), fd) < 0) {
+            if (captured[f] != NULL) fclose(captured[f]);
+            if (saved_fds[f] >= 0) close(saved_fds[f]);
+            captured[f] = NULL;
+            saved_fds[f] = -1;
+            cache_release(NULL, 0);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief  Stop capturing stdout and stderr, write out what was captured,
+ * and store it in the cache under a key if requested.
+ * @details  Failure to store the answer is reported but not an error.
+ *
+ * @param key  The key from cache_lookup().
+ * @param store  Nonzero if the answer is to be stored.
+ */
+
+void cache_release(const char *key, int store) {
+    fflush(stdout);
+    fflush(stderr);
+    char *data = NULL;
+    size_t size = 8, out_len = 0;
+    for (int f = 0; f < 2; f++) {
+        if (saved_fds[f] < 0) continue;
+        dup2(saved_fds[f], f == 0 ? STDOUT_FILENO : STDERR_FILENO);
+        close(saved_fds[f]);
+        saved_fds[f] = -1;
+    }
+    for (int f = 0; f < 2; f++) {
+        if (captured[f] == NULL) continue;
+        long len = ftell(captured[f]);
+        char *grown = len >= 0 ? realloc(data, size + len) : NULL;
+        if (grown == NULL) {
+            store = 0;
+        } else {
+            data = grown;
+            rewind(captured[f]);
+            if (fread(data + size, 1, len, captured[f]) != (size_t)len)
+                store = 0;
+            fwrite(data + size, 1, len, f == 0 ? stdout : stderr);
+            size += len;
+            if (f == 0) out_len = len;
+        }
+        fclose(captured[f]);
+        captured[f] = NULL;
+    }
+    if (store && key != NULL && data != NULL) {
+        for (int b = 0; b < 8; b++)
+            data[b] = (uint64_t)out_len >> (8 * b);
+        OSM_Cache_put(osm_cache_dir, key, data, size, osm_cache_size);
+    }
+    free(data);
+}
+
+/*
+ * Collect the ids given with '-n' and then those given with '-w' into an
+ * array to be freed by the caller.
+ */
+
+static OSM_Id *query_ids(int argc, char **argv, size_t *num_nodesp, size_t *num_waysp) {
+    OSM_Id *ids = malloc(argc * sizeof(OSM_Id));
+    if (ids == NULL) return NULL;
+    size_t num_nodes = 0, num_ways = 0;
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0)
+            parse_id(argv[i+1], &ids[num_nodes++]);
+    }
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "-w") == 0)
+            parse_id(argv[i+1], &ids[num_nodes + num_ways++]);
+    }
+    *num_nodesp = num_nodes;
+    *num_waysp = num_ways;
+    return ids;
+}
+
+/**
+ * @brief  Load the map for '--index': only the blocks of the input file
+ * that its index may place the ids given with '-n' and '-w' in, and its
+ * header.  The index is read from its sidecar file or built.
+ *
+ * @param argc  Argument count, as passed to main.
+ * @param argv  Argument vector, as passed to main, already validated.
+ * @param op  Options for building the index and decoding the blocks.
+ * @return  The map, or NULL in case of an error.
+ */
+
+OSM_Map *load_indexed_map(int argc, char **argv, const OSM_Options *op) {
+    size_t num_nodes, num_ways;
+    OSM_Id *ids = query_ids(argc, argv, &num_nodes, &num_ways);
+    if (ids == NULL) return NULL;
+
+    OSM_Map *map = NULL;
+    OSM_Index *ix = OSM_Index_open(osm_input_file, op);
+    FILE *in = ix != NULL ? fopen(osm_input_file, "rb") : NULL;
+    if (in != NULL) {
+        map = OSM_Index_load(ix, in, ids, num_nodes, ids + num_nodes, num_ways, op);
+        OSM_Index_get_stats(ix, &osm_index_stats);
+        fclose(in);
+    }
+    OSM_Index_free(ix);
+    free(ids);
+    return map;
+}
+
+/**
+ * @brief  Load the map for '--shards': the blocks of the input file that
+ * hold the ids given with '-n' and '-w', and its header, as found by
+ * worker processes that also count the nodes and ways of the file.
+ *
+ * @param argc  Argument count, as passed to main.
+ * @param argv  Argument vector, as passed to main, already validated.
+ * @param op  Options for decoding the blocks.
+ * @return  The map, or NULL in case of an error.
+ */
+
+OSM_Map *load_sharded_map(int argc, char **argv, const OSM_Options *op) {
+    size_t num_nodes, num_ways;
+    OSM_Id *ids = query_ids(argc, argv, &num_nodes, &num_ways);
+    if (ids == NULL) return NULL;
+    OSM_Map *map = OSM_Shards_load(osm_input_file, osm_shards, ids, num_nodes, ids + num_nodes, num_ways,
+                                   &osm_shard_stats, op);
+    free(ids);
+    return map;
+}
+
+/*
+ * Options that select a mode, and the others that a mode may or may not be
+ * combined with.  Queries are -n, -w, -s and -b.
+ */
+
+#define USE_QUERIES     0x00001
+#define USE_WHERE       0x00002
+#define USE_COMPONENTS  0x00004
+#define USE_RENDER      0x00008
+#define USE_DIFF        0x00010
+#define USE_AT          0x00020
+#define USE_INDEX       0x00040
+#define USE_SHARDS      0x00080
+#define USE_CACHE       0x00100
+#define USE_UPDATES     0x00200
+#define USE_SAMPLE      0x00400
+#define USE_TAG_STATS   0x00800
+#define USE_CHECK_REFS  0x01000
+#define USE_GEOJSON     0x02000
+#define USE_PGCOPY      0x04000
+#define USE_FLATGEOBUF  0x08000
+#define USE_SERVE       0x10000
+
+/* How many '-f' files a mode takes */
+#define ANY_FILES       0
+#define ONE_FILE        1
+#define AT_MOST_ONE     2
+
+/*
+ * A mode and what it may be combined with.  Two options may be given
+ * together if the mode of either allows the other; the usage message is
+ * that of the first mode in the table that does not.  A mode with a run
+ * function is run by main() instead of loading a map.
+ */
+
+typedef struct Mode {
+    unsigned int use;
+    int files;
+    unsigned int allows;
+    unsigned int needs;
+    int (*run)(const OSM_Options *op);
+    const char *usage;
+} Mode;
+
+static const Mode modes[] = {
+    { USE_SAMPLE, ONE_FILE, 0, 0, run_sample,
+      "--sample needs a single -f file and cannot be used with other queries" },
+    { USE_TAG_STATS, AT_MOST_ONE, USE_SHARDS, 0, run_tag_stats,
+      "--tag-stats needs at most one -f file and cannot be used with other queries" },
+    { USE_CHECK_REFS, ONE_FILE, 0, 0, run_check_refs,
+      "--check-refs needs a single -f file and cannot be used with other queries" },
+    { USE_GEOJSON, AT_MOST_ONE, USE_SHARDS, 0, run_geojson,
+      "--geojson and --geojsonseq need at most one -f file and cannot be used with other queries" },
+    { USE_PGCOPY, AT_MOST_ONE, USE_SHARDS, 0, run_pgcopy,
+      "--pgcopy needs at most one -f file and cannot be used with other queries" },
+    { USE_FLATGEOBUF, AT_MOST_ONE, 0, 0, run_flatgeobuf,
+      "--flatgeobuf needs at most one -f file and cannot be used with other queries" },
+    { USE_SERVE, ONE_FILE, USE_AT | USE_UPDATES, 0, run_serve,
+      "--serve needs a single -f file and takes its queries from stdin" },
+    { USE_UPDATES, ANY_FILES, USE_SERVE, USE_SERVE, NULL,
+      "--updates needs --serve and cannot be used with --at or --index" },
+    { USE_CACHE, ONE_FILE, USE_QUERIES | USE_AT | USE_SHARDS, 0, NULL,
+      "--cache needs a single -f file and only caches -n, -w, -s and -b queries" },
+    { USE_SHARDS, ONE_FILE, USE_QUERIES | USE_CACHE | USE_GEOJSON | USE_PGCOPY | USE_TAG_STATS, 0, NULL,
+      "--shards needs a single -f file and only covers -n, -w, -s, -b, --tag-stats and the GeoJSON and COPY exports" },
+    { USE_COMPONENTS, ANY_FILES, USE_QUERIES | USE_WHERE | USE_RENDER | USE_DIFF, 0, NULL,
+      "--components and --component-ids cannot be used with --index or --at" },
+    { USE_INDEX, ONE_FILE, USE_QUERIES | USE_RENDER | USE_DIFF, 0, NULL,
+      "--index needs a single -f file and cannot be used with --at or --where" },
+};
+
+#define NUM_MODES   (sizeof(modes) / sizeof(modes[0]))
+
+/* The options given, as found by process_args() */
+static unsigned int options_used;
+
+/*
+ * Check the combination of options given against the table of modes,
+ * printing the usage message of the first mode that it does not suit.
+ */
+
+static int check_modes(unsigned int used) {
+    for (size_t m = 0; m < NUM_MODES; m++) {
+        const Mode *mp = &modes[m];
+        if (!(used & mp->use)) continue;
+        int ok = (used & mp->needs) == mp->needs &&
+                 (mp->files != ONE_FILE || osm_num_input_files == 1) &&
+                 (mp->files != AT_MOST_ONE || osm_num_input_files <= 1);
+        for (size_t o = 0; o < NUM_MODES && ok; o++) {
+            const Mode *op = &modes[o];
+            if (o != m && (used & op->use) && !(mp->allows & op->use) && !(op->allows & mp->use))
+                ok = 0;
+        }
+        unsigned int others = used & ~mp->use & ~mp->allows;
+        for (size_t o = 0; o < NUM_MODES; o++)
+            others &= ~modes[o].use;
+        if (!ok || others != 0) {
+            fprintf(stderr, "%s\n", mp->usage);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief  Find the mode, if any, that main() runs instead of loading a map,
+ * once process_args() has validated the arguments.
+ *
+ * @return  The function that runs the mode, or NULL if there is none.
+ */
+
+int (*standalone_mode(void))(const OSM_Options *op) {
+    for (size_t m = 0; m < NUM_MODES; m++) {
+        if ((options_used & modes[m].use) && modes[m].run != NULL)
+            return modes[m].run;
+    }
+    return NULL;
+}
+
 /**
  * @brief  Validate command-line arguments with possible simultaneous execution
  * of queries against a map.
@@ -20,9 +1049,10 @@ char *osm_input_file = NULL;
  * argc and argv and verifies that they represent a valid invocation of the
  * program.  In addition, this function determines whether '-h' has been given
  * as the first argument and, if so, sets the global variable help_requested
- * to a nonzero value.  It also checks whether there is an occurrence of
+ * to a nonzero value.  It also checks whether there are occurrences of
  * '-f filename' and, if so, sets the global variable osm_input_file to the
- * specified filename.
+ * first filename specified and, during validation, collects all of them in
+ * osm_input_files.
  * @param argc  Argument count, as passed to main.
  * @param argv  Argument vector, as passed to main.
  * @param mp  If non-NULL, this is a pointer to a map to be used for processing
@@ -40,81 +1070,233 @@ int process_args(int argc, char **argv, OSM_Map *mp) {
     }
 
     int file_available = 0;
+    unsigned int used = 0;
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-h") == 0) {
             help_requested = 1;
             return 0;
         } else if (strcmp(argv[i], "-f") == 0) {
-            if (file_available) {
-                fprintf(stderr, "-f can only be used once\n");
-                return -1;
-            }
             if (i+1 >= argc || argv[i+1][0] == '-') {
-                fprintf(stderr, "-f should be followed by a file name");
+                fprintf(stderr, "-f should be followed by a file name\n");
                 return -1;
             }
-            osm_input_file = argv[i+1];
+            if (mp == NULL) {
+                char **files = realloc(osm_input_files, (osm_num_input_files + 1) * sizeof(char *));
+                if (files == NULL) return -1;
+                osm_input_files = files;
+                osm_input_files[osm_num_input_files++] = argv[i+1];
+            }
+            if (!file_available)
+                osm_input_file = argv[i+1];
             file_available = 1;
             i++;
         } else if (strcmp(argv[i], "-n") == 0) {
-            if (osm_input_file == NULL) {
-                fprintf(stderr, "No input file given \n");
+            OSM_Id id;
+            if (i+1 >= argc || parse_id(argv[i+1], &id) != 0) {
+                fprintf(stderr, "-n should be followed by the node id\n");
+                return -1;
+            }
+            i++;
+            used |= USE_QUERIES;
+
+            if (mp != NULL && query_node(mp, id) != 0)
+                return -1;
+
+        } else if (strcmp(argv[i], "-w") == 0) {
+            OSM_Id id;
+            if (i+1 >= argc || parse_id(argv[i+1], &id) != 0) {
+                fprintf(stderr, "-w should be followed by the way id\n");
+                return -1;
+            }
+            i++;
+            used |= USE_QUERIES;
+
+            int num_keys = 0;
+            while (i+1+num_keys < argc && argv[i+1+num_keys][0] != '-')
+                num_keys++;
+
+            if (mp != NULL && query_way(mp, id, &argv[i+1], num_keys) != 0)
+                return -1;
+            i += num_keys;
+
+        } else if (strcmp(argv[i], "--where") == 0) {
+            if (i+1 >= argc) {
+                fprintf(stderr, "--where should be followed by a filter expression\n");
                 return -1;
             }
+            i++;
 
+            if (query_where(mp, argv[i]) != 0)
+                return -1;
+            used |= USE_WHERE;
+
+        } else if (strcmp(argv[i], "--components") == 0 || strcmp(argv[i], "--component-ids") == 0) {
+            int export_ids = strcmp(argv[i], "--component-ids") == 0;
+            char *expr = NULL;
+            if (i+1 < argc && argv[i+1][0] != '-')
+                expr = argv[++i];
+            if (query_components(mp, expr, export_ids) != 0)
+                return -1;
+            used |= USE_COMPONENTS;
+
+        } else if (strcmp(argv[i], "--render") == 0) {
             if (i+1 >= argc || argv[i+1][0] == '-') {
-                fprintf(stderr, "-n should be followed by the node id\n");
+                fprintf(stderr, "--render should be followed by the name of a PNG file\n");
                 return -1;
             }
+            osm_render_path = argv[++i];
+            used |= USE_RENDER;
 
-        } else if (strcmp(argv[i], "-w") == 0) {
-            if (osm_input_file == NULL) {
-                fprintf(stderr, "No input file given \n");
+            if (mp != NULL && render_map(mp) != 0)
+                return -1;
+
+        } else if (strcmp(argv[i], "--size") == 0) {
+            char c;
+            if (i+1 >= argc || sscanf(argv[i+1], "%dx%d%c", &osm_render_opts.width,
+                                      &osm_render_opts.height, &c) != 2 ||
+                osm_render_opts.width <= 0 || osm_render_opts.height <= 0 ||
+                osm_render_opts.width > 1 << 15 || osm_render_opts.height > 1 << 15) {
+                fprintf(stderr, "--size should be followed by the image size, such as 1024x768\n");
+                return -1;
+            }
+            i++;
+
+        } else if (strcmp(argv[i], "--bbox") == 0) {
+            if (i+1 >= argc || parse_bbox(argv[i+1], &osm_render_opts) != 0) {
+                fprintf(stderr, "--bbox should be followed by MIN_LON,MIN_LAT,MAX_LON,MAX_LAT in degrees\n");
                 return -1;
             }
+            i++;
 
+        } else if (strcmp(argv[i], "--diff") == 0 || strcmp(argv[i], "--diff-summary") == 0) {
+            if (i+2 >= argc || argv[i+1][0] == '-' || argv[i+2][0] == '-') {
+                fprintf(stderr, "%s should be followed by the old and new file names\n", argv[i]);
+                return -1;
+            }
+            osm_diff_old = argv[i+1];
+            osm_diff_new = argv[i+2];
+            osm_diff_summary = argv[i][6] == '-';
+            i += 2;
+
+        } else if (strcmp(argv[i], "--sample") == 0) {
+            char *end = NULL;
+            if (i+1 < argc)
+                osm_sample_fraction = strtod(argv[i+1], &end);
+            if (i+1 >= argc || end == argv[i+1] || *end != '\0' ||
+                !(osm_sample_fraction > 0 && osm_sample_fraction <= 1)) {
+                fprintf(stderr, "--sample should be followed by a fraction in (0, 1]\n");
+                return -1;
+            }
+            osm_sample_given = 1;
+            i++;
+
+        } else if (strcmp(argv[i], "--tag-stats") == 0) {
+            osm_tag_stats = 1;
+
+        } else if (strcmp(argv[i], "--check-refs") == 0) {
+            osm_check_refs = 1;
+
+        } else if (strcmp(argv[i], "--geojson") == 0 || strcmp(argv[i], "--geojsonseq") == 0) {
+            osm_geojson_format = argv[i][9] == 's' ? OSM_GEOJSON_SEQ : OSM_GEOJSON;
+
+        } else if (strcmp(argv[i], "--pgcopy") == 0) {
+            osm_pgcopy = 1;
+
+        } else if (strcmp(argv[i], "--flatgeobuf") == 0) {
             if (i+1 >= argc || argv[i+1][0] == '-') {
-                fprintf(stderr, "-w should be followed by the way id\n");
+                fprintf(stderr, "--flatgeobuf should be followed by the name of an output file\n");
                 return -1;
             }
+            osm_flatgeobuf_path = argv[++i];
 
-        } else if (strcmp(argv[i], "-s") == 0) {
-            if (osm_input_file == NULL) {
-                fprintf(stderr, "No input file given \n");
+        } else if (strcmp(argv[i], "--serve") == 0) {
+            osm_serve = 1;
+
+        } else if (strcmp(argv[i], "--updates") == 0) {
+            if (i+1 >= argc || argv[i+1][0] == '-') {
+                fprintf(stderr, "--updates should be followed by the name of a directory\n");
                 return -1;
             }
+            osm_updates_dir = argv[++i];
 
-            if (i+1 < argc && argv[i+1][0] != '-') {
-                fprintf(stderr, "-s can only be followed by other query arguments\n");
+        } else if (strcmp(argv[i], "--index") == 0) {
+            osm_use_index = 1;
+
+        } else if (strcmp(argv[i], "--shards") == 0) {
+            char *end = NULL;
+            long n = 0;
+            if (i+1 < argc)
+                n = strtol(argv[i+1], &end, 10);
+            if (i+1 >= argc || end == argv[i+1] || *end != '\0' || n < 1 || n > OSM_SHARDS_MAX) {
+                fprintf(stderr, "--shards should be followed by a number of processes from 1 to %d\n",
+                        OSM_SHARDS_MAX);
                 return -1;
             }
+            osm_shards = n;
+            i++;
 
-            printf("nodes: %d, ways: %d\n", OSM_Map_get_num_nodes(mp), OSM_Map_get_num_ways(mp));
-        } else if (strcmp(argv[i], "-b") == 0) {
-            if (osm_input_file == NULL) {
-                fprintf(stderr, "No input file given \n");
+        } else if (strcmp(argv[i], "--cache") == 0) {
+            if (i+1 >= argc || argv[i+1][0] == '-') {
+                fprintf(stderr, "--cache should be followed by the name of a directory\n");
                 return -1;
             }
+            osm_cache_dir = argv[++i];
 
-            if (i+1 < argc && argv[i+1][0] != '-') {
-                fprintf(stderr, "-b can only be followed by other query arguments\n");
+        } else if (strcmp(argv[i], "--cache-size") == 0) {
+            char *end = NULL;
+            unsigned long long mb = 0;
+            if (i+1 < argc) {
+                errno = 0;
+                mb = strtoull(argv[i+1], &end, 10);
+            }
+            if (i+1 >= argc || end == argv[i+1] || *end != '\0' || argv[i+1][0] == '-' ||
+                errno != 0 || mb == 0 || mb > UINT64_MAX >> 20) {
+                fprintf(stderr, "--cache-size should be followed by a size in megabytes\n");
                 return -1;
             }
+            osm_cache_size = (uint64_t)mb << 20;
+            i++;
 
-            OSM_BBox *bbox = (OSM_BBox *)malloc(sizeof(OSM_BBox *));
-            bbox = OSM_Map_get_BBox(mp);
+        } else if (strcmp(argv[i], "-v") == 0) {
+            osm_verbose = 1;
 
+        } else if (strcmp(argv[i], "--at") == 0) {
+            if (i+1 >= argc || parse_time(argv[i+1], &osm_at_time) != 0) {
+                fprintf(stderr, "--at should be followed by a time, such as 2020-01-01T00:00:00Z\n");
+                return -1;
+            }
+            osm_at_given = 1;
+            i++;
 
-            int64_t max_lon = OSM_BBox_get_max_lon(bbox);
-            int64_t min_lon = OSM_BBox_get_min_lon(bbox);
-            int64_t max_lat = OSM_BBox_get_max_lat(bbox);
-            int64_t min_lat = OSM_BBox_get_min_lat(bbox);
+        } else if (strcmp(argv[i], "-s") == 0) {
+            if (i+1 < argc && argv[i+1][0] != '-') {
+                fprintf(stderr, "-s can only be followed by other query arguments\n");
+                return -1;
+            }
+            used |= USE_QUERIES;
 
-            printf ("max lon: %" PRId64 ", ", max_lon);
-            printf ("min lon: %" PRId64 ", ", min_lon);
-            printf ("max lat: %" PRId64 ", ", max_lat);
-            printf ("min lat: %" PRId64 "\n", min_lat);
+            if (mp != NULL)
+                print_summary(mp);
+        } else if (strcmp(argv[i], "-b") == 0) {
+            if (i+1 < argc && argv[i+1][0] != '-') {
+                fprintf(stderr, "-b can only be followed by other query arguments\n");
+                return -1;
+            }
+            used |= USE_QUERIES;
+
+            if (mp != NULL)
+                print_bbox(mp);
         }
     }
-    return 0;
+    if (mp != NULL)
+        return 0;
+    used |= (osm_diff_old ? USE_DIFF : 0) | (osm_at_given ? USE_AT : 0) |
+            (osm_use_index ? USE_INDEX : 0) | (osm_shards > 0 ? USE_SHARDS : 0) |
+            (osm_cache_dir ? USE_CACHE : 0) | (osm_updates_dir ? USE_UPDATES : 0) |
+            (osm_sample_given ? USE_SAMPLE : 0) | (osm_tag_stats ? USE_TAG_STATS : 0) |
+            (osm_check_refs ? USE_CHECK_REFS : 0) | (osm_geojson_format >= 0 ? USE_GEOJSON : 0) |
+            (osm_pgcopy ? USE_PGCOPY : 0) | (osm_flatgeobuf_path ? USE_FLATGEOBUF : 0) |
+            (osm_serve ? USE_SERVE : 0);
+    options_used = used;
+    return check_modes(used);
 }
@@ -1,7 +1,10 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 
 #include "protobuf.h"
+#include "pb_util.h"
 #include "zlib_inflate.h"
 #include "debug.h"
 
@@ -137,12 +140,18 @@ int PB_inflate_embedded_message(char *buf, size_t len, PB_Message *msgp) {
         return -1;
     }
 
-    zlib_inflate(input, output);
+    int ret = zlib_inflate(input, output);
     fclose(input);
     fflush(output);
     fclose(output);
 
+    if (ret != 0) {
+        free(outbuf);
+        return -1;
+    }
+
     int result = PB_read_embedded_message(outbuf, outlen, msgp);
+    free(outbuf);
     return result;
 }
 
@@ -215,7 +224,7 @@ int PB_read_tag(FILE *in, PB_WireType *typep, int32_t *fieldp) {
 
     uint64_t tag;
 
-    size_t bytes_read = PB_read_varint(in, &tag);
+    int bytes_read = PB_read_varint(in, &tag);
 
     if (bytes_read < 1) {
         return -1;
@@ -273,8 +282,15 @@ int PB_read_value(FILE *in, PB_WireType type, union value *valuep) {
 
             bytes_read += bytes;
 
+            // The byte count is returned as an int, so larger values cannot be read.
+            if (size > (uint64_t)INT_MAX - bytes_read) {
+                return -1;
+            }
             valuep->bytes.size = (size_t)size;
             valuep->bytes.buf = malloc(size);
+            if (valuep->bytes.buf == NULL) {
+                return -1;
+            }
             bytes_read += size;
             if (fread(valuep->bytes.buf, 1, size, in) != size) {
                 return -1;
@@ -465,3 +481,41 @@ void PB_show_message(PB_Message msg, FILE *out) {
         curr = curr->next;
     }
 }
+
+/**
+ * @brief  Compare the contents of a LEN_TYPE field with a null-terminated string.
+ * @details  The bytes of a LEN_TYPE field are not null-terminated, so they
+ * cannot be passed directly to strcmp().
+ *
+ * @param fp  The field to compare.
+ * @param str  The string to compare against.
+ * @return  Nonzero if the field is a LEN_TYPE field whose contents are exactly
+ * the characters of str, otherwise 0.
+ */
+
+int PB_field_equals(PB_Field *fp, const char *str) {
+    if (fp == NULL || fp->type != LEN_TYPE) return 0;
+    size_t len = strlen(str);
+    return fp->value.bytes.size == len && memcmp(fp->value.bytes.buf, str, len) == 0;
+}
+
+/**
+ * @brief  Free a PB_Message object, including the sentinel, all of its fields,
+ * and the contents of any LEN_TYPE fields.
+ *
+ * @param msg  The message to be freed, or NULL.
+ */
+
+void PB_free_message(PB_Message msg) {
+    if (msg == NULL) return;
+
+    PB_Field *curr = msg->next;
+    while (curr != msg) {
+        PB_Field *next = curr->next;
+        if (curr->type == LEN_TYPE)
+            free(curr->value.bytes.buf);
+        free(curr);
+        curr = next;
+    }
+    free(msg);
+}
@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "strpool.h"
+#include "debug.h"
+
+struct SP_Pool {
+    char *data;             // Null-terminated strings, back to back
+    size_t data_size;
+    size_t data_cap;
+    size_t *offsets;        // Offset in data of each string, indexed by id
+    uint32_t *lengths;      // Length of each string, indexed by id
+    uint32_t count;
+    uint32_t cap;
+    uint32_t *slots;        // Open-addressed hash table of (id + 1), 0 if empty
+    uint32_t num_slots;     // Always a power of two
+};
+
+static uint64_t sp_hash(const char *str, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;     // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)str[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static int sp_rehash(SP_Pool *sp, uint32_t num_slots) {
+    uint32_t *slots = calloc(num_slots, sizeof(uint32_t));
+    if (slots == NULL) return -1;
+
+    for (uint32_t id = 0; id < sp->count; id++) {
+        uint64_t h = sp_hash(sp->data + sp->offsets[id], sp->lengths[id]);
+        uint32_t i = h & (num_slots - 1);
+        while (slots[i] != 0)
+            i = (i + 1) & (num_slots - 1);
+        slots[i] = id + 1;
+    }
+    free(sp->slots);
+    sp->slots = slots;
+    sp->num_slots = num_slots;
+    return 0;
+}
+
+/**
+ * @brief  Create a new, empty string pool.
+ * @return  The new pool, or NULL if memory could not be allocated.
+ */
+
+SP_Pool *SP_create(void) {
+    SP_Pool *sp = calloc(1, sizeof(SP_Pool));
+    if (sp == NULL) return NULL;
+    if (sp_rehash(sp, 1024) != 0) {
+        free(sp);
+        return NULL;
+    }
+    return sp;
+}
+
+/**
+ * @brief  Free a string pool.  Pointers previously returned by SP_get()
+ * become invalid.
+ * @param sp  The pool to be freed, or NULL.
+ */
+
+void SP_free(SP_Pool *sp) {
+    if (sp == NULL) return;
+    free(sp->data);
+    free(sp->offsets);
+    free(sp->lengths);
+    free(sp->slots);
+    free(sp);
+}
+
+/**
+ * @brief  Look up the id of a string in a pool, without adding it.
+ * @param sp  The pool to search.
+ * @param str  The characters of the string, which need not be null-terminated.
+ * @param len  The number of characters in the string.
+ * @return  The id of the string, or SP_NONE if it is not in the pool.
+ */
+
+uint32_t SP_lookup(SP_Pool *sp, const char *str, size_t len) {
+    uint32_t i = sp_hash(str, len) & (sp->num_slots - 1);
+    while (sp->slots[i] != 0) {
+        uint32_t id = sp->slots[i] - 1;
+        if (sp->lengths[id] == len && memcmp(sp->data + sp->offsets[id], str, len) == 0)
+            return id;
+        i = (i + 1) & (sp->num_slots - 1);
+    }
+    return SP_NONE;
+}
+
+/**
+ * @brief  Intern a string in a pool.
+ * @param sp  The pool in which to intern the string.
+ * @param str  The characters of the string, which need not be null-terminated.
+ * @param len  The number of characters in the string.
+ * @return  The id of the string, which is the id previously assigned if an
+ * equal string was already present, or SP_NONE if memory could not be
+ * allocated.
+ */
+
+uint32_t SP_intern(SP_Pool *sp, const char *str, size_t len) {
+    uint64_t h = sp_hash(str, len);
+    uint32_t i = h & (sp->num_slots - 1);
+    while (sp->slots[i] != 0) {
+        uint32_t id = sp->slots[i] - 1;
+        if (sp->lengths[id] == len && memcmp(sp->data + sp->offsets[id], str, len) == 0)
+            return id;
+        i = (i + 1) & (sp->num_slots - 1);
+    }
+    if (len >= UINT32_MAX || sp->count >= SP_NONE - 1)
+        return SP_NONE;
+
+    if (sp->count == sp->cap) {
+        uint32_t cap = sp->cap ? sp->cap * 2 : 1024;
+        size_t *offsets = realloc(sp->offsets, cap * sizeof(size_t));
+        if (offsets == NULL) return SP_NONE;
+        sp->offsets = offsets;
+        uint32_t *lengths = realloc(sp->lengths, cap * sizeof(uint32_t));
+        if (lengths == NULL) return SP_NONE;
+        sp->lengths = lengths;
+        sp->cap = cap;
+    }
+    if (sp->data_size + len + 1 > sp->data_cap) {
+        size_t cap = sp->data_cap ? sp->data_cap : 16384;
+        while (sp->data_size + len + 1 > cap)
+            cap *= 2;
+        char *data = realloc(sp->data, cap);
+        if (data == NULL) return SP_NONE;
+        sp->data = data;
+        sp->data_cap = cap;
+    }
+
+    uint32_t id = sp->count++;
+    sp->offsets[id] = sp->data_size;
+    sp->lengths[id] = len;
+    memcpy(sp->data + sp->data_size, str, len);
+    sp->data[sp->data_size + len] = '\0';
+    sp->data_size += len + 1;
+    sp->slots[i] = id + 1;
+
+    if ((uint64_t)sp->count * 2 > sp->num_slots) {
+        if (sp_rehash(sp, sp->num_slots * 2) != 0)
+            debug("Unable to grow string pool hash table");
+    }
+    return id;
+}
+
+/**
+ * @brief  Get the string with a specified id from a pool.
+ * @param sp  The pool to query.
+ * @param id  The id of the string.
+ * @return  The string as a null-terminated character array, or NULL if
+ * there is no string with the specified id.  The returned pointer remains
+ * valid until the next call to SP_intern() or SP_free().
+ */
+
+char *SP_get(SP_Pool *sp, uint32_t id) {
+    if (sp == NULL || id >= sp->count) return NULL;
+    return sp->data + sp->offsets[id];
+}
+
+/**
+ * @brief  Get the number of distinct strings in a pool.
+ */
+
+size_t SP_count(SP_Pool *sp) {
+    return sp ? sp->count : 0;
+}
+
+/**
+ * @brief  Get the number of bytes of heap storage used by a pool.
+ */
+
+size_t SP_bytes(SP_Pool *sp) {
+    if (sp == NULL) return 0;
+    return sizeof(SP_Pool) + sp->data_cap
+        + (size_t)sp->cap * (sizeof(size_t) + sizeof(uint32_t))
+        + (size_t)sp->num_slots * sizeof(uint32_t);
+}
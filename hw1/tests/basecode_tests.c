@@ -1,6 +1,28 @@
 #include <criterion/criterion.h>
 #include <criterion/logging.h>
+#include <utime.h>
+#include <math.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include "global.h"
+#include "osmpbf.h"
+#include "osmfilter.h"
+#include "osmdiff.h"
+#include "osmindex.h"
+#include "osmsample.h"
+#include "osmtagstats.h"
+#include "osmcomponents.h"
+#include "osmrender.h"
+#include "osmgeojson.h"
+#include "osmpgcopy.h"
+#include "osmflatgeobuf.h"
+#include "osmcache.h"
+#include "osmlive.h"
+#include "osmdelta.h"
+#include "osmshard.h"
+#include "osmrefs.h"
+#include "osmblock.h"
+#include "osmmap.h"
 #include "test_common.h"
 
 #define PROGRAM_PATH "bin/pbf"
@@ -151,5 +173,1483 @@ Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
 }
 #undef TEST_NAME
 
+/**
+ * Compress the id columns of the SBU map and check that accessors and
+ * id lookups are unaffected.
+ */
+
+#define TEST_NAME compress_ids_sbu_map
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    char *filename = "tests/rsrc/sbu.pbf";
+    FILE *in = fopen(filename, "r");
+    cr_assert(in != NULL, "The file '%s' could not be opened\n", filename);
+    OSM_Map *mp = OSM_read_Map(in);
+    cr_assert(mp != NULL, "A non-NULL OSM_Map pointer was expected\n");
+    int n = OSM_Map_get_num_nodes(mp);
+    OSM_Id *ids = malloc(n * sizeof(OSM_Id));
+    for (int i = 0; i < n; i++)
+        ids[i] = OSM_Node_get_id(OSM_Map_get_Node(mp, i));
+    size_t before = OSM_Map_get_id_bytes(mp);
+    size_t id_bytes = (OSM_Map_get_num_nodes64(mp) + OSM_Map_get_num_ways64(mp)) * sizeof(OSM_Id);
+    cr_assert_eq(OSM_Map_compress_ids(mp), 0, "The id columns could not be compressed\n");
+    cr_assert_lt(OSM_Map_get_id_bytes(mp), before - id_bytes / 2,
+                 "Compressed ids were not under half the size of the id columns\n");
+    for (int i = 0; i < n; i++) {
+        OSM_Node *np = OSM_Map_get_Node(mp, i);
+        cr_assert_eq(OSM_Node_get_id(np), ids[i], "Wrong id for node %d\n", i);
+        cr_assert_eq(OSM_Map_find_Node(mp, ids[i]), np, "Wrong lookup for node %d\n", i);
+    }
+    free(ids);
+}
+#undef TEST_NAME
+
+#define TEST_NAME wide_counts_sbu_map
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    char *filename = "tests/rsrc/sbu.pbf";
+    FILE *in = fopen(filename, "r");
+    cr_assert(in != NULL, "The file '%s' could not be opened\n", filename);
+    OSM_Map *mp = OSM_read_Map(in);
+    cr_assert(mp != NULL, "A non-NULL OSM_Map pointer was expected\n");
+    cr_assert_eq(OSM_Map_get_num_nodes64(mp), (size_t)OSM_Map_get_num_nodes(mp), "Mismatched node counts\n");
+    cr_assert_eq(OSM_Map_get_num_ways64(mp), (size_t)OSM_Map_get_num_ways(mp), "Mismatched way counts\n");
+    size_t n = OSM_Map_get_num_ways64(mp);
+    for (size_t i = 0; i < n; i++) {
+        OSM_Way *wp = OSM_Map_get_Way64(mp, i);
+        cr_assert_eq(wp, OSM_Map_get_Way(mp, i), "Mismatched way %zu\n", i);
+        size_t num_refs = OSM_Way_get_num_refs64(wp);
+        cr_assert_eq(num_refs, (size_t)OSM_Way_get_num_refs(wp), "Mismatched ref count for way %zu\n", i);
+        for (size_t r = 0; r < num_refs; r++)
+            cr_assert_eq(OSM_Way_get_ref64(wp, r), OSM_Way_get_ref(wp, r), "Mismatched ref of way %zu\n", i);
+        cr_assert_eq(OSM_Way_get_ref64(wp, num_refs), -1, "Ref past the end of way %zu\n", i);
+    }
+    cr_assert_null(OSM_Map_get_Node64(mp, OSM_Map_get_num_nodes64(mp)), "Node past the end\n");
+    OSM_Map_free(mp);
+}
+#undef TEST_NAME
+
+static int check_node_batch(void *arg, size_t first, size_t count, const OSM_Id *ids,
+                            const OSM_Lat *lats, const OSM_Lon *lons) {
+    OSM_Map *mp = arg;
+    for (size_t i = 0; i < count; i++) {
+        OSM_Node *np = OSM_Map_get_Node64(mp, first + i);
+        if (ids[i] != OSM_Node_get_id(np) || lats[i] != OSM_Node_get_lat(np) ||
+            lons[i] != OSM_Node_get_lon(np))
+            return 1;
+    }
+    return 0;
+}
+
+#define TEST_NAME node_batches_sbu_map
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    char *filename = "tests/rsrc/sbu.pbf";
+    FILE *in = fopen(filename, "r");
+    cr_assert(in != NULL, "The file '%s' could not be opened\n", filename);
+    OSM_Map *mp = OSM_read_Map(in);
+    cr_assert(mp != NULL, "A non-NULL OSM_Map pointer was expected\n");
+    OSM_NodeColumns cols;
+    cr_assert_eq(OSM_Map_node_columns(mp, &cols), 0, "Node columns were not returned\n");
+    cr_assert_eq(cols.count, OSM_Map_get_num_nodes64(mp), "Wrong node column length\n");
+    cr_assert_eq(cols.lats[0], OSM_Node_get_lat(OSM_Map_get_Node64(mp, 0)), "Wrong latitude\n");
+    cr_assert_eq(OSM_Map_foreach_Nodes(mp, check_node_batch, mp), 0, "Node batches disagree with accessors\n");
+    cr_assert_eq(OSM_Map_compress_ids(mp), 0, "The id columns could not be compressed\n");
+    cr_assert_eq(OSM_Map_foreach_Nodes(mp, check_node_batch, mp), 0, "Compressed node batches disagree with accessors\n");
+    OSM_Map_free(mp);
+}
+#undef TEST_NAME
+
+#define TEST_NAME filter_sbu_map
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    char *filename = "tests/rsrc/sbu.pbf";
+    FILE *in = fopen(filename, "r");
+    cr_assert(in != NULL, "The file '%s' could not be opened\n", filename);
+    OSM_Map *mp = OSM_read_Map(in);
+    cr_assert(mp != NULL, "A non-NULL OSM_Map pointer was expected\n");
+    OSM_Filter *fp = OSM_Filter_compile(mp, "lat:40.92..40.93 & !lon:-73.13.. | way & highway=service");
+    cr_assert(fp != NULL, "The filter could not be compiled\n");
+    size_t expected = 0;
+    for (size_t i = 0; i < OSM_Map_get_num_nodes64(mp); i++) {
+        OSM_Node *np = OSM_Map_get_Node64(mp, i);
+        OSM_Lat lat = OSM_Node_get_lat(np);
+        expected += lat >= 40920000000 && lat <= 40930000000 && OSM_Node_get_lon(np) < -73130000000;
+    }
+    cr_assert_eq(OSM_Filter_count(fp, OSM_TYPE_NODE), expected, "Wrong number of nodes selected\n");
+    expected = 0;
+    for (size_t i = 0; i < OSM_Map_get_num_ways64(mp); i++) {
+        OSM_Way *wp = OSM_Map_get_Way64(mp, i);
+        for (int k = 0; k < OSM_Way_get_num_keys(wp); k++)
+            if (strcmp(OSM_Way_get_key(wp, k), "highway") == 0 &&
+                strcmp(OSM_Way_get_value(wp, k), "service") == 0)
+                expected++;
+    }
+    cr_assert_eq(OSM_Filter_count(fp, OSM_TYPE_WAY), expected, "Wrong number of ways selected\n");
+    OSM_Filter_free(fp);
+
+    // Bounds that are values of the column, on every lane and in the tail of a batch
+    for (size_t b = 0; b < 8; b++) {
+        OSM_Lat lo = OSM_Node_get_lat(OSM_Map_get_Node64(mp, 1024 * b + b));
+        OSM_Lat hi = OSM_Node_get_lat(OSM_Map_get_Node64(mp, OSM_Map_get_num_nodes64(mp) - 1 - b));
+        if (lo > hi) {
+            OSM_Lat t = lo;
+            lo = hi;
+            hi = t;
+        }
+        char expr[64];
+        snprintf(expr, sizeof(expr), "lat:%" PRId64 ".%09" PRId64 "..%" PRId64 ".%09" PRId64,
+                 lo / 1000000000, lo % 1000000000, hi / 1000000000, hi % 1000000000);
+        fp = OSM_Filter_compile(mp, expr);
+        cr_assert(fp != NULL, "The filter %s could not be compiled\n", expr);
+        expected = 0;
+        for (size_t i = 0; i < OSM_Map_get_num_nodes64(mp); i++) {
+            OSM_Lat lat = OSM_Node_get_lat(OSM_Map_get_Node64(mp, i));
+            expected += lat >= lo && lat <= hi;
+        }
+        cr_assert_eq(OSM_Filter_count(fp, OSM_TYPE_NODE), expected, "Wrong number of nodes for %s\n", expr);
+        OSM_Filter_free(fp);
+    }
+    cr_assert_null(OSM_Filter_compile(mp, "node & (lat:1..2"), "An invalid filter was compiled\n");
+    OSM_Map_free(mp);
+}
+#undef TEST_NAME
+
+/* A map loaded on its own thread, with its own options */
+
+typedef struct LoadArg {
+    OSM_Options opts;
+    OSM_Map *map;
+} LoadArg;
+
+static void *load_sbu_map(void *arg) {
+    LoadArg *ap = arg;
+    FILE *in = fopen("tests/rsrc/sbu.pbf", "r");
+    if (in != NULL) {
+        ap->map = OSM_read_Map_opts(in, &ap->opts);
+        fclose(in);
+    }
+    return NULL;
+}
+
+#define TEST_NAME concurrent_loads_sbu_map
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    char *filename = "tests/rsrc/sbu.pbf";
+    FILE *in = fopen(filename, "r");
+    cr_assert(in != NULL, "The file '%s' could not be opened\n", filename);
+    OSM_Map *serial = OSM_read_Map(in);
+    fclose(in);
+    cr_assert(serial != NULL, "A non-NULL OSM_Map pointer was expected\n");
+
+    LoadArg args[4];
+    pthread_t threads[4];
+    for (int t = 0; t < 4; t++) {
+        OSM_Options_init(&args[t].opts);
+        args[t].map = NULL;
+    }
+    args[1].opts.threads = 4;
+    args[1].opts.types = OSM_TYPE_NODE;
+    args[2].opts.threads = 2;
+    args[2].opts.metadata = 1;
+    args[3].opts.threads = 3;
+    args[3].opts.types = OSM_TYPE_WAY;
+    args[3].opts.compress_ids = 1;
+    for (int t = 0; t < 4; t++)
+        cr_assert_eq(pthread_create(&threads[t], NULL, load_sbu_map, &args[t]), 0,
+                     "Thread %d could not be started\n", t);
+    for (int t = 0; t < 4; t++)
+        pthread_join(threads[t], NULL);
+
+    OSM_Id node_id = 213352011, way_id = 20175414;
+    OSM_Node *expected_node = OSM_Map_find_Node(serial, node_id);
+    OSM_Way *expected_way = OSM_Map_find_Way(serial, way_id);
+    for (int t = 0; t < 4; t++) {
+        OSM_Map *mp = args[t].map;
+        unsigned int types = args[t].opts.types;
+        cr_assert(mp != NULL, "The map of thread %d could not be read\n", t);
+        cr_assert_eq(OSM_Map_get_num_nodes64(mp), types & OSM_TYPE_NODE ? 46415 : 0,
+                     "Wrong number of nodes in thread %d\n", t);
+        cr_assert_eq(OSM_Map_get_num_ways64(mp), types & OSM_TYPE_WAY ? 5812 : 0,
+                     "Wrong number of ways in thread %d\n", t);
+        if (types & OSM_TYPE_NODE) {
+            OSM_Node *np = OSM_Map_find_Node(mp, node_id);
+            cr_assert(np != NULL && OSM_Node_get_lat(np) == OSM_Node_get_lat(expected_node) &&
+                      OSM_Node_get_lon(np) == OSM_Node_get_lon(expected_node),
+                      "Wrong node %ld in thread %d\n", (long)node_id, t);
+        }
+        if (types & OSM_TYPE_WAY) {
+            OSM_Way *wp = OSM_Map_find_Way(mp, way_id);
+            cr_assert(wp != NULL && OSM_Way_get_num_refs64(wp) == OSM_Way_get_num_refs64(expected_way) &&
+                      OSM_Way_get_ref64(wp, 0) == OSM_Way_get_ref64(expected_way, 0) &&
+                      OSM_Way_get_num_keys(wp) == OSM_Way_get_num_keys(expected_way),
+                      "Wrong way %ld in thread %d\n", (long)way_id, t);
+        }
+        if (args[t].opts.metadata)
+            cr_assert(OSM_Node_get_version(OSM_Map_find_Node(mp, node_id)) > 0,
+                      "Thread %d should have loaded versions\n", t);
+        OSM_Map_free(mp);
+    }
+    OSM_Map_free(serial);
+}
+#undef TEST_NAME
+
+#define TEST_NAME merge_duplicate_inputs
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    char *filename = "tests/rsrc/sbu.pbf";
+    FILE *ins[3];
+    for (int i = 0; i < 3; i++) {
+        ins[i] = fopen(filename, "r");
+        cr_assert(ins[i] != NULL, "The file '%s' could not be opened\n", filename);
+    }
+    OSM_Map *single = OSM_read_Map(ins[0]);
+    rewind(ins[0]);
+    OSM_Options opts;
+    OSM_Options_init(&opts);
+    opts.threads = 4;
+    OSM_Map *merged = OSM_read_Map_merged(ins, 3, &opts);
+    cr_assert(single != NULL && merged != NULL, "Non-NULL OSM_Map pointers were expected\n");
+    size_t n = OSM_Map_get_num_nodes64(single);
+    cr_assert_eq(OSM_Map_get_num_nodes64(merged), n, "Duplicate nodes were not merged\n");
+    cr_assert_eq(OSM_Map_get_num_ways64(merged), OSM_Map_get_num_ways64(single), "Duplicate ways were not merged\n");
+    for (size_t i = 0; i < n; i++) {
+        OSM_Node *a = OSM_Map_get_Node64(single, i), *b = OSM_Map_get_Node64(merged, i);
+        cr_assert_eq(OSM_Node_get_id(a), OSM_Node_get_id(b), "Wrong id for node %zu\n", i);
+        cr_assert_eq(OSM_Node_get_lat(a), OSM_Node_get_lat(b), "Wrong lat for node %zu\n", i);
+        cr_assert_eq(OSM_Node_get_num_keys(a), OSM_Node_get_num_keys(b), "Wrong keys for node %zu\n", i);
+        for (int k = 0; k < OSM_Node_get_num_keys(a); k++)
+            cr_assert_str_eq(OSM_Node_get_value(a, k), OSM_Node_get_value(b, k), "Wrong value for node %zu\n", i);
+    }
+    OSM_Map_free(single);
+    OSM_Map_free(merged);
+    for (int i = 0; i < 3; i++)
+        fclose(ins[i]);
+}
+#undef TEST_NAME
+
+#define TEST_NAME diff_identical_files
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    char *filename = "tests/rsrc/sbu.pbf";
+    OSM_Options opts;
+    OSM_Options_init(&opts);
+    opts.threads = 3;
+    OSM_DiffStats stats;
+    cr_assert_eq(OSM_diff_files(filename, filename, &opts, &stats, NULL), 0, "The diff failed\n");
+    for (int k = 0; k < 2; k++) {
+        cr_assert_eq(stats.created[k], 0, "Unexpected created entities\n");
+        cr_assert_eq(stats.modified[k], 0, "Unexpected modified entities\n");
+        cr_assert_eq(stats.deleted[k], 0, "Unexpected deleted entities\n");
+    }
+}
+#undef TEST_NAME
+
+/*
+ * Protobuf encoding of small synthetic PBF files for the tests: raw blobs
+ * holding blocks of plain (not dense) nodes and of ways.
+ */
 
+typedef struct PBuf {
+    unsigned char data[4096];
+    size_t len;
+} PBuf;
+
+static void pb_varint(PBuf *b, uint64_t v) {
+    do {
+        b->data[b->len++] = (v & 0x7f) | (v > 0x7f ? 0x80 : 0);
+        v >>= 7;
+    } while (v != 0);
+}
+
+static void pb_uint(PBuf *b, int field, uint64_t v) {
+    pb_varint(b, field << 3);
+    pb_varint(b, v);
+}
+
+static void pb_sint(PBuf *b, int field, int64_t v) {
+    pb_uint(b, field, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+static void pb_bytes(PBuf *b, int field, const void *p, size_t n) {
+    pb_varint(b, field << 3 | 2);
+    pb_varint(b, n);
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+}
+
+static void pb_message(PBuf *b, int field, const PBuf *m) {
+    pb_bytes(b, field, m->data, m->len);
+}
+
+/* A packed field of delta-coded values */
+
+static void pb_deltas(PBuf *b, int field, const int64_t *v, int n) {
+    PBuf packed = { .len = 0 };
+    for (int i = 0; i < n; i++) {
+        int64_t d = v[i] - (i > 0 ? v[i - 1] : 0);
+        pb_varint(&packed, ((uint64_t)d << 1) ^ (uint64_t)(d >> 63));
+    }
+    pb_message(b, field, &packed);
+}
+
+static void pb_info(PBuf *b, int version, int64_t timestamp, int visible) {
+    PBuf info = { .len = 0 };
+    pb_uint(&info, 1, version);
+    pb_uint(&info, 2, timestamp);
+    pb_uint(&info, 6, visible);
+    pb_message(b, 4, &info);
+}
+
+/* A node in a group, at coordinates in units of 100 nanodegrees */
+
+static void pb_node(PBuf *group, OSM_Id id, int64_t lat, int64_t lon, int version,
+                    int64_t timestamp, int visible) {
+    PBuf node = { .len = 0 };
+    pb_sint(&node, 1, id);
+    pb_info(&node, version, timestamp, visible);
+    pb_sint(&node, 8, lat);
+    pb_sint(&node, 9, lon);
+    pb_message(group, 1, &node);
+}
+
+/* A way in a group, with the locations of its refs if lats and lons are not NULL */
+
+static void pb_way(PBuf *group, OSM_Id id, const int64_t *refs, const int64_t *lats,
+                   const int64_t *lons, int num_refs, int version, int64_t timestamp, int visible) {
+    PBuf way = { .len = 0 };
+    pb_uint(&way, 1, id);
+    pb_info(&way, version, timestamp, visible);
+    pb_deltas(&way, 8, refs, num_refs);
+    if (lats != NULL && lons != NULL) {
+        pb_deltas(&way, 9, lats, num_refs);
+        pb_deltas(&way, 10, lons, num_refs);
+    }
+    pb_message(group, 3, &way);
+}
+
+/* Write a data blob of the primitive groups, with an empty string table */
+
+static void write_pbf_block(FILE *out, const PBuf *groups, int num_groups) {
+    static PBuf table, block, blob, header;
+    table.len = block.len = blob.len = header.len = 0;
+    pb_bytes(&table, 1, "", 0);
+    pb_message(&block, 1, &table);
+    for (int g = 0; g < num_groups; g++)
+        pb_message(&block, 2, &groups[g]);
+    pb_message(&blob, 1, &block);
+    pb_uint(&blob, 2, block.len);
+    pb_bytes(&header, 1, "OSMData", 7);
+    pb_uint(&header, 3, blob.len);
+    unsigned char len[4] = { header.len >> 24, header.len >> 16, header.len >> 8, header.len };
+    fwrite(len, 1, 4, out);
+    fwrite(header.data, 1, header.len, out);
+    fwrite(blob.data, 1, blob.len, out);
+}
+
+/*
+ * A history file: node 1 at 1000, moved at 2000 and deleted at 3000, node 2
+ * at 1500, and way 10 over both nodes at 1200, down to node 2 at 2500.
+ */
+
+static FILE *write_history_pbf(void) {
+    FILE *out = tmpfile();
+    cr_assert(out != NULL, "The history file could not be created\n");
+    PBuf groups[2] = { { .len = 0 }, { .len = 0 } };
+    pb_node(&groups[0], 1, 10000000, 20000000, 1, 1000, 1);
+    pb_node(&groups[0], 1, 15000000, 20000000, 2, 2000, 1);
+    pb_node(&groups[0], 1, 0, 0, 3, 3000, 0);
+    pb_node(&groups[0], 2, 30000000, 40000000, 1, 1500, 1);
+    int64_t refs[2] = { 1, 2 };
+    pb_way(&groups[1], 10, refs, NULL, NULL, 2, 1, 1200, 1);
+    pb_way(&groups[1], 10, refs + 1, NULL, NULL, 1, 2, 2500, 1);
+    write_pbf_block(out, groups, 2);
+    fflush(out);
+    rewind(out);
+    return out;
+}
+
+#define TEST_NAME history_index_load
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    // History implies metadata for every loader, not only the merge reader
+    FILE *f = write_history_pbf();
+    OSM_Options opts;
+    OSM_Options_init(&opts);
+    opts.history = 1;
+    OSM_Index *ix = OSM_Index_build(f, &opts);
+    cr_assert(ix != NULL, "The index could not be built\n");
+    OSM_Id node_id = 1, way_id = 10;
+    OSM_Map *map = OSM_Index_load(ix, f, &node_id, 1, &way_id, 1, &opts);
+    fclose(f);
+    cr_assert(map != NULL, "A non-NULL OSM_Map pointer was expected\n");
+    cr_assert_eq(OSM_Map_get_num_nodes64(map), 4, "Every node version should be loaded\n");
+    cr_assert_null(OSM_Map_find_Node(map, 1), "Node 1 should be deleted\n");
+    OSM_Node *np = OSM_Map_find_Node_at(map, 1, 2000);
+    cr_assert(np != NULL && OSM_Node_get_version(np) == 2, "Node 1 should be at version 2\n");
+    OSM_Map_free(map);
+    OSM_Index_free(ix);
+}
+#undef TEST_NAME
+
+#define TEST_NAME history_versions_map
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    FILE *f = write_history_pbf();
+    OSM_Options opts;
+    OSM_Options_init(&opts);
+    opts.history = 1;
+    OSM_Map *map = OSM_read_Map_opts(f, &opts);
+    cr_assert(map != NULL && OSM_Map_is_history(map), "A history map was expected\n");
+    cr_assert_eq(OSM_Map_get_num_nodes64(map), 4, "Every node version should be kept\n");
+    cr_assert_eq(OSM_Map_get_num_ways64(map), 2, "Every way version should be kept\n");
+
+    // Before the first version, between versions, and after the deletion
+    cr_assert_null(OSM_Map_find_Node_at(map, 1, 999), "Node 1 found before it existed\n");
+    OSM_Node *np = OSM_Map_find_Node_at(map, 1, 1999);
+    cr_assert(np != NULL && OSM_Node_get_version(np) == 1 && OSM_Node_get_lat(np) == 1000000000,
+              "Node 1 should be at version 1 before 2000\n");
+    np = OSM_Map_find_Node_at(map, 1, 2999);
+    cr_assert(np != NULL && OSM_Node_get_version(np) == 2 && OSM_Node_get_lat(np) == 1500000000,
+              "Node 1 should be at version 2 before 3000\n");
+    cr_assert_null(OSM_Map_find_Node_at(map, 1, 3000), "Node 1 should be deleted at 3000\n");
+    cr_assert_null(OSM_Map_find_Node(map, 1), "The latest version of node 1 is a deletion\n");
+    np = OSM_Map_find_Node(map, 2);
+    cr_assert(np != NULL && OSM_Node_is_visible(np), "Node 2 should be current\n");
+    size_t expected_nodes[] = { 0, 1, 2, 2, 1 };
+    int64_t times[] = { 999, 1000, 1500, 2999, 3000 };
+    for (int t = 0; t < 5; t++)
+        cr_assert_eq(OSM_Map_get_num_nodes_at(map, times[t]), expected_nodes[t],
+                     "Wrong number of nodes at %ld\n", (long)times[t]);
+
+    cr_assert_null(OSM_Map_find_Way_at(map, 10, 1199), "Way 10 found before it existed\n");
+    OSM_Way *wp = OSM_Map_find_Way_at(map, 10, 2499);
+    cr_assert(wp != NULL && OSM_Way_get_version(wp) == 1 && OSM_Way_get_num_refs64(wp) == 2,
+              "Way 10 should have two refs before 2500\n");
+    wp = OSM_Map_find_Way(map, 10);
+    cr_assert(wp != NULL && OSM_Way_get_version(wp) == 2 && OSM_Way_get_num_refs64(wp) == 1 &&
+              OSM_Way_get_ref64(wp, 0) == 2, "Way 10 should end with node 2 only\n");
+    OSM_Map_free(map);
+
+    // Versions after the window are dropped, and so is the deletion
+    rewind(f);
+    opts.history_until = 2500;
+    map = OSM_read_Map_opts(f, &opts);
+    cr_assert(map != NULL, "A non-NULL OSM_Map pointer was expected\n");
+    cr_assert_eq(OSM_Map_get_num_nodes64(map), 3, "The deletion at 3000 should be dropped\n");
+    np = OSM_Map_find_Node(map, 1);
+    cr_assert(np != NULL && OSM_Node_get_version(np) == 2, "Node 1 should end at version 2\n");
+    wp = OSM_Map_find_Way(map, 10);
+    cr_assert(wp != NULL && OSM_Way_get_version(wp) == 2, "Way 10 at 2500 is in the window\n");
+    OSM_Map_free(map);
+
+    // Versions superseded before the window are dropped
+    rewind(f);
+    opts.history_until = 0;
+    opts.history_from = 2100;
+    map = OSM_read_Map_opts(f, &opts);
+    fclose(f);
+    cr_assert(map != NULL, "A non-NULL OSM_Map pointer was expected\n");
+    cr_assert_eq(OSM_Map_get_num_nodes64(map), 3, "Version 1 of node 1 should be dropped\n");
+    cr_assert_null(OSM_Map_find_Node_at(map, 1, 1500), "Version 1 of node 1 should be gone\n");
+    np = OSM_Map_find_Node_at(map, 1, 2100);
+    cr_assert(np != NULL && OSM_Node_get_version(np) == 2, "Version 2 of node 1 should be kept\n");
+    cr_assert_eq(OSM_Map_get_num_ways64(map), 2, "Way 10 was superseded after the window began\n");
+    OSM_Map_free(map);
+}
+#undef TEST_NAME
+
+/*
+ * Write a file of nodes 1 to 3 and ways 10 and 12, or of its next version,
+ * where node 3 and way 12 are deleted, way 10 loses its ref to node 3, and
+ * node 4 and way 11 are created.
+ */
+
+static void write_diff_pbf(const char *path, int next) {
+    FILE *out = fopen(path, "w");
+    cr_assert(out != NULL, "The file %s could not be created\n", path);
+    PBuf groups[2] = { { .len = 0 }, { .len = 0 } };
+    pb_node(&groups[0], 1, 10000000, 20000000, 1, 1000, 1);
+    pb_node(&groups[0], 2, 10000100, 20000000, 1, 1000, 1);
+    if (!next)
+        pb_node(&groups[0], 3, 10000200, 20000000, 1, 1000, 1);
+    else
+        pb_node(&groups[0], 4, 10000300, 20000000, 1, 2000, 1);
+    int64_t refs[] = { 1, 2, 3 }, new_refs[] = { 2, 4 };
+    pb_way(&groups[1], 10, refs, NULL, NULL, next ? 2 : 3, next ? 2 : 1, next ? 2000 : 1000, 1);
+    if (next)
+        pb_way(&groups[1], 11, new_refs, NULL, NULL, 2, 1, 2000, 1);
+    else
+        pb_way(&groups[1], 12, refs + 2, NULL, NULL, 1, 1, 1000, 1);
+    write_pbf_block(out, groups, 2);
+    fclose(out);
+}
+
+#define TEST_NAME diff_osc_order
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    char dir[] = "/tmp/pbf_diffXXXXXX", old_path[64], new_path[64];
+    cr_assert(mkdtemp(dir) != NULL, "The directory could not be created\n");
+    snprintf(old_path, sizeof(old_path), "%s/old.pbf", dir);
+    snprintf(new_path, sizeof(new_path), "%s/new.pbf", dir);
+    write_diff_pbf(old_path, 0);
+    write_diff_pbf(new_path, 1);
+    OSM_DiffStats stats;
+    FILE *osc = tmpfile();
+    cr_assert_eq(OSM_diff_files(old_path, new_path, NULL, &stats, osc), 0, "The diff failed\n");
+    remove(old_path);
+    remove(new_path);
+    rmdir(dir);
+    cr_assert(stats.created[0] == 1 && stats.created[1] == 1 && stats.modified[0] == 0 &&
+              stats.modified[1] == 1 && stats.deleted[0] == 1 && stats.deleted[1] == 1,
+              "Wrong numbers of changes\n");
+
+    // Creations, nodes first, then modifications, then deletions, ways first
+    char buf[4096];
+    rewind(osc);
+    size_t len = fread(buf, 1, sizeof(buf) - 1, osc);
+    fclose(osc);
+    buf[len] = '\0';
+    const char *order[] = { "<create>", "<node id=\"4\"", "<way id=\"11\"", "</create>",
+                            "<modify>", "<way id=\"10\"", "</modify>",
+                            "<delete>", "<way id=\"12\"/>", "<node id=\"3\"/>", "</delete>" };
+    const char *p = buf;
+    for (size_t i = 0; i < sizeof(order) / sizeof(order[0]); i++) {
+        p = strstr(p, order[i]);
+        cr_assert(p != NULL, "Expected %s next in the osmChange document:\n%s\n", order[i], buf);
+    }
+    cr_assert_null(strstr(p, "<create>"), "The document should have one section per action\n");
+}
+#undef TEST_NAME
+
+#define TEST_NAME history_sbu_map
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    char *filename = "tests/rsrc/sbu.pbf";
+    FILE *ins[2];
+    for (int i = 0; i < 2; i++) {
+        ins[i] = fopen(filename, "r");
+        cr_assert(ins[i] != NULL, "The file '%s' could not be opened\n", filename);
+    }
+    OSM_Options opts;
+    OSM_Options_init(&opts);
+    opts.threads = 2;
+    opts.history = 1;
+    OSM_Map *map = OSM_read_Map_merged(ins, 2, &opts);
+    cr_assert(map != NULL, "A non-NULL OSM_Map pointer was expected\n");
+    cr_assert(OSM_Map_is_history(map), "The map should hold history\n");
+    size_t n = OSM_Map_get_num_nodes64(map);
+    cr_assert_eq(n, 46415, "Identical versions were not merged\n");
+    cr_assert_eq(OSM_Map_get_num_nodes_at(map, INT64_MAX), n, "Wrong number of current nodes\n");
+
+    OSM_Node *np = OSM_Map_find_Node(map, 213352011);
+    cr_assert(np != NULL && OSM_Node_is_visible(np), "Node 213352011 should be found\n");
+    int64_t time = OSM_Node_get_timestamp(np);
+    cr_assert_eq(OSM_Map_find_Node_at(map, 213352011, time), np, "Wrong version at its timestamp\n");
+    cr_assert_null(OSM_Map_find_Node_at(map, 213352011, time - 1), "Node found before it existed\n");
+    cr_assert(OSM_Map_get_num_nodes_at(map, time - 1) < n, "Node counted before it existed\n");
+    OSM_Map_free(map);
+    for (int i = 0; i < 2; i++)
+        fclose(ins[i]);
+}
+#undef TEST_NAME
+
+#define TEST_NAME header_features_sbu_map
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    char *filename = "tests/rsrc/sbu.pbf";
+    FILE *f = fopen(filename, "r");
+    cr_assert(f != NULL, "The file '%s' could not be opened\n", filename);
+    OSM_Map *map = OSM_read_Map(f);
+    fclose(f);
+    cr_assert(map != NULL, "A non-NULL OSM_Map pointer was expected\n");
+    cr_assert_eq(OSM_Map_get_required_features(map), OSM_FEATURE_SCHEMA | OSM_FEATURE_DENSE_NODES,
+                 "Wrong required features\n");
+    cr_assert_eq(OSM_Map_get_optional_features(map), OSM_FEATURE_SORTED, "Wrong optional features\n");
+    cr_assert_str_eq(OSM_feature_name(OSM_FEATURE_SORTED), "Sort.Type_then_ID", "Wrong feature name\n");
+    OSM_Node *np = OSM_Map_find_Node(map, 213352011);
+    cr_assert(np != NULL, "Node 213352011 should be found\n");
+    OSM_Map_free(map);
+
+    // A header that declares the wrong order must not break lookups
+    OSM_Options opts;
+    OSM_Options_init(&opts);
+    map = OSM_Map_create(&opts);
+    OSM_Block *header = calloc(1, sizeof(OSM_Block));
+    OSM_Block *block = calloc(1, sizeof(OSM_Block));
+    cr_assert(map != NULL && header != NULL && block != NULL, "The map could not be created\n");
+    header->type = OSM_BLOB_HEADER;
+    header->optional_features = OSM_FEATURE_SORTED;
+    block->type = OSM_BLOB_DATA;
+    OSM_Id ids[] = { 30, 10, 40, 20 };
+    for (int i = 0; i < 4; i++)
+        cr_assert_eq(OSM_Block_add_Node(block, &opts, ids[i], i, i, -1, 0), 0, "The node could not be added\n");
+    cr_assert(OSM_Map_add_Block(map, header) == 0 && OSM_Map_add_Block(map, block) == 0 &&
+              OSM_Map_finish(map, &opts) == 0, "The map could not be finished\n");
+    OSM_Block_free(header);
+    OSM_Block_free(block);
+    for (int i = 0; i < 4; i++) {
+        np = OSM_Map_find_Node(map, ids[i]);
+        cr_assert(np != NULL && OSM_Node_get_id(np) == ids[i], "Node %ld should be found\n", (long)ids[i]);
+    }
+    OSM_Map_free(map);
+}
+#undef TEST_NAME
+
+#define TEST_NAME way_locations_sbu_map
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    char *filename = "tests/rsrc/sbu.pbf";
+    FILE *f = fopen(filename, "r");
+    cr_assert(f != NULL, "The file '%s' could not be opened\n", filename);
+    OSM_Map *map = OSM_read_Map(f);
+    fclose(f);
+    cr_assert(map != NULL, "A non-NULL OSM_Map pointer was expected\n");
+    cr_assert(!OSM_Map_has_way_locations(map), "The file has no way locations\n");
+    OSM_Way *wp = OSM_Map_find_Way(map, 20175414);
+    cr_assert(wp != NULL, "Way 20175414 should be found\n");
+    size_t num_refs;
+    const OSM_Id *refs = OSM_Way_refs(wp, &num_refs);
+    for (size_t r = 0; r < num_refs; r++) {
+        OSM_Lat lat;
+        OSM_Lon lon;
+        OSM_Node *np = OSM_Map_find_Node(map, refs[r]);
+        cr_assert_eq(OSM_Way_get_ref_location(wp, r, &lat, &lon), 0, "No location for ref %zu\n", r);
+        cr_assert(lat == OSM_Node_get_lat(np) && lon == OSM_Node_get_lon(np), "Wrong location for ref %zu\n", r);
+    }
+    OSM_Lat lat;
+    OSM_Lon lon;
+    cr_assert_eq(OSM_Way_get_ref_location(wp, num_refs, &lat, &lon), -1, "Ref index out of range\n");
+    OSM_Map_free(map);
+}
+#undef TEST_NAME
 
+/* A block of two ways with the locations of their refs, and one of a way without */
+
+static void write_way_location_blocks(FILE *out, int with_locations) {
+    PBuf group = { .len = 0 };
+    if (with_locations) {
+        int64_t refs[] = { 1, 2, 3 }, lats[] = { 405000000, 405000100, 404999900 },
+                lons[] = { -731000000, -731000200, -730999000 };
+        pb_way(&group, 20, refs, lats, lons, 3, 1, 1000, 1);
+        pb_way(&group, 21, refs + 1, lats + 1, lons + 1, 2, 1, 1000, 1);
+    } else {
+        int64_t refs[] = { 3, 4 };
+        pb_way(&group, 22, refs, NULL, NULL, 2, 1, 1000, 1);
+    }
+    write_pbf_block(out, &group, 1);
+}
+
+#define TEST_NAME way_locations_map
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    FILE *f = tmpfile();
+    cr_assert(f != NULL, "The file could not be created\n");
+    write_way_location_blocks(f, 1);
+    rewind(f);
+    OSM_Map *map = OSM_read_Map(f);
+    fclose(f);
+    cr_assert(map != NULL && OSM_Map_has_way_locations(map), "The ways should have locations\n");
+    OSM_Lat lats[] = { 40500000000, 40500010000, 40499990000 };
+    OSM_Lon lons[] = { -73100000000, -73100020000, -73099900000 };
+    OSM_Way *wp = OSM_Map_find_Way(map, 20);
+    cr_assert(wp != NULL && OSM_Way_get_num_refs64(wp) == 3, "Way 20 should have three refs\n");
+    for (size_t r = 0; r < 3; r++) {
+        OSM_Lat lat;
+        OSM_Lon lon;
+        cr_assert_eq(OSM_Way_get_ref_location(wp, r, &lat, &lon), 0, "No location for ref %zu\n", r);
+        cr_assert(lat == lats[r] && lon == lons[r], "Wrong location for ref %zu of way 20\n", r);
+    }
+    wp = OSM_Map_find_Way(map, 21);
+    for (size_t r = 0; r < 2; r++) {
+        OSM_Lat lat;
+        OSM_Lon lon;
+        cr_assert_eq(OSM_Way_get_ref_location(wp, r, &lat, &lon), 0, "No location for ref %zu\n", r);
+        cr_assert(lat == lats[r + 1] && lon == lons[r + 1], "Wrong location for ref %zu of way 21\n", r);
+    }
+    OSM_Map_free(map);
+
+    // A block without locations drops the column, whichever block comes first
+    for (int order = 0; order < 2; order++) {
+        f = tmpfile();
+        cr_assert(f != NULL, "The file could not be created\n");
+        write_way_location_blocks(f, !order);
+        write_way_location_blocks(f, order);
+        rewind(f);
+        map = OSM_read_Map(f);
+        fclose(f);
+        cr_assert(map != NULL && OSM_Map_get_num_ways64(map) == 3, "Three ways were expected\n");
+        cr_assert(!OSM_Map_has_way_locations(map), "A block without locations should drop them\n");
+        OSM_Lat lat;
+        OSM_Lon lon;
+        cr_assert_eq(OSM_Way_get_ref_location(OSM_Map_find_Way(map, 20), 0, &lat, &lon), -1,
+                     "Ref 1 of way 20 has neither a location nor a node\n");
+        OSM_Map_free(map);
+    }
+}
+#undef TEST_NAME
+
+#define TEST_NAME index_lookup_sbu_map
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    char *filename = "tests/rsrc/sbu.pbf";
+    FILE *f = fopen(filename, "r");
+    cr_assert(f != NULL, "The file '%s' could not be opened\n", filename);
+    OSM_Index *built = OSM_Index_build(f, NULL);
+    cr_assert(built != NULL, "The index could not be built\n");
+    FILE *tmp = tmpfile();
+    cr_assert_eq(OSM_Index_write(built, tmp), 0, "The index could not be written\n");
+    rewind(tmp);
+    OSM_Index *ix = OSM_Index_read(tmp);
+    fclose(tmp);
+    OSM_Index_free(built);
+    cr_assert(ix != NULL, "The index could not be read back\n");
+
+    OSM_Id node_id = 213352011, way_id = 20175414;
+    OSM_Map *map = OSM_Index_load(ix, f, &node_id, 1, &way_id, 1, NULL);
+    fclose(f);
+    cr_assert(map != NULL, "A non-NULL OSM_Map pointer was expected\n");
+    OSM_Node *np = OSM_Map_find_Node(map, node_id);
+    cr_assert(np != NULL && OSM_Node_get_lat(np) == 40925192800, "Node 213352011 was not loaded\n");
+    cr_assert(OSM_Map_find_Way(map, way_id) != NULL, "Way 20175414 was not loaded\n");
+
+    OSM_IndexStats stats;
+    OSM_Index_get_stats(ix, &stats);
+    cr_assert_eq(stats.num_ids, 46415 + 5812, "Wrong number of indexed ids\n");
+    cr_assert(stats.hits >= 2 && stats.hits == stats.false_positives + 2, "Wrong lookup statistics\n");
+    OSM_Map_free(map);
+    OSM_Index_free(ix);
+}
+#undef TEST_NAME
+
+#define TEST_NAME sample_sbu_map
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    char *filename = "tests/rsrc/sbu.pbf";
+    FILE *f = fopen(filename, "r");
+    cr_assert(f != NULL, "The file '%s' could not be opened\n", filename);
+    OSM_Sample sample;
+    int ret = OSM_sample_file(f, 1, 1, &sample);
+    cr_assert_eq(ret, 0, "Sampling the whole file failed\n");
+    cr_assert_eq(sample.sampled_blocks, 3, "Every block should have been sampled\n");
+    cr_assert(sample.nodes.value > 46414.5 && sample.nodes.value < 46415.5 && sample.nodes.half_width == 0,
+              "Sampling every block should count the nodes exactly\n");
+    cr_assert(sample.ways.value > 5811.5 && sample.ways.value < 5812.5 && sample.ways.half_width == 0,
+              "Sampling every block should count the ways exactly\n");
+    cr_assert(sample.num_keys > 0 && strcmp(sample.keys[0].key, "highway") == 0,
+              "The most frequent key should be highway\n");
+    OSM_Sample_free(&sample);
+
+    // The file is sorted, and each of its blocks holds one type, so each is a stratum
+    rewind(f);
+    ret = OSM_sample_file(f, 0.5, 1, &sample);
+    fclose(f);
+    cr_assert_eq(ret, 0, "Sampling half the file failed\n");
+    cr_assert_eq(sample.sampled_blocks, 3, "The blocks where the types start should be sampled\n");
+    cr_assert(sample.ways.value > 5811.5 && sample.ways.value < 5812.5 && sample.ways.half_width == 0 &&
+              sample.relations.value > 273.5 && sample.relations.value < 274.5,
+              "The ways and relations should be counted exactly, got %.0f and %.0f\n",
+              sample.ways.value, sample.relations.value);
+    OSM_Sample_free(&sample);
+}
+#undef TEST_NAME
+
+/*
+ * Write the blobs of sbu.pbf to a temporary file in the order of a pattern,
+ * with H for its header and n, w and r for its blocks of nodes, ways and
+ * relations.
+ */
+
+static FILE *copy_sbu_blobs(const char *pattern) {
+    FILE *in = fopen("tests/rsrc/sbu.pbf", "r"), *out = tmpfile();
+    cr_assert(in != NULL && out != NULL, "The files could not be opened\n");
+    uint64_t offsets[4], lengths[4], offset = 0;
+    OSM_Blob blob;
+    for (int i = 0; i < 4 && OSM_skip_Blob(in, offset, &blob) == 1; i++) {
+        offsets[i] = offset;
+        lengths[i] = blob.length;
+        offset += blob.length;
+        OSM_Blob_free(&blob);
+        fseeko(in, offset, SEEK_SET);
+    }
+    for (const char *p = pattern; *p != '\0'; p++) {
+        int i = strchr("Hnwr", *p) - "Hnwr";
+        char *buf = malloc(lengths[i]);
+        fseeko(in, offsets[i], SEEK_SET);
+        cr_assert(buf != NULL && fread(buf, 1, lengths[i], in) == lengths[i], "The blob could not be read\n");
+        fwrite(buf, 1, lengths[i], out);
+        free(buf);
+    }
+    fclose(in);
+    rewind(out);
+    return out;
+}
+
+static int covers(OSM_Estimate e, double truth) {
+    return !isnan(e.half_width) && fabs(e.value - truth) <= e.half_width + 0.5;
+}
+
+#define TEST_NAME sample_intervals
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    // Sorted by type: only the blocks within a type are sampled, and they are alike
+    FILE *f = copy_sbu_blobs("Hnnnnnnnnnnnnwwwwwwwwrrrrrr");
+    OSM_Sample sample;
+    cr_assert_eq(OSM_sample_file(f, 0.25, 1, &sample), 0, "Sampling the sorted file failed\n");
+    fclose(f);
+    cr_assert(sample.sampled_blocks < sample.num_blocks, "Not every block should be sampled\n");
+    cr_assert(covers(sample.nodes, 12 * 46415) && covers(sample.ways, 8 * 5812) &&
+              covers(sample.relations, 6 * 274), "The intervals should cover the counts\n");
+    OSM_Sample_free(&sample);
+
+    // Not declared sorted, with the types mixed: most intervals should cover the counts
+    f = copy_sbu_blobs("nwnrnnwnwrnnnwnrwnwnnrwwnnrw");
+    int covered[3] = { 0 };
+    for (int seed = 1; seed <= 20; seed++) {
+        rewind(f);
+        cr_assert_eq(OSM_sample_file(f, 0.5, seed, &sample), 0, "Sampling the mixed file failed\n");
+        cr_assert_eq(sample.sampled_blocks, 14, "Half the blocks should be sampled\n");
+        covered[0] += covers(sample.nodes, 14 * 46415);
+        covered[1] += covers(sample.ways, 9 * 5812);
+        covered[2] += covers(sample.relations, 5 * 274);
+        OSM_Estimate e[3] = { sample.nodes, sample.ways, sample.relations };
+        for (int i = 0; i < 3; i++)
+            cr_assert(e[i].value > 0 || isnan(e[i].half_width), "A count not found should have no interval\n");
+        OSM_Sample_free(&sample);
+    }
+    fclose(f);
+    for (int i = 0; i < 3; i++)
+        cr_assert(covered[i] >= 16, "Only %d of 20 intervals covered count %d\n", covered[i], i);
+}
+#undef TEST_NAME
+
+#define TEST_NAME tag_stats_sbu_map
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    char *filename = "tests/rsrc/sbu.pbf";
+    for (int threads = 1; threads <= 4; threads += 3) {
+        FILE *f = fopen(filename, "r");
+        cr_assert(f != NULL, "The file '%s' could not be opened\n", filename);
+        OSM_Options opts;
+        OSM_Options_init(&opts);
+        opts.threads = threads;
+        OSM_TagStats *ts = OSM_TagStats_compute(f, &opts);
+        fclose(f);
+        cr_assert(ts != NULL, "The tag statistics could not be computed\n");
+
+        size_t num_keys;
+        const OSM_KeyStats *keys = OSM_TagStats_get_keys(ts, &num_keys);
+        cr_assert(num_keys > 0 && strcmp(keys[0].key, "highway") == 0,
+                  "The most frequent key should be highway\n");
+        cr_assert_eq(keys[0].count, 3648, "Wrong number of highway tags\n");
+        cr_assert(keys[0].distinct_values > 19 && keys[0].distinct_values < 23,
+                  "Wrong estimate of distinct highway values\n");
+        cr_assert(keys[0].num_top > 0 && strcmp(keys[0].top[0].value, "footway") == 0 &&
+                  keys[0].top[0].count == 1324 && keys[0].top[0].error == 0,
+                  "The most frequent highway value should be footway\n");
+        OSM_TagStats_free(ts);
+    }
+
+    // Worker processes merge their sketches into the same counts and registers
+    FILE *f = fopen(filename, "r");
+    cr_assert(f != NULL, "The file '%s' could not be opened\n", filename);
+    OSM_TagStats *ts = OSM_TagStats_compute(f, NULL);
+    fclose(f);
+    OSM_TagStats *sharded = OSM_TagStats_compute_shards(filename, 3, NULL);
+    cr_assert(ts != NULL && sharded != NULL, "The tag statistics could not be computed\n");
+    size_t num_keys, num_sharded;
+    const OSM_KeyStats *keys = OSM_TagStats_get_keys(ts, &num_keys);
+    const OSM_KeyStats *sharded_keys = OSM_TagStats_get_keys(sharded, &num_sharded);
+    cr_assert_eq(num_sharded, num_keys, "Wrong number of keys with shards\n");
+    for (size_t i = 0; i < num_keys; i++) {
+        cr_assert(strcmp(sharded_keys[i].key, keys[i].key) == 0 &&
+                  sharded_keys[i].count == keys[i].count &&
+                  sharded_keys[i].distinct_values == keys[i].distinct_values,
+                  "Key %s differs with shards\n", keys[i].key);
+    }
+    cr_assert(sharded_keys[0].num_top > 0 && strcmp(sharded_keys[0].top[0].value, "footway") == 0 &&
+              sharded_keys[0].top[0].count == 1324,
+              "The most frequent highway value should be footway with shards\n");
+    OSM_TagStats_free(ts);
+    OSM_TagStats_free(sharded);
+}
+#undef TEST_NAME
+
+#define TEST_NAME components_sbu_map
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    char *filename = "tests/rsrc/sbu.pbf";
+    FILE *f = fopen(filename, "r");
+    cr_assert(f != NULL, "The file '%s' could not be opened\n", filename);
+    OSM_Map *map = OSM_read_Map(f);
+    fclose(f);
+    cr_assert(map != NULL, "A non-NULL OSM_Map pointer was expected\n");
+
+    OSM_Components comps;
+    cr_assert_eq(OSM_Map_way_components(map, NULL, 4, &comps), 0, "Finding the components failed\n");
+    cr_assert_eq(comps.num_components, 2232, "Wrong number of components\n");
+    cr_assert(comps.way_counts[0] == 2814 && comps.node_counts[0] == 16763,
+              "Wrong size of the largest component\n");
+    size_t total = 0;
+    for (size_t c = 0; c < comps.num_components; c++)
+        total += comps.way_counts[c];
+    cr_assert_eq(total, 5812, "Every way should be in a component\n");
+    OSM_Components_free(&comps);
+
+    OSM_Filter *fp = OSM_Filter_compile(map, "highway=*");
+    cr_assert(fp != NULL, "The filter could not be compiled\n");
+    cr_assert_eq(OSM_Map_way_components(map, fp, 1, &comps), 0, "Finding the components failed\n");
+    cr_assert_eq(comps.num_components, 43, "Wrong number of highway components\n");
+    size_t index = 0;
+    while (index < comps.num_ways && OSM_Way_get_id(OSM_Map_get_Way64(map, index)) != 20175414)
+        index++;
+    cr_assert(index < comps.num_ways && comps.way_components[index] == 0,
+              "Tabler Drive should be in the largest highway component\n");
+    OSM_Components_free(&comps);
+    OSM_Filter_free(fp);
+    OSM_Map_free(map);
+}
+#undef TEST_NAME
+
+#define TEST_NAME render_sbu_map
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    char *filename = "tests/rsrc/sbu.pbf";
+    FILE *f = fopen(filename, "r");
+    cr_assert(f != NULL, "The file '%s' could not be opened\n", filename);
+    OSM_Map *map = OSM_read_Map(f);
+    fclose(f);
+    cr_assert(map != NULL, "A non-NULL OSM_Map pointer was expected\n");
+
+    OSM_RenderOptions opts = { 300, 200, 0, 0, 0, 0, 0, 2 };
+    FILE *out = tmpfile();
+    cr_assert_eq(OSM_render_png(map, &opts, out), 0, "The map could not be rendered\n");
+    long size = ftell(out);
+    rewind(out);
+    unsigned char head[24];
+    cr_assert_eq(fread(head, 1, sizeof(head), out), sizeof(head), "The PNG file is too short\n");
+    fclose(out);
+    cr_assert(memcmp(head, "\x89PNG\r\n\x1a\n", 8) == 0 && memcmp(head + 12, "IHDR", 4) == 0,
+              "The output is not a PNG file\n");
+    cr_assert(head[18] == 1 && head[19] == 44 && head[22] == 0 && head[23] == 200,
+              "The PNG image should be 300 x 200\n");
+    cr_assert(size > 1000, "The image should not be blank\n");
+
+    opts.width = 0;
+    cr_assert_neq(OSM_render_png(map, &opts, stdout), 0, "An empty image should be rejected\n");
+    OSM_Map_free(map);
+}
+#undef TEST_NAME
+
+#define TEST_NAME geojson_sbu_map
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    char *filename = "tests/rsrc/sbu.pbf";
+    FILE *f = fopen(filename, "r");
+    cr_assert(f != NULL, "The file '%s' could not be opened\n", filename);
+    OSM_Options opts;
+    OSM_Options_init(&opts);
+    opts.threads = 2;
+    FILE *out = tmpfile();
+    cr_assert_eq(OSM_export_geojson(f, out, OSM_GEOJSON_SEQ, &opts), 0, "The file could not be exported\n");
+    fclose(f);
+    rewind(out);
+
+    char line[65536];
+    int features = 0, found = 0;
+    while (fgets(line, sizeof(line), out) != NULL) {
+        cr_assert(line[0] == '\x1e' && strncmp(line + 1, "{\"type\":\"Feature\"", 17) == 0,
+                  "Each line should hold one feature\n");
+        features++;
+        if (strstr(line, "\"id\":\"way/20175414\"") != NULL)
+            found = strstr(line, "\"name\":\"Tabler Drive\"") != NULL
+                && strstr(line, "\"type\":\"LineString\"") != NULL;
+    }
+    fclose(out);
+    cr_assert_eq(features, 8612, "Expected 8612 features, got %d\n", features);
+    cr_assert(found, "Tabler Drive should be exported as a LineString\n");
+}
+#undef TEST_NAME
+
+#define TEST_NAME pgcopy_sbu_map
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    char *filename = "tests/rsrc/sbu.pbf";
+    FILE *f = fopen(filename, "r");
+    cr_assert(f != NULL, "The file '%s' could not be opened\n", filename);
+    OSM_Options opts;
+    OSM_Options_init(&opts);
+    opts.threads = 2;
+    FILE *out = tmpfile();
+    cr_assert_eq(OSM_export_pgcopy(f, out, &opts), 0, "The file could not be exported\n");
+    fclose(f);
+    long size = ftell(out);
+    rewind(out);
+    unsigned char *data = malloc(size);
+    cr_assert_eq(fread(data, 1, size, out), (size_t)size, "The output could not be read back\n");
+    fclose(out);
+    cr_assert(size > 21 && memcmp(data, "PGCOPY\n\377\r\n\0\0\0\0\0\0\0\0\0", 19) == 0,
+              "The output should start with the COPY signature\n");
+
+    int rows = 0, found = 0;
+    long p = 19;
+    while (p + 2 <= size && (data[p] << 8 | data[p + 1]) == 4) {
+        p += 2;
+        uint32_t lens[4];
+        unsigned char *fields[4];
+        for (int i = 0; i < 4 && p + 4 <= size; i++) {
+            lens[i] = (uint32_t)data[p] << 24 | data[p + 1] << 16 | data[p + 2] << 8 | data[p + 3];
+            fields[i] = data + p + 4;
+            p += 4 + lens[i];
+        }
+        int64_t id = 0;
+        for (int b = 0; b < 8; b++)
+            id = id << 8 | fields[1][b];
+        if (id == 20175414 && lens[0] == 3 && memcmp(fields[0], "way", 3) == 0)
+            found = fields[3][0] == 1 && fields[3][1] == 2 && fields[3][4] == 0x20;
+        rows++;
+    }
+    cr_assert(p == size - 2 && data[p] == 0xff && data[p + 1] == 0xff,
+              "The rows should be followed by the trailer\n");
+    free(data);
+    cr_assert_eq(rows, 8612, "Expected 8612 rows, got %d\n", rows);
+    cr_assert(found, "Tabler Drive should be exported as a LineString with an SRID\n");
+}
+#undef TEST_NAME
+
+#define TEST_NAME flatgeobuf_sbu_map
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    char *filename = "tests/rsrc/sbu.pbf";
+    FILE *f = fopen(filename, "r");
+    cr_assert(f != NULL, "The file '%s' could not be opened\n", filename);
+    OSM_Options opts;
+    OSM_Options_init(&opts);
+    opts.threads = 3;
+    FILE *out = tmpfile();
+    cr_assert_eq(OSM_export_flatgeobuf(f, out, &opts), 0, "The file could not be exported\n");
+    fclose(f);
+    long size = ftell(out);
+    rewind(out);
+    unsigned char *data = malloc(size);
+    cr_assert_eq(fread(data, 1, size, out), (size_t)size, "The output could not be read back\n");
+    fclose(out);
+    cr_assert(size > 12 && memcmp(data, "fgb\3fgb\0", 8) == 0, "The output should start with the magic bytes\n");
+
+    // Find features_count, field 8 of the header table, through its vtable
+    uint32_t header_size = data[8] | data[9] << 8 | data[10] << 16 | (uint32_t)data[11] << 24;
+    unsigned char *base = data + 12;
+    uint32_t table = base[0] | base[1] << 8 | base[2] << 16 | (uint32_t)base[3] << 24;
+    int32_t vtable = table - (int32_t)(base[table] | base[table + 1] << 8 | base[table + 2] << 16 |
+                                       (uint32_t)base[table + 3] << 24);
+    uint16_t field = base[vtable + 4 + 2 * 8] | base[vtable + 5 + 2 * 8] << 8;
+    uint64_t count = 0;
+    for (int b = 7; b >= 0; b--)
+        count = count << 8 | base[table + field + b];
+    cr_assert_eq(count, 8612, "Expected 8612 features, got %lu\n", (unsigned long)count);
+
+    // The tree of 8612 leaves with 16 per node has 539 + 34 + 3 + 1 nodes above them
+    long features = 12 + header_size + 40 * (8612 + 539 + 34 + 3 + 1);
+    int found = 0, num_features = 0;
+    for (long p = features; p + 4 <= size; num_features++) {
+        uint32_t len = data[p] | data[p + 1] << 8 | data[p + 2] << 16 | (uint32_t)data[p + 3] << 24;
+        for (uint32_t i = 0; i + 21 <= len && !found; i++)
+            found = memcmp(data + p + 4 + i, "\"name\":\"Tabler Drive\"", 21) == 0;
+        p += 4 + len;
+    }
+    free(data);
+    cr_assert_eq(num_features, 8612, "Expected 8612 features after the index, got %d\n", num_features);
+    cr_assert(found, "Tabler Drive should be among the features\n");
+}
+#undef TEST_NAME
+
+#define TEST_NAME cache_sbu_map
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    char *filename = "tests/rsrc/sbu.pbf";
+    FILE *f = fopen(filename, "r");
+    cr_assert(f != NULL, "The file '%s' could not be opened\n", filename);
+    char first[OSM_CACHE_FINGERPRINT_LEN + 1], second[OSM_CACHE_FINGERPRINT_LEN + 1];
+    cr_assert_eq(OSM_Cache_fingerprint(f, first), 0, "The file could not be fingerprinted\n");
+    cr_assert_eq(OSM_Cache_fingerprint(f, second), 0, "The file could not be fingerprinted again\n");
+    cr_assert_eq(ftell(f), 0, "The file should be left at its start\n");
+    fclose(f);
+    cr_assert_eq(strlen(first), OSM_CACHE_FINGERPRINT_LEN, "The fingerprint has the wrong length\n");
+    cr_assert_str_eq(first, second, "The fingerprint should not change\n");
+
+    char dir[] = "/tmp/pbf_cacheXXXXXX";
+    cr_assert(mkdtemp(dir) != NULL, "The cache directory could not be created\n");
+    char big[1000];
+    memset(big, 'x', sizeof(big));
+    cr_assert_eq(OSM_Cache_put(dir, "old", big, sizeof(big), 1 << 20), 0, "The entry could not be stored\n");
+    char *data = NULL;
+    size_t size = 0;
+    cr_assert_eq(OSM_Cache_get(dir, "old", &data, &size), 1, "The entry should be found\n");
+    cr_assert(size == sizeof(big) && memcmp(data, big, size) == 0, "The entry holds the wrong result\n");
+    free(data);
+    cr_assert_eq(OSM_Cache_get(dir, "other", &data, &size), 0, "Another key should miss\n");
+
+    // Age the entry, then store one for which there is only room on its own
+    DIR *dp = opendir(dir);
+    struct dirent *de;
+    char path[512];
+    while ((de = readdir(dp)) != NULL) {
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        if (de->d_name[0] != '.')
+            utime(path, &(struct utimbuf){ 1, 1 });
+    }
+    closedir(dp);
+    cr_assert_eq(OSM_Cache_put(dir, "new", "result", 6, 100), 0, "The entry could not be stored\n");
+    cr_assert_eq(OSM_Cache_get(dir, "old", &data, &size), 0, "The least recently used entry should be evicted\n");
+    cr_assert_eq(OSM_Cache_get(dir, "new", &data, &size), 1, "The new entry should be kept\n");
+    cr_assert(size == 6 && memcmp(data, "result", 6) == 0, "The entry holds the wrong result\n");
+    free(data);
+
+    dp = opendir(dir);
+    while ((de = readdir(dp)) != NULL) {
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        if (de->d_name[0] != '.')
+            unlink(path);
+    }
+    closedir(dp);
+    rmdir(dir);
+}
+#undef TEST_NAME
+
+#define TEST_NAME live_sbu_map
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    FILE *f = fopen("tests/rsrc/sbu.pbf", "r");
+    cr_assert(f != NULL, "The file 'tests/rsrc/sbu.pbf' could not be opened\n");
+    static char data[1 << 20];
+    size_t size = fread(data, 1, sizeof(data), f);
+    fclose(f);
+
+    char dir[] = "/tmp/pbf_liveXXXXXX", path[64], temp[64];
+    cr_assert(mkdtemp(dir) != NULL, "The directory could not be created\n");
+    snprintf(path, sizeof(path), "%s/map.pbf", dir);
+    snprintf(temp, sizeof(temp), "%s/new.pbf", dir);
+    f = fopen(path, "w");
+    cr_assert(f != NULL && fwrite(data, 1, size, f) == size && fclose(f) == 0, "The map could not be copied\n");
+
+    OSM_Options opts;
+    OSM_Options_init(&opts);
+    opts.threads = 2;
+    OSM_LiveMap *lp = OSM_LiveMap_open(path, 2, &opts);
+    cr_assert(lp != NULL, "The map could not be loaded\n");
+    cr_assert_eq(OSM_LiveMap_watch(lp), 0, "The map could not be watched\n");
+    OSM_Map *old = OSM_LiveMap_enter(lp, 1);
+
+    // Replace the file by renaming a copy over it, while reader 1 holds the map
+    f = fopen(temp, "w");
+    cr_assert(f != NULL && fwrite(data, 1, size, f) == size && fclose(f) == 0, "The map could not be copied\n");
+    cr_assert_eq(rename(temp, path), 0, "The map could not be replaced\n");
+    for (int i = 0; i < 1000 && OSM_LiveMap_get_generation(lp) < 2; i++)
+        usleep(10000);
+    cr_assert_eq(OSM_LiveMap_get_generation(lp), 2, "The map should have been reloaded once\n");
+
+    OSM_Map *mp = OSM_LiveMap_enter(lp, 0);
+    cr_assert(mp != old, "Reader 0 should get the new map\n");
+    cr_assert_eq(OSM_Map_get_num_nodes64(mp), 46415, "The new map has the wrong number of nodes\n");
+    cr_assert_eq(OSM_Map_get_num_nodes64(old), 46415, "The old map should stay valid while it is held\n");
+    cr_assert(OSM_Map_find_Way(old, 20175414) != NULL, "The old map should stay valid while it is held\n");
+    OSM_LiveMap_leave(lp, 0);
+    OSM_LiveMap_leave(lp, 1);
+    OSM_LiveMap_free(lp);
+    unlink(path);
+    rmdir(dir);
+}
+#undef TEST_NAME
+
+#define TEST_NAME delta_sbu_map
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    FILE *f = fopen("tests/rsrc/sbu.pbf", "r");
+    cr_assert(f != NULL, "The file 'tests/rsrc/sbu.pbf' could not be opened\n");
+    OSM_Options opts;
+    OSM_Options_init(&opts);
+    OSM_Map *base = OSM_read_Map_opts(f, &opts);
+    fclose(f);
+    cr_assert(base != NULL, "The map could not be read\n");
+
+    char dir[] = "/tmp/pbf_deltaXXXXXX", path[64];
+    cr_assert(mkdtemp(dir) != NULL, "The directory could not be created\n");
+    snprintf(path, sizeof(path), "%s/001.osc", dir);
+    f = fopen(path, "w");
+    cr_assert(f != NULL, "The change file could not be created\n");
+    fprintf(f, "<?xml version=\"1.0\"?>\n<osmChange version=\"0.6\">\n"
+               "<modify><node id=\"213362274\" version=\"9\" lat=\"40.5\" lon=\"-73.25\">"
+               "<tag k=\"name\" v=\"A &amp; B\"/></node></modify>\n"
+               "<create><node id=\"999999999001\" version=\"1\" lat=\"40.9\" lon=\"-73.1\"/>"
+               "<way id=\"999999999002\" version=\"1\"><nd ref=\"999999999001\"/><nd ref=\"213362274\"/>"
+               "<tag k=\"highway\" v=\"path\"/></way></create>\n"
+               "<delete><way id=\"20175414\" version=\"7\"/></delete>\n</osmChange>\n");
+    fclose(f);
+
+    OSM_Delta *dp = OSM_Delta_create(base, 1, &opts);
+    cr_assert(dp != NULL, "The overlay could not be created\n");
+    cr_assert_eq(OSM_Delta_apply_dir(dp, dir), 1, "One change file should have been applied\n");
+    cr_assert_eq(OSM_Delta_apply_dir(dp, dir), 0, "The change file should not be applied twice\n");
+
+    for (int pass = 0; pass < 2; pass++) {
+        OSM_DeltaView *vp = OSM_Delta_enter(dp, 0);
+        cr_assert_eq(OSM_DeltaView_get_num_runs(vp), pass ? 0 : 1, "The view has the wrong number of runs\n");
+        cr_assert_eq(OSM_DeltaView_get_num_nodes(vp), 46416, "The view has the wrong number of nodes\n");
+        cr_assert_eq(OSM_DeltaView_get_num_ways(vp), 5812, "The view has the wrong number of ways\n");
+        OSM_Node *np = OSM_DeltaView_find_Node(vp, 213362274);
+        cr_assert(np != NULL && OSM_Node_get_lat(np) == 40500000000, "The modified node is wrong\n");
+        cr_assert(OSM_Node_get_num_keys(np) == 1 && strcmp(OSM_Node_get_value(np, 0), "A & B") == 0,
+                  "The modified node has the wrong tags\n");
+        cr_assert(OSM_DeltaView_find_Way(vp, 20175414) == NULL, "The deleted way should be gone\n");
+        OSM_Way *wp = OSM_DeltaView_find_Way(vp, 999999999002);
+        size_t num_refs = 0;
+        const OSM_Id *refs = wp != NULL ? OSM_Way_refs(wp, &num_refs) : NULL;
+        cr_assert(num_refs == 2 && refs[0] == 999999999001 && refs[1] == 213362274,
+                  "The created way has the wrong refs\n");
+        cr_assert(OSM_DeltaView_find_Node(vp, 213352011) != NULL, "An unchanged node should be found\n");
+        OSM_Delta_leave(dp, 0);
+        if (pass == 0)
+            cr_assert_eq(OSM_Delta_compact(dp), 0, "The runs could not be compacted\n");
+    }
+    OSM_Delta_free(dp);
+    unlink(path);
+    rmdir(dir);
+}
+#undef TEST_NAME
+
+#define TEST_NAME shards_sbu_map
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    char *filename = "tests/rsrc/sbu.pbf";
+    FILE *f = fopen(filename, "r");
+    cr_assert(f != NULL, "The file '%s' could not be opened\n", filename);
+    OSM_Shard *shards = NULL;
+    uint64_t header_offset;
+    int n = OSM_Shards_plan(f, 3, &shards, &header_offset);
+    cr_assert_eq(n, 3, "Expected 3 ranges, got %d\n", n);
+    cr_assert_eq(header_offset, 0, "The header blob should come first\n");
+    cr_assert(shards[0].start == 0 && shards[0].end == shards[1].start && shards[1].end == shards[2].start,
+              "The ranges should be contiguous\n");
+    fseek(f, 0, SEEK_END);
+    cr_assert_eq(shards[2].end, (uint64_t)ftell(f), "The ranges should cover the file\n");
+    free(shards);
+
+    OSM_Options opts;
+    OSM_Options_init(&opts);
+    opts.threads = 2;
+    OSM_Id node_id = 213362274, way_id = 20175414;
+    OSM_ShardStats stats;
+    OSM_Map *map = OSM_Shards_load(filename, 3, &node_id, 1, &way_id, 1, &stats, &opts);
+    cr_assert(map != NULL, "The blocks could not be loaded\n");
+    cr_assert(stats.num_nodes == 46415 && stats.num_ways == 5812,
+              "Expected 46415 nodes and 5812 ways, got %zu and %zu\n", stats.num_nodes, stats.num_ways);
+    cr_assert(stats.num_blocks >= 1 && stats.num_blocks <= 2, "Only the blocks with the ids should be decoded\n");
+    cr_assert(OSM_Map_find_Node(map, node_id) != NULL, "Node 213362274 was not loaded\n");
+    cr_assert(OSM_Map_find_Way(map, way_id) != NULL, "Way 20175414 was not loaded\n");
+    cr_assert(OSM_Map_get_BBox(map) != NULL, "The header should be loaded\n");
+    OSM_Map_free(map);
+
+    // The sharded export matches the streamed one byte for byte
+    FILE *out = tmpfile(), *sharded = tmpfile();
+    rewind(f);
+    cr_assert_eq(OSM_export_geojson(f, out, OSM_GEOJSON, &opts), 0, "The file could not be exported\n");
+    cr_assert_eq(OSM_export_geojson_shards(filename, 3, sharded, OSM_GEOJSON, &opts), 0,
+                 "The file could not be exported in shards\n");
+    fclose(f);
+    long size = ftell(out);
+    cr_assert(size > 0 && size == ftell(sharded), "The exports should have the same size\n");
+    rewind(out);
+    rewind(sharded);
+    int c, same = 1;
+    while ((c = getc(out)) != EOF)
+        same &= c == getc(sharded);
+    fclose(out);
+    fclose(sharded);
+    cr_assert(same, "The exports should be the same\n");
+}
+#undef TEST_NAME
+
+#define TEST_NAME check_refs_sbu_map
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    char *filename = "tests/rsrc/sbu.pbf";
+    FILE *f = fopen(filename, "r");
+    cr_assert(f != NULL, "The file '%s' could not be opened\n", filename);
+    OSM_Options opts;
+    OSM_Options_init(&opts);
+    opts.threads = 4;
+    OSM_RefCheck check;
+    cr_assert_eq(OSM_check_refs(f, &check, &opts), 0, "The refs could not be checked\n");
+    cr_assert(check.num_nodes == 46415 && check.num_ways == 5812,
+              "Expected 46415 nodes and 5812 ways, got %zu and %zu\n", check.num_nodes, check.num_ways);
+    cr_assert(check.num_refs > 0 && check.missing_refs == 0 && check.num_samples == 0,
+              "Every ref should be found, %zu of %zu were not\n", check.missing_refs, check.num_refs);
+    cr_assert(check.duplicate_nodes == 0 && check.duplicate_ways == 0 && check.duplicate_relations == 0,
+              "No id should be duplicated\n");
+    size_t num_refs = check.num_refs;
+
+    // The extract is cut along boundaries whose relations have members outside it
+    cr_assert_eq(check.num_relations, 274, "Expected 274 relations, got %zu\n", check.num_relations);
+    cr_assert(check.missing_members > 0 && check.missing_members < check.num_members,
+              "Some members should be missing, got %zu of %zu\n", check.missing_members, check.num_members);
+    cr_assert_eq(check.missing_members, check.missing_members_by_type[OSM_MEMBER_NODE] +
+                 check.missing_members_by_type[OSM_MEMBER_WAY] + check.missing_members_by_type[OSM_MEMBER_RELATION],
+                 "The missing members by type should add up\n");
+    cr_assert(check.broken_relations > 0 && check.num_member_samples == OSM_REFS_SAMPLES,
+              "Expected %d samples of missing members\n", OSM_REFS_SAMPLES);
+    OSM_RefCheck full = check;
+
+    // Without the blobs of nodes, every ref and node member is missing
+    FILE *ways = tmpfile();
+    OSM_Blob blob;
+    uint64_t offset = 0;
+    size_t node_members = 0;
+    opts.members = 1;
+    rewind(f);
+    while (OSM_skip_Blob(f, offset, &blob) == 1) {
+        OSM_Block *bp = blob.type == OSM_BLOB_DATA ? OSM_read_Block_at(f, offset, &opts) : NULL;
+        for (int m = 0; bp != NULL && m < bp->num_members; m++)
+            node_members += bp->member_types[m] == OSM_MEMBER_NODE;
+        if (blob.type != OSM_BLOB_DATA || (bp != NULL && bp->num_nodes == 0)) {
+            char buf[blob.length];
+            fseeko(f, offset, SEEK_SET);
+            cr_assert_eq(fread(buf, 1, blob.length, f), blob.length, "The blob could not be copied\n");
+            fwrite(buf, 1, blob.length, ways);
+        }
+        if (bp != NULL)
+            OSM_Block_free(bp);
+        offset += blob.length;
+        OSM_Blob_free(&blob);
+        fseeko(f, offset, SEEK_SET);
+    }
+    fclose(f);
+    cr_assert_eq(OSM_check_refs(ways, &check, &opts), 0, "The refs could not be checked\n");
+    fclose(ways);
+    cr_assert(check.num_nodes == 0 && check.num_ways == 5812, "Only the ways should be left\n");
+    cr_assert(check.num_refs == num_refs && check.missing_refs == num_refs && check.broken_ways == 5812,
+              "Every ref should be missing, got %zu of %zu\n", check.missing_refs, check.num_refs);
+    cr_assert_eq(check.num_samples, OSM_REFS_SAMPLES, "Expected %d samples\n", OSM_REFS_SAMPLES);
+    cr_assert(check.samples[0].ref >= 213352011, "The samples should be node ids\n");
+    for (int i = 1; i < check.num_samples; i++)
+        cr_assert(check.samples[i - 1].ref < check.samples[i].ref, "The samples should be distinct and sorted\n");
+    cr_assert(check.num_members == full.num_members &&
+              check.missing_members_by_type[OSM_MEMBER_NODE] == node_members &&
+              check.missing_members_by_type[OSM_MEMBER_WAY] == full.missing_members_by_type[OSM_MEMBER_WAY],
+              "Only the node members should be missing too, got %zu of %zu\n",
+              check.missing_members_by_type[OSM_MEMBER_NODE], node_members);
+    for (int i = 0; i < check.num_member_samples; i++)
+        cr_assert_eq(check.member_samples[i].type, OSM_MEMBER_NODE, "The smallest samples should be nodes\n");
+}
+#undef TEST_NAME
+
+#define TEST_NAME reserve_sbu_map
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    char *filename = "tests/rsrc/sbu.pbf";
+    FILE *f = fopen(filename, "r");
+    cr_assert(f != NULL, "The file '%s' could not be opened\n", filename);
+    OSM_Options opts;
+    OSM_Options_init(&opts);
+    OSM_Map *expected = OSM_read_Map_opts(f, &opts);
+    cr_assert(expected != NULL, "The map could not be read\n");
+
+    // Columns sized for part of the file keep growing without moving what they hold
+    rewind(f);
+    OSM_Map *map = OSM_Map_create(&opts);
+    cr_assert_eq(OSM_Map_reserve(map, 1000, 100, 1000), 0, "The columns could not be reserved\n");
+    OSM_BlockReader *reader = OSM_BlockReader_open(f, &opts);
+    OSM_Block *bp;
+    while (OSM_BlockReader_next(reader, &bp) == 1) {
+        cr_assert_eq(OSM_Map_add_Block(map, bp), 0, "The block could not be added\n");
+        OSM_Block_free(bp);
+    }
+    OSM_BlockReader_close(reader);
+    fclose(f);
+    cr_assert_eq(OSM_Map_finish(map, &opts), 0, "The map could not be finished\n");
+
+    OSM_NodeColumns nodes, expected_nodes;
+    OSM_WayColumns ways, expected_ways;
+    OSM_Map_node_columns(map, &nodes);
+    OSM_Map_node_columns(expected, &expected_nodes);
+    OSM_Map_way_columns(map, &ways);
+    OSM_Map_way_columns(expected, &expected_ways);
+    cr_assert(nodes.count == 46415 && ways.count == 5812 && ways.num_refs == expected_ways.num_refs,
+              "Expected 46415 nodes and 5812 ways, got %zu and %zu\n", nodes.count, ways.count);
+    cr_assert(memcmp(nodes.ids, expected_nodes.ids, nodes.count * sizeof(OSM_Id)) == 0 &&
+              memcmp(nodes.lats, expected_nodes.lats, nodes.count * sizeof(OSM_Lat)) == 0 &&
+              memcmp(nodes.lons, expected_nodes.lons, nodes.count * sizeof(OSM_Lon)) == 0,
+              "The node columns should match\n");
+    cr_assert(memcmp(ways.ref_start, expected_ways.ref_start, (ways.count + 1) * sizeof(size_t)) == 0 &&
+              memcmp(ways.refs, expected_ways.refs, ways.num_refs * sizeof(OSM_Id)) == 0,
+              "The way columns should match\n");
+    OSM_Way *wp = OSM_Map_find_Way(map, 20175414);
+    cr_assert(wp != NULL && OSM_Way_get_num_keys(wp) > 0, "Way 20175414 should have its tags\n");
+    OSM_Map_free(map);
+
+    // The counts of an up-to-date index sidecar size the columns exactly
+    OSM_Index *ix = OSM_Index_open(filename, NULL);
+    cr_assert(ix != NULL, "The index could not be opened\n");
+    OSM_Index_free(ix);
+    f = fopen(filename, "r");
+    ix = OSM_Index_find(filename, f);
+    cr_assert(ix != NULL, "The index sidecar should be found\n");
+    map = OSM_Map_create(&opts);
+    cr_assert_eq(OSM_Index_reserve(ix, map, &opts), 0, "The columns could not be reserved\n");
+    cr_assert(map->node_cap == 46415 && map->way_cap == 5812 && map->ref_cap == expected_ways.num_refs,
+              "The columns should be sized for the file, got %zu nodes, %zu ways and %zu refs\n",
+              map->node_cap, map->way_cap, map->ref_cap);
+    OSM_Map_free(map);
+    OSM_Index_free(ix);
+    opts.path = filename;
+    map = OSM_read_Map_opts(f, &opts);
+    fclose(f);
+    cr_assert(map != NULL && OSM_Map_get_num_nodes64(map) == 46415 && OSM_Map_get_num_ways64(map) == 5812,
+              "The map read with the sidecar should hold the whole file\n");
+    OSM_Map_free(map);
+    OSM_Map_free(expected);
+}
+#undef TEST_NAME
+
+#define TEST_NAME tag_sets_sbu_map
+Test(TEST_SUITE, TEST_NAME, .timeout=TEST_TIMEOUT)
+{
+    char *filename = "tests/rsrc/sbu.pbf";
+    FILE *in = fopen(filename, "r");
+    cr_assert(in != NULL, "The file '%s' could not be opened\n", filename);
+    OSM_Map *mp = OSM_read_Map(in);
+    fclose(in);
+    cr_assert(mp != NULL, "A non-NULL OSM_Map pointer was expected\n");
+
+    // Ways with the same tags share them, and each keeps its own keys and values
+    size_t num_pairs = 0, same = 0;
+    int num_ways = OSM_Map_get_num_ways(mp);
+    for (int i = 0; i < num_ways; i++) {
+        OSM_Way *wp = OSM_Map_get_Way(mp, i), *prev = i > 0 ? OSM_Map_get_Way(mp, i - 1) : NULL;
+        int num_keys = OSM_Way_get_num_keys(wp), equal = prev && OSM_Way_get_num_keys(prev) == num_keys;
+        for (int k = 0; k < num_keys; k++) {
+            cr_assert(OSM_Way_get_key(wp, k) != NULL && OSM_Way_get_value(wp, k) != NULL,
+                      "Way %d should have tag %d\n", i, k);
+            equal = equal && strcmp(OSM_Way_get_key(wp, k), OSM_Way_get_key(prev, k)) == 0 &&
+                    strcmp(OSM_Way_get_value(wp, k), OSM_Way_get_value(prev, k)) == 0;
+        }
+        num_pairs += num_keys;
+        same += equal && num_keys > 0;
+    }
+    int num_nodes = OSM_Map_get_num_nodes(mp);
+    for (int i = 0; i < num_nodes; i++)
+        num_pairs += OSM_Node_get_num_keys(OSM_Map_get_Node(mp, i));
+    cr_assert_gt(same, 0, "Some neighboring ways should have the same tags\n");
+    size_t plain = (num_nodes + num_ways) * sizeof(size_t) + num_pairs * 2 * sizeof(uint32_t);
+    cr_assert_lt(OSM_Map_get_tag_bytes(mp), plain * 2 / 3,
+                 "Shared tag sets should take less than %zu bytes, took %zu\n", plain * 2 / 3,
+                 OSM_Map_get_tag_bytes(mp));
+
+    OSM_Way *wp = OSM_Map_find_Way(mp, 20175414);
+    int found = 0;
+    for (int k = 0; wp != NULL && k < OSM_Way_get_num_keys(wp); k++)
+        found |= strcmp(OSM_Way_get_key(wp, k), "name") == 0 &&
+                 strcmp(OSM_Way_get_value(wp, k), "Tabler Drive") == 0;
+    cr_assert(found, "Way 20175414 should be named Tabler Drive\n");
+    OSM_Map_free(mp);
+}
+#undef TEST_NAME